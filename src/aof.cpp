@@ -0,0 +1,671 @@
+#include "server.h"
+
+// append-only log: the write commands of an iteration are appended to the
+// current photon.aof.<seq> segment at once, and synced as --appendfsync
+// says. a snapshot covers the segments before its `aof_base`, and
+// BGREWRITEAOF replaces them all with the commands that rebuild the keyspace.
+
+// whether writes are recorded, for the append log or the replicas
+static bool propagating()
+{
+    return (g_data.aof_on || !g_data.repl_backlog.empty()) && !g_data.aof_loading;
+}
+
+// record a write command for the append log
+void cmd_propagate_begin(const std::vector<std::string> &cmd)
+{
+    if (!propagating())
+    {
+        return;
+    }
+    g_data.aof_prop_start = g_data.aof_buf.size();
+    buf_append_cmd(g_data.aof_buf, cmd);
+}
+
+void cmd_propagate_end(bool failed)
+{
+    if (g_data.aof_prop_start == (size_t)-1)
+    {
+        return;
+    }
+    if (failed)
+    {
+        g_data.aof_buf.resize(g_data.aof_prop_start);
+    }
+    g_data.aof_prop_start = (size_t)-1;
+}
+
+// log a different command than the one running, e.g. with absolute times
+void propagate_replace(const std::vector<std::string> &cmd)
+{
+    if (g_data.aof_prop_start == (size_t)-1)
+    {
+        return;
+    }
+    g_data.aof_buf.resize(g_data.aof_prop_start);
+    buf_append_cmd(g_data.aof_buf, cmd);
+}
+
+// log a change that is not from a client command, e.g. an expiration
+void propagate(const std::vector<std::string> &cmd)
+{
+    if (!propagating())
+    {
+        return;
+    }
+    buf_append_cmd(g_data.aof_buf, cmd);
+}
+
+// the writes of an EXEC or a script go out as one MULTI ... EXEC block,
+// a replica or a replay applies all of them or none
+void propagate_tx_begin()
+{
+    if (g_data.aof_tx_depth++ == 0 && propagating())
+    {
+        g_data.aof_tx_start = g_data.aof_buf.size();
+        buf_append_cmd(g_data.aof_buf, {"MULTI"});
+    }
+}
+
+void propagate_tx_end()
+{
+    if (--g_data.aof_tx_depth > 0 || g_data.aof_tx_start == (size_t)-1)
+    {
+        return;
+    }
+    const size_t k_multi_size = 4 + 4 + 5; // nstr, len, "MULTI"
+    if (g_data.aof_buf.size() == g_data.aof_tx_start + k_multi_size)
+    {
+        g_data.aof_buf.resize(g_data.aof_tx_start); // no writes
+    }
+    else
+    {
+        buf_append_cmd(g_data.aof_buf, {"EXEC"});
+    }
+    g_data.aof_tx_start = (size_t)-1;
+}
+
+// one command of the log or of a master's stream. a MULTI ... EXEC block
+// is kept until its EXEC is in. returns the bytes of the stream applied.
+uint64_t stream_apply(StreamTx &tx, std::vector<std::string> &cmd, size_t size)
+{
+    tx.bytes += size;
+    bool multi = cmd.size() == 1 && cmd[0] == "MULTI";
+    bool exec = cmd.size() == 1 && cmd[0] == "EXEC";
+    if (multi)
+    {
+        tx.open = true; // a block without EXEC before it is dropped
+        tx.cmds.clear();
+        return 0;
+    }
+    if (tx.open && !exec)
+    {
+        tx.cmds.push_back(std::move(cmd));
+        return 0;
+    }
+    Buffer scratch;
+    if (exec)
+    {
+        propagate_tx_begin();
+        for (std::vector<std::string> &c : tx.cmds)
+        {
+            do_request(c, scratch);
+            scratch.clear();
+        }
+        propagate_tx_end();
+        tx.open = false;
+        tx.cmds.clear();
+    }
+    else
+    {
+        do_request(cmd, scratch);
+    }
+    uint64_t n = tx.bytes;
+    tx.bytes = 0;
+    return n;
+}
+
+static void aof_segment_name(uint64_t seq, char *buf, size_t size)
+{
+    snprintf(buf, size, "photon.aof.%llu", (unsigned long long)seq);
+}
+
+static int aof_open_segment(uint64_t seq)
+{
+    char name[64];
+    aof_segment_name(seq, name, sizeof(name));
+    int fd = open(name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        die("open() append log");
+    }
+    return fd;
+}
+
+// segment numbers on disk, sorted
+static std::vector<uint64_t> aof_list_segments()
+{
+    std::vector<uint64_t> seqs;
+    DIR *dir = opendir(".");
+    if (!dir)
+    {
+        return seqs;
+    }
+    const char *prefix = "photon.aof.";
+    size_t plen = strlen(prefix);
+    while (struct dirent *de = readdir(dir))
+    {
+        int64_t seq = 0;
+        if (strncmp(de->d_name, prefix, plen) == 0 &&
+            str2int(de->d_name + plen, seq) && seq >= 0)
+        {
+            seqs.push_back((uint64_t)seq);
+        }
+    }
+    closedir(dir);
+    std::sort(seqs.begin(), seqs.end());
+    return seqs;
+}
+
+// segments before `base` are covered by the snapshot
+void aof_remove_old(uint64_t base)
+{
+    for (uint64_t seq : aof_list_segments())
+    {
+        if (seq < base)
+        {
+            char name[64];
+            aof_segment_name(seq, name, sizeof(name));
+            unlink(name);
+        }
+    }
+}
+
+static void aof_job_func(void *arg)
+{
+    AofJob *job = (AofJob *)arg;
+    if (fdatasync(job->fd) != 0)
+    {
+        job->err = errno;
+    }
+    if (job->close_fd)
+    {
+        close(job->fd);
+    }
+}
+
+static void aof_job_next()
+{
+    if (g_data.aof_jobs.empty() || g_data.aof_jobs.front()->running)
+    {
+        return;
+    }
+    AofJob *job = g_data.aof_jobs.front();
+    job->running = true;
+    thread_pool_submit(&g_data.thread_pool, &job->group, PRIO_CRITICAL, &aof_job_func, job);
+    task_group_close(&g_data.thread_pool, &job->group);
+}
+
+// on the event loop, jobs finish in submission order
+static void aof_job_done(void *arg)
+{
+    AofJob *job = (AofJob *)arg;
+    assert(job == g_data.aof_jobs.front());
+    g_data.aof_jobs.pop_front();
+    if (job->err)
+    {
+        errno = job->err;
+        msg_errno("fdatasync() append log");
+    }
+    else if (job->off > g_data.aof_synced)
+    {
+        g_data.aof_synced = job->off;
+    }
+    g_data.aof_last_fsync_ms = get_monotonic_msec();
+    task_group_destroy(&job->group);
+    delete job;
+    aof_job_next();
+}
+
+// sync the current segment up to what has been written
+static void aof_fsync_queue()
+{
+    if (!g_data.aof_jobs.empty())
+    {
+        AofJob *last = g_data.aof_jobs.back();
+        if (!last->running && last->fd == g_data.aof_fd && !last->close_fd)
+        {
+            // not started yet, let it cover the new writes too
+            last->off = g_data.aof_written;
+            g_data.aof_queued = g_data.aof_written;
+            return;
+        }
+    }
+    AofJob *job = new AofJob();
+    task_group_init(&job->group, &aof_job_done, job);
+    job->fd = g_data.aof_fd;
+    job->off = g_data.aof_written;
+    g_data.aof_queued = job->off;
+    g_data.aof_jobs.push_back(job);
+    aof_job_next();
+}
+
+
+// group commit: write the commands of this iteration at once
+void aof_flush()
+{
+    repl_feed_backlog(); // before they leave the buffer
+    size_t nwritten = 0;
+    while (nwritten < g_data.aof_buf.size())
+    {
+        ssize_t rv = write(g_data.aof_fd, &g_data.aof_buf[nwritten],
+                           g_data.aof_buf.size() - nwritten);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv < 0)
+        {
+            msg_errno("write() append log"); // retried next iteration
+            break;
+        }
+        nwritten += (size_t)rv;
+    }
+    g_data.aof_written += nwritten;
+    g_data.aof_size += nwritten;
+    buf_consume(g_data.aof_buf, nwritten);
+    g_data.repl_fed -= nwritten;
+
+    if (g_data.aof_written <= g_data.aof_queued)
+    {
+        return;
+    }
+    if (g_data.aof_fsync == AOF_FSYNC_ALWAYS)
+    {
+        aof_fsync_queue();
+    }
+    else if (g_data.aof_fsync == AOF_FSYNC_EVERYSEC && g_data.aof_jobs.empty() &&
+             get_monotonic_msec() >= g_data.aof_last_fsync_ms + 1000)
+    {
+        aof_fsync_queue();
+    }
+}
+
+// continue the log in a new segment, the old one is synced and closed
+void aof_rotate()
+{
+    aof_flush();
+    AofJob *job = new AofJob();
+    task_group_init(&job->group, &aof_job_done, job);
+    job->fd = g_data.aof_fd;
+    job->off = g_data.aof_written;
+    job->close_fd = true;
+    g_data.aof_queued = job->off;
+    g_data.aof_jobs.push_back(job);
+    aof_job_next();
+
+    g_data.aof_seq++;
+    g_data.aof_fd = aof_open_segment(g_data.aof_seq);
+}
+
+// whether the replies of `conn` must wait for the log to be synced
+bool conn_aof_blocked(Conn *conn)
+{
+    return g_data.aof_fsync == AOF_FSYNC_ALWAYS && conn->aof_wait > g_data.aof_synced;
+}
+
+// replay one segment, returns false if it is damaged
+static bool aof_replay(uint64_t seq, bool last)
+{
+    char name[64];
+    aof_segment_name(seq, name, sizeof(name));
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    Buffer data;
+    uint8_t chunk[64 * 1024];
+    ssize_t rv = 0;
+    while ((rv = read(fd, chunk, sizeof(chunk))) > 0)
+    {
+        buf_append(data, chunk, (size_t)rv);
+    }
+    close(fd);
+
+    size_t pos = 0;
+    size_t applied = 0; // not inside a MULTI ... EXEC block
+    StreamTx tx;
+    while (pos < data.size())
+    {
+        size_t size = req_size(&data[pos], data.size() - pos);
+        std::vector<std::string> cmd;
+        if (size == 0 || parse_req(&data[pos], size, cmd) < 0)
+        {
+            break;
+        }
+        pos += size;
+        applied += stream_apply(tx, cmd, size);
+    }
+    if (applied == data.size())
+    {
+        return true;
+    }
+    pos = applied;
+    if (!last)
+    {
+        fprintf(stderr, "append log %s is damaged at %zu\n", name, pos);
+        return false;
+    }
+    // a partial write from a crash, drop it
+    fprintf(stderr, "truncating an incomplete command or transaction at the end of %s\n", name);
+    return truncate(name, (off_t)pos) == 0;
+}
+
+// after the snapshot: replay the log, then open a new segment
+void aof_load(uint64_t base)
+{
+    std::vector<uint64_t> seqs = aof_list_segments();
+    uint64_t next = base;
+    if (!seqs.empty() && seqs.back() + 1 > next)
+    {
+        next = seqs.back() + 1;
+    }
+    if (g_data.aof_on)
+    {
+        g_data.aof_loading = true;
+        for (size_t i = 0; i < seqs.size(); i++)
+        {
+            if (seqs[i] >= base && !aof_replay(seqs[i], i + 1 == seqs.size()))
+            {
+                die("failed to load the append log");
+            }
+        }
+        g_data.aof_loading = false;
+        g_data.aof_fd = aof_open_segment(next);
+        g_data.aof_size = aof_disk_size();
+        g_data.aof_rewrite_base_size = g_data.aof_size;
+    }
+    g_data.aof_seq = next;
+    g_data.dirty = 0;
+}
+
+// on shutdown: write out and sync everything
+void aof_shutdown()
+{
+    if (!g_data.aof_on)
+    {
+        return;
+    }
+    aof_flush();
+    while (!g_data.aof_jobs.empty())
+    {
+        struct pollfd pfd = {thread_pool_done_fd(&g_data.thread_pool), POLLIN, 0};
+        poll(&pfd, 1, -1);
+        thread_pool_run_done(&g_data.thread_pool);
+    }
+    if (fdatasync(g_data.aof_fd) != 0)
+    {
+        msg_errno("fdatasync() append log");
+    }
+    close(g_data.aof_fd);
+}
+
+// bytes in all segments on disk
+uint64_t aof_disk_size()
+{
+    uint64_t total = 0;
+    for (uint64_t seq : aof_list_segments())
+    {
+        char name[64];
+        aof_segment_name(seq, name, sizeof(name));
+        struct stat st;
+        if (stat(name, &st) == 0)
+        {
+            total += (uint64_t)st.st_size;
+        }
+    }
+    return total;
+}
+
+struct RewriteCtx
+{
+    int fd = -1;
+    bool ok = true;
+    Buffer buf;
+    int64_t now_wall = 0; // ms
+    int64_t now_mono = 0; // ms
+    Entry *ent = NULL;    // the zset being written
+    std::vector<std::string> zadd;
+    std::vector<std::string> zttl; // member, unix ms, ...
+    std::vector<std::string> batch; // HSET key field value...
+};
+
+static void rewrite_emit(RewriteCtx *ctx, const std::vector<std::string> &cmd)
+{
+    buf_append_cmd(ctx->buf, cmd);
+    const size_t k_rewrite_buf = 1 << 20;
+    if (ctx->ok && ctx->buf.size() >= k_rewrite_buf)
+    {
+        ctx->ok = write_all(ctx->fd, ctx->buf.data(), ctx->buf.size());
+        ctx->buf.clear();
+    }
+}
+
+static std::string dbl2str(double val)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.17g", val);
+    return buf;
+}
+
+static void rewrite_zadd_flush(RewriteCtx *ctx)
+{
+    if (ctx->zadd.size() > 2)
+    {
+        rewrite_emit(ctx, ctx->zadd);
+    }
+    ctx->zadd.resize(2); // ZADD key
+}
+
+static void cb_rewrite_znode(ZNode *znode, void *arg)
+{
+    RewriteCtx *ctx = (RewriteCtx *)arg;
+    ctx->zadd.push_back(dbl2str(znode->score));
+    ctx->zadd.push_back(std::string(znode->name, znode->len));
+    if (znode->heap_idx != (size_t)-1)
+    {
+        int64_t at = (int64_t)ctx->ent->zset.heap[znode->heap_idx].val;
+        ctx->zttl.push_back(std::string(znode->name, znode->len));
+        ctx->zttl.push_back(int2str(ctx->now_wall + (at - ctx->now_mono)));
+    }
+    const size_t k_zadd_batch = 64; // pairs per command
+    if (ctx->zadd.size() >= 2 + 2 * k_zadd_batch)
+    {
+        rewrite_zadd_flush(ctx);
+    }
+}
+
+static void cb_rewrite_hfield(const char *field, size_t flen, const char *val, size_t vlen, void *arg)
+{
+    RewriteCtx *ctx = (RewriteCtx *)arg;
+    ctx->batch.emplace_back(field, flen);
+    ctx->batch.emplace_back(val, vlen);
+    const size_t k_hset_batch = 64; // pairs per command
+    if (ctx->batch.size() >= 2 + 2 * k_hset_batch)
+    {
+        rewrite_emit(ctx, ctx->batch);
+        ctx->batch.resize(2);
+    }
+}
+
+static bool cb_rewrite_entry(HNode *node, void *arg)
+{
+    RewriteCtx *ctx = (RewriteCtx *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type == T_STR)
+    {
+        std::string tmp;
+        rewrite_emit(ctx, {"SET", ent->key, entry_str(ent, tmp)});
+    }
+    else if (ent->type == T_ZSET)
+    {
+        ctx->ent = ent;
+        ctx->zadd = {"ZADD", ent->key};
+        ctx->zttl.clear();
+        zset_foreach(&ent->zset, &cb_rewrite_znode, ctx);
+        rewrite_zadd_flush(ctx);
+        for (size_t i = 0; i < ctx->zttl.size(); i += 2)
+        {
+            rewrite_emit(ctx, {"ZPEXPIREAT", ent->key, ctx->zttl[i], ctx->zttl[i + 1]});
+        }
+    }
+    else if (ent->type == T_HASH)
+    {
+        ctx->batch = {"HSET", ent->key};
+        hash_foreach(ent, &cb_rewrite_hfield, ctx);
+        if (ctx->batch.size() > 2)
+        {
+            rewrite_emit(ctx, ctx->batch);
+        }
+    }
+    else if (ent->type == T_THROTTLE)
+    {
+        Buffer payload;
+        entry_dump(payload, ent, ctx->now_wall, ctx->now_mono);
+        rewrite_emit(ctx, {"RESTORE", ent->key, std::string(payload.begin(), payload.end()), "REPLACE"});
+    }
+    if (ent->heap_idx != (size_t)-1)
+    {
+        int64_t at = (int64_t)g_data.heap[ent->heap_idx].val;
+        rewrite_emit(ctx, {"PEXPIREAT", ent->key, int2str(ctx->now_wall + (at - ctx->now_mono))});
+    }
+    return ctx->ok;
+}
+
+// child: the shortest command stream that rebuilds the keyspace
+static bool aof_rewrite_write(const char *filename)
+{
+    RewriteCtx ctx;
+    ctx.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (ctx.fd < 0)
+    {
+        return false;
+    }
+    ctx.now_wall = (int64_t)get_wall_msec();
+    ctx.now_mono = (int64_t)get_monotonic_msec();
+    // replayed on top of any snapshot, so start from scratch
+    rewrite_emit(&ctx, {"FLUSHALL"});
+    hm_foreach(&g_data.db, &cb_rewrite_entry, &ctx);
+    ctx.ok = ctx.ok && write_all(ctx.fd, ctx.buf.data(), ctx.buf.size());
+    ctx.ok = ctx.ok && fsync(ctx.fd) == 0;
+    close(ctx.fd);
+    return ctx.ok;
+}
+
+// the log continues in a new segment, the child replaces all older ones
+static bool aof_rewrite_start()
+{
+    assert(g_data.aof_on && g_data.child_pid == -1);
+    g_data.aof_rewrite_scheduled = false;
+    img_adopt_all();
+    aof_rotate();
+    g_data.aof_rewrite_seq = g_data.aof_seq - 1;
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        msg_errno("fork() error");
+        aof_rewrite_done(false, -1);
+        return false;
+    }
+    if (pid == 0)
+    {
+        char tmpname[256];
+        snprintf(tmpname, sizeof(tmpname), "temp-rewrite-%d.aof", (int)getpid());
+        bool ok = aof_rewrite_write(tmpname);
+        if (!ok)
+        {
+            unlink(tmpname);
+        }
+        _exit(ok ? 0 : 1);
+    }
+    fprintf(stderr, "background log rewrite started by pid %d\n", (int)pid);
+    g_data.child_pid = pid;
+    g_data.child_type = CHILD_AOF_REWRITE;
+    return true;
+}
+
+// `pid` is the child that wrote the new log
+void aof_rewrite_done(bool ok, pid_t pid)
+{
+    g_data.aof_last_rewrite_ok = ok;
+    if (!ok)
+    {
+        // don't retry automatically before the log doubles again
+        g_data.aof_rewrite_base_size = g_data.aof_size;
+        return;
+    }
+    char tmpname[256];
+    snprintf(tmpname, sizeof(tmpname), "temp-rewrite-%d.aof", (int)pid);
+    if (!g_data.aof_on)
+    {
+        unlink(tmpname); // turned off meanwhile
+        return;
+    }
+    char name[64];
+    aof_segment_name(g_data.aof_rewrite_seq, name, sizeof(name));
+    if (rename(tmpname, name) != 0)
+    {
+        msg_errno("rename() rewritten log");
+        unlink(tmpname);
+        g_data.aof_last_rewrite_ok = false;
+        return;
+    }
+    aof_remove_old(g_data.aof_rewrite_seq);
+    g_data.aof_size = aof_disk_size();
+    g_data.aof_rewrite_base_size = g_data.aof_size;
+}
+
+// BGREWRITEAOF
+void do_bgrewriteaof(std::vector<std::string> &, Buffer &out)
+{
+    if (!g_data.aof_on)
+    {
+        return out_err(out, ERR_UNKNOWN, "append log is off");
+    }
+    if (g_data.child_type == CHILD_AOF_REWRITE)
+    {
+        return out_err(out, ERR_UNKNOWN, "background log rewrite already in progress");
+    }
+    if (g_data.child_pid != -1)
+    {
+        g_data.aof_rewrite_scheduled = true;
+        return out_str(out, "Background append only file rewriting scheduled", 47);
+    }
+    if (!aof_rewrite_start())
+    {
+        return out_err(out, ERR_UNKNOWN, "fork failed");
+    }
+    return out_str(out, "Background append only file rewriting started", 45);
+}
+
+// scheduled rewrites, and rewrites when the log has doubled since the last one
+void aof_rewrite_cron()
+{
+    if (!g_data.aof_on || g_data.child_pid != -1)
+    {
+        return;
+    }
+    const uint64_t k_rewrite_min_size = 64 << 20;
+    uint64_t base = g_data.aof_rewrite_base_size;
+    bool grown = g_data.aof_size >= k_rewrite_min_size && g_data.aof_size >= 2 * base;
+    if (g_data.aof_rewrite_scheduled || grown)
+    {
+        if (grown)
+        {
+            fprintf(stderr, "append log has grown to %llu bytes, rewriting\n",
+                    (unsigned long long)g_data.aof_size);
+        }
+        aof_rewrite_start();
+    }
+}
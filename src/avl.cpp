@@ -54,7 +54,7 @@ static AVLNode *rot_right(AVLNode *node)
 static AVLNode *avl_fix_left(AVLNode *node)
 {
     if (avl_height(node->left->left) < avl_height(node->left->right))
-        node->right = rot_left(node->left);
+        node->left = rot_left(node->left);
     return rot_right(node);
 }
 
@@ -0,0 +1,191 @@
+#include "server.h"
+
+// change feed: CDCSUBSCRIBE clients get the changes to keys under their
+// prefixes. the write paths call key_changed(), the events of an iteration
+// are sent to each subscriber as one ["cdc", [[event, key, member?]...]]
+// response. a batch for a subscriber over the output limit is dropped.
+
+void prefix_add(PrefixIndex &idx, const std::string &prefix, Conn *conn)
+{
+    channel_find(&idx.map, prefix, true)->subs.push_back(conn);
+    idx.lens[prefix.size()]++;
+}
+
+// true if it was there
+bool prefix_del(PrefixIndex &idx, const std::string &prefix, Conn *conn)
+{
+    if (!channel_unsub(&idx.map, prefix, conn))
+    {
+        return false;
+    }
+    if (--idx.lens[prefix.size()] == 0)
+    {
+        idx.lens.erase(prefix.size());
+    }
+    return true;
+}
+
+// calls f for each connection with a prefix of the key
+void prefix_foreach(PrefixIndex &idx, const std::string &key,
+                    void (*f)(Conn *, void *), void *arg)
+{
+    for (auto &it : idx.lens)
+    {
+        if (it.first > key.size())
+        {
+            break;
+        }
+        Channel *ch = channel_find(&idx.map, key.substr(0, it.first), false);
+        for (size_t i = 0; ch && i < ch->subs.size(); i++)
+        {
+            f(ch->subs[i], arg);
+        }
+    }
+}
+
+void cdc_conn_gone(Conn *conn)
+{
+    for (const std::string &prefix : conn->cdc_prefixes)
+    {
+        prefix_del(g_data.cdc, prefix, conn);
+    }
+}
+
+static void cdc_add(Conn *conn, const char *event, const std::string &key,
+                    const std::string *member)
+{
+    if (conn->cdc_seq == g_data.cdc_seq)
+    {
+        return; // matched by another of its prefixes
+    }
+    conn->cdc_seq = g_data.cdc_seq;
+    if (conn->cdc_count++ == 0)
+    {
+        g_data.cdc_pending.push_back(conn->fd);
+    }
+    out_arr(conn->cdc_batch, member ? 3 : 2);
+    out_str(conn->cdc_batch, event, strlen(event));
+    out_str(conn->cdc_batch, key.data(), key.size());
+    if (member)
+    {
+        out_str(conn->cdc_batch, member->data(), member->size());
+    }
+}
+
+struct CdcEvent
+{
+    const char *event;
+    const std::string *key;
+    const std::string *member;
+};
+
+static void cb_cdc_add(Conn *conn, void *arg)
+{
+    CdcEvent *ev = (CdcEvent *)arg;
+    cdc_add(conn, ev->event, *ev->key, ev->member);
+}
+
+void cdc_emit(const char *event, const std::string &key, const std::string *member)
+{
+    if (g_data.cdc.lens.empty())
+    {
+        return;
+    }
+    g_data.cdc_seq++;
+    g_data.cdc_events++;
+    CdcEvent ev = {event, &key, member};
+    prefix_foreach(g_data.cdc, key, &cb_cdc_add, &ev);
+}
+
+// FLUSHALL goes to everyone
+void cdc_emit_all(const char *event)
+{
+    g_data.cdc_seq++;
+    for (Conn *conn : g_data.fd2conn)
+    {
+        if (conn && !conn->cdc_prefixes.empty())
+        {
+            cdc_add(conn, event, std::string(), NULL);
+        }
+    }
+}
+
+// at the end of an iteration: one response per subscriber
+void cdc_flush()
+{
+    for (int fd : g_data.cdc_pending)
+    {
+        Conn *conn = g_data.fd2conn[fd];
+        if (!conn || conn->cdc_count == 0)
+        {
+            continue;
+        }
+        if (conn->want_close ||
+            conn->outgoing.size() + conn->pubq_bytes > g_data.pubsub_limit)
+        {
+            g_data.cdc_dropped += conn->cdc_count;
+        }
+        else
+        {
+            PubMsg *m = new PubMsg();
+            size_t header = 0;
+            response_begin(m->data, &header);
+            out_arr(m->data, 2);
+            out_str(m->data, "cdc", 3);
+            out_arr(m->data, conn->cdc_count);
+            buf_append(m->data, conn->cdc_batch.data(), conn->cdc_batch.size());
+            response_end(m->data, header);
+            m->refs++;
+            conn_queue_msg(conn, pubmsg_for(m, conn->proto));
+            pubmsg_unref(m);
+        }
+        conn->cdc_batch.clear();
+        conn->cdc_count = 0;
+    }
+    g_data.cdc_pending.clear();
+}
+
+// CDCSUBSCRIBE prefix..., the number of prefixes of the connection
+void do_cdcsubscribe(std::vector<std::string> &cmd, Buffer &out)
+{
+    Conn *conn = g_data.cur_conn;
+    if (!conn)
+    {
+        return out_err(out, ERR_UNKNOWN, "not a client");
+    }
+    std::vector<std::string> &names = conn->cdc_prefixes;
+    for (size_t i = 1; i < cmd.size(); i++)
+    {
+        if (std::find(names.begin(), names.end(), cmd[i]) != names.end())
+        {
+            continue;
+        }
+        prefix_add(g_data.cdc, cmd[i], conn);
+        names.push_back(cmd[i]);
+    }
+    return out_int(out, (int64_t)names.size());
+}
+
+// CDCUNSUBSCRIBE [prefix...], all if none given
+void do_cdcunsubscribe(std::vector<std::string> &cmd, Buffer &out)
+{
+    Conn *conn = g_data.cur_conn;
+    if (!conn)
+    {
+        return out_err(out, ERR_UNKNOWN, "not a client");
+    }
+    std::vector<std::string> &names = conn->cdc_prefixes;
+    std::vector<std::string> which(cmd.begin() + 1, cmd.end());
+    if (which.empty())
+    {
+        which = names;
+    }
+    for (const std::string &prefix : which)
+    {
+        if (prefix_del(g_data.cdc, prefix, conn))
+        {
+            names.erase(std::find(names.begin(), names.end(), prefix));
+        }
+    }
+    return out_int(out, (int64_t)names.size());
+}
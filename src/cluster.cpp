@@ -0,0 +1,607 @@
+#include "server.h"
+
+// cluster mode: a request for a slot we don't own is redirected with
+// ERR_MOVED "<slot> <host:port>". while a slot migrates, keys that are
+// already gone get ERR_ASK to the target, which serves them after an
+// ASKING. the slot map is set by the CLUSTER commands and kept in
+// photon-cluster.conf.
+
+static int32_t cluster_node(const std::string &addr)
+{
+    for (size_t i = 0; i < g_data.cluster_nodes.size(); i++)
+    {
+        if (g_data.cluster_nodes[i] == addr)
+        {
+            return (int32_t)i;
+        }
+    }
+    g_data.cluster_nodes.push_back(addr);
+    return (int32_t)g_data.cluster_nodes.size() - 1;
+}
+
+void cluster_init()
+{
+    g_data.cluster_nodes = {g_data.cluster_announce + ":" + int2str(g_data.port)};
+    g_data.slot_owner.assign(k_cluster_slots, -1);
+    g_data.slot_migrating.assign(k_cluster_slots, -1);
+    g_data.slot_importing.assign(k_cluster_slots, -1);
+}
+
+static bool cluster_save()
+{
+    std::string s;
+    for (uint32_t slot = 0; slot < k_cluster_slots;)
+    {
+        uint32_t end = slot;
+        while (end + 1 < k_cluster_slots && g_data.slot_owner[end + 1] == g_data.slot_owner[slot])
+        {
+            end++;
+        }
+        if (g_data.slot_owner[slot] >= 0)
+        {
+            s += "slots " + int2str(slot) + " " + int2str(end) + " " +
+                 g_data.cluster_nodes[g_data.slot_owner[slot]] + "\n";
+        }
+        slot = end + 1;
+    }
+    for (uint32_t slot = 0; slot < k_cluster_slots; slot++)
+    {
+        if (g_data.slot_migrating[slot] >= 0)
+        {
+            s += "migrating " + int2str(slot) + " " +
+                 g_data.cluster_nodes[g_data.slot_migrating[slot]] + "\n";
+        }
+        if (g_data.slot_importing[slot] >= 0)
+        {
+            s += "importing " + int2str(slot) + " " +
+                 g_data.cluster_nodes[g_data.slot_importing[slot]] + "\n";
+        }
+    }
+    int fd = open("photon-cluster.conf.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ok = write_all(fd, (const uint8_t *)s.data(), s.size()) && fsync(fd) == 0;
+    close(fd);
+    return ok && rename("photon-cluster.conf.tmp", "photon-cluster.conf") == 0;
+}
+
+bool cluster_load()
+{
+    FILE *fp = fopen("photon-cluster.conf", "r");
+    if (!fp)
+    {
+        return errno == ENOENT; // not configured yet
+    }
+    char kind[16], addr[256];
+    unsigned start = 0, end = 0;
+    bool ok = true;
+    while (ok && fscanf(fp, "%15s %u", kind, &start) == 2)
+    {
+        std::string k = kind;
+        if (k == "slots")
+        {
+            ok = fscanf(fp, "%u %255s", &end, addr) == 2 && start <= end &&
+                 end < k_cluster_slots;
+            for (uint32_t slot = start; ok && slot <= end; slot++)
+            {
+                g_data.slot_owner[slot] = cluster_node(addr);
+            }
+        }
+        else if ((k == "migrating" || k == "importing") && start < k_cluster_slots)
+        {
+            ok = fscanf(fp, "%255s", addr) == 1;
+            std::vector<int32_t> &v = k == "migrating" ? g_data.slot_migrating
+                                                       : g_data.slot_importing;
+            v[start] = ok ? cluster_node(addr) : -1;
+        }
+        else
+        {
+            ok = false;
+        }
+    }
+    ok = ok && feof(fp);
+    fclose(fp);
+    return ok;
+}
+
+static void out_redirect(Buffer &out, uint32_t code, uint32_t slot, int32_t node)
+{
+    out_err(out, code, int2str(slot) + " " + g_data.cluster_nodes[node]);
+}
+
+static bool key_exists(const std::string &k)
+{
+    LookupKey key;
+    key.key = k;
+    key.node.hcode = str_hash((const uint8_t *)k.data(), k.size());
+    return db_lookup(&key) != NULL;
+}
+
+// cmd[1..last] are keys, true if a redirect or an error was written
+bool cmd_cluster_redirect(const std::vector<std::string> &cmd, size_t last, Buffer &out)
+{
+    Conn *conn = g_data.cur_conn;
+    if (!g_data.cluster_on || !conn)
+    {
+        return false; // the replication stream and the log are not routed
+    }
+    uint32_t slot = key_slot(cmd[1].data(), cmd[1].size());
+    for (size_t i = 2; i <= last; i++)
+    {
+        if (key_slot(cmd[i].data(), cmd[i].size()) != slot)
+        {
+            out_err(out, ERR_BAD_ARG, "keys in different slots");
+            return true;
+        }
+    }
+    int32_t owner = g_data.slot_owner[slot];
+    if (owner == 0)
+    {
+        int32_t target = g_data.slot_migrating[slot];
+        if (target < 0)
+        {
+            return false;
+        }
+        // keys that are already moved, and new ones, go to the target
+        for (size_t i = 1; i <= last; i++)
+        {
+            if (!key_exists(cmd[i]))
+            {
+                out_redirect(out, ERR_ASK, slot, target);
+                return true;
+            }
+        }
+        return false;
+    }
+    if (g_data.slot_importing[slot] >= 0 && conn->asking)
+    {
+        return false;
+    }
+    if (owner < 0)
+    {
+        out_err(out, ERR_UNKNOWN, "slot " + int2str(slot) + " is not served");
+        return true;
+    }
+    out_redirect(out, ERR_MOVED, slot, owner);
+    return true;
+}
+
+void do_asking(std::vector<std::string> &, Buffer &out)
+{
+    if (!g_data.cluster_on)
+    {
+        return out_err(out, ERR_UNKNOWN, "cluster mode is off");
+    }
+    if (g_data.cur_conn)
+    {
+        g_data.cur_conn->asking = true;
+    }
+    return out_ok(out);
+}
+
+static bool str2slot(const std::string &s, uint32_t &slot)
+{
+    int64_t val = 0;
+    if (!str2int(s, val) || val < 0 || val >= (int64_t)k_cluster_slots)
+    {
+        return false;
+    }
+    slot = (uint32_t)val;
+    return true;
+}
+
+struct SlotKeysCtx
+{
+    uint32_t slot = 0;
+    size_t limit = 0;
+    size_t count = 0;
+    Buffer *out = NULL; // NULL only counts
+};
+
+static bool cb_slot_keys(HNode *node, void *arg)
+{
+    SlotKeysCtx *ctx = (SlotKeysCtx *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    if (key_slot(ent->key.data(), ent->key.size()) != ctx->slot)
+    {
+        return true;
+    }
+    if (ctx->out)
+    {
+        out_str(*ctx->out, ent->key.data(), ent->key.size());
+    }
+    return ++ctx->count < ctx->limit;
+}
+
+// CLUSTER SLOTS, the ranges as [start, end, "host:port"]
+static void cluster_slots(Buffer &out)
+{
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    for (uint32_t slot = 0; slot < k_cluster_slots;)
+    {
+        uint32_t end = slot;
+        int32_t owner = g_data.slot_owner[slot];
+        while (end + 1 < k_cluster_slots && g_data.slot_owner[end + 1] == owner)
+        {
+            end++;
+        }
+        if (owner >= 0)
+        {
+            const std::string &addr = g_data.cluster_nodes[owner];
+            out_arr(out, 3);
+            out_int(out, slot);
+            out_int(out, end);
+            out_str(out, addr.data(), addr.size());
+            n++;
+        }
+        slot = end + 1;
+    }
+    out_end_arr(out, ctx, n);
+}
+
+// CLUSTER KEYSLOT key | SLOTS | ADDSLOTSRANGE start end addr
+//       | SETSLOT slot NODE|MIGRATING|IMPORTING addr | SETSLOT slot STABLE
+//       | COUNTKEYSINSLOT slot | GETKEYSINSLOT slot count
+void do_cluster(std::vector<std::string> &cmd, Buffer &out)
+{
+    if (!g_data.cluster_on)
+    {
+        return out_err(out, ERR_UNKNOWN, "cluster mode is off");
+    }
+    std::string sub = cmd[1];
+    std::transform(sub.begin(), sub.end(), sub.begin(), ::toupper);
+    uint32_t slot = 0, end = 0;
+    if (sub == "KEYSLOT" && cmd.size() == 3)
+    {
+        return out_int(out, key_slot(cmd[2].data(), cmd[2].size()));
+    }
+    if (sub == "SLOTS" && cmd.size() == 2)
+    {
+        return cluster_slots(out);
+    }
+    if (sub == "COUNTKEYSINSLOT" && cmd.size() == 3 && str2slot(cmd[2], slot))
+    {
+        img_adopt_all();
+        SlotKeysCtx ctx;
+        ctx.slot = slot;
+        ctx.limit = (size_t)-1;
+        hm_foreach(&g_data.db, &cb_slot_keys, &ctx);
+        return out_int(out, (int64_t)ctx.count);
+    }
+    int64_t limit = 0;
+    if (sub == "GETKEYSINSLOT" && cmd.size() == 4 && str2slot(cmd[2], slot) &&
+        str2int(cmd[3], limit) && limit >= 0)
+    {
+        img_adopt_all();
+        SlotKeysCtx ctx;
+        ctx.slot = slot;
+        ctx.limit = (size_t)limit;
+        ctx.out = &out;
+        size_t arr = out_begin_arr(out);
+        if (limit > 0)
+        {
+            hm_foreach(&g_data.db, &cb_slot_keys, &ctx);
+        }
+        return out_end_arr(out, arr, (uint32_t)ctx.count);
+    }
+    if (sub == "ADDSLOTSRANGE" && cmd.size() == 5 && str2slot(cmd[2], slot) &&
+        str2slot(cmd[3], end) && slot <= end)
+    {
+        int32_t node = cluster_node(cmd[4]);
+        for (uint32_t i = slot; i <= end; i++)
+        {
+            g_data.slot_owner[i] = node;
+        }
+    }
+    else if (sub == "SETSLOT" && cmd.size() >= 4 && str2slot(cmd[2], slot))
+    {
+        std::string how = cmd[3];
+        std::transform(how.begin(), how.end(), how.begin(), ::toupper);
+        if (how == "STABLE" && cmd.size() == 4)
+        {
+            g_data.slot_migrating[slot] = -1;
+            g_data.slot_importing[slot] = -1;
+        }
+        else if (how == "NODE" && cmd.size() == 5)
+        {
+            // the migration is over
+            g_data.slot_owner[slot] = cluster_node(cmd[4]);
+            g_data.slot_migrating[slot] = -1;
+            g_data.slot_importing[slot] = -1;
+        }
+        else if (how == "MIGRATING" && cmd.size() == 5 && g_data.slot_owner[slot] == 0)
+        {
+            g_data.slot_migrating[slot] = cluster_node(cmd[4]);
+        }
+        else if (how == "IMPORTING" && cmd.size() == 5 && g_data.slot_owner[slot] != 0)
+        {
+            g_data.slot_importing[slot] = cluster_node(cmd[4]);
+        }
+        else
+        {
+            return out_err(out, ERR_BAD_ARG, "bad SETSLOT");
+        }
+    }
+    else
+    {
+        return out_err(out, ERR_BAD_ARG, "bad CLUSTER subcommand");
+    }
+    if (!cluster_save())
+    {
+        return out_err(out, ERR_UNKNOWN, "failed to save photon-cluster.conf");
+    }
+    return out_ok(out);
+}
+
+// RESTORE key payload [REPLACE], the payload is an entry_dump() record
+void do_restore(std::vector<std::string> &cmd, Buffer &out)
+{
+    bool replace = cmd.size() == 4 && strcasecmp(cmd[3].c_str(), "REPLACE") == 0;
+    if (cmd.size() == 4 && !replace)
+    {
+        return out_err(out, ERR_BAD_ARG, "expect REPLACE");
+    }
+    int64_t now_wall = (int64_t)get_wall_msec();
+    int64_t expire_at = -1;
+    const uint8_t *data = (const uint8_t *)cmd[2].data();
+    SnapReader r = {data, data + cmd[2].size()};
+    Entry *ent = entry_restore(r, now_wall, (int64_t)get_monotonic_msec(), expire_at);
+    if (!ent || r.cur != r.end || ent->key != cmd[1])
+    {
+        if (ent)
+        {
+            entry_del_sync(ent);
+        }
+        return out_err(out, ERR_BAD_ARG, "bad payload");
+    }
+    LookupKey key;
+    key.key = cmd[1];
+    key.node.hcode = ent->node.hcode;
+    if (HNode *node = db_lookup(&key))
+    {
+        if (!replace)
+        {
+            entry_del_sync(ent);
+            return out_err(out, ERR_BAD_ARG, "key exists");
+        }
+        db_delete(&key);
+        entry_del(container_of(node, Entry, node), true);
+    }
+    g_data.dirty++;
+    if (expire_at >= 0 && expire_at <= now_wall)
+    {
+        entry_del_sync(ent); // expired on the way
+        return out_ok(out);
+    }
+    hm_insert(&g_data.db, &ent->node);
+    key_changed("set", ent->key);
+    if (expire_at >= 0)
+    {
+        entry_set_ttl(ent, expire_at - now_wall);
+    }
+    if (ent->type == T_ZSET && !ent->zset.heap.empty())
+    {
+        entry_sync_zexpire(ent);
+    }
+    return out_ok(out);
+}
+
+
+// the connection to another node for MIGRATE, made on first use. the
+// connect does not block, the requests go out once it is established.
+static Conn *migrate_link(const std::string &host, const std::string &port)
+{
+    std::string addr = host + ":" + port;
+    auto it = g_data.migrate_links.find(addr);
+    if (it != g_data.migrate_links.end())
+    {
+        return it->second;
+    }
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+    {
+        return NULL;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        freeaddrinfo(res);
+        return NULL;
+    }
+    fd_set_nb(fd);
+    int rv = connect(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (rv < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return NULL;
+    }
+    Conn *conn = conn_new(fd);
+    conn->migrate_addr = addr;
+    g_data.migrate_links[addr] = conn;
+    return conn;
+}
+
+// all the replies of a job are in: delete the keys that moved, then
+// answer the caller and run its next requests
+static void migrate_job_done(MigrateJob *job)
+{
+    Conn *conn = (size_t)job->fd < g_data.fd2conn.size() ? g_data.fd2conn[job->fd] : NULL;
+    if (conn && (conn->id != job->conn_id || !conn->migrating))
+    {
+        conn = NULL; // disconnected meanwhile
+    }
+    Buffer out;
+    if (job->ok)
+    {
+        size_t aof_len = g_data.aof_buf.size();
+        std::string kept;
+        for (size_t i = 0; i < job->keys.size(); i++)
+        {
+            // a key written meanwhile stays, the target has an older copy
+            if (g_data.watch_versions[watch_bucket(job->keys[i])] != job->versions[i])
+            {
+                kept += " " + job->keys[i];
+                continue;
+            }
+            LookupKey key;
+            key.key = job->keys[i];
+            key.node.hcode = str_hash((const uint8_t *)key.key.data(), key.key.size());
+            HNode *node = db_delete(&key);
+            if (!node)
+            {
+                continue;
+            }
+            Entry *ent = container_of(node, Entry, node);
+            propagate({"DEL", ent->key});
+            key_changed("del", ent->key);
+            entry_del(ent, true);
+            g_data.dirty++;
+        }
+        if (kept.empty())
+            out_ok(out);
+        else
+            out_err(out, ERR_UNKNOWN, "written during the migration, kept here:" + kept);
+        if (conn && g_data.aof_on && g_data.aof_buf.size() > aof_len)
+        {
+            conn->aof_wait = g_data.aof_written + g_data.aof_buf.size();
+        }
+    }
+    else
+    {
+        out_err(out, ERR_UNKNOWN, "migration to " + job->target + " failed");
+    }
+    uint32_t req_id = job->req_id;
+    delete job;
+    if (!conn)
+    {
+        return;
+    }
+    conn->migrating = false;
+    conn_reply(conn, req_id, out);
+    while (try_one_request(conn))
+    {
+    }
+    if (conn_has_output(conn))
+    {
+        conn->want_read = false;
+        conn->want_write = true;
+    }
+}
+
+// one reply of the target, false if more data is needed
+bool migrate_link_step(Conn *conn)
+{
+    Buffer &in = conn->incoming;
+    if (in.size() < 4)
+    {
+        return false;
+    }
+    uint32_t len = 0;
+    memcpy(&len, in.data(), 4);
+    if (len > k_max_msg || len < 1 || conn->migrate_jobs.empty())
+    {
+        conn->want_close = true;
+        return false;
+    }
+    if (in.size() < 4 + (size_t)len)
+    {
+        return false;
+    }
+    MigrateJob *job = conn->migrate_jobs.front();
+    job->ok = job->ok && in[4] == TAG_OK;
+    buf_consume(in, 4 + len);
+    if (--job->replies == 0)
+    {
+        conn->migrate_jobs.pop_front();
+        migrate_job_done(job);
+    }
+    return true;
+}
+
+// a link closed: the jobs still waiting on it fail
+void migrate_link_gone(Conn *conn)
+{
+    if (conn->migrate_addr.empty())
+    {
+        return;
+    }
+    g_data.migrate_links.erase(conn->migrate_addr);
+    conn->migrate_addr.clear();
+    std::deque<MigrateJob *> jobs;
+    jobs.swap(conn->migrate_jobs);
+    for (MigrateJob *job : jobs)
+    {
+        job->ok = false;
+        migrate_job_done(job);
+    }
+}
+
+// MIGRATE host port key [key...]: move keys to another node. the
+// target gets ASKING + RESTORE for each, they are deleted here once it
+// has replied. the caller waits for that, the other clients go on.
+void do_migrate(std::vector<std::string> &cmd, Buffer &out)
+{
+    if (!cmd_write_allowed())
+    {
+        return out_err(out, ERR_READONLY, "read only replica");
+    }
+    Conn *conn = g_data.cur_conn;
+    if (!conn)
+    {
+        return out_err(out, ERR_BAD_ARG, "MIGRATE needs a client");
+    }
+    Buffer req;
+    MigrateJob *job = new MigrateJob();
+    int64_t now_wall = (int64_t)get_wall_msec();
+    int64_t now_mono = (int64_t)get_monotonic_msec();
+    for (size_t i = 3; i < cmd.size(); i++)
+    {
+        LookupKey key;
+        key.key = cmd[i];
+        key.node.hcode = str_hash((const uint8_t *)key.key.data(), key.key.size());
+        HNode *node = db_lookup(&key);
+        if (!node)
+        {
+            continue;
+        }
+        Entry *ent = container_of(node, Entry, node);
+        Buffer payload;
+        entry_dump(payload, ent, now_wall, now_mono);
+        buf_append_cmd(req, {"ASKING"});
+        buf_append_cmd(req, {"RESTORE", ent->key, std::string(payload.begin(), payload.end()),
+                             "REPLACE"});
+        job->keys.push_back(ent->key);
+        job->versions.push_back(g_data.watch_versions[watch_bucket(ent->key)]);
+    }
+    if (job->keys.empty())
+    {
+        delete job;
+        return out_str(out, "NOKEY", 5);
+    }
+    Conn *link = migrate_link(cmd[1], cmd[2]);
+    if (!link)
+    {
+        delete job;
+        return out_err(out, ERR_UNKNOWN, "migration to " + cmd[1] + ":" + cmd[2] + " failed");
+    }
+    job->fd = conn->fd;
+    job->conn_id = conn->id;
+    job->req_id = g_data.cur_req_id;
+    job->target = link->migrate_addr;
+    job->replies = 2 * job->keys.size();
+    link->migrate_jobs.push_back(job);
+    buf_append(link->outgoing, req.data(), req.size());
+    link->want_write = true;
+    // a slow target fails the job after the idle timeout
+    link->last_active_ms = get_monotonic_msec();
+    dlist_detach(&link->idle_node);
+    dlist_insert_before(&g_data.idle_list, &link->idle_node);
+    conn->migrating = true;
+}
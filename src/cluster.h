@@ -0,0 +1,40 @@
+#pragma once
+
+#include "common.h"
+
+// cluster mode: keys map to a fixed number of slots, each owned by a node
+const uint32_t k_cluster_slots = 16384;
+
+// error codes of a redirect, the message is "<slot> <host:port>"
+enum
+{
+    ERR_MOVED = 6, // that node owns the key
+    ERR_ASK = 7,   // retry once there, after ASKING
+};
+
+// a key's slot. only the part in the first {...} is hashed if there is
+// one, so related keys can be kept on the same node.
+inline uint32_t key_slot(const char *key, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (key[i] != '{')
+        {
+            continue;
+        }
+        for (size_t j = i + 1; j < len; j++)
+        {
+            if (key[j] == '}')
+            {
+                if (j > i + 1)
+                {
+                    key += i + 1;
+                    len = j - i - 1;
+                }
+                break;
+            }
+        }
+        break;
+    }
+    return (uint32_t)(str_hash((const uint8_t *)key, len) % k_cluster_slots);
+}
@@ -11,42 +11,153 @@ struct CommandEntry
     CommandHandler handler;
     size_t min_args;
     size_t max_args;
+    uint32_t flags = 0;
 };
 
 static const std::unordered_map<std::string, CommandEntry> command_table = {
     {"ZAP", {do_zap, 1, 1}},
-    {"GET", {do_get, 2, 2}},
-    {"SET", {do_set, 3, 3}},
-    {"DEL", {do_del, 2, 2}},
+    {"PING", {do_ping, 1, 2}},
+    {"HELLO", {do_hello, 1, 2, CMD_NOTX}},
+    {"PROTO", {do_proto, 2, 2, CMD_NOTX}},
+    {"GET", {do_get, 2, 2, CMD_KEY}},
+    {"SET", {do_set, 3, 8, CMD_WRITE | CMD_KEY}},
+    {"GETDEL", {do_getdel, 2, 2, CMD_WRITE | CMD_KEY}},
+    {"GETEX", {do_getex, 2, 4, CMD_WRITE | CMD_KEY}},
+    {"DEL", {do_del, 2, 2, CMD_WRITE | CMD_KEY}},
+    {"APPEND", {do_append, 3, 3, CMD_WRITE | CMD_KEY}},
+    {"SETRANGE", {do_setrange, 4, 4, CMD_WRITE | CMD_KEY}},
+    {"GETRANGE", {do_getrange, 4, 4, CMD_KEY}},
+    {"STRLEN", {do_strlen, 2, 2, CMD_KEY}},
+    {"SETBLOB", {do_setblob, 3, 3, CMD_WRITE | CMD_KEY | CMD_NOTX}},
+    {"INCR", {do_incr, 2, 2, CMD_WRITE | CMD_KEY}},
+    {"DECR", {do_incr, 2, 2, CMD_WRITE | CMD_KEY}},
+    {"INCRBY", {do_incrby, 3, 3, CMD_WRITE | CMD_KEY}},
+    {"DECRBY", {do_incrby, 3, 3, CMD_WRITE | CMD_KEY}},
+    {"INCRBYFLOAT", {do_incrbyfloat, 3, 3, CMD_WRITE | CMD_KEY}},
+    {"THROTTLE", {do_throttle, 5, 6, CMD_WRITE | CMD_KEY}},
+    {"HSET", {do_hset, 4, k_max_args, CMD_WRITE | CMD_KEY}},
+    {"HGET", {do_hget, 3, 3, CMD_KEY}},
+    {"HMGET", {do_hmget, 3, k_max_args, CMD_KEY}},
+    {"HDEL", {do_hdel, 3, k_max_args, CMD_WRITE | CMD_KEY}},
+    {"HLEN", {do_hlen, 2, 2, CMD_KEY}},
+    {"HGETALL", {do_hgetall, 2, 2, CMD_KEY}},
+    {"HINCRBY", {do_hincrby, 4, 4, CMD_WRITE | CMD_KEY}},
+    {"HSCAN", {do_hscan, 3, 7, CMD_KEY}},
+    {"UNLINK", {do_unlink, 2, k_max_args, CMD_WRITE | CMD_KEYS}},
+    {"FLUSHALL", {do_flushall, 1, 2, CMD_WRITE}},
     {"KEYS", {do_keys, 1, 1}},
-    {"ZADD", {do_zadd, 4, 4}},
-    {"ZREM", {do_zrem, 3, 3}},
-    {"ZSCORE", {do_zscore, 3, 3}},
-    {"ZQUERY", {do_zquery, 6, 6}},
-    {"PEXPIRE", {do_expire, 3, 3}},
-    {"PTTL", {do_ttl, 2, 2}},
-    {"SAVE", {do_save, 1, 1}},
-    {"LOAD", {do_load, 1, 1}},
+    {"ZADD", {do_zadd, 4, k_max_args, CMD_WRITE | CMD_KEY}},
+    {"ZREM", {do_zrem, 3, 3, CMD_WRITE | CMD_KEY}},
+    {"ZSCORE", {do_zscore, 3, 3, CMD_KEY}},
+    {"ZQUERY", {do_zquery, 6, 6, CMD_KEY}},
+    {"PEXPIRE", {do_expire, 3, 3, CMD_WRITE | CMD_KEY}},
+    {"PEXPIREAT", {do_expireat, 3, 3, CMD_WRITE | CMD_KEY}},
+    {"PTTL", {do_ttl, 2, 2, CMD_KEY}},
+    {"ZPEXPIRE", {do_zexpire, 4, 4, CMD_WRITE | CMD_KEY}},
+    {"ZPEXPIREAT", {do_zexpireat, 4, 4, CMD_WRITE | CMD_KEY}},
+    {"ZPTTL", {do_zttl, 3, 3, CMD_KEY}},
+    {"SAVE", {do_save, 1, 1, CMD_NOTX | CMD_NOSCRIPT}},
+    {"LOAD", {do_load, 1, 1, CMD_WRITE | CMD_NOTX | CMD_NOSCRIPT}},
+    {"BGSAVE", {do_bgsave, 1, 1, CMD_NOTX | CMD_NOSCRIPT}},
+    {"BGREWRITEAOF", {do_bgrewriteaof, 1, 1, CMD_NOTX | CMD_NOSCRIPT}},
+    {"LASTSAVE", {do_lastsave, 1, 1}},
+    {"INFO", {do_info, 1, 1}},
+    {"PSYNC", {do_psync, 3, 3, CMD_NOTX}},
+    {"REPLICAOF", {do_replicaof, 3, 3, CMD_NOTX}},
+    {"CLUSTER", {do_cluster, 2, 5}},
+    {"ASKING", {do_asking, 1, 1}},
+    {"MIGRATE", {do_migrate, 4, k_max_args, CMD_NOTX | CMD_NOSCRIPT}},
+    {"RESTORE", {do_restore, 3, 4, CMD_WRITE | CMD_KEY}},
+    {"SUBSCRIBE", {do_subscribe, 2, k_max_args, CMD_NOTX}},
+    {"UNSUBSCRIBE", {do_unsubscribe, 1, k_max_args, CMD_NOTX}},
+    {"PSUBSCRIBE", {do_psubscribe, 2, k_max_args, CMD_NOTX}},
+    {"PUNSUBSCRIBE", {do_punsubscribe, 1, k_max_args, CMD_NOTX}},
+    {"PUBLISH", {do_publish, 3, 3}},
+    {"CDCSUBSCRIBE", {do_cdcsubscribe, 2, k_max_args, CMD_NOTX}},
+    {"CDCUNSUBSCRIBE", {do_cdcunsubscribe, 1, k_max_args, CMD_NOTX}},
+    {"CLIENT", {do_client, 3, k_max_args}},
+    {"MULTI", {do_multi, 1, 1, CMD_TX}},
+    {"EXEC", {do_exec, 1, 1, CMD_TX}},
+    {"DISCARD", {do_discard, 1, 1, CMD_TX}},
+    {"WATCH", {do_watch, 2, k_max_args, CMD_KEYS | CMD_TX}},
+    {"UNWATCH", {do_unwatch, 1, 1, CMD_TX}},
+    {"EVAL", {do_eval, 3, k_max_args, CMD_NOSCRIPT}},
+    {"EVALSHA", {do_evalsha, 3, k_max_args, CMD_NOSCRIPT}},
+    {"SCRIPT", {do_script, 2, k_max_args, CMD_NOSCRIPT}},
 };
 
+static const CommandEntry *cmd_find(const std::string &name)
+{
+    std::string cmd_name = name;
+    std::transform(cmd_name.begin(), cmd_name.end(), cmd_name.begin(), ::toupper);
+    auto it = command_table.find(cmd_name);
+    return it == command_table.end() ? NULL : &it->second;
+}
+
+uint32_t cmd_flags(const std::string &name)
+{
+    const CommandEntry *entry = cmd_find(name);
+    return entry ? entry->flags : 0;
+}
+
 void do_request(std::vector<std::string> &cmd, Buffer &out)
 {
     if (cmd.empty())
     {
         return out_err(out, ERR_UNKNOWN, "empty command");
     }
-    std::string cmd_name = cmd[0];
-    std::transform(cmd_name.begin(), cmd_name.end(), cmd_name.begin(), ::toupper);
-
-    auto it = command_table.find(cmd_name);
-    if (it == command_table.end())
+    // inside MULTI, a command that fails here aborts the transaction
+    const CommandEntry *found = cmd_find(cmd[0]);
+    if (!found)
     {
+        cmd_multi_fail();
         return out_err(out, ERR_UNKNOWN, "unknown command");
     }
-    const CommandEntry &entry = it->second;
+    const CommandEntry &entry = *found;
     if (cmd.size() < entry.min_args || cmd.size() > entry.max_args)
     {
+        cmd_multi_fail();
         return out_err(out, ERR_BAD_ARG, "wrong number of arguments");
     }
+    if (entry.flags & (CMD_KEY | CMD_KEYS))
+    {
+        size_t last = entry.flags & CMD_KEYS ? cmd.size() - 1 : 1;
+        if (cmd_cluster_redirect(cmd, last, out))
+        {
+            cmd_multi_fail();
+            return;
+        }
+    }
+    if (cmd_multi_active() && !(entry.flags & CMD_TX))
+    {
+        if (entry.flags & CMD_NOTX)
+        {
+            cmd_multi_fail();
+            return out_err(out, ERR_BAD_ARG, "not allowed in MULTI");
+        }
+        if ((entry.flags & CMD_WRITE) && !cmd_write_allowed())
+        {
+            cmd_multi_fail();
+            return out_err(out, ERR_READONLY, "read only replica");
+        }
+        return cmd_multi_queue(cmd, out); // EXEC runs it
+    }
+    if (!(entry.flags & CMD_WRITE))
+    {
+        if (entry.flags & CMD_KEY)
+        {
+            cmd_track_read(cmd[1]); // before the handler takes it
+        }
+        return entry.handler(cmd, out);
+    }
+    if (!cmd_write_allowed())
+    {
+        return out_err(out, ERR_READONLY, "read only replica");
+    }
+    // record it before the handler consumes the arguments
+    size_t pos = out.size();
+    cmd_propagate_begin(cmd);
     entry.handler(cmd, out);
+    // no reply: parked, it runs again later
+    cmd_propagate_end(out.size() == pos || out[pos] == TAG_ERR);
 }
\ No newline at end of file
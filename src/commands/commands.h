@@ -2,6 +2,7 @@
 #include <vector>
 #include <string>
 #include "../common.h"
+#include "../cluster.h"
 
 enum
 {
@@ -9,23 +10,123 @@ enum
     ERR_TOO_BIG = 2, // response too big
     ERR_BAD_TYP = 3, // bad type
     ERR_BAD_ARG = 4, // bad args
+    ERR_READONLY = 5, // write to a replica
+    // 6 and 7 are ERR_MOVED and ERR_ASK, in cluster.h
+    ERR_TIMEOUT = 8,  // protocol v2: the deadline passed before it ran
+    ERR_SCRIPT = 9,   // a script failed or ran out of budget
+    ERR_NOSCRIPT = 10, // EVALSHA of a script not in the cache
+};
+
+// datatypes of serialized data
+enum
+{
+    TAG_NIL = 0, // nil
+    TAG_ERR = 1, // error code + msg
+    TAG_STR = 2, // string
+    TAG_INT = 3, // int64
+    TAG_DBL = 4, // double
+    TAG_ARR = 5, // array
+    TAG_OK = 6,  // success response
+    TAG_MORE = 7 // a chunk of a streamed array, more follow
+};
+
+// command flags
+enum
+{
+    CMD_WRITE = 1 << 0, // modifies the keyspace, goes to the append log
+    CMD_KEY = 1 << 1,   // cmd[1] is a key, for cluster routing
+    CMD_KEYS = 1 << 2,  // all arguments are keys
+    CMD_TX = 1 << 3,    // runs right away inside MULTI, the rest is queued
+    CMD_NOTX = 1 << 4,  // refused inside MULTI
+    CMD_NOSCRIPT = 1 << 5, // refused inside a script
 };
 
 typedef std::vector<uint8_t> Buffer;
 
+const size_t k_max_args = 200 * 1000;
+
 extern void do_zap(std::vector<std::string> &, Buffer &);
 extern void do_get(std::vector<std::string> &, Buffer &);
 extern void do_set(std::vector<std::string> &, Buffer &);
 extern void do_del(std::vector<std::string> &, Buffer &);
+extern void do_unlink(std::vector<std::string> &, Buffer &);
+extern void do_flushall(std::vector<std::string> &, Buffer &);
 extern void do_keys(std::vector<std::string> &, Buffer &);
 extern void do_zadd(std::vector<std::string> &, Buffer &);
 extern void do_zrem(std::vector<std::string> &, Buffer &);
 extern void do_zscore(std::vector<std::string> &, Buffer &);
 extern void do_zquery(std::vector<std::string> &, Buffer &);
 extern void do_expire(std::vector<std::string> &, Buffer &);
+extern void do_expireat(std::vector<std::string> &, Buffer &);
 extern void do_ttl(std::vector<std::string> &, Buffer &);
+extern void do_zexpire(std::vector<std::string> &, Buffer &);
+extern void do_zexpireat(std::vector<std::string> &, Buffer &);
+extern void do_zttl(std::vector<std::string> &, Buffer &);
 extern void do_save(std::vector<std::string> &, Buffer &);
 extern void do_load(std::vector<std::string> &, Buffer &);
+extern void do_bgsave(std::vector<std::string> &, Buffer &);
+extern void do_bgrewriteaof(std::vector<std::string> &, Buffer &);
+extern void do_lastsave(std::vector<std::string> &, Buffer &);
+extern void do_info(std::vector<std::string> &, Buffer &);
+extern void do_psync(std::vector<std::string> &, Buffer &);
+extern void do_replicaof(std::vector<std::string> &, Buffer &);
+extern void do_cluster(std::vector<std::string> &, Buffer &);
+extern void do_asking(std::vector<std::string> &, Buffer &);
+extern void do_migrate(std::vector<std::string> &, Buffer &);
+extern void do_restore(std::vector<std::string> &, Buffer &);
+extern void do_subscribe(std::vector<std::string> &, Buffer &);
+extern void do_unsubscribe(std::vector<std::string> &, Buffer &);
+extern void do_psubscribe(std::vector<std::string> &, Buffer &);
+extern void do_punsubscribe(std::vector<std::string> &, Buffer &);
+extern void do_publish(std::vector<std::string> &, Buffer &);
+extern void do_cdcsubscribe(std::vector<std::string> &, Buffer &);
+extern void do_cdcunsubscribe(std::vector<std::string> &, Buffer &);
+extern void do_client(std::vector<std::string> &, Buffer &);
+extern void do_ping(std::vector<std::string> &, Buffer &);
+extern void do_hello(std::vector<std::string> &, Buffer &);
+extern void do_proto(std::vector<std::string> &, Buffer &);
+extern void do_append(std::vector<std::string> &, Buffer &);
+extern void do_setrange(std::vector<std::string> &, Buffer &);
+extern void do_getrange(std::vector<std::string> &, Buffer &);
+extern void do_strlen(std::vector<std::string> &, Buffer &);
+extern void do_setblob(std::vector<std::string> &, Buffer &);
+extern void do_getdel(std::vector<std::string> &, Buffer &);
+extern void do_getex(std::vector<std::string> &, Buffer &);
+extern void do_incr(std::vector<std::string> &, Buffer &);
+extern void do_multi(std::vector<std::string> &, Buffer &);
+extern void do_exec(std::vector<std::string> &, Buffer &);
+extern void do_discard(std::vector<std::string> &, Buffer &);
+extern void do_watch(std::vector<std::string> &, Buffer &);
+extern void do_unwatch(std::vector<std::string> &, Buffer &);
+extern void do_incrby(std::vector<std::string> &, Buffer &);
+extern void do_incrbyfloat(std::vector<std::string> &, Buffer &);
+extern void do_throttle(std::vector<std::string> &, Buffer &);
+extern void do_hset(std::vector<std::string> &, Buffer &);
+extern void do_hget(std::vector<std::string> &, Buffer &);
+extern void do_hmget(std::vector<std::string> &, Buffer &);
+extern void do_hdel(std::vector<std::string> &, Buffer &);
+extern void do_hlen(std::vector<std::string> &, Buffer &);
+extern void do_hgetall(std::vector<std::string> &, Buffer &);
+extern void do_hincrby(std::vector<std::string> &, Buffer &);
+extern void do_hscan(std::vector<std::string> &, Buffer &);
+extern void do_eval(std::vector<std::string> &, Buffer &);
+extern void do_evalsha(std::vector<std::string> &, Buffer &);
+extern void do_script(std::vector<std::string> &, Buffer &);
 
 void do_request(std::vector<std::string> &cmd, Buffer &out);
+// flags of a known command, 0 otherwise
+uint32_t cmd_flags(const std::string &name);
+// MULTI: true if the client is queueing, a refused command aborts EXEC
+bool cmd_multi_active();
+void cmd_multi_queue(std::vector<std::string> &cmd, Buffer &out);
+void cmd_multi_fail();
+// write commands are recorded for the append log, dropped if they fail
+void cmd_propagate_begin(const std::vector<std::string> &cmd);
+void cmd_propagate_end(bool failed);
+// false for clients of a replica
+bool cmd_write_allowed();
+// cmd[1..last] are keys, true if the request was answered with a redirect
+bool cmd_cluster_redirect(const std::vector<std::string> &cmd, size_t last, Buffer &out);
+// the client of the running command read this key, for CLIENT TRACKING
+void cmd_track_read(const std::string &key);
 void out_err(Buffer &out, uint32_t code, const std::string &msg);
\ No newline at end of file
@@ -121,6 +121,22 @@ void hm_insert(HMap *hmap, HNode *node)
     hm_help_rehashing(hmap); // migrate some keys
 }
 
+// presize an empty map for about one key per slot
+void hm_reserve(HMap *hmap, size_t n)
+{
+    if (hm_size(hmap) > 0)
+    {
+        return;
+    }
+    hm_clear(hmap);
+    size_t slots = 4;
+    while (slots < n)
+    {
+        slots *= 2;
+    }
+    h_init(&hmap->newer, slots);
+}
+
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *))
 {
     hm_help_rehashing(hmap);
@@ -151,8 +167,10 @@ static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg)
 {
     for (size_t i = 0; htab->mask != 0 && i <= htab->mask; i++)
     {
-        for (HNode *node = htab->tab[i]; node != NULL; node = node->next)
+        // `f` may free the node
+        for (HNode *node = htab->tab[i], *next = NULL; node != NULL; node = next)
         {
+            next = node->next;
             if (!f(node, arg))
                 return false;
         }
@@ -164,3 +182,78 @@ void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg)
 {
     h_foreach(&hmap->newer, f, arg) && h_foreach(&hmap->older, f, arg);
 }
+
+// up to `n` nodes from the chains after a random slot, for approximate
+// eviction. a slot is picked by `rnd` so the caller owns the randomness.
+size_t hm_sample(HMap *hmap, uint64_t rnd, HNode **out, size_t n)
+{
+    // during rehashing most keys may still be in the older table
+    HTab *htab = hmap->older.size > hmap->newer.size ? &hmap->older : &hmap->newer;
+    if (!htab->tab || htab->size == 0)
+    {
+        return 0;
+    }
+    size_t got = 0;
+    size_t max_probes = n * 8;
+    for (size_t i = 0; i <= htab->mask && i < max_probes && got < n; i++)
+    {
+        HNode *node = htab->tab[(rnd + i) & htab->mask];
+        for (; node && got < n; node = node->next)
+        {
+            out[got++] = node;
+        }
+    }
+    return got;
+}
+
+static void h_scan_slot(HTab *htab, size_t pos, void (*f)(HNode *, void *), void *arg)
+{
+    for (HNode *node = htab->tab[pos]; node != NULL; node = node->next)
+    {
+        f(node, arg);
+    }
+}
+
+static uint64_t rev_bits(uint64_t v)
+{
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0f0f0f0f0f0f0f0full) | ((v & 0x0f0f0f0f0f0f0f0full) << 4);
+    v = ((v >> 8) & 0x00ff00ff00ff00ffull) | ((v & 0x00ff00ff00ff00ffull) << 8);
+    v = ((v >> 16) & 0x0000ffff0000ffffull) | ((v & 0x0000ffff0000ffffull) << 16);
+    return (v >> 32) | (v << 32);
+}
+
+// the cursor counts with its bits reversed, so the slots already visited
+// stay visited when the table doubles: slot i splits into i and i+n.
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg)
+{
+    HTab *small = &hmap->newer;
+    if (!small->tab)
+    {
+        return 0;
+    }
+    uint64_t mask = small->mask;
+    if (!hmap->older.tab)
+    {
+        h_scan_slot(small, cursor & mask, f, arg);
+    }
+    else
+    {
+        // rehashing: the older table is the smaller one
+        small = &hmap->older;
+        HTab *large = &hmap->newer;
+        mask = small->mask;
+        h_scan_slot(small, cursor & mask, f, arg);
+        // and the slots of the larger table it expands to
+        uint64_t v = cursor;
+        do
+        {
+            h_scan_slot(large, v & large->mask, f, arg);
+            v |= ~large->mask;
+            v = rev_bits(rev_bits(v) + 1);
+        } while (v & (mask ^ large->mask));
+    }
+    cursor |= ~mask;
+    return rev_bits(rev_bits(cursor) + 1);
+}
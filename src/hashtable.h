@@ -30,5 +30,11 @@ HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void hm_insert(HMap *hmap, HNode *node);
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void hm_clear(HMap *hmap);
+void hm_reserve(HMap *hmap, size_t n);
 size_t hm_size(HMap *hmap);
-void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
\ No newline at end of file
+void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
+size_t hm_sample(HMap *hmap, uint64_t rnd, HNode **out, size_t n);
+// visits the slots at `cursor`, returns the next cursor, 0 when done.
+// a key present for the whole scan is visited at least once, even if the
+// map grows between calls. start with 0.
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg);
\ No newline at end of file
@@ -2,7 +2,7 @@
 
 static size_t heap_parent(size_t i)
 {
-    return (i - 1) / 2 - 1;
+    return (i + 1) / 2 - 1;
 }
 
 static size_t heap_left(size_t i)
@@ -68,4 +68,26 @@ void heap_update(HeapItem *a, size_t pos, size_t len)
     {
         heap_down(a, pos, len);
     }
-}
\ No newline at end of file
+}
+
+void heap_delete(std::vector<HeapItem> &heap, size_t pos)
+{
+    // swap with last
+    heap[pos] = heap.back();
+    heap.pop_back();
+
+    if (pos < heap.size())
+        heap_update(heap.data(), pos, heap.size());
+}
+
+void heap_upsert(std::vector<HeapItem> &heap, size_t pos, HeapItem t)
+{
+    if (pos < heap.size())
+        heap[pos] = t; // update exising
+    else
+    {
+        pos = heap.size();
+        heap.push_back(t); // insert new
+    }
+    heap_update(heap.data(), pos, heap.size());
+}
@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <vector>
 
 struct HeapItem
 {
@@ -9,4 +10,6 @@ struct HeapItem
     size_t *ref = NULL;
 };
 
-void heap_update(HeapItem *a, size_t pos, size_t len);
\ No newline at end of file
+void heap_update(HeapItem *a, size_t pos, size_t len);
+void heap_delete(std::vector<HeapItem> &heap, size_t pos);
+void heap_upsert(std::vector<HeapItem> &heap, size_t pos, HeapItem t);
@@ -0,0 +1,271 @@
+#include "server.h"
+
+// warm restart: a clean shutdown writes the keyspace as an image (the format
+// is in snapshot.h) that the next start maps. its records are adopted into
+// the keyspace when a key is looked up, and in the background.
+
+static uint64_t img_u64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    memcpy(&v, p, sizeof(v));
+    return le64toh(v);
+}
+
+// unmap the image, keys that are not adopted yet are gone
+void img_drop()
+{
+    if (!g_data.img)
+    {
+        return;
+    }
+    munmap(g_data.img, g_data.img_size);
+    g_data.img = NULL;
+    g_data.img_size = 0;
+    g_data.img_pending = 0;
+}
+
+// decode a record into the keyspace and mark it in our private copy
+static void img_adopt_record(uint8_t *rec)
+{
+    uint8_t *adopted = rec + 16;
+    if (*adopted)
+    {
+        return;
+    }
+    *adopted = 1;
+    g_data.img_pending--;
+
+    SnapReader r = {rec + k_img_record_header, g_data.img + g_data.img_slots_off};
+    int64_t now_wall = (int64_t)get_wall_msec();
+    int64_t now_mono = (int64_t)get_monotonic_msec();
+    int64_t expire_at = -1;
+    Entry *ent = entry_restore(r, now_wall, now_mono, expire_at);
+    if (!ent)
+    {
+        msg("image: bad record");
+        return;
+    }
+    if (expire_at >= 0 && expire_at <= now_wall)
+    {
+        entry_del(ent, true); // expired while we were down
+        return;
+    }
+    hm_insert(&g_data.db, &ent->node);
+    if (expire_at >= 0)
+    {
+        entry_set_ttl(ent, expire_at - now_wall);
+    }
+    if (ent->type == T_ZSET && !ent->zset.heap.empty())
+    {
+        entry_sync_zexpire(ent);
+    }
+}
+
+// the offset of a record, 0 if it is not a valid one
+static uint64_t img_check_off(uint64_t off)
+{
+    if (off < k_img_header_size || off > g_data.img_slots_off ||
+        g_data.img_slots_off - off < k_img_record_header)
+    {
+        return 0;
+    }
+    return off;
+}
+
+static uint64_t img_slot(uint64_t slot)
+{
+    return img_check_off(img_u64(g_data.img + g_data.img_slots_off + slot * 8));
+}
+
+// adopt `key` if it is in the image
+void img_adopt(LookupKey *key)
+{
+    uint64_t slot = key->node.hcode & (g_data.img_nslots - 1);
+    for (uint64_t off = img_slot(slot); off; off = img_check_off(img_u64(g_data.img + off)))
+    {
+        uint8_t *rec = g_data.img + off;
+        if (img_u64(rec + 8) != key->node.hcode || rec[16])
+        {
+            continue;
+        }
+        // the entry starts with flags:u8 type:u8 key:str
+        SnapReader r = {rec + k_img_record_header + 2, g_data.img + g_data.img_slots_off};
+        uint32_t klen = 0;
+        const uint8_t *kdata = snap_read_str(r, klen);
+        if (r.ok && klen == key->key.size() && memcmp(kdata, key->key.data(), klen) == 0)
+        {
+            img_adopt_record(rec);
+            return;
+        }
+    }
+}
+
+// adopt the chains of a few slots, the image goes away after the last one
+static void img_adopt_slots(size_t max_works)
+{
+    size_t nworks = 0;
+    while (g_data.img && nworks < max_works)
+    {
+        if (g_data.img_cursor >= g_data.img_nslots || g_data.img_pending == 0)
+        {
+            img_drop();
+            break;
+        }
+        uint64_t slot = g_data.img_cursor++;
+        for (uint64_t off = img_slot(slot); off; off = img_check_off(img_u64(g_data.img + off)))
+        {
+            img_adopt_record(g_data.img + off);
+            nworks++;
+        }
+    }
+}
+
+void img_adopt_cron()
+{
+    const size_t k_img_adopt_work = 1000;
+    img_adopt_slots(k_img_adopt_work);
+}
+
+// before anything that walks the whole keyspace
+void img_adopt_all()
+{
+    img_adopt_slots((size_t)-1);
+}
+
+// map the image and make it the keyspace. the file is removed right away,
+// a crash after this restarts from the snapshot and the log as usual.
+bool img_open(const char *filename, uint64_t *aof_base)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    size_t size = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    void *map = size >= k_img_header_size
+                    ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)
+                    : MAP_FAILED;
+    close(fd);
+    unlink(filename);
+    if (map == MAP_FAILED)
+    {
+        return false;
+    }
+    const uint8_t *data = (const uint8_t *)map;
+    SnapReader r = {data, data + size};
+    uint8_t magic[8];
+    snap_read(r, magic, sizeof(magic));
+    uint32_t version = snap_read_u32(r);
+    uint64_t nkeys = snap_read_u64(r);
+    uint64_t nslots = snap_read_u64(r);
+    uint64_t slots_off = snap_read_u64(r);
+    uint64_t base = snap_read_u64(r);
+    uint32_t crc = snap_read_u32(r);
+    bool ok = r.ok && memcmp(magic, k_img_magic, sizeof(magic)) == 0 &&
+              version == k_img_version &&
+              crc == crc32_update(0, data, k_img_header_size - 4) &&
+              nslots > 0 && (nslots & (nslots - 1)) == 0 &&
+              slots_off <= size && (size - slots_off) / 8 >= nslots;
+    if (!ok)
+    {
+        msg("image: bad header, ignored");
+        munmap(map, size);
+        return false;
+    }
+    madvise(map, size, MADV_RANDOM);
+    g_data.img = (uint8_t *)map;
+    g_data.img_size = size;
+    g_data.img_nslots = nslots;
+    g_data.img_slots_off = slots_off;
+    g_data.img_pending = nkeys;
+    g_data.img_cursor = 0;
+    hm_reserve(&g_data.db, nkeys);
+    *aof_base = base;
+    return true;
+}
+
+struct ImgWriter
+{
+    int fd = -1;
+    bool ok = true;
+    Buffer buf;
+    uint64_t off = 0; // file offset of buf[0]
+    std::vector<uint64_t> slots;
+    int64_t now_wall = 0; // ms
+    int64_t now_mono = 0; // ms
+};
+
+static bool cb_img_save(HNode *node, void *arg)
+{
+    ImgWriter &w = *(ImgWriter *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    // prepend to the chain of its slot
+    uint64_t &head = w.slots[ent->node.hcode & (w.slots.size() - 1)];
+    uint64_t rec_off = w.off + w.buf.size();
+    snap_append_u64(w.buf, head);
+    snap_append_u64(w.buf, ent->node.hcode);
+    buf_append_u8(w.buf, 0);
+    entry_dump(w.buf, ent, w.now_wall, w.now_mono);
+    head = rec_off;
+    if (w.buf.size() >= k_snap_block)
+    {
+        w.ok = w.ok && write_all(w.fd, w.buf.data(), w.buf.size());
+        w.off += w.buf.size();
+        w.buf.clear();
+    }
+    return w.ok;
+}
+
+// on a clean shutdown: the keyspace laid out as a hash table of records
+bool img_save(const char *filename)
+{
+    img_adopt_all();
+    char tmpname[256];
+    snprintf(tmpname, sizeof(tmpname), "temp-%d.img", (int)getpid());
+    int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    ImgWriter w;
+    w.fd = fd;
+    w.now_wall = (int64_t)get_wall_msec();
+    w.now_mono = (int64_t)get_monotonic_msec();
+    uint64_t nkeys = hm_size(&g_data.db);
+    uint64_t nslots = 1;
+    while (nslots < nkeys)
+    {
+        nslots *= 2;
+    }
+    w.slots.assign(nslots, 0);
+    w.buf.resize(k_img_header_size); // filled in last
+
+    hm_foreach(&g_data.db, &cb_img_save, &w);
+
+    uint64_t slots_off = w.off + w.buf.size();
+    for (uint64_t head : w.slots)
+    {
+        snap_append_u64(w.buf, head);
+    }
+    w.ok = w.ok && write_all(fd, w.buf.data(), w.buf.size());
+
+    Buffer hdr;
+    buf_append(hdr, (const uint8_t *)k_img_magic, sizeof(k_img_magic));
+    snap_append_u32(hdr, k_img_version);
+    snap_append_u64(hdr, (uint64_t)nkeys);
+    snap_append_u64(hdr, (uint64_t)nslots);
+    snap_append_u64(hdr, (uint64_t)slots_off);
+    snap_append_u64(hdr, (uint64_t)(g_data.aof_seq + 1)); // the log is fully applied
+    snap_append_u32(hdr, crc32_update(0, hdr.data(), hdr.size()));
+    w.ok = w.ok && pwrite(fd, hdr.data(), hdr.size(), 0) == (ssize_t)hdr.size();
+
+    bool ok = w.ok && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmpname, filename) != 0)
+    {
+        unlink(tmpname);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,791 @@
+#include "server.h"
+
+// snapshots: SAVE writes the keyspace to photon.rdb, BGSAVE does it from a
+// forked child. the format is in snapshot.h, entries are also serialized
+// this way for RESTORE, full syncs and the warm restart image.
+
+struct DumpCtx
+{
+    Buffer *out = NULL;
+    ZSet *zset = NULL;
+    bool member_ttl = false;
+    int64_t now_wall = 0; // ms
+    int64_t now_mono = 0; // ms
+};
+
+static void cb_dump_znode(ZNode *znode, void *arg)
+{
+    DumpCtx *ctx = (DumpCtx *)arg;
+    snap_append_dbl(*ctx->out, znode->score);
+    snap_append_u32(*ctx->out, (uint32_t)znode->len);
+    buf_append(*ctx->out, (uint8_t *)znode->name, znode->len);
+    if (ctx->member_ttl)
+    {
+        int64_t at = -1;
+        if (znode->heap_idx != (size_t)-1)
+        {
+            int64_t mono = (int64_t)ctx->zset->heap[znode->heap_idx].val;
+            at = ctx->now_wall + (mono - ctx->now_mono);
+        }
+        snap_append_u64(*ctx->out, (uint64_t)at);
+    }
+}
+
+static void cb_dump_hfield(const char *field, size_t flen, const char *val, size_t vlen, void *arg)
+{
+    Buffer &out = *(Buffer *)arg;
+    snap_append_u32(out, (uint32_t)flen);
+    buf_append(out, (const uint8_t *)field, flen);
+    snap_append_u32(out, (uint32_t)vlen);
+    buf_append(out, (const uint8_t *)val, vlen);
+}
+
+// serialized entry, TTLs in unix ms:
+//   flags:u8 type:u8 key:str [expire_at:i64] value
+//   T_STR:  str, or val:i64 with SNAP_F_INT
+//   T_ZSET: count:u32 (score:f64 name:str [expire_at:i64])... in order
+//   T_THROTTLE: tat:i64, unix us
+//   T_HASH: count:u32 (field:str val:str)...
+void entry_dump(Buffer &out, Entry *ent, int64_t now_wall, int64_t now_mono)
+{
+    uint8_t flags = 0;
+    if (ent->heap_idx != (size_t)-1)
+    {
+        flags |= SNAP_F_TTL;
+    }
+    if (ent->type == T_ZSET && !ent->zset.heap.empty())
+    {
+        flags |= SNAP_F_MEMBER_TTL;
+    }
+    if (ent->int_enc)
+    {
+        flags |= SNAP_F_INT;
+    }
+    buf_append_u8(out, flags);
+    buf_append_u8(out, (uint8_t)ent->type);
+    snap_append_u32(out, (uint32_t)ent->key.size());
+    buf_append(out, (uint8_t *)ent->key.data(), ent->key.size());
+    if (flags & SNAP_F_TTL)
+    {
+        int64_t mono = (int64_t)g_data.heap[ent->heap_idx].val;
+        snap_append_u64(out, (uint64_t)(now_wall + (mono - now_mono)));
+    }
+    if (ent->int_enc || ent->type == T_THROTTLE)
+    {
+        snap_append_u64(out, (uint64_t)ent->ival);
+    }
+    else if (ent->type == T_STR)
+    {
+        std::string tmp;
+        const std::string &val = entry_str(ent, tmp);
+        snap_append_u32(out, (uint32_t)val.size());
+        buf_append(out, (uint8_t *)val.data(), val.size());
+    }
+    else if (ent->type == T_ZSET)
+    {
+        DumpCtx ctx;
+        ctx.out = &out;
+        ctx.zset = &ent->zset;
+        ctx.member_ttl = flags & SNAP_F_MEMBER_TTL;
+        ctx.now_wall = now_wall;
+        ctx.now_mono = now_mono;
+        snap_append_u32(out, (uint32_t)hm_size(&ent->zset.hmap));
+        zset_foreach_sorted(&ent->zset, &cb_dump_znode, &ctx);
+    }
+    else if (ent->type == T_HASH)
+    {
+        snap_append_u32(out, (uint32_t)hash_len(ent));
+        hash_foreach(ent, &cb_dump_hfield, &out);
+    }
+}
+
+// the reverse of entry_dump(), NULL if the record is malformed.
+// member TTLs are set, the key TTL is returned in `expire_at` (-1 for none).
+Entry *entry_restore(SnapReader &r, int64_t now_wall, int64_t now_mono,
+                     int64_t &expire_at)
+{
+    uint8_t flags = snap_read_u8(r);
+    uint8_t type = snap_read_u8(r);
+    uint32_t klen = 0;
+    const uint8_t *key = snap_read_str(r, klen);
+    expire_at = (flags & SNAP_F_TTL) ? (int64_t)snap_read_u64(r) : -1;
+    if (!r.ok || (type != T_STR && type != T_ZSET && type != T_THROTTLE && type != T_HASH))
+    {
+        r.ok = false;
+        return NULL;
+    }
+    Entry *ent = entry_new(type);
+    ent->key.assign((const char *)key, klen);
+    ent->node.hcode = str_hash(key, klen);
+    if ((type == T_STR && (flags & SNAP_F_INT)) || type == T_THROTTLE)
+    {
+        ent->int_enc = type == T_STR;
+        ent->ival = (int64_t)snap_read_u64(r);
+    }
+    else if (type == T_STR)
+    {
+        uint32_t vlen = 0;
+        const uint8_t *val = snap_read_str(r, vlen);
+        ent->str.assign((const char *)val, vlen);
+    }
+    else if (type == T_HASH)
+    {
+        // fields are unique, packed while they fit
+        uint32_t count = snap_read_u32(r);
+        for (uint32_t i = 0; i < count && r.ok; i++)
+        {
+            uint32_t flen = 0, vlen = 0;
+            const char *field = (const char *)snap_read_str(r, flen);
+            const char *val = (const char *)snap_read_str(r, vlen);
+            if (!r.ok)
+            {
+                break;
+            }
+            if (!ent->hash && (i >= k_hash_packed_max || flen > k_hash_packed_max_len ||
+                               vlen > k_hash_packed_max_len))
+            {
+                hash_convert(ent);
+            }
+            if (ent->hash)
+            {
+                hash_insert(ent, field, flen, val, vlen);
+            }
+            else
+            {
+                hpack_append(ent->str, field, flen, val, vlen);
+            }
+        }
+    }
+    else
+    {
+        // members are sorted, the tree is built bottom-up
+        uint32_t count = snap_read_u32(r);
+        ZSetBuilder builder;
+        builder.nodes.reserve(r.ok ? std::min<size_t>(count, r.end - r.cur) : 0);
+        struct MemberTTL
+        {
+            const char *name;
+            uint32_t len;
+            int64_t at; // unix ms
+        };
+        std::vector<MemberTTL> ttls;
+        for (uint32_t i = 0; i < count && r.ok; i++)
+        {
+            double score = snap_read_dbl(r);
+            uint32_t len = 0;
+            const uint8_t *name = snap_read_str(r, len);
+            int64_t at = (flags & SNAP_F_MEMBER_TTL) ? (int64_t)snap_read_u64(r) : -1;
+            if (!r.ok || (at >= 0 && at <= now_wall))
+            {
+                continue; // already expired
+            }
+            zset_builder_add(&builder, (const char *)name, len, score);
+            if (at >= 0)
+            {
+                ttls.push_back({(const char *)name, len, at});
+            }
+        }
+        zset_builder_finish(&builder, &ent->zset);
+        for (MemberTTL &ttl : ttls)
+        {
+            ZNode *znode = zset_lookup(&ent->zset, ttl.name, ttl.len);
+            zset_set_expire(&ent->zset, znode, now_mono + (ttl.at - now_wall));
+        }
+    }
+    if (!r.ok)
+    {
+        entry_del_sync(ent);
+        return NULL;
+    }
+    return ent;
+}
+
+static void snap_flush(SnapWriter &w)
+{
+    uint32_t len = (uint32_t)w.buf.size();
+    if (w.framed && len)
+    {
+        w.ok = w.ok && write_all(w.fd, (const uint8_t *)&len, 4);
+    }
+    w.ok = w.ok && write_all(w.fd, w.buf.data(), w.buf.size());
+    w.buf.clear();
+}
+
+static void snap_section_begin(SnapWriter &w, uint8_t kind)
+{
+    w.sec_start = w.buf.size();
+    w.sec_count = 0;
+    buf_append_u8(w.buf, kind);
+    snap_append_u32(w.buf, 0);
+    snap_append_u64(w.buf, 0);
+}
+
+// fill in the header and append the checksum
+static void snap_section_end(SnapWriter &w)
+{
+    uint8_t *hdr = &w.buf[w.sec_start];
+    uint64_t len = w.buf.size() - w.sec_start - k_snap_section_header;
+    uint32_t count_le = htole32(w.sec_count);
+    uint64_t len_le = htole64(len);
+    memcpy(hdr + 1, &count_le, 4);
+    memcpy(hdr + 5, &len_le, 8);
+    snap_append_u32(w.buf, crc32_update(0, hdr + k_snap_section_header, len));
+}
+
+// serialize the keyspace to `w.fd`
+bool snapshot_write(SnapWriter &w, uint64_t aof_base)
+{
+    w.buf.reserve(k_snap_block + (64 << 10));
+
+    uint64_t nkeys = hm_size(&g_data.db);
+    g_data.save_progress->keys_total = nkeys;
+    g_data.save_progress->keys_done = 0;
+    buf_append(w.buf, (const uint8_t *)k_snap_magic, sizeof(k_snap_magic));
+    snap_append_u32(w.buf, k_snap_version);
+    snap_append_u64(w.buf, (uint64_t)nkeys);
+    snap_append_u64(w.buf, (uint64_t)aof_base);
+    snap_append_u32(w.buf, crc32_update(0, w.buf.data(), w.buf.size()));
+
+    w.now_wall = (int64_t)get_wall_msec();
+    w.now_mono = (int64_t)get_monotonic_msec();
+    snap_section_begin(w, SNAP_SEC_ENTRIES);
+    hm_foreach(&g_data.db, [](HNode *node, void *arg)
+               {
+        SnapWriter &w = *(SnapWriter *)arg;
+        entry_dump(w.buf, container_of(node, Entry, node), w.now_wall, w.now_mono);
+        w.sec_count++;
+        g_data.save_progress->keys_done++;
+        if (w.buf.size() >= k_snap_block)
+        {
+            snap_section_end(w);
+            snap_flush(w);
+            snap_section_begin(w, SNAP_SEC_ENTRIES);
+        }
+        return w.ok; }, &w);
+    if (w.sec_count == 0)
+    {
+        w.buf.resize(w.sec_start); // drop the empty section
+    }
+    else
+    {
+        snap_section_end(w);
+    }
+    snap_section_begin(w, SNAP_SEC_END);
+    snap_section_end(w);
+    snap_flush(w);
+    return w.ok;
+}
+
+// write the keyspace to a temp file, then rename it over `filename`
+static bool save_snapshot(const char *filename)
+{
+    std::lock_guard<std::mutex> lk(snap_mutex);
+    char tmpname[256];
+    snprintf(tmpname, sizeof(tmpname), "temp-%d.rdb", (int)getpid());
+    SnapWriter w;
+    w.fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w.fd < 0)
+        return false;
+    // make the data durable before it replaces the old snapshot
+    bool ok = snapshot_write(w, g_data.aof_save_base) && fsync(w.fd) == 0;
+    close(w.fd);
+    if (!ok || rename(tmpname, filename) != 0)
+    {
+        unlink(tmpname);
+        return false;
+    }
+    return true;
+}
+
+
+// the log continues in a new segment that the snapshot does not cover
+static void save_prepare()
+{
+    img_adopt_all();
+    if (g_data.aof_on)
+    {
+        aof_rotate();
+    }
+    g_data.aof_save_base = g_data.aof_seq;
+}
+
+static void save_done(bool ok, uint64_t dirty_saved)
+{
+    g_data.last_save_ok = ok;
+    if (ok)
+    {
+        // LOAD may have reset it meanwhile
+        g_data.dirty -= std::min(g_data.dirty, dirty_saved);
+        g_data.last_save_time = get_wall_sec();
+        aof_remove_old(g_data.aof_save_base);
+        if (g_data.aof_on)
+        {
+            g_data.aof_size = aof_disk_size();
+        }
+    }
+}
+
+void do_save(std::vector<std::string> &, Buffer &out)
+{
+    if (g_data.child_pid != -1)
+    {
+        return out_err(out, ERR_UNKNOWN, "background save or log rewrite in progress");
+    }
+    save_prepare();
+    bool ok = save_snapshot("photon.rdb");
+    save_done(ok, g_data.dirty);
+    if (ok)
+        out_ok(out);
+    else
+        out_err(out, ERR_UNKNOWN, "save failed");
+}
+
+// fork and serialize the child's copy-on-write view of the keyspace
+static bool bgsave_start()
+{
+    assert(g_data.child_pid == -1);
+    save_prepare();
+    g_data.save_progress->keys_total = hm_size(&g_data.db);
+    g_data.save_progress->keys_done = 0;
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        msg_errno("fork() error");
+        g_data.last_save_ok = false;
+        return false;
+    }
+    if (pid == 0)
+    {
+        // child: only this thread exists, don't touch the thread pool
+        _exit(save_snapshot("photon.rdb") ? 0 : 1);
+    }
+    fprintf(stderr, "background saving started by pid %d\n", (int)pid);
+    g_data.child_pid = pid;
+    g_data.child_type = CHILD_SAVE;
+    g_data.dirty_before_save = g_data.dirty;
+    g_data.last_bgsave_start = get_wall_sec();
+    return true;
+}
+
+
+// reap the child process if it has exited
+void child_check_done(bool block)
+{
+    if (g_data.child_pid == -1)
+    {
+        return;
+    }
+    int status = 0;
+    pid_t pid = waitpid(g_data.child_pid, &status, block ? 0 : WNOHANG);
+    if (pid == 0)
+    {
+        return; // still running
+    }
+    bool ok = pid == g_data.child_pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    bool is_save = g_data.child_type == CHILD_SAVE;
+    if (g_data.child_type == CHILD_REPL_SYNC)
+    {
+        fprintf(stderr, "full sync of a replica %s\n", ok ? "done" : "failed");
+        g_data.child_pid = -1;
+        g_data.child_type = CHILD_NONE;
+        return repl_sync_done(ok);
+    }
+    fprintf(stderr, "background %s %s\n", is_save ? "saving" : "log rewrite",
+            ok ? "done" : "failed");
+    if (!ok && pid == g_data.child_pid && WIFSIGNALED(status))
+    {
+        // the child did not get to remove its temp file
+        char tmpname[256];
+        snprintf(tmpname, sizeof(tmpname), is_save ? "temp-%d.rdb" : "temp-rewrite-%d.aof",
+                 (int)g_data.child_pid);
+        unlink(tmpname);
+    }
+    pid = g_data.child_pid;
+    g_data.child_pid = -1;
+    g_data.child_type = CHILD_NONE;
+    if (is_save)
+    {
+        save_done(ok, g_data.dirty_before_save);
+    }
+    else
+    {
+        aof_rewrite_done(ok, pid);
+    }
+}
+
+void do_bgsave(std::vector<std::string> &, Buffer &out)
+{
+    if (g_data.child_pid != -1)
+    {
+        return out_err(out, ERR_UNKNOWN, "background save or log rewrite in progress");
+    }
+    if (!bgsave_start())
+    {
+        return out_err(out, ERR_UNKNOWN, "fork failed");
+    }
+    return out_str(out, "Background saving started", 25);
+}
+
+// LASTSAVE, unix time of the last successful save
+void do_lastsave(std::vector<std::string> &, Buffer &out)
+{
+    return out_int(out, (int64_t)g_data.last_save_time);
+}
+
+// automatic BGSAVE by "N changes in M seconds" rules
+void bgsave_cron()
+{
+    if (g_data.child_pid != -1 || g_data.dirty == 0)
+    {
+        return;
+    }
+    uint64_t now = get_wall_sec();
+    for (const SaveRule &rule : g_data.save_rules)
+    {
+        // after a failure, retry no sooner than every few seconds
+        const uint64_t k_retry_delay_sec = 5;
+        if (!g_data.last_save_ok && now - g_data.last_bgsave_start < k_retry_delay_sec)
+        {
+            return;
+        }
+        if (g_data.dirty >= rule.changes && now - g_data.last_save_time >= rule.seconds)
+        {
+            fprintf(stderr, "%llu changes in %llu seconds, saving\n",
+                    (unsigned long long)rule.changes, (unsigned long long)rule.seconds);
+            bgsave_start();
+            return;
+        }
+    }
+}
+// `aof_base` is the first log segment to replay on top of it
+// a keyspace being decoded, swapped in once complete
+struct SnapLoad
+{
+    HMap db;
+    std::vector<std::pair<Entry *, int64_t>> ttls; // unix ms
+    int64_t now_wall = 0;
+    int64_t now_mono = 0;
+};
+
+static void snap_load_add(SnapLoad &load, Entry *ent, int64_t expire_at)
+{
+    if (expire_at >= 0 && expire_at <= load.now_wall)
+    {
+        entry_del_sync(ent); // already expired
+        return;
+    }
+    hm_insert(&load.db, &ent->node);
+    if (expire_at >= 0)
+    {
+        load.ttls.push_back({ent, expire_at});
+    }
+}
+
+// replace the keyspace and register the timers
+static void snap_load_commit(SnapLoad &load)
+{
+    img_drop();
+    db_flush(true);
+    keys_flushed();
+    g_data.db = load.db;
+    load.db = HMap{};
+    g_data.heap.reserve(load.ttls.size());
+    for (auto &item : load.ttls)
+    {
+        entry_set_ttl(item.first, item.second - load.now_wall);
+    }
+    hm_foreach(&g_data.db, [](HNode *node, void *)
+               {
+        Entry *ent = container_of(node, Entry, node);
+        if (ent->type == T_ZSET && !ent->zset.heap.empty())
+        {
+            entry_sync_zexpire(ent);
+        }
+        return true; }, NULL);
+}
+
+// one section, decoded on the thread pool
+struct SnapTask
+{
+    const uint8_t *data = NULL;
+    uint64_t len = 0;
+    uint32_t count = 0;
+    uint32_t crc = 0;
+    int64_t now_wall = 0;
+    int64_t now_mono = 0;
+    std::vector<std::pair<Entry *, int64_t>> ents; // with the key TTL
+    const char *err = NULL;
+};
+
+static void snap_task_func(void *arg)
+{
+    SnapTask *task = (SnapTask *)arg;
+    if (task->crc != crc32_update(0, task->data, task->len))
+    {
+        task->err = "snapshot: checksum mismatch";
+        return;
+    }
+    SnapReader r = {task->data, task->data + task->len};
+    task->ents.reserve(task->count);
+    for (uint32_t i = 0; i < task->count; i++)
+    {
+        int64_t expire_at = -1;
+        Entry *ent = entry_restore(r, task->now_wall, task->now_mono, expire_at);
+        if (!ent)
+        {
+            task->err = "snapshot: bad entry";
+            return;
+        }
+        if (expire_at >= 0 && expire_at <= task->now_wall)
+        {
+            entry_del_sync(ent); // already expired
+            continue;
+        }
+        task->ents.push_back({ent, expire_at});
+    }
+    if (r.cur != r.end)
+    {
+        task->err = "snapshot: bad section";
+    }
+}
+
+// sections are decoded in parallel, then merged into the keyspace
+static bool load_snapshot_v2(const uint8_t *data, size_t size, SnapLoad &load,
+                             uint64_t *aof_base)
+{
+    SnapReader r = {data, data + size};
+    uint8_t magic[8];
+    snap_read(r, magic, sizeof(magic));
+    uint32_t version = snap_read_u32(r);
+    uint64_t nkeys = snap_read_u64(r);
+    uint64_t base = snap_read_u64(r);
+    uint32_t crc = snap_read_u32(r);
+    if (!r.ok || crc != crc32_update(0, data, k_snap_header_size - 4))
+    {
+        msg("snapshot: bad header");
+        return false;
+    }
+    if (version != k_snap_version)
+    {
+        fprintf(stderr, "snapshot: unsupported version %u\n", version);
+        return false;
+    }
+
+    // find the sections
+    std::vector<SnapTask> tasks;
+    while (true)
+    {
+        uint8_t kind = snap_read_u8(r);
+        uint32_t count = snap_read_u32(r);
+        uint64_t len = snap_read_u64(r);
+        if (!r.ok || len > (uint64_t)(r.end - r.cur) || r.end - r.cur - len < 4)
+        {
+            msg("snapshot: truncated");
+            return false;
+        }
+        const uint8_t *payload = r.cur;
+        r.cur += len;
+        uint32_t sec_crc = snap_read_u32(r);
+        if (kind == SNAP_SEC_END)
+        {
+            break;
+        }
+        if (kind != SNAP_SEC_ENTRIES)
+        {
+            continue; // from a newer minor version, skip
+        }
+        SnapTask task;
+        task.data = payload;
+        task.len = len;
+        task.count = count;
+        task.crc = sec_crc;
+        task.now_wall = load.now_wall;
+        task.now_mono = load.now_mono;
+        tasks.push_back(task);
+    }
+
+    TaskGroup group;
+    task_group_init(&group, NULL, NULL);
+    for (SnapTask &task : tasks)
+    {
+        thread_pool_submit(&g_data.thread_pool, &group, PRIO_CRITICAL, &snap_task_func, &task);
+    }
+    task_group_wait(&g_data.thread_pool, &group);
+    task_group_destroy(&group);
+
+    const char *err = NULL;
+    for (SnapTask &task : tasks)
+    {
+        err = err ? err : task.err;
+    }
+    hm_reserve(&load.db, nkeys);
+    for (SnapTask &task : tasks)
+    {
+        for (auto &item : task.ents)
+        {
+            if (err)
+            {
+                entry_del_sync(item.first);
+            }
+            else
+            {
+                snap_load_add(load, item.first, item.second);
+            }
+        }
+    }
+    if (err)
+    {
+        msg(err);
+        return false;
+    }
+    *aof_base = base;
+    return true;
+}
+
+// the original format: a key count, records without TTLs, and an
+// optional trailer with the log base
+const uint32_t k_snap_v1_aof_magic = 0x42414850; // "PHAB"
+
+static bool load_snapshot_v1(const uint8_t *data, size_t size, SnapLoad &load,
+                             uint64_t *aof_base)
+{
+    SnapReader r = {data, data + size};
+    uint32_t n = snap_read_u32(r);
+    hm_reserve(&load.db, n);
+    for (uint32_t i = 0; i < n && r.ok; i++)
+    {
+        uint32_t klen = 0;
+        const uint8_t *key = snap_read_str(r, klen);
+        uint32_t type = snap_read_u32(r);
+        if (!r.ok || (type != T_STR && type != T_ZSET))
+        {
+            r.ok = false;
+            break;
+        }
+        Entry *ent = entry_new(type);
+        ent->key.assign((const char *)key, klen);
+        ent->node.hcode = str_hash(key, klen);
+        if (type == T_STR)
+        {
+            uint32_t vlen = 0;
+            const uint8_t *val = snap_read_str(r, vlen);
+            ent->str.assign((const char *)val, vlen);
+        }
+        else
+        {
+            uint32_t count = snap_read_u32(r);
+            hm_reserve(&ent->zset.hmap, count);
+            for (uint32_t j = 0; j < count && r.ok; j++)
+            {
+                double score = snap_read_dbl(r);
+                uint32_t len = 0;
+                const char *name = (const char *)snap_read_str(r, len);
+                if (r.ok)
+                {
+                    zset_insert(&ent->zset, name, len, score);
+                }
+            }
+        }
+        snap_load_add(load, ent, -1);
+    }
+    if (!r.ok)
+    {
+        msg("snapshot: truncated");
+        return false;
+    }
+    uint32_t magic = snap_read_u32(r);
+    uint64_t base = snap_read_u64(r);
+    *aof_base = r.ok && magic == k_snap_v1_aof_magic ? base : 0;
+    return true;
+}
+
+// decode a snapshot into a new keyspace, the current one is kept if
+// it is damaged
+bool load_snapshot_data(const uint8_t *data, size_t size, uint64_t *aof_base)
+{
+    SnapLoad load;
+    load.now_wall = (int64_t)get_wall_msec();
+    load.now_mono = (int64_t)get_monotonic_msec();
+    bool v2 = size >= sizeof(k_snap_magic) && memcmp(data, k_snap_magic, sizeof(k_snap_magic)) == 0;
+    bool ok = v2 ? load_snapshot_v2(data, size, load, aof_base)
+                 : load_snapshot_v1(data, size, load, aof_base);
+    if (!ok)
+    {
+        db_free(&load.db);
+        return false;
+    }
+    snap_load_commit(load);
+    return true;
+}
+
+// map the file and load it. `aof_base` is the first log segment to
+// replay on top of it.
+bool load_snapshot(const char *filename, uint64_t *aof_base)
+{
+    std::lock_guard<std::mutex> lk(snap_mutex);
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    Buffer copy;
+    const uint8_t *data = NULL;
+    void *map = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (map != MAP_FAILED)
+    {
+        madvise(map, size, MADV_SEQUENTIAL);
+        data = (const uint8_t *)map;
+    }
+    else
+    {
+        // one sequential read
+        copy.resize(size);
+        size_t nread = 0;
+        while (nread < size)
+        {
+            ssize_t rv = pread(fd, &copy[nread], size - nread, (off_t)nread);
+            if (rv <= 0)
+                break;
+            nread += (size_t)rv;
+        }
+        copy.resize(nread);
+        size = nread;
+        data = copy.data();
+    }
+    close(fd);
+
+    bool ok = load_snapshot_data(data, size, aof_base);
+    if (map != MAP_FAILED)
+    {
+        munmap(map, size);
+    }
+    return ok;
+}
+void do_load(std::vector<std::string> &, Buffer &out)
+{
+    if (g_data.aof_on)
+    {
+        // the log would no longer match the keyspace
+        return out_err(out, ERR_UNKNOWN, "LOAD is not allowed with appendonly");
+    }
+    if (g_data.child_pid != -1)
+    {
+        return out_err(out, ERR_UNKNOWN, "background save or log rewrite in progress");
+    }
+    uint64_t aof_base = 0;
+    if (load_snapshot("photon.rdb", &aof_base))
+    {
+        g_data.dirty = 0;
+        // the replicas start over with a full sync, not from the stream
+        cmd_propagate_end(true);
+        repl_new_history();
+        out_ok(out);
+    }
+    else
+        out_err(out, ERR_UNKNOWN, "load failed");
+}
@@ -7,11 +7,14 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
+#include <netdb.h>
 #include <assert.h>
 #include <vector>
 #include <string>
+#include <map>
 #include <iostream>
 #include <algorithm>
+#include "cluster.h"
 #define PROMPT "\033[93m⚡photon>\033[0m "
 
 static void msg(const char *msg)
@@ -217,10 +220,11 @@ static int32_t print_response(const uint8_t *data, size_t size)
     }
 }
 
-static int32_t read_res(int fd)
+// reads one reply body
+static int32_t read_res(int fd, std::vector<uint8_t> &body)
 {
     // 4B header
-    char rbuf[4 + k_max_msg + 1];
+    char rbuf[4];
     errno = 0;
     int32_t err = read_full(fd, rbuf, 4);
     if (err)
@@ -242,45 +246,282 @@ static int32_t read_res(int fd)
     }
 
     // reply body
-    err = read_full(fd, &rbuf[4], len);
+    body.resize(len);
+    err = read_full(fd, (char *)body.data(), len);
     if (err)
     {
         msg("read() error");
         return err;
     }
+    return 0;
+}
 
+static int32_t print_res(const std::vector<uint8_t> &body)
+{
     // print server response
-    int32_t rv = print_response((uint8_t *)&rbuf[4], len);
+    int32_t rv = print_response(body.data(), body.size());
     if (rv < 0)
     {
         msg("failed to parse response");
         return rv;
     }
-    if ((uint32_t)rv != len)
+    if ((uint32_t)rv != body.size())
     {
-        fprintf(stderr, "DEBUG: response size mismatch %d != %u\n", rv, len);
+        fprintf(stderr, "DEBUG: response size mismatch %d != %zu\n", rv, body.size());
     }
     return 0;
 }
 
-int main()
+static int connect_to(const std::string &host, const std::string &port)
 {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+    {
+        return -1;
+    }
     int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0)
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// -c: keys are routed to the node that owns their slot
+static struct
+{
+    bool on = false;
+    std::string seed;                // "host:port" from the command line
+    std::vector<std::string> slots;  // owner of each slot, empty if unknown
+    std::map<std::string, int> conns; // "host:port" -> fd
+} g_cluster;
+
+// commands without a key in cmd[1]
+static bool is_keyless(const std::string &name)
+{
+    static const char *names[] = {
+        "ZAP", "PING", "HELLO", "PROTO", "KEYS", "FLUSHALL", "SAVE", "LOAD",
+        "BGSAVE", "BGREWRITEAOF", "LASTSAVE", "INFO", "PSYNC", "REPLICAOF",
+        "CLUSTER", "ASKING", "MIGRATE", "SUBSCRIBE", "UNSUBSCRIBE",
+        "PSUBSCRIBE", "PUNSUBSCRIBE", "PUBLISH", "CDCSUBSCRIBE",
+        "CDCUNSUBSCRIBE", "CLIENT", "MULTI", "EXEC", "DISCARD", "UNWATCH",
+        "SCRIPT",
+    };
+    for (const char *n : names)
+    {
+        if (name == n)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the key that picks the node for a command, NULL for the seed node
+static const std::string *routing_key(const std::vector<std::string> &cmd)
+{
+    std::string name = cmd[0];
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+    if (name == "EVAL" || name == "EVALSHA")
+    {
+        // EVAL script numkeys key... arg...
+        return cmd.size() > 3 && atoi(cmd[2].c_str()) > 0 ? &cmd[3] : NULL;
+    }
+    return cmd.size() > 1 && !is_keyless(name) ? &cmd[1] : NULL;
+}
+
+static int cluster_conn(const std::string &addr)
+{
+    auto it = g_cluster.conns.find(addr);
+    if (it != g_cluster.conns.end())
+    {
+        return it->second;
+    }
+    size_t colon = addr.rfind(':');
+    if (colon == std::string::npos)
+    {
+        return -1;
+    }
+    int fd = connect_to(addr.substr(0, colon), addr.substr(colon + 1));
+    if (fd >= 0)
+    {
+        g_cluster.conns[addr] = fd;
+    }
+    return fd;
+}
+
+static void cluster_drop(const std::string &addr)
+{
+    auto it = g_cluster.conns.find(addr);
+    if (it != g_cluster.conns.end())
+    {
+        close(it->second);
+        g_cluster.conns.erase(it);
+    }
+}
+
+static bool get_u32(const std::vector<uint8_t> &b, size_t &pos, uint32_t &val)
+{
+    if (pos + 4 > b.size())
+    {
+        return false;
+    }
+    memcpy(&val, &b[pos], 4);
+    val = le32toh(val);
+    pos += 4;
+    return true;
+}
+
+// load the slot map with CLUSTER SLOTS: [[start, end, "host:port"], ...]
+static void cluster_refresh(const std::string &addr)
+{
+    int fd = cluster_conn(addr);
+    std::vector<uint8_t> body;
+    if (fd < 0 || send_req(fd, {"CLUSTER", "SLOTS"}) || read_res(fd, body))
+    {
+        cluster_drop(addr);
+        return;
+    }
+    size_t pos = 1;
+    uint32_t n = 0;
+    if (body.empty() || body[0] != TAG_ARR || !get_u32(body, pos, n))
+    {
+        return;
+    }
+    g_cluster.slots.assign(k_cluster_slots, "");
+    for (uint32_t i = 0; i < n; i++)
+    {
+        int64_t start = 0, end = 0;
+        uint32_t cnt = 0, len = 0;
+        if (pos >= body.size() || body[pos++] != TAG_ARR || !get_u32(body, pos, cnt) ||
+            cnt != 3 || pos + 2 * 9 + 5 > body.size())
+        {
+            return;
+        }
+        memcpy(&start, &body[pos + 1], 8);
+        memcpy(&end, &body[pos + 10], 8);
+        pos += 19;
+        if (!get_u32(body, pos, len) || pos + len > body.size())
+        {
+            return;
+        }
+        std::string owner((const char *)&body[pos], len);
+        pos += len;
+        for (int64_t slot = start; slot <= end && slot < (int64_t)k_cluster_slots; slot++)
+        {
+            g_cluster.slots[slot] = owner;
+        }
+    }
+}
+
+// the code and the "<slot> <host:port>" of a redirect, 0 if not one
+static int32_t redirect_of(const std::vector<uint8_t> &body, std::string &addr)
+{
+    if (body.size() < 1 + 8 || body[0] != TAG_ERR)
+    {
+        return 0;
+    }
+    int32_t code = 0;
+    uint32_t len = 0;
+    memcpy(&code, &body[1], 4);
+    memcpy(&len, &body[5], 4);
+    code = le32toh(code);
+    len = le32toh(len);
+    std::string m((const char *)&body[9], std::min<size_t>(len, body.size() - 9));
+    size_t sp = m.find(' ');
+    if ((code != ERR_MOVED && code != ERR_ASK) || sp == std::string::npos)
+    {
+        return 0;
+    }
+    addr = m.substr(sp + 1);
+    if (code == ERR_MOVED)
+    {
+        g_cluster.slots[atoi(m.c_str()) % k_cluster_slots] = addr;
+    }
+    return code;
+}
+
+// sends the command to the owner of its key, following redirects
+static int32_t cluster_request(const std::vector<std::string> &cmd)
+{
+    std::string addr = g_cluster.seed;
+    if (const std::string *key = routing_key(cmd))
+    {
+        const std::string &owner = g_cluster.slots[key_slot(key->data(), key->size())];
+        addr = owner.empty() ? addr : owner;
+    }
+    bool asking = false;
+    for (int tries = 0; tries < 5; tries++)
     {
-        die("socket()");
+        int fd = cluster_conn(addr);
+        if (fd < 0)
+        {
+            fprintf(stderr, "can't connect to %s\n", addr.c_str());
+            return -1;
+        }
+        std::vector<uint8_t> body;
+        bool failed = asking && (send_req(fd, {"ASKING"}) || read_res(fd, body));
+        if (failed || send_req(fd, cmd) || read_res(fd, body))
+        {
+            cluster_drop(addr);
+            return -1;
+        }
+        std::string target;
+        int32_t code = redirect_of(body, target);
+        if (code == 0)
+        {
+            return print_res(body);
+        }
+        fprintf(stderr, "-> %s %s\n", code == ERR_MOVED ? "moved to" : "asking", target.c_str());
+        asking = code == ERR_ASK; // only this once
+        addr = target;
     }
+    msg("too many redirects");
+    return 0;
+}
 
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);
-    int rv = connect(fd, (const struct sockaddr *)&addr, sizeof(addr));
+int main(int argc, char **argv)
+{
+    std::string host = "127.0.0.1", port = "1234";
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-h" && i + 1 < argc)
+        {
+            host = argv[++i];
+        }
+        else if (arg == "-p" && i + 1 < argc)
+        {
+            port = argv[++i];
+        }
+        else if (arg == "-c")
+        {
+            g_cluster.on = true;
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [-h <host>] [-p <port>] [-c]\n", argv[0]);
+            return 1;
+        }
+    }
 
-    if (rv)
+    int fd = connect_to(host, port);
+    if (fd < 0)
     {
         die("connect");
     }
+    if (g_cluster.on)
+    {
+        g_cluster.seed = host + ":" + port;
+        g_cluster.conns[g_cluster.seed] = fd;
+        g_cluster.slots.assign(k_cluster_slots, "");
+        cluster_refresh(g_cluster.seed);
+    }
 
     while (true)
     {
@@ -302,6 +543,15 @@ int main()
                 pos++;
                 continue;
             }
+            // "..." keeps its spaces, e.g. a script
+            if (line[pos] == '"')
+            {
+                size_t end = line.find('"', pos + 1);
+                end = end == std::string::npos ? line.size() : end;
+                cmd.push_back(line.substr(pos + 1, end - pos - 1));
+                pos = end + 1;
+                continue;
+            }
             size_t start = pos;
             while (pos < line.size() && !isspace(line[pos]))
             {
@@ -314,19 +564,37 @@ int main()
         if (cmd[0] == "exit" || cmd[0] == "quit")
             break;
 
+        if (g_cluster.on)
+        {
+            cluster_request(cmd);
+            continue;
+        }
         int32_t err = send_req(fd, cmd);
         if (err)
         {
             msg("Failed to send request");
             break;
         }
-        err = read_res(fd);
+        std::vector<uint8_t> body;
+        err = read_res(fd, body);
+        if (!err)
+        {
+            err = print_res(body);
+        }
         if (err)
         {
             msg("Failed to send request");
             break;
         }
     }
+    if (g_cluster.on)
+    {
+        for (auto &it : g_cluster.conns)
+        {
+            close(it.second);
+        }
+        return 0;
+    }
     close(fd);
     return 0;
-}
\ No newline at end of file
+}
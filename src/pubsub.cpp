@@ -0,0 +1,399 @@
+#include "server.h"
+
+// pub/sub: a published message is serialized once into a PubMsg and
+// queued by reference on each subscriber, handle_write() sends it from
+// there. a subscriber with more than --pubsub-output-limit bytes queued
+// is disconnected.
+
+static bool channel_eq(HNode *lhs, HNode *key)
+{
+    Channel *ch = container_of(lhs, Channel, node);
+    LookupKey *hkey = container_of(key, LookupKey, node);
+    return ch->name == hkey->key;
+}
+
+Channel *channel_find(HMap *map, const std::string &name, bool create)
+{
+    LookupKey key;
+    key.key = name;
+    key.node.hcode = str_hash((const uint8_t *)name.data(), name.size());
+    HNode *node = hm_lookup(map, &key.node, &channel_eq);
+    if (node || !create)
+    {
+        return node ? container_of(node, Channel, node) : NULL;
+    }
+    Channel *ch = new Channel();
+    ch->name = name;
+    ch->node.hcode = key.node.hcode;
+    hm_insert(map, &ch->node);
+    return ch;
+}
+
+// true if it was subscribed
+bool channel_unsub(HMap *map, const std::string &name, Conn *conn)
+{
+    Channel *ch = channel_find(map, name, false);
+    if (!ch)
+    {
+        return false;
+    }
+    auto it = std::find(ch->subs.begin(), ch->subs.end(), conn);
+    if (it == ch->subs.end())
+    {
+        return false;
+    }
+    ch->subs.erase(it);
+    if (ch->subs.empty())
+    {
+        hm_delete(map, &ch->node, &hnode_same);
+        delete ch;
+    }
+    return true;
+}
+
+// matches one character against the pattern at `p`, which moves past it
+static bool glob_one(const std::string &pat, size_t &p, char c)
+{
+    size_t q = p;
+    bool ok = false;
+    size_t close = pat[q] == '[' ? pat.find(']', q + 2) : std::string::npos;
+    if (pat[q] == '?')
+    {
+        ok = true;
+        q++;
+    }
+    else if (close != std::string::npos)
+    {
+        // [abc], [a-z], [^abc]
+        q++;
+        bool neg = pat[q] == '^' && q + 1 < close;
+        q += neg;
+        for (; q < close; q++)
+        {
+            if (q + 2 < close && pat[q + 1] == '-')
+            {
+                ok = ok || (c >= pat[q] && c <= pat[q + 2]);
+                q += 2;
+            }
+            else
+            {
+                ok = ok || c == pat[q];
+            }
+        }
+        ok = ok != neg;
+        q = close + 1;
+    }
+    else if (pat[q] == '\\' && q + 1 < pat.size())
+    {
+        ok = pat[q + 1] == c;
+        q += 2;
+    }
+    else
+    {
+        ok = pat[q] == c;
+        q++;
+    }
+    if (ok)
+    {
+        p = q;
+    }
+    return ok;
+}
+
+// glob-style: *, ?, [...] and \ to escape
+bool glob_match(const std::string &pat, const std::string &s)
+{
+    size_t p = 0, i = 0;
+    size_t star_p = std::string::npos, star_i = 0; // where to backtrack to
+    while (i < s.size())
+    {
+        if (p < pat.size() && pat[p] == '*')
+        {
+            star_p = ++p;
+            star_i = i;
+        }
+        else if (p < pat.size() && glob_one(pat, p, s[i]))
+        {
+            i++;
+        }
+        else if (star_p != std::string::npos)
+        {
+            p = star_p; // let the last * take one more character
+            i = ++star_i;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (p < pat.size() && pat[p] == '*')
+    {
+        p++;
+    }
+    return p == pat.size();
+}
+
+void pubmsg_unref(PubMsg *m)
+{
+    if (--m->refs > 0)
+    {
+        return;
+    }
+    for (PubMsg *copy : m->copies)
+    {
+        if (copy)
+        {
+            pubmsg_unref(copy);
+        }
+    }
+    delete m;
+}
+
+// the message in the protocol of a connection, translated once per version
+PubMsg *pubmsg_for(PubMsg *m, int proto)
+{
+    if (proto == PROTO_BIN)
+    {
+        return m;
+    }
+    PubMsg *&copy = m->copies[proto - PROTO_V2];
+    if (!copy)
+    {
+        copy = new PubMsg();
+        copy->refs = 1; // held by `m`
+        if (proto == PROTO_V2)
+        {
+            v2_frame(copy->data, 0, V2_RES_PUSH, &m->data[4], m->data.size() - 4);
+        }
+        else
+        {
+            resp_encode(&m->data[4], m->data.size() - 4, copy->data, proto, true);
+        }
+    }
+    return copy;
+}
+
+// after `outgoing` and the earlier messages
+void conn_queue_msg(Conn *conn, PubMsg *m)
+{
+    m->refs++;
+    conn->pubq.push_back(m);
+    conn->pubq_bytes += m->data.size();
+    conn->want_read = false;
+    conn->want_write = true;
+}
+
+// drop the sent bytes from the front of the queue
+void conn_pubq_consume(Conn *conn, size_t n)
+{
+    conn->pubq_bytes -= n;
+    while (n > 0)
+    {
+        PubMsg *m = conn->pubq.front();
+        size_t k = std::min(n, m->data.size() - conn->pubq_head);
+        conn->pubq_head += k;
+        n -= k;
+        if (conn->pubq_head == m->data.size())
+        {
+            conn->pubq.pop_front();
+            conn->pubq_head = 0;
+            pubmsg_unref(m);
+        }
+    }
+}
+
+void pubsub_push(Conn *conn, PubMsg *m)
+{
+    if (conn->want_close)
+    {
+        return;
+    }
+    m = pubmsg_for(m, conn->proto);
+    if (conn->outgoing.size() + conn->pubq_bytes + m->data.size() > g_data.pubsub_limit)
+    {
+        msg("subscriber is too slow, disconnecting");
+        conn->want_close = true;
+        g_data.pubsub_dropped++;
+        g_data.pubsub_drops.push_back(conn->fd);
+        return;
+    }
+    conn_queue_msg(conn, m);
+}
+
+struct PatternCtx
+{
+    const std::string *channel;
+    const std::string *payload;
+    uint64_t nrecv = 0;
+};
+
+static bool cb_publish_pattern(HNode *node, void *arg)
+{
+    PatternCtx *ctx = (PatternCtx *)arg;
+    Channel *pat = container_of(node, Channel, node);
+    if (!glob_match(pat->name, *ctx->channel))
+    {
+        return true;
+    }
+    PubMsg *m = new PubMsg();
+    size_t header = 0;
+    response_begin(m->data, &header);
+    out_arr(m->data, 4);
+    out_str(m->data, "pmessage", 8);
+    out_str(m->data, pat->name.data(), pat->name.size());
+    out_str(m->data, ctx->channel->data(), ctx->channel->size());
+    out_str(m->data, ctx->payload->data(), ctx->payload->size());
+    response_end(m->data, header);
+    m->refs++; // held while fanning out
+    for (Conn *conn : pat->subs)
+    {
+        pubsub_push(conn, m);
+    }
+    ctx->nrecv += pat->subs.size();
+    pubmsg_unref(m);
+    return true;
+}
+
+// the number of subscriptions that got it
+static uint64_t pubsub_publish(const std::string &channel, const std::string &payload)
+{
+    g_data.pubsub_messages++;
+    PatternCtx ctx;
+    ctx.channel = &channel;
+    ctx.payload = &payload;
+    if (Channel *ch = channel_find(&g_data.channels, channel, false))
+    {
+        PubMsg *m = new PubMsg();
+        size_t header = 0;
+        response_begin(m->data, &header);
+        out_arr(m->data, 3);
+        out_str(m->data, "message", 7);
+        out_str(m->data, channel.data(), channel.size());
+        out_str(m->data, payload.data(), payload.size());
+        response_end(m->data, header);
+        m->refs++;
+        for (Conn *conn : ch->subs)
+        {
+            pubsub_push(conn, m);
+        }
+        ctx.nrecv += ch->subs.size();
+        pubmsg_unref(m);
+    }
+    if (hm_size(&g_data.patterns) > 0)
+    {
+        hm_foreach(&g_data.patterns, &cb_publish_pattern, &ctx);
+    }
+    return ctx.nrecv;
+}
+
+// after the connections are handled: close the dropped subscribers
+void pubsub_cron()
+{
+    for (int fd : g_data.pubsub_drops)
+    {
+        Conn *conn = g_data.fd2conn[fd];
+        if (conn && conn->want_close)
+        {
+            conn_destroy(conn);
+        }
+    }
+    g_data.pubsub_drops.clear();
+}
+
+
+void pubsub_conn_gone(Conn *conn)
+{
+    for (const std::string &name : conn->channels)
+    {
+        channel_unsub(&g_data.channels, name, conn);
+    }
+    for (const std::string &name : conn->patterns)
+    {
+        channel_unsub(&g_data.patterns, name, conn);
+    }
+    for (PubMsg *m : conn->pubq)
+    {
+        pubmsg_unref(m);
+    }
+    conn->pubq.clear();
+    cdc_conn_gone(conn);
+    tracking_off(conn);
+}
+
+static uint64_t conn_nsubs(Conn *conn)
+{
+    return conn->channels.size() + conn->patterns.size();
+}
+
+// SUBSCRIBE channel... or PSUBSCRIBE pattern..., the number of subscriptions
+static void pubsub_sub(std::vector<std::string> &cmd, Buffer &out, bool pattern)
+{
+    Conn *conn = g_data.cur_conn;
+    if (!conn)
+    {
+        return out_err(out, ERR_UNKNOWN, "not a client");
+    }
+    HMap *map = pattern ? &g_data.patterns : &g_data.channels;
+    std::vector<std::string> &names = pattern ? conn->patterns : conn->channels;
+    for (size_t i = 1; i < cmd.size(); i++)
+    {
+        if (std::find(names.begin(), names.end(), cmd[i]) != names.end())
+        {
+            continue;
+        }
+        channel_find(map, cmd[i], true)->subs.push_back(conn);
+        names.push_back(cmd[i]);
+    }
+    return out_int(out, (int64_t)conn_nsubs(conn));
+}
+
+// UNSUBSCRIBE [channel...] or PUNSUBSCRIBE [pattern...], all if none given
+static void pubsub_unsub(std::vector<std::string> &cmd, Buffer &out, bool pattern)
+{
+    Conn *conn = g_data.cur_conn;
+    if (!conn)
+    {
+        return out_err(out, ERR_UNKNOWN, "not a client");
+    }
+    HMap *map = pattern ? &g_data.patterns : &g_data.channels;
+    std::vector<std::string> &names = pattern ? conn->patterns : conn->channels;
+    std::vector<std::string> which(cmd.begin() + 1, cmd.end());
+    if (which.empty())
+    {
+        which = names;
+    }
+    for (const std::string &name : which)
+    {
+        if (channel_unsub(map, name, conn))
+        {
+            names.erase(std::find(names.begin(), names.end(), name));
+        }
+    }
+    return out_int(out, (int64_t)conn_nsubs(conn));
+}
+
+void do_subscribe(std::vector<std::string> &cmd, Buffer &out)
+{
+    return pubsub_sub(cmd, out, false);
+}
+
+void do_psubscribe(std::vector<std::string> &cmd, Buffer &out)
+{
+    return pubsub_sub(cmd, out, true);
+}
+
+void do_unsubscribe(std::vector<std::string> &cmd, Buffer &out)
+{
+    return pubsub_unsub(cmd, out, false);
+}
+
+void do_punsubscribe(std::vector<std::string> &cmd, Buffer &out)
+{
+    return pubsub_unsub(cmd, out, true);
+}
+
+// PUBLISH channel message, the number of receivers
+void do_publish(std::vector<std::string> &cmd, Buffer &out)
+{
+    return out_int(out, (int64_t)pubsub_publish(cmd[1], cmd[2]));
+}
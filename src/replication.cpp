@@ -0,0 +1,499 @@
+#include "server.h"
+
+// replication: a replica sends PSYNC <replid> <offset> and gets the
+// part of the backlog it missed, or a full sync. then it is fed the
+// command stream, the same bytes that go to the append log. offsets
+// count the bytes of the stream.
+//
+//   full sync: the reply "FULLRESYNC <replid>", then from a child:
+//   offset:u64, the snapshot in blocks of len:u32 data, len 0 at the end
+
+const size_t k_repl_out_chunk = 256 << 10; // backlog bytes queued per replica at once
+const size_t k_repl_pending_max = 256 << 20; // stream kept for a replica during its sync
+const char *k_repl_transfer_file = "photon-sync.tmp";
+const uint64_t k_repl_retry_ms = 1000;
+
+void repl_new_replid()
+{
+    uint8_t rnd[20];
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    ssize_t rv = fd < 0 ? -1 : read(fd, rnd, sizeof(rnd));
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    char hex[2 * sizeof(rnd) + 1];
+    for (size_t i = 0; i < sizeof(rnd); i++)
+    {
+        uint8_t b = rv == (ssize_t)sizeof(rnd) ? rnd[i] : (uint8_t)rand();
+        snprintf(hex + 2 * i, 3, "%02x", b);
+    }
+    g_data.replid = hex;
+}
+
+// append the new part of `aof_buf` to the backlog ring
+void repl_feed_backlog()
+{
+    const uint8_t *data = g_data.aof_buf.data() + g_data.repl_fed;
+    size_t n = g_data.aof_buf.size() - g_data.repl_fed;
+    g_data.repl_fed = g_data.aof_buf.size();
+    Buffer &ring = g_data.repl_backlog;
+    if (ring.empty() || n == 0)
+    {
+        return;
+    }
+    if (g_data.repl_sync_conn)
+    {
+        // it gets these once the snapshot is out, the backlog may lose them
+        buf_append(g_data.repl_sync_conn->repl_pending, data, n);
+    }
+    g_data.repl_off += n;
+    g_data.repl_backlog_histlen = std::min<uint64_t>(g_data.repl_backlog_histlen + n, ring.size());
+    if (n > ring.size())
+    {
+        data += n - ring.size(); // only the tail fits
+        n = ring.size();
+    }
+    while (n > 0)
+    {
+        size_t k = std::min(n, ring.size() - g_data.repl_backlog_idx);
+        memcpy(&ring[g_data.repl_backlog_idx], data, k);
+        g_data.repl_backlog_idx = (g_data.repl_backlog_idx + k) % ring.size();
+        data += k;
+        n -= k;
+    }
+}
+
+// queue the next part of the stream, false if the backlog no longer has it
+static bool repl_send(Conn *conn)
+{
+    uint64_t lag = g_data.repl_off - conn->repl_off;
+    if (lag > g_data.repl_backlog_histlen)
+    {
+        return false;
+    }
+    Buffer &ring = g_data.repl_backlog;
+    size_t room = conn->outgoing.size() < k_repl_out_chunk
+                      ? k_repl_out_chunk - conn->outgoing.size()
+                      : 0;
+    size_t n = (size_t)std::min<uint64_t>(lag, room);
+    size_t pos = (size_t)((g_data.repl_backlog_idx + ring.size() - lag) % ring.size());
+    while (n > 0)
+    {
+        size_t k = std::min(n, ring.size() - pos);
+        buf_append(conn->outgoing, &ring[pos], k);
+        pos = (pos + k) % ring.size();
+        conn->repl_off += k;
+        n -= k;
+    }
+    if (conn->outgoing.size() > 0)
+    {
+        conn->want_read = false;
+        conn->want_write = true;
+    }
+    return true;
+}
+
+// at the end of each iteration: the new commands go to the replicas
+void repl_feed()
+{
+    repl_feed_backlog();
+    if (!g_data.aof_on)
+    {
+        g_data.aof_buf.clear();
+        g_data.repl_fed = 0;
+    }
+    for (Conn *conn : g_data.fd2conn)
+    {
+        if (conn && conn->repl_state == REPL_ONLINE && !repl_send(conn))
+        {
+            msg("replica fell behind the backlog, disconnecting");
+            conn_destroy(conn);
+        }
+        else if (conn && conn->repl_state == REPL_SENDING &&
+                 conn->repl_pending.size() > k_repl_pending_max)
+        {
+            msg("too many writes during the full sync of a replica, disconnecting");
+            conn_destroy(conn);
+        }
+    }
+}
+
+// our data no longer follows our stream, e.g. after a full sync from
+// a master. our own replicas start over.
+void repl_new_history()
+{
+    repl_new_replid();
+    g_data.repl_backlog_histlen = 0;
+    for (Conn *conn : g_data.fd2conn)
+    {
+        if (conn && conn->repl_state >= REPL_WAIT_SYNC && conn->repl_state <= REPL_ONLINE)
+        {
+            conn_destroy(conn);
+        }
+    }
+}
+
+// PSYNC replid offset, from a replica
+void do_psync(std::vector<std::string> &cmd, Buffer &out)
+{
+    Conn *conn = g_data.cur_conn;
+    int64_t off = 0;
+    if (!str2int(cmd[2], off))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    if (!conn || conn->repl_state != REPL_NONE)
+    {
+        return out_err(out, ERR_UNKNOWN, "already a replica");
+    }
+    if (g_data.repl_backlog.empty())
+    {
+        // the stream is recorded from the first replica on
+        g_data.repl_backlog.resize(g_data.repl_backlog_size);
+        g_data.repl_backlog_idx = 0;
+        g_data.repl_backlog_histlen = 0;
+        g_data.repl_fed = g_data.aof_buf.size();
+    }
+    uint64_t oldest = g_data.repl_off - g_data.repl_backlog_histlen;
+    if (cmd[1] == g_data.replid && off >= (int64_t)oldest && off <= (int64_t)g_data.repl_off)
+    {
+        fprintf(stderr, "partial resync of a replica from offset %lld\n", (long long)off);
+        conn->repl_state = REPL_ONLINE;
+        conn->repl_off = (uint64_t)off;
+        return out_str(out, "CONTINUE", 8);
+    }
+    conn->repl_state = REPL_WAIT_SYNC; // forked by repl_cron()
+    std::string reply = "FULLRESYNC " + g_data.replid;
+    return out_str(out, reply.data(), reply.size());
+}
+
+// fork a child that writes the snapshot to the replica's socket
+static bool repl_sync_start(Conn *conn)
+{
+    assert(g_data.child_pid == -1);
+    img_adopt_all();
+    repl_feed_backlog(); // the snapshot includes everything up to here
+    uint64_t off = g_data.repl_off;
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        msg_errno("fork() error");
+        return false;
+    }
+    if (pid == 0)
+    {
+        // child: blocking writes, the parent leaves the socket alone meanwhile
+        int flags = fcntl(conn->fd, F_GETFL, 0);
+        fcntl(conn->fd, F_SETFL, flags & ~O_NONBLOCK);
+        SnapWriter w;
+        w.fd = conn->fd;
+        w.framed = true;
+        uint32_t end = 0;
+        bool ok = write_all(w.fd, (const uint8_t *)&off, 8) && snapshot_write(w, 0) &&
+                  write_all(w.fd, (const uint8_t *)&end, 4);
+        _exit(ok ? 0 : 1);
+    }
+    fprintf(stderr, "full sync of a replica started by pid %d\n", (int)pid);
+    g_data.child_pid = pid;
+    g_data.child_type = CHILD_REPL_SYNC;
+    g_data.repl_sync_conn = conn;
+    conn->repl_state = REPL_SENDING;
+    conn->repl_off = off;
+    conn->want_read = false;
+    conn->want_write = false;
+    return true;
+}
+
+void repl_sync_done(bool ok)
+{
+    Conn *conn = g_data.repl_sync_conn;
+    g_data.repl_sync_conn = NULL;
+    if (!conn)
+    {
+        return; // disconnected meanwhile
+    }
+    fd_set_nb(conn->fd);
+    if (!ok)
+    {
+        return conn_destroy(conn);
+    }
+    // the writes made during the sync, then the stream as usual
+    conn->repl_state = REPL_ONLINE;
+    conn->want_read = true;
+    conn->repl_off += conn->repl_pending.size();
+    buf_append(conn->outgoing, conn->repl_pending.data(), conn->repl_pending.size());
+    Buffer().swap(conn->repl_pending);
+    if (!repl_send(conn))
+    {
+        msg("replica fell behind the backlog during the sync");
+        conn_destroy(conn);
+    }
+}
+
+// non-blocking connect, the PSYNC goes out once it is established
+static void repl_connect()
+{
+    g_data.repl_retry_ms = get_monotonic_msec() + k_repl_retry_ms;
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    char port[16];
+    snprintf(port, sizeof(port), "%d", g_data.master_port);
+    if (getaddrinfo(g_data.master_host.c_str(), port, &hints, &res) != 0)
+    {
+        msg("cannot resolve the master");
+        return;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        freeaddrinfo(res);
+        return msg_errno("socket()");
+    }
+    fd_set_nb(fd);
+    int rv = connect(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (rv < 0 && errno != EINPROGRESS)
+    {
+        msg_errno("connect() to the master");
+        close(fd);
+        return;
+    }
+    Conn *conn = conn_new(fd);
+    conn->repl_state = REPL_LINK_HANDSHAKE;
+    g_data.repl_tx = StreamTx{};
+    conn->want_write = true;
+    bool known = !g_data.master_replid.empty();
+    buf_append_cmd(conn->outgoing, {"PSYNC", known ? g_data.master_replid : "?",
+                                    known ? int2str((int64_t)g_data.master_off) : "-1"});
+    g_data.repl_link = conn;
+    fprintf(stderr, "connecting to the master %s:%d\n", g_data.master_host.c_str(),
+            g_data.master_port);
+}
+
+static void repl_link_drop()
+{
+    if (g_data.repl_link)
+    {
+        conn_destroy(g_data.repl_link);
+    }
+}
+
+// drop the snapshot being received
+void repl_transfer_reset()
+{
+    if (g_data.repl_transfer_fd >= 0)
+    {
+        close(g_data.repl_transfer_fd);
+        unlink(k_repl_transfer_file);
+    }
+    g_data.repl_transfer_fd = -1;
+    g_data.repl_transfer_bytes = 0;
+}
+
+// replace the keyspace with the snapshot of the master
+static bool repl_transfer_done(Conn *conn)
+{
+    uint64_t aof_base = 0;
+    bool ok = load_snapshot(k_repl_transfer_file, &aof_base);
+    repl_transfer_reset();
+    if (!ok)
+    {
+        msg("bad snapshot from the master");
+        conn->want_close = true;
+        return false;
+    }
+    g_data.master_replid = g_data.repl_transfer_replid;
+    g_data.master_off = (uint64_t)g_data.repl_transfer_off;
+    conn->repl_state = REPL_LINK_ONLINE;
+    g_data.dirty++;
+    repl_new_history();
+    if (g_data.aof_on)
+    {
+        g_data.aof_rewrite_scheduled = true; // the log does not have the new data
+    }
+    fprintf(stderr, "full sync from the master done, %llu keys\n",
+            (unsigned long long)hm_size(&g_data.db));
+    return true;
+}
+
+// one step of the link to the master, false if more data is needed
+bool repl_link_step(Conn *conn)
+{
+    Buffer &in = conn->incoming;
+    uint32_t len = 0;
+    if (conn->repl_state == REPL_LINK_HANDSHAKE)
+    {
+        // the PSYNC reply, a string
+        if (in.size() < 4)
+        {
+            return false;
+        }
+        memcpy(&len, in.data(), 4);
+        if (len > k_max_msg || len < 1)
+        {
+            conn->want_close = true;
+            return false;
+        }
+        if (in.size() < 4 + (size_t)len)
+        {
+            return false;
+        }
+        std::string reply;
+        if (len >= 5 && in[4] == TAG_STR)
+        {
+            reply.assign((const char *)&in[9], len - 5);
+        }
+        buf_consume(in, 4 + len);
+        if (reply == "CONTINUE")
+        {
+            msg("partial resync with the master");
+            conn->repl_state = REPL_LINK_ONLINE;
+            return true;
+        }
+        if (reply.compare(0, 11, "FULLRESYNC ") != 0)
+        {
+            msg("the master refused the sync");
+            conn->want_close = true;
+            return false;
+        }
+        msg("full sync from the master");
+        g_data.repl_transfer_replid = reply.substr(11);
+        g_data.repl_transfer_off = -1;
+        repl_transfer_reset();
+        // spooled to disk rather than held in memory next to the keyspace
+        g_data.repl_transfer_fd =
+            open(k_repl_transfer_file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (g_data.repl_transfer_fd < 0)
+        {
+            msg_errno("open() of the sync file");
+            conn->want_close = true;
+            return false;
+        }
+        conn->repl_state = REPL_LINK_TRANSFER;
+        return true;
+    }
+    if (conn->repl_state == REPL_LINK_TRANSFER)
+    {
+        if (g_data.repl_transfer_off < 0)
+        {
+            if (in.size() < 8)
+            {
+                return false;
+            }
+            memcpy(&g_data.repl_transfer_off, in.data(), 8);
+            buf_consume(in, 8);
+            return true;
+        }
+        if (in.size() < 4)
+        {
+            return false;
+        }
+        memcpy(&len, in.data(), 4);
+        if (len > k_max_msg)
+        {
+            conn->want_close = true;
+            return false;
+        }
+        if (in.size() < 4 + (size_t)len)
+        {
+            return false;
+        }
+        if (!write_all(g_data.repl_transfer_fd, &in[4], len))
+        {
+            msg_errno("write() of the sync file");
+            conn->want_close = true;
+            return false;
+        }
+        g_data.repl_transfer_bytes += len;
+        buf_consume(in, 4 + len);
+        return len > 0 || repl_transfer_done(conn);
+    }
+    // the command stream, applied without replies
+    size_t size = req_size(in.data(), in.size());
+    if (size == 0)
+    {
+        return false;
+    }
+    std::vector<std::string> cmd;
+    if (parse_req(in.data(), size, cmd) < 0)
+    {
+        msg("bad command from the master");
+        conn->want_close = true;
+        return false;
+    }
+    // no current client: writes are allowed, cold values are read inline.
+    // the offset covers whole blocks, a PSYNC resends a partial one.
+    g_data.master_off += stream_apply(g_data.repl_tx, cmd, size);
+    buf_consume(in, size);
+    return true;
+}
+
+// writes on a replica only come from its master
+bool cmd_write_allowed()
+{
+    return g_data.master_host.empty() || !g_data.cur_conn;
+}
+
+// REPLICAOF host port, REPLICAOF NO ONE
+void do_replicaof(std::vector<std::string> &cmd, Buffer &out)
+{
+    if (strcasecmp(cmd[1].c_str(), "no") == 0 && strcasecmp(cmd[2].c_str(), "one") == 0)
+    {
+        if (!g_data.master_host.empty())
+        {
+            msg("promoted to master");
+            repl_link_drop();
+            g_data.master_host.clear();
+            g_data.master_replid.clear();
+            g_data.master_off = 0;
+            repl_new_history();
+        }
+        return out_ok(out);
+    }
+    int64_t port = 0;
+    if (!str2int(cmd[2], port) || port <= 0 || port > 65535)
+    {
+        return out_err(out, ERR_BAD_ARG, "bad port");
+    }
+    if (cmd[1] == g_data.master_host && port == g_data.master_port)
+    {
+        return out_ok(out); // already
+    }
+    repl_link_drop();
+    g_data.master_host = cmd[1];
+    g_data.master_port = (int)port;
+    // another master, another history
+    g_data.master_replid.clear();
+    g_data.master_off = 0;
+    g_data.repl_retry_ms = 0;
+    return out_ok(out);
+}
+
+void repl_cron()
+{
+    // replica: (re)connect to the master
+    if (!g_data.master_host.empty() && !g_data.repl_link &&
+        get_monotonic_msec() >= g_data.repl_retry_ms)
+    {
+        repl_connect();
+    }
+    // master: one full sync at a time, after the FULLRESYNC reply is out
+    if (g_data.child_pid != -1)
+    {
+        return;
+    }
+    for (Conn *conn : g_data.fd2conn)
+    {
+        if (conn && conn->repl_state == REPL_WAIT_SYNC && conn->outgoing.empty())
+        {
+            if (!repl_sync_start(conn))
+            {
+                conn_destroy(conn); // it retries
+            }
+            return;
+        }
+    }
+}
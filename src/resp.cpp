@@ -0,0 +1,266 @@
+#include "resp.h"
+#include "commands/commands.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+const size_t k_resp_max_inline = 64 << 10;
+const size_t k_resp_max_bulk = 32 << 20;
+
+// a decimal line "<prefix><int>\r\n" at `cur`. 0 if incomplete, -1 if bad
+static int resp_read_int(const uint8_t *&cur, const uint8_t *end, int64_t &val)
+{
+    const uint8_t *eol = (const uint8_t *)memchr(cur, '\r', end - cur);
+    if (!eol || eol + 1 >= end)
+    {
+        return end - cur > 32 ? -1 : 0;
+    }
+    if (eol[1] != '\n' || eol == cur + 1)
+    {
+        return -1;
+    }
+    char *endp = NULL;
+    std::string digits((const char *)cur + 1, eol - cur - 1);
+    val = strtoll(digits.c_str(), &endp, 10);
+    if (*endp)
+    {
+        return -1;
+    }
+    cur = eol + 2;
+    return 1;
+}
+
+static int64_t resp_parse_inline(const uint8_t *data, size_t size, std::vector<std::string> &cmd)
+{
+    const uint8_t *eol = (const uint8_t *)memchr(data, '\n', size);
+    if (!eol)
+    {
+        return size > k_resp_max_inline ? -1 : 0;
+    }
+    const uint8_t *end = eol > data && eol[-1] == '\r' ? eol - 1 : eol;
+    for (const uint8_t *cur = data; cur < end;)
+    {
+        if (*cur == ' ' || *cur == '\t')
+        {
+            cur++;
+            continue;
+        }
+        const uint8_t *start = cur;
+        while (cur < end && *cur != ' ' && *cur != '\t')
+        {
+            cur++;
+        }
+        cmd.emplace_back((const char *)start, cur - start);
+    }
+    return eol + 1 - data;
+}
+
+int64_t resp_parse(const uint8_t *data, size_t size, std::vector<std::string> &cmd,
+                   size_t &need)
+{
+    need = 0;
+    if (size == 0)
+    {
+        return 0;
+    }
+    if (data[0] != '*')
+    {
+        return resp_parse_inline(data, size, cmd);
+    }
+    const uint8_t *cur = data, *end = data + size;
+    int64_t nstr = 0;
+    int rv = resp_read_int(cur, end, nstr);
+    if (rv <= 0 || nstr < 0 || nstr > (int64_t)k_max_args)
+    {
+        return rv == 0 ? 0 : -1;
+    }
+    cmd.reserve((size_t)nstr);
+    for (int64_t i = 0; i < nstr; i++)
+    {
+        int64_t len = 0;
+        if (cur < end && *cur != '$')
+        {
+            return -1;
+        }
+        rv = cur < end ? resp_read_int(cur, end, len) : 0;
+        if (rv < 0 || (rv > 0 && (len < 0 || (size_t)len > k_resp_max_bulk)))
+        {
+            return -1;
+        }
+        if (rv == 0 || (size_t)(end - cur) < (size_t)len + 2)
+        {
+            need = (cur - data) + (rv ? (size_t)len + 2 : 0);
+            cmd.clear();
+            return 0;
+        }
+        if (cur[len] != '\r' || cur[len + 1] != '\n')
+        {
+            return -1;
+        }
+        cmd.emplace_back((const char *)cur, (size_t)len);
+        cur += len + 2;
+    }
+    return cur - data;
+}
+
+static void resp_append(std::vector<uint8_t> &out, const char *s, size_t len)
+{
+    out.insert(out.end(), (const uint8_t *)s, (const uint8_t *)s + len);
+}
+
+static void resp_line(std::vector<uint8_t> &out, char type, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void resp_line(std::vector<uint8_t> &out, char type, const char *fmt, ...)
+{
+    char buf[64];
+    buf[0] = type;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + 1, sizeof(buf) - 3, fmt, ap);
+    va_end(ap);
+    n = n < (int)sizeof(buf) - 3 ? n : (int)sizeof(buf) - 4;
+    buf[1 + n] = '\r';
+    buf[2 + n] = '\n';
+    resp_append(out, buf, n + 3);
+}
+
+static const char *resp_err_prefix(uint32_t code)
+{
+    switch (code)
+    {
+    case ERR_BAD_TYP:
+        return "WRONGTYPE";
+    case ERR_READONLY:
+        return "READONLY";
+    case ERR_MOVED:
+        return "MOVED";
+    case ERR_ASK:
+        return "ASK";
+    case ERR_NOSCRIPT:
+        return "NOSCRIPT";
+    default:
+        return "ERR";
+    }
+}
+
+static bool resp_encode_one(const uint8_t *&cur, const uint8_t *end, std::vector<uint8_t> &out,
+                            int version, bool push)
+{
+    if (cur >= end)
+    {
+        return false;
+    }
+    uint8_t tag = *cur++;
+    uint32_t len = 0;
+    int64_t ival = 0;
+    double dval = 0;
+    switch (tag)
+    {
+    case TAG_NIL:
+        resp_append(out, version >= 3 ? "_\r\n" : "$-1\r\n", version >= 3 ? 3 : 5);
+        return true;
+    case TAG_OK:
+        resp_append(out, "+OK\r\n", 5);
+        return true;
+    case TAG_ERR:
+    {
+        uint32_t code = 0;
+        if (end - cur < 8)
+        {
+            return false;
+        }
+        memcpy(&code, cur, 4);
+        memcpy(&len, cur + 4, 4);
+        cur += 8;
+        if ((size_t)(end - cur) < len)
+        {
+            return false;
+        }
+        std::string msg((const char *)cur, len);
+        cur += len;
+        for (char &c : msg)
+        {
+            c = c == '\r' || c == '\n' ? ' ' : c;
+        }
+        out.push_back('-');
+        const char *prefix = resp_err_prefix(code);
+        resp_append(out, prefix, strlen(prefix));
+        out.push_back(' ');
+        resp_append(out, msg.data(), msg.size());
+        resp_append(out, "\r\n", 2);
+        return true;
+    }
+    case TAG_STR:
+        if (end - cur < 4)
+        {
+            return false;
+        }
+        memcpy(&len, cur, 4);
+        cur += 4;
+        if ((size_t)(end - cur) < len)
+        {
+            return false;
+        }
+        resp_line(out, '$', "%u", len);
+        resp_append(out, (const char *)cur, len);
+        resp_append(out, "\r\n", 2);
+        cur += len;
+        return true;
+    case TAG_INT:
+        if (end - cur < 8)
+        {
+            return false;
+        }
+        memcpy(&ival, cur, 8);
+        cur += 8;
+        resp_line(out, ':', "%lld", (long long)ival);
+        return true;
+    case TAG_DBL:
+    {
+        if (end - cur < 8)
+        {
+            return false;
+        }
+        memcpy(&dval, cur, 8);
+        cur += 8;
+        if (version >= 3)
+        {
+            resp_line(out, ',', "%.17g", dval);
+            return true;
+        }
+        char buf[32];
+        int n = snprintf(buf, sizeof(buf), "%.17g", dval);
+        resp_line(out, '$', "%d", n);
+        resp_append(out, buf, n);
+        resp_append(out, "\r\n", 2);
+        return true;
+    }
+    case TAG_ARR:
+        if (end - cur < 4)
+        {
+            return false;
+        }
+        memcpy(&len, cur, 4);
+        cur += 4;
+        resp_line(out, push && version >= 3 ? '>' : '*', "%u", len);
+        for (uint32_t i = 0; i < len; i++)
+        {
+            if (!resp_encode_one(cur, end, out, version, false))
+            {
+                return false;
+            }
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool resp_encode(const uint8_t *data, size_t size, std::vector<uint8_t> &out,
+                 int version, bool push)
+{
+    const uint8_t *cur = data;
+    return resp_encode_one(cur, data + size, out, version, push) && cur == data + size;
+}
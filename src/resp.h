@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// RESP front end: requests in the redis protocol, multibulk
+// ("*2\r\n$3\r\nGET\r\n$1\r\nk\r\n") or inline ("GET k\r\n"), run by the
+// same handlers. their tagged replies are translated to RESP2 or RESP3.
+
+// parses one request at the front of `data`. returns the bytes it takes,
+// 0 if more are needed, -1 on a protocol error. with 0, `need` is a lower
+// bound of the request size, so a big bulk string is not parsed again
+// for every read.
+int64_t resp_parse(const uint8_t *data, size_t size, std::vector<std::string> &cmd,
+                   size_t &need);
+
+// appends the RESP form of a tagged reply. a push is a pub/sub message,
+// `>` in RESP3 instead of `*`. false if `data` is not a valid reply.
+bool resp_encode(const uint8_t *data, size_t size, std::vector<uint8_t> &out,
+                 int version, bool push);
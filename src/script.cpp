@@ -0,0 +1,1766 @@
+#include "script.h"
+#include "commands/commands.h"
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <memory>
+
+const size_t k_script_max_str = 32 << 20;   // a string built by a script
+const size_t k_script_max_reply = 32 << 20; // the returned value
+const uint32_t k_script_max_depth = 32;     // arrays inside arrays
+const uint32_t k_script_max_nesting = 200;  // of the source
+
+// value types
+enum
+{
+    V_NIL = 0,
+    V_BOOL = 1,
+    V_INT = 2,
+    V_DBL = 3,
+    V_STR = 4,
+    V_ARR = 5, // by reference, copied when put into another array
+    V_ERR = 6, // an error reply, from pcall
+};
+
+struct Value
+{
+    uint8_t type = V_NIL;
+    bool b = false;
+    int64_t i = 0; // or the error code
+    double d = 0;
+    std::string s; // or the error message
+    std::shared_ptr<std::vector<Value>> arr;
+};
+
+static const char *type_name(const Value &v)
+{
+    static const char *names[] = {"nil", "boolean", "number", "number", "string", "array", "error"};
+    return names[v.type];
+}
+
+enum
+{
+    OP_NIL,
+    OP_TRUE,
+    OP_FALSE,
+    OP_CONST, // consts[a]
+    OP_LOAD,  // slots[a]
+    OP_STORE,
+    OP_POP,
+    OP_INDEX,    // arr idx -> val
+    OP_SETINDEX, // arr idx val ->
+    OP_NEWARR,   // a values -> arr
+    OP_LEN,
+    OP_NEG,
+    OP_NOT,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_IDIV,
+    OP_MOD,
+    OP_CONCAT,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_JMP,
+    OP_JMPF,   // pops, jumps if false
+    OP_AND,    // jumps keeping the top if false, pops otherwise
+    OP_OR,     // jumps keeping the top if true, pops otherwise
+    OP_FORCHK, // pushes whether the loop in slots a..a+2 goes on
+    OP_BUILTIN, // a = builtin << 16 | nargs
+    OP_RET,
+};
+
+struct Ins
+{
+    uint8_t op = 0;
+    int32_t a = 0;
+    uint32_t line = 0;
+};
+
+struct Script
+{
+    std::vector<Ins> code;
+    std::vector<Value> consts;
+    uint32_t nslots = 0; // KEYS and ARGV are slots 0 and 1
+};
+
+enum
+{
+    B_CALL,
+    B_PCALL,
+    B_TONUMBER,
+    B_TOSTRING,
+    B_ERROR,
+    B_ISERROR,
+};
+
+static const struct
+{
+    const char *name;
+    uint32_t min_args;
+    uint32_t max_args;
+} k_builtins[] = {
+    {"call", 1, 0xffff},
+    {"pcall", 1, 0xffff},
+    {"tonumber", 1, 1},
+    {"tostring", 1, 1},
+    {"error", 1, 1},
+    {"iserror", 1, 1},
+};
+
+// compiler: one pass, code is emitted while parsing
+
+enum
+{
+    TK_EOF,
+    TK_NAME,
+    TK_KW,  // a keyword, in `text`
+    TK_SYM, // an operator or punctuation, in `text`
+    TK_INT,
+    TK_DBL,
+    TK_STR,
+};
+
+struct Token
+{
+    uint32_t type = TK_EOF;
+    std::string text;
+    int64_t ival = 0;
+    double dval = 0;
+    uint32_t line = 1;
+};
+
+struct Parser
+{
+    const char *cur = NULL;
+    const char *end = NULL;
+    uint32_t line = 1;
+    Token tok;
+    Script *sc = NULL;
+    // visible locals, innermost last
+    std::vector<std::pair<std::string, uint32_t>> scope;
+    uint32_t nslots = 0; // slots in use
+    // jumps of the break statements, per enclosing loop
+    std::vector<std::vector<size_t>> breaks;
+    uint32_t nesting = 0;
+    std::string err; // the first error, sticky
+};
+
+static bool parse_fail(Parser &p, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static bool parse_fail(Parser &p, const char *fmt, ...)
+{
+    if (!p.err.empty())
+    {
+        return false;
+    }
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    p.err = "line " + std::to_string(p.tok.line) + ": " + buf;
+    p.tok.type = TK_EOF;
+    return false;
+}
+
+static const char *k_keywords[] = {
+    "and", "break", "do", "else", "elseif", "end", "false", "for",
+    "if", "local", "nil", "not", "or", "return", "then", "true", "while",
+};
+
+static bool lex_string(Parser &p, Token &t)
+{
+    char quote = *p.cur++;
+    t.type = TK_STR;
+    while (p.cur < p.end && *p.cur != quote)
+    {
+        char c = *p.cur++;
+        if (c == '\n')
+        {
+            break;
+        }
+        if (c != '\\')
+        {
+            t.text.push_back(c);
+            continue;
+        }
+        if (p.cur == p.end)
+        {
+            break;
+        }
+        c = *p.cur++;
+        switch (c)
+        {
+        case 'n':
+            t.text.push_back('\n');
+            break;
+        case 'r':
+            t.text.push_back('\r');
+            break;
+        case 't':
+            t.text.push_back('\t');
+            break;
+        case '0':
+            t.text.push_back('\0');
+            break;
+        case 'x':
+        {
+            if (p.end - p.cur < 2 || !isxdigit((uint8_t)p.cur[0]) || !isxdigit((uint8_t)p.cur[1]))
+            {
+                return parse_fail(p, "bad \\x escape");
+            }
+            char hex[3] = {p.cur[0], p.cur[1], 0};
+            t.text.push_back((char)strtol(hex, NULL, 16));
+            p.cur += 2;
+            break;
+        }
+        case '\\':
+        case '"':
+        case '\'':
+            t.text.push_back(c);
+            break;
+        default:
+            return parse_fail(p, "bad escape '\\%c'", c);
+        }
+    }
+    if (p.cur == p.end || *p.cur != quote)
+    {
+        return parse_fail(p, "unfinished string");
+    }
+    p.cur++;
+    return true;
+}
+
+static bool lex_number(Parser &p, Token &t)
+{
+    const char *start = p.cur;
+    bool is_float = false;
+    while (p.cur < p.end && (isalnum((uint8_t)*p.cur) || *p.cur == '.'))
+    {
+        char c = *p.cur;
+        is_float = is_float || c == '.' || c == 'e' || c == 'E';
+        p.cur++;
+        // an exponent sign
+        if ((c == 'e' || c == 'E') && p.cur < p.end && (*p.cur == '+' || *p.cur == '-'))
+        {
+            p.cur++;
+        }
+    }
+    std::string s(start, p.cur - start);
+    char *endp = NULL;
+    if (!is_float)
+    {
+        errno = 0;
+        t.ival = strtoll(s.c_str(), &endp, 10);
+        if (*endp == 0 && errno == 0)
+        {
+            t.type = TK_INT;
+            return true;
+        }
+    }
+    t.dval = strtod(s.c_str(), &endp);
+    if (*endp)
+    {
+        return parse_fail(p, "malformed number '%s'", s.c_str());
+    }
+    t.type = TK_DBL;
+    return true;
+}
+
+// reads the next token into p.tok, TK_EOF after an error
+static void lex(Parser &p)
+{
+    for (;;)
+    {
+        while (p.cur < p.end && isspace((uint8_t)*p.cur))
+        {
+            p.line += *p.cur++ == '\n';
+        }
+        if (p.end - p.cur < 2 || p.cur[0] != '-' || p.cur[1] != '-')
+        {
+            break;
+        }
+        while (p.cur < p.end && *p.cur != '\n')
+        {
+            p.cur++; // a comment
+        }
+    }
+    Token t;
+    t.line = p.line;
+    p.tok = t;
+    if (p.cur == p.end || !p.err.empty())
+    {
+        return;
+    }
+    char c = *p.cur;
+    if (isalpha((uint8_t)c) || c == '_')
+    {
+        const char *start = p.cur;
+        while (p.cur < p.end && (isalnum((uint8_t)*p.cur) || *p.cur == '_'))
+        {
+            p.cur++;
+        }
+        t.text.assign(start, p.cur - start);
+        t.type = TK_NAME;
+        for (const char *kw : k_keywords)
+        {
+            if (t.text == kw)
+            {
+                t.type = TK_KW;
+            }
+        }
+    }
+    else if (isdigit((uint8_t)c))
+    {
+        if (!lex_number(p, t))
+        {
+            return;
+        }
+    }
+    else if (c == '"' || c == '\'')
+    {
+        if (!lex_string(p, t))
+        {
+            return;
+        }
+    }
+    else
+    {
+        static const char *two[] = {"==", "~=", "<=", ">=", "..", "//"};
+        t.type = TK_SYM;
+        for (const char *s : two)
+        {
+            if (p.end - p.cur >= 2 && p.cur[0] == s[0] && p.cur[1] == s[1])
+            {
+                t.text = s;
+            }
+        }
+        if (t.text.empty())
+        {
+            if (!strchr("+-*/%#<>=()[]{},;", c))
+            {
+                p.tok.line = p.line;
+                parse_fail(p, "unexpected character '%c'", c);
+                return;
+            }
+            t.text = std::string(1, c);
+        }
+        p.cur += t.text.size();
+    }
+    p.tok = t;
+}
+
+static bool is(Parser &p, const char *s)
+{
+    return (p.tok.type == TK_SYM || p.tok.type == TK_KW) && p.tok.text == s;
+}
+
+static bool accept(Parser &p, const char *s)
+{
+    if (!is(p, s))
+    {
+        return false;
+    }
+    lex(p);
+    return true;
+}
+
+static const char *tok_desc(Parser &p)
+{
+    return p.tok.type == TK_EOF ? "<eof>" : p.tok.type == TK_STR ? "string" : p.tok.text.empty() ? "number" : p.tok.text.c_str();
+}
+
+static bool expect(Parser &p, const char *s)
+{
+    return accept(p, s) || parse_fail(p, "'%s' expected near '%s'", s, tok_desc(p));
+}
+
+static size_t emit(Parser &p, uint8_t op, int32_t a = 0)
+{
+    Ins ins;
+    ins.op = op;
+    ins.a = a;
+    ins.line = p.tok.line;
+    p.sc->code.push_back(ins);
+    return p.sc->code.size() - 1;
+}
+
+// points a jump at the next instruction
+static void patch(Parser &p, size_t at)
+{
+    p.sc->code[at].a = (int32_t)p.sc->code.size();
+}
+
+static void emit_const(Parser &p, Value v)
+{
+    p.sc->consts.push_back(std::move(v));
+    emit(p, OP_CONST, (int32_t)p.sc->consts.size() - 1);
+}
+
+static uint32_t new_slot(Parser &p)
+{
+    uint32_t slot = p.nslots++;
+    p.sc->nslots = p.nslots > p.sc->nslots ? p.nslots : p.sc->nslots;
+    return slot;
+}
+
+static bool find_local(Parser &p, const std::string &name, uint32_t &slot)
+{
+    for (size_t i = p.scope.size(); i-- > 0;)
+    {
+        if (p.scope[i].first == name)
+        {
+            slot = p.scope[i].second;
+            return true;
+        }
+    }
+    return parse_fail(p, "unknown variable '%s'", name.c_str());
+}
+
+static bool parse_expr(Parser &p, int min_prec = 1);
+
+// name(args...), the name is already read
+static bool parse_call(Parser &p, const std::string &name)
+{
+    uint32_t b = 0;
+    while (b < sizeof(k_builtins) / sizeof(k_builtins[0]) && name != k_builtins[b].name)
+    {
+        b++;
+    }
+    if (b == sizeof(k_builtins) / sizeof(k_builtins[0]))
+    {
+        return parse_fail(p, "unknown function '%s'", name.c_str());
+    }
+    uint32_t line = p.tok.line;
+    expect(p, "(");
+    uint32_t nargs = 0;
+    if (!is(p, ")"))
+    {
+        do
+        {
+            if (!parse_expr(p))
+            {
+                return false;
+            }
+            nargs++;
+        } while (accept(p, ","));
+    }
+    if (!expect(p, ")"))
+    {
+        return false;
+    }
+    if (nargs < k_builtins[b].min_args || nargs > k_builtins[b].max_args)
+    {
+        p.tok.line = line;
+        return parse_fail(p, "wrong number of arguments to '%s'", name.c_str());
+    }
+    emit(p, OP_BUILTIN, (int32_t)(b << 16 | nargs));
+    return true;
+}
+
+static bool parse_primary(Parser &p)
+{
+    Token t = p.tok;
+    if (t.type == TK_INT || t.type == TK_DBL || t.type == TK_STR)
+    {
+        Value v;
+        v.type = t.type == TK_INT ? V_INT : t.type == TK_DBL ? V_DBL : V_STR;
+        v.i = t.ival;
+        v.d = t.dval;
+        v.s = std::move(t.text);
+        emit_const(p, std::move(v));
+        lex(p);
+    }
+    else if (accept(p, "nil") || accept(p, "true") || accept(p, "false"))
+    {
+        emit(p, t.text == "nil" ? OP_NIL : t.text == "true" ? OP_TRUE : OP_FALSE);
+    }
+    else if (t.type == TK_NAME)
+    {
+        lex(p);
+        uint32_t slot = 0;
+        if (is(p, "("))
+        {
+            if (!parse_call(p, t.text))
+            {
+                return false;
+            }
+        }
+        else if (find_local(p, t.text, slot))
+        {
+            emit(p, OP_LOAD, (int32_t)slot);
+        }
+    }
+    else if (accept(p, "("))
+    {
+        if (!parse_expr(p) || !expect(p, ")"))
+        {
+            return false;
+        }
+    }
+    else if (accept(p, "{"))
+    {
+        uint32_t n = 0;
+        while (!is(p, "}") && p.err.empty())
+        {
+            if (!parse_expr(p))
+            {
+                return false;
+            }
+            n++;
+            if (!accept(p, ","))
+            {
+                break;
+            }
+        }
+        expect(p, "}");
+        emit(p, OP_NEWARR, (int32_t)n);
+    }
+    else
+    {
+        return parse_fail(p, "unexpected '%s'", tok_desc(p));
+    }
+    while (p.err.empty() && accept(p, "["))
+    {
+        if (!parse_expr(p) || !expect(p, "]"))
+        {
+            return false;
+        }
+        emit(p, OP_INDEX);
+    }
+    return p.err.empty();
+}
+
+// prefix operators are collected first and applied innermost first, so a
+// long run of them does not recurse
+static bool parse_unary(Parser &p)
+{
+    std::vector<uint8_t> ops;
+    for (;;)
+    {
+        uint8_t op = is(p, "not") ? OP_NOT : is(p, "-") ? OP_NEG : is(p, "#") ? OP_LEN : OP_RET;
+        if (op == OP_RET)
+        {
+            break;
+        }
+        ops.push_back(op);
+        lex(p);
+    }
+    if (!parse_primary(p))
+    {
+        return false;
+    }
+    for (size_t i = ops.size(); i > 0; i--)
+    {
+        emit(p, ops[i - 1]);
+    }
+    return true;
+}
+
+// the precedence of a binary operator, 0 if the token is not one
+static int binary_prec(Parser &p, uint8_t &op)
+{
+    static const struct
+    {
+        const char *text;
+        int prec;
+        uint8_t op;
+    } ops[] = {
+        {"or", 1, OP_OR}, {"and", 2, OP_AND},
+        {"==", 3, OP_EQ}, {"~=", 3, OP_NE}, {"<", 3, OP_LT}, {"<=", 3, OP_LE}, {">", 3, OP_GT}, {">=", 3, OP_GE},
+        {"..", 4, OP_CONCAT},
+        {"+", 5, OP_ADD}, {"-", 5, OP_SUB},
+        {"*", 6, OP_MUL}, {"/", 6, OP_DIV}, {"//", 6, OP_IDIV}, {"%", 6, OP_MOD},
+    };
+    for (const auto &o : ops)
+    {
+        if (is(p, o.text))
+        {
+            op = o.op;
+            return o.prec;
+        }
+    }
+    return 0;
+}
+
+static bool parse_expr(Parser &p, int min_prec)
+{
+    if (++p.nesting > k_script_max_nesting)
+    {
+        return parse_fail(p, "expression too deeply nested");
+    }
+    if (!parse_unary(p))
+    {
+        return false;
+    }
+    uint8_t op = 0;
+    int prec = 0;
+    while ((prec = binary_prec(p, op)) >= min_prec)
+    {
+        lex(p);
+        // and/or skip the right side once the left one decides
+        size_t jump = op == OP_AND || op == OP_OR ? emit(p, op) : 0;
+        if (!parse_expr(p, prec + 1))
+        {
+            return false;
+        }
+        if (jump)
+        {
+            patch(p, jump);
+        }
+        else
+        {
+            emit(p, op);
+        }
+    }
+    p.nesting--;
+    return p.err.empty();
+}
+
+static bool block_end(Parser &p)
+{
+    return p.tok.type == TK_EOF || is(p, "end") || is(p, "else") || is(p, "elseif");
+}
+
+static bool parse_stmt(Parser &p);
+
+// a block has its own locals
+static bool parse_block(Parser &p)
+{
+    if (++p.nesting > k_script_max_nesting)
+    {
+        return parse_fail(p, "blocks too deeply nested");
+    }
+    size_t scope = p.scope.size();
+    uint32_t nslots = p.nslots;
+    while (!block_end(p))
+    {
+        if (!parse_stmt(p))
+        {
+            return false;
+        }
+    }
+    p.scope.resize(scope);
+    p.nslots = nslots;
+    p.nesting--;
+    return p.err.empty();
+}
+
+static void patch_breaks(Parser &p)
+{
+    for (size_t at : p.breaks.back())
+    {
+        patch(p, at);
+    }
+    p.breaks.pop_back();
+}
+
+static bool parse_if(Parser &p)
+{
+    std::vector<size_t> exits;
+    do
+    {
+        if (!parse_expr(p) || !expect(p, "then"))
+        {
+            return false;
+        }
+        size_t skip = emit(p, OP_JMPF);
+        if (!parse_block(p))
+        {
+            return false;
+        }
+        if (is(p, "elseif") || is(p, "else"))
+        {
+            exits.push_back(emit(p, OP_JMP));
+        }
+        patch(p, skip);
+    } while (accept(p, "elseif"));
+    if (accept(p, "else") && !parse_block(p))
+    {
+        return false;
+    }
+    for (size_t at : exits)
+    {
+        patch(p, at);
+    }
+    return expect(p, "end");
+}
+
+static bool parse_while(Parser &p)
+{
+    int32_t top = (int32_t)p.sc->code.size();
+    if (!parse_expr(p) || !expect(p, "do"))
+    {
+        return false;
+    }
+    size_t exit = emit(p, OP_JMPF);
+    p.breaks.emplace_back();
+    if (!parse_block(p))
+    {
+        return false;
+    }
+    emit(p, OP_JMP, top);
+    patch(p, exit);
+    patch_breaks(p);
+    return expect(p, "end");
+}
+
+// for i = start, limit [, step] do ... end
+static bool parse_for(Parser &p)
+{
+    if (p.tok.type != TK_NAME)
+    {
+        return parse_fail(p, "name expected near '%s'", tok_desc(p));
+    }
+    std::string name = p.tok.text;
+    lex(p);
+    if (!expect(p, "=") || !parse_expr(p) || !expect(p, ",") || !parse_expr(p))
+    {
+        return false;
+    }
+    if (!accept(p, ","))
+    {
+        Value one;
+        one.type = V_INT;
+        one.i = 1;
+        emit_const(p, one);
+    }
+    else if (!parse_expr(p))
+    {
+        return false;
+    }
+    if (!expect(p, "do"))
+    {
+        return false;
+    }
+    // the counter, limit and step, then the variable the body sees
+    size_t scope = p.scope.size();
+    uint32_t nslots = p.nslots;
+    uint32_t base = new_slot(p);
+    new_slot(p);
+    new_slot(p);
+    emit(p, OP_STORE, (int32_t)base + 2);
+    emit(p, OP_STORE, (int32_t)base + 1);
+    emit(p, OP_STORE, (int32_t)base);
+    int32_t top = (int32_t)p.sc->code.size();
+    emit(p, OP_FORCHK, (int32_t)base);
+    size_t exit = emit(p, OP_JMPF);
+    uint32_t var = new_slot(p);
+    p.scope.push_back({name, var});
+    emit(p, OP_LOAD, (int32_t)base);
+    emit(p, OP_STORE, (int32_t)var);
+    p.breaks.emplace_back();
+    if (!parse_block(p))
+    {
+        return false;
+    }
+    emit(p, OP_LOAD, (int32_t)base);
+    emit(p, OP_LOAD, (int32_t)base + 2);
+    emit(p, OP_ADD);
+    emit(p, OP_STORE, (int32_t)base);
+    emit(p, OP_JMP, top);
+    patch(p, exit);
+    patch_breaks(p);
+    p.scope.resize(scope);
+    p.nslots = nslots;
+    return expect(p, "end");
+}
+
+// name = expr, name[i]... = expr, or name(...)
+static bool parse_name_stmt(Parser &p)
+{
+    std::string name = p.tok.text;
+    lex(p);
+    if (is(p, "("))
+    {
+        if (!parse_call(p, name))
+        {
+            return false;
+        }
+        emit(p, OP_POP);
+        return true;
+    }
+    uint32_t slot = 0;
+    if (!find_local(p, name, slot))
+    {
+        return false;
+    }
+    if (accept(p, "="))
+    {
+        if (!parse_expr(p))
+        {
+            return false;
+        }
+        emit(p, OP_STORE, (int32_t)slot);
+        return true;
+    }
+    if (!is(p, "["))
+    {
+        return parse_fail(p, "syntax error near '%s'", tok_desc(p));
+    }
+    emit(p, OP_LOAD, (int32_t)slot);
+    for (;;)
+    {
+        lex(p);
+        if (!parse_expr(p) || !expect(p, "]"))
+        {
+            return false;
+        }
+        if (accept(p, "="))
+        {
+            if (!parse_expr(p))
+            {
+                return false;
+            }
+            emit(p, OP_SETINDEX);
+            return true;
+        }
+        if (!is(p, "["))
+        {
+            return parse_fail(p, "'=' expected near '%s'", tok_desc(p));
+        }
+        emit(p, OP_INDEX);
+    }
+}
+
+static bool parse_stmt(Parser &p)
+{
+    if (accept(p, ";"))
+    {
+        return true;
+    }
+    if (accept(p, "local"))
+    {
+        if (p.tok.type != TK_NAME)
+        {
+            return parse_fail(p, "name expected near '%s'", tok_desc(p));
+        }
+        std::string name = p.tok.text;
+        lex(p);
+        if (!accept(p, "="))
+        {
+            emit(p, OP_NIL);
+        }
+        else if (!parse_expr(p))
+        {
+            return false;
+        }
+        // declared after its value, `local x = x` reads the outer one
+        uint32_t slot = new_slot(p);
+        p.scope.push_back({name, slot});
+        emit(p, OP_STORE, (int32_t)slot);
+        return true;
+    }
+    if (accept(p, "if"))
+    {
+        return parse_if(p);
+    }
+    if (accept(p, "while"))
+    {
+        return parse_while(p);
+    }
+    if (accept(p, "for"))
+    {
+        return parse_for(p);
+    }
+    if (is(p, "break"))
+    {
+        if (p.breaks.empty())
+        {
+            return parse_fail(p, "'break' outside a loop");
+        }
+        p.breaks.back().push_back(emit(p, OP_JMP));
+        lex(p);
+        return true;
+    }
+    if (accept(p, "return"))
+    {
+        if (block_end(p) || is(p, ";"))
+        {
+            emit(p, OP_NIL);
+        }
+        else if (!parse_expr(p))
+        {
+            return false;
+        }
+        emit(p, OP_RET);
+        return true;
+    }
+    if (p.tok.type == TK_NAME)
+    {
+        return parse_name_stmt(p);
+    }
+    return parse_fail(p, "unexpected '%s'", tok_desc(p));
+}
+
+Script *script_compile(const std::string &src, std::string &err)
+{
+    Script *sc = new Script();
+    Parser p;
+    p.cur = src.data();
+    p.end = src.data() + src.size();
+    p.sc = sc;
+    p.scope = {{"KEYS", new_slot(p)}, {"ARGV", new_slot(p)}};
+    lex(p);
+    if (parse_block(p) && p.tok.type != TK_EOF)
+    {
+        parse_fail(p, "unexpected '%s'", tok_desc(p));
+    }
+    if (!p.err.empty())
+    {
+        err = p.err;
+        delete sc;
+        return NULL;
+    }
+    emit(p, OP_NIL);
+    emit(p, OP_RET);
+    return sc;
+}
+
+void script_free(Script *script)
+{
+    delete script;
+}
+
+// the VM
+
+struct VM
+{
+    ScriptRun *run = NULL;
+    uint64_t start_us = 0;
+    uint32_t line = 0;     // of the running instruction
+    uint32_t err_code = 0; // set: the script stops
+    std::string err;
+};
+
+static uint64_t mono_us()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+static bool vm_fail(VM &vm, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static bool vm_fail(VM &vm, const char *fmt, ...)
+{
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    vm.err_code = ERR_SCRIPT;
+    vm.err = "line " + std::to_string(vm.line) + ": " + buf;
+    return false;
+}
+
+// the clock is read every so often, and after every command
+static bool vm_spend(VM &vm, uint64_t ops, bool check_time = false)
+{
+    ScriptRun &run = *vm.run;
+    uint64_t before = run.ops;
+    run.ops += ops;
+    if (run.max_ops && run.ops > run.max_ops)
+    {
+        run.over_budget = true;
+        return vm_fail(vm, "script exceeded its budget of %llu ops", (unsigned long long)run.max_ops);
+    }
+    if (run.max_us && (check_time || (before >> 10) != (run.ops >> 10)) &&
+        mono_us() - vm.start_us > run.max_us)
+    {
+        run.over_budget = true;
+        return vm_fail(vm, "script exceeded its budget of %llu ms", (unsigned long long)(run.max_us / 1000));
+    }
+    return true;
+}
+
+static bool truthy(const Value &v)
+{
+    return !(v.type == V_NIL || (v.type == V_BOOL && !v.b));
+}
+
+// a number, or a string that reads as one
+static bool to_num(const Value &v, Value &out)
+{
+    if (v.type == V_INT || v.type == V_DBL)
+    {
+        out.type = v.type;
+        out.i = v.i;
+        out.d = v.d;
+        return true;
+    }
+    if (v.type != V_STR || v.s.empty() || isspace((uint8_t)v.s[0]))
+    {
+        return false;
+    }
+    char *endp = NULL;
+    errno = 0;
+    out.i = strtoll(v.s.c_str(), &endp, 10);
+    if (*endp == 0 && errno == 0)
+    {
+        out.type = V_INT;
+        return true;
+    }
+    out.d = strtod(v.s.c_str(), &endp);
+    out.type = V_DBL;
+    return *endp == 0 && !isnan(out.d);
+}
+
+static double num_dbl(const Value &v)
+{
+    return v.type == V_INT ? (double)v.i : v.d;
+}
+
+static std::string num_str(const Value &v)
+{
+    char buf[32];
+    if (v.type == V_INT)
+    {
+        snprintf(buf, sizeof(buf), "%lld", (long long)v.i);
+    }
+    else
+    {
+        snprintf(buf, sizeof(buf), "%.17g", v.d);
+    }
+    return buf;
+}
+
+static std::string to_str(const Value &v)
+{
+    switch (v.type)
+    {
+    case V_NIL:
+        return "nil";
+    case V_BOOL:
+        return v.b ? "true" : "false";
+    case V_INT:
+    case V_DBL:
+        return num_str(v);
+    case V_ARR:
+        return "array";
+    default:
+        return v.s;
+    }
+}
+
+// a copy for another array to hold, so arrays never contain themselves
+static bool copy_value(VM &vm, const Value &v, Value &out, uint32_t depth = 1)
+{
+    out = v;
+    if (v.type != V_ARR)
+    {
+        return true;
+    }
+    if (depth >= k_script_max_depth)
+    {
+        return vm_fail(vm, "arrays nested too deeply");
+    }
+    if (!vm_spend(vm, v.arr->size()))
+    {
+        return false;
+    }
+    out.arr = std::make_shared<std::vector<Value>>(v.arr->size());
+    for (size_t i = 0; i < v.arr->size(); i++)
+    {
+        if (!copy_value(vm, (*v.arr)[i], (*out.arr)[i], depth + 1))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool vm_arith(VM &vm, uint8_t op, const Value &a, const Value &b, Value &r)
+{
+    Value x, y;
+    if (!to_num(a, x) || !to_num(b, y))
+    {
+        return vm_fail(vm, "attempt to do arithmetic on a %s value", type_name(to_num(a, x) ? b : a));
+    }
+    if (x.type == V_INT && y.type == V_INT && op != OP_DIV)
+    {
+        r.type = V_INT;
+        bool overflow = false;
+        switch (op)
+        {
+        case OP_ADD:
+            overflow = __builtin_add_overflow(x.i, y.i, &r.i);
+            break;
+        case OP_SUB:
+            overflow = __builtin_sub_overflow(x.i, y.i, &r.i);
+            break;
+        case OP_MUL:
+            overflow = __builtin_mul_overflow(x.i, y.i, &r.i);
+            break;
+        default: // floored, like Lua
+            if (y.i == 0)
+            {
+                return vm_fail(vm, "attempt to divide by zero");
+            }
+            if (y.i == -1)
+            {
+                overflow = op == OP_IDIV && x.i == INT64_MIN;
+                r.i = op == OP_IDIV ? -x.i : 0;
+                break;
+            }
+            r.i = op == OP_IDIV ? x.i / y.i : x.i % y.i;
+            if (x.i % y.i != 0 && (x.i < 0) != (y.i < 0))
+            {
+                r.i = op == OP_IDIV ? r.i - 1 : r.i + y.i;
+            }
+        }
+        return !overflow || vm_fail(vm, "integer overflow");
+    }
+    double dx = num_dbl(x), dy = num_dbl(y);
+    r.type = V_DBL;
+    switch (op)
+    {
+    case OP_ADD:
+        r.d = dx + dy;
+        break;
+    case OP_SUB:
+        r.d = dx - dy;
+        break;
+    case OP_MUL:
+        r.d = dx * dy;
+        break;
+    case OP_DIV:
+        r.d = dx / dy;
+        break;
+    case OP_IDIV:
+        r.d = floor(dx / dy);
+        break;
+    default:
+        r.d = dx - floor(dx / dy) * dy;
+    }
+    return true;
+}
+
+static bool vm_equal(const Value &a, const Value &b)
+{
+    bool na = a.type == V_INT || a.type == V_DBL, nb = b.type == V_INT || b.type == V_DBL;
+    if (na && nb)
+    {
+        return a.type == V_INT && b.type == V_INT ? a.i == b.i : num_dbl(a) == num_dbl(b);
+    }
+    if (a.type != b.type)
+    {
+        return false;
+    }
+    switch (a.type)
+    {
+    case V_NIL:
+        return true;
+    case V_BOOL:
+        return a.b == b.b;
+    case V_ARR:
+        return a.arr == b.arr;
+    case V_ERR:
+        return a.i == b.i && a.s == b.s;
+    default:
+        return a.s == b.s;
+    }
+}
+
+// -1, 0 or 1, numbers with numbers and strings with strings
+static bool vm_compare(VM &vm, const Value &a, const Value &b, int &res)
+{
+    if (a.type == V_STR && b.type == V_STR)
+    {
+        res = a.s < b.s ? -1 : a.s > b.s;
+        return true;
+    }
+    if ((a.type != V_INT && a.type != V_DBL) || (b.type != V_INT && b.type != V_DBL))
+    {
+        return vm_fail(vm, "attempt to compare %s with %s", type_name(a), type_name(b));
+    }
+    if (a.type == V_INT && b.type == V_INT)
+    {
+        res = a.i < b.i ? -1 : a.i > b.i;
+    }
+    else
+    {
+        res = num_dbl(a) < num_dbl(b) ? -1 : num_dbl(a) > num_dbl(b);
+    }
+    return true;
+}
+
+// 1-based, an integer or a float with no fraction
+static bool vm_index(VM &vm, const Value &arr, const Value &idx, int64_t &i)
+{
+    if (arr.type != V_ARR)
+    {
+        return vm_fail(vm, "attempt to index a %s value", type_name(arr));
+    }
+    if (idx.type == V_INT)
+    {
+        i = idx.i;
+        return true;
+    }
+    if (idx.type == V_DBL && idx.d == floor(idx.d) && fabs(idx.d) < 9e18)
+    {
+        i = (int64_t)idx.d;
+        return true;
+    }
+    return vm_fail(vm, "bad array index, a %s value", type_name(idx));
+}
+
+// decoding command replies
+
+static bool decode_reply(VM &vm, const uint8_t *&cur, const uint8_t *end, Value &v,
+                         uint32_t depth = 1)
+{
+    if (cur >= end || depth > k_script_max_depth)
+    {
+        return false;
+    }
+    uint8_t tag = *cur++;
+    uint32_t len = 0;
+    switch (tag)
+    {
+    case TAG_NIL:
+        v.type = V_NIL;
+        return true;
+    case TAG_OK:
+        v.type = V_BOOL;
+        v.b = true;
+        return true;
+    case TAG_INT:
+    case TAG_DBL:
+        if (end - cur < 8)
+        {
+            return false;
+        }
+        v.type = tag == TAG_INT ? V_INT : V_DBL;
+        memcpy(tag == TAG_INT ? (void *)&v.i : (void *)&v.d, cur, 8);
+        cur += 8;
+        return true;
+    case TAG_ERR:
+    {
+        uint32_t code = 0;
+        if (end - cur < 8)
+        {
+            return false;
+        }
+        memcpy(&code, cur, 4);
+        memcpy(&len, cur + 4, 4);
+        cur += 8;
+        if ((size_t)(end - cur) < len)
+        {
+            return false;
+        }
+        v.type = V_ERR;
+        v.i = code;
+        v.s.assign((const char *)cur, len);
+        cur += len;
+        return true;
+    }
+    case TAG_STR:
+        if (end - cur < 4)
+        {
+            return false;
+        }
+        memcpy(&len, cur, 4);
+        cur += 4;
+        if ((size_t)(end - cur) < len)
+        {
+            return false;
+        }
+        v.type = V_STR;
+        v.s.assign((const char *)cur, len);
+        cur += len;
+        return true;
+    case TAG_ARR:
+        if (end - cur < 4)
+        {
+            return false;
+        }
+        memcpy(&len, cur, 4);
+        cur += 4;
+        if (len > (size_t)(end - cur) || !vm_spend(vm, len))
+        {
+            return false;
+        }
+        v.type = V_ARR;
+        v.arr = std::make_shared<std::vector<Value>>(len);
+        for (uint32_t i = 0; i < len; i++)
+        {
+            if (!decode_reply(vm, cur, end, (*v.arr)[i], depth + 1))
+            {
+                return false;
+            }
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void put_u32(std::vector<uint8_t> &out, uint32_t v)
+{
+    out.insert(out.end(), (const uint8_t *)&v, (const uint8_t *)&v + 4);
+}
+
+// true -> OK, false -> nil, an error value -> an error reply
+static bool encode_value(const Value &v, std::vector<uint8_t> &out, uint32_t depth = 1)
+{
+    if (out.size() > k_script_max_reply || depth > k_script_max_depth)
+    {
+        return false;
+    }
+    switch (v.type)
+    {
+    case V_NIL:
+        out.push_back(TAG_NIL);
+        break;
+    case V_BOOL:
+        out.push_back(v.b ? TAG_OK : TAG_NIL);
+        break;
+    case V_INT:
+    case V_DBL:
+        out.push_back(v.type == V_INT ? TAG_INT : TAG_DBL);
+        out.insert(out.end(), (const uint8_t *)(v.type == V_INT ? (const void *)&v.i : (const void *)&v.d),
+                   (const uint8_t *)(v.type == V_INT ? (const void *)&v.i : (const void *)&v.d) + 8);
+        break;
+    case V_STR:
+        out.push_back(TAG_STR);
+        put_u32(out, (uint32_t)v.s.size());
+        out.insert(out.end(), v.s.begin(), v.s.end());
+        break;
+    case V_ERR:
+        out_err(out, (uint32_t)v.i, v.s);
+        break;
+    case V_ARR:
+        out.push_back(TAG_ARR);
+        put_u32(out, (uint32_t)v.arr->size());
+        for (const Value &e : *v.arr)
+        {
+            if (!encode_value(e, out, depth + 1))
+            {
+                return false;
+            }
+        }
+        break;
+    }
+    return true;
+}
+
+static bool vm_builtin(VM &vm, uint32_t b, Value *args, uint32_t nargs, Value &res)
+{
+    switch (b)
+    {
+    case B_CALL:
+    case B_PCALL:
+    {
+        std::vector<std::string> cmd(nargs);
+        for (uint32_t i = 0; i < nargs; i++)
+        {
+            if (args[i].type == V_STR)
+            {
+                cmd[i].swap(args[i].s);
+            }
+            else if (args[i].type == V_INT || args[i].type == V_DBL)
+            {
+                cmd[i] = num_str(args[i]);
+            }
+            else
+            {
+                return vm_fail(vm, "bad argument #%u to '%s', a %s value", i + 1,
+                               k_builtins[b].name, type_name(args[i]));
+            }
+        }
+        std::vector<uint8_t> reply;
+        vm.run->call(cmd, reply);
+        if (!vm_spend(vm, 1, true))
+        {
+            return false;
+        }
+        const uint8_t *cur = reply.data();
+        if (!decode_reply(vm, cur, cur + reply.size(), res))
+        {
+            return vm.err.empty() ? vm_fail(vm, "unreadable reply") : false;
+        }
+        if (res.type == V_ERR && b == B_CALL)
+        {
+            // the command's own error reaches the client
+            vm.err_code = (uint32_t)res.i;
+            vm.err = res.s;
+            return false;
+        }
+        return true;
+    }
+    case B_TONUMBER:
+        if (!to_num(args[0], res))
+        {
+            res = Value();
+        }
+        return true;
+    case B_TOSTRING:
+        res.type = V_STR;
+        res.s = to_str(args[0]);
+        return true;
+    case B_ERROR:
+        vm.err_code = ERR_SCRIPT;
+        vm.err = to_str(args[0]);
+        return false;
+    default: // B_ISERROR
+        res.type = V_BOOL;
+        res.b = args[0].type == V_ERR;
+        return true;
+    }
+}
+
+static Value vm_pop(std::vector<Value> &stack)
+{
+    Value v = std::move(stack.back());
+    stack.pop_back();
+    return v;
+}
+
+static Value make_array(const std::vector<std::string> &strs)
+{
+    Value v;
+    v.type = V_ARR;
+    v.arr = std::make_shared<std::vector<Value>>(strs.size());
+    for (size_t i = 0; i < strs.size(); i++)
+    {
+        (*v.arr)[i].type = V_STR;
+        (*v.arr)[i].s = strs[i];
+    }
+    return v;
+}
+
+void script_run(const Script *sc, ScriptRun &run, std::vector<uint8_t> &out)
+{
+    VM vm;
+    vm.run = &run;
+    vm.start_us = mono_us();
+    std::vector<Value> slots(sc->nslots);
+    slots[0] = make_array(run.keys);
+    slots[1] = make_array(run.argv);
+    std::vector<Value> stack;
+    Value ret;
+    size_t pc = 0;
+    while (pc < sc->code.size() && vm_spend(vm, 1))
+    {
+        const Ins &ins = sc->code[pc++];
+        vm.line = ins.line;
+        bool ok = true;
+        switch (ins.op)
+        {
+        case OP_NIL:
+            stack.emplace_back();
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            stack.emplace_back();
+            stack.back().type = V_BOOL;
+            stack.back().b = ins.op == OP_TRUE;
+            break;
+        case OP_CONST:
+            stack.push_back(sc->consts[ins.a]);
+            break;
+        case OP_LOAD:
+            stack.push_back(slots[ins.a]);
+            break;
+        case OP_STORE:
+            slots[ins.a] = vm_pop(stack);
+            break;
+        case OP_POP:
+            stack.pop_back();
+            break;
+        case OP_INDEX:
+        {
+            Value idx = vm_pop(stack);
+            Value arr = vm_pop(stack);
+            int64_t i = 0;
+            ok = vm_index(vm, arr, idx, i);
+            stack.emplace_back();
+            if (ok && i >= 1 && (uint64_t)i <= arr.arr->size())
+            {
+                stack.back() = (*arr.arr)[i - 1];
+            }
+            break;
+        }
+        case OP_SETINDEX:
+        {
+            Value val = vm_pop(stack);
+            Value idx = vm_pop(stack);
+            Value arr = vm_pop(stack);
+            int64_t i = 0;
+            ok = vm_index(vm, arr, idx, i);
+            if (ok && (i < 1 || (uint64_t)i > arr.arr->size() + 1))
+            {
+                ok = vm_fail(vm, "array index %lld out of range", (long long)i);
+            }
+            Value copy;
+            ok = ok && copy_value(vm, val, copy);
+            if (ok && (uint64_t)i == arr.arr->size() + 1)
+            {
+                arr.arr->push_back(std::move(copy));
+            }
+            else if (ok)
+            {
+                (*arr.arr)[i - 1] = std::move(copy);
+            }
+            break;
+        }
+        case OP_NEWARR:
+        {
+            Value arr;
+            arr.type = V_ARR;
+            arr.arr = std::make_shared<std::vector<Value>>(ins.a);
+            size_t base = stack.size() - ins.a;
+            for (int32_t i = 0; ok && i < ins.a; i++)
+            {
+                ok = copy_value(vm, stack[base + i], (*arr.arr)[i]);
+            }
+            stack.resize(base);
+            stack.push_back(std::move(arr));
+            break;
+        }
+        case OP_LEN:
+        {
+            Value v = vm_pop(stack);
+            if (v.type != V_STR && v.type != V_ARR)
+            {
+                ok = vm_fail(vm, "attempt to get the length of a %s value", type_name(v));
+            }
+            stack.emplace_back();
+            stack.back().type = V_INT;
+            stack.back().i = v.type == V_ARR ? (int64_t)v.arr->size() : (int64_t)v.s.size();
+            break;
+        }
+        case OP_NEG:
+        {
+            Value zero;
+            zero.type = V_INT;
+            Value v = vm_pop(stack);
+            stack.emplace_back();
+            ok = vm_arith(vm, OP_SUB, zero, v, stack.back());
+            break;
+        }
+        case OP_NOT:
+        {
+            bool b = !truthy(stack.back());
+            stack.back() = Value();
+            stack.back().type = V_BOOL;
+            stack.back().b = b;
+            break;
+        }
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_IDIV:
+        case OP_MOD:
+        {
+            Value b = vm_pop(stack);
+            Value a = vm_pop(stack);
+            stack.emplace_back();
+            ok = vm_arith(vm, ins.op, a, b, stack.back());
+            break;
+        }
+        case OP_CONCAT:
+        {
+            Value b = vm_pop(stack);
+            Value &a = stack.back();
+            for (Value *v : {&a, &b})
+            {
+                if (v->type != V_STR && v->type != V_INT && v->type != V_DBL)
+                {
+                    ok = vm_fail(vm, "attempt to concatenate a %s value", type_name(*v));
+                }
+            }
+            if (ok && a.s.size() + b.s.size() + 64 > k_script_max_str)
+            {
+                ok = vm_fail(vm, "string too long");
+            }
+            if (ok)
+            {
+                std::string s = a.type == V_STR ? std::move(a.s) : num_str(a);
+                s += b.type == V_STR ? b.s : num_str(b);
+                a = Value();
+                a.type = V_STR;
+                a.s = std::move(s);
+            }
+            break;
+        }
+        case OP_EQ:
+        case OP_NE:
+        case OP_LT:
+        case OP_LE:
+        case OP_GT:
+        case OP_GE:
+        {
+            Value b = vm_pop(stack);
+            Value a = vm_pop(stack);
+            bool res = false;
+            int cmp = 0;
+            if (ins.op == OP_EQ || ins.op == OP_NE)
+            {
+                res = vm_equal(a, b) == (ins.op == OP_EQ);
+            }
+            else if ((ok = vm_compare(vm, a, b, cmp)))
+            {
+                res = ins.op == OP_LT ? cmp < 0 : ins.op == OP_LE ? cmp <= 0 : ins.op == OP_GT ? cmp > 0 : cmp >= 0;
+            }
+            stack.emplace_back();
+            stack.back().type = V_BOOL;
+            stack.back().b = res;
+            break;
+        }
+        case OP_JMP:
+            pc = ins.a;
+            break;
+        case OP_JMPF:
+            if (!truthy(vm_pop(stack)))
+            {
+                pc = ins.a;
+            }
+            break;
+        case OP_AND:
+        case OP_OR:
+            if (truthy(stack.back()) == (ins.op == OP_OR))
+            {
+                pc = ins.a;
+            }
+            else
+            {
+                stack.pop_back();
+            }
+            break;
+        case OP_FORCHK:
+        {
+            Value i, limit, step;
+            if (!to_num(slots[ins.a], i) || !to_num(slots[ins.a + 1], limit) ||
+                !to_num(slots[ins.a + 2], step))
+            {
+                ok = vm_fail(vm, "'for' values must be numbers");
+            }
+            int cmp = 0;
+            ok = ok && vm_compare(vm, i, limit, cmp);
+            stack.emplace_back();
+            stack.back().type = V_BOOL;
+            stack.back().b = num_dbl(step) >= 0 ? cmp <= 0 : cmp >= 0;
+            break;
+        }
+        case OP_BUILTIN:
+        {
+            uint32_t nargs = ins.a & 0xffff;
+            size_t base = stack.size() - nargs;
+            Value res;
+            ok = vm_builtin(vm, (uint32_t)ins.a >> 16, &stack[base], nargs, res);
+            stack.resize(base);
+            stack.push_back(std::move(res));
+            break;
+        }
+        default: // OP_RET
+            ret = vm_pop(stack);
+            pc = sc->code.size();
+        }
+        if (!ok)
+        {
+            break;
+        }
+    }
+    if (!vm.err.empty())
+    {
+        return out_err(out, vm.err_code, vm.err);
+    }
+    size_t pos = out.size();
+    if (!encode_value(ret, out))
+    {
+        out.resize(pos);
+        out_err(out, ERR_TOO_BIG, "script reply too big or too deep");
+    }
+}
+
+// FIPS 180-1
+static uint32_t rol32(uint32_t v, int n)
+{
+    return (v << n) | (v >> (32 - n));
+}
+
+std::string script_sha1(const std::string &data)
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    std::string msg = data;
+    msg.push_back((char)0x80);
+    while (msg.size() % 64 != 56)
+    {
+        msg.push_back(0);
+    }
+    uint64_t bits = (uint64_t)data.size() * 8;
+    for (int i = 7; i >= 0; i--)
+    {
+        msg.push_back((char)(bits >> (i * 8)));
+    }
+    for (size_t off = 0; off < msg.size(); off += 64)
+    {
+        uint32_t w[80];
+        const uint8_t *blk = (const uint8_t *)msg.data() + off;
+        for (int i = 0; i < 16; i++)
+        {
+            w[i] = (uint32_t)blk[4 * i] << 24 | (uint32_t)blk[4 * i + 1] << 16 |
+                   (uint32_t)blk[4 * i + 2] << 8 | blk[4 * i + 3];
+        }
+        for (int i = 16; i < 80; i++)
+        {
+            w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++)
+        {
+            uint32_t f = 0, k = 0;
+            if (i < 20)
+            {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            }
+            else if (i < 40)
+            {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }
+            else if (i < 60)
+            {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            }
+            else
+            {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t t = rol32(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol32(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    char hex[41];
+    for (int i = 0; i < 5; i++)
+    {
+        snprintf(hex + 8 * i, 9, "%08x", h[i]);
+    }
+    return std::string(hex, 40);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// server-side scripts: a small Lua-like language compiled to bytecode for
+// a stack VM. a script runs commands with call(), in one go, so several
+// dependent commands cost one round trip and no client runs in between.
+//
+//   local n = call("INCR", KEYS[1])
+//   if n == 1 then call("PEXPIRE", KEYS[1], ARGV[1]) end
+//   return n
+//
+// values: nil, booleans, integers, floats, strings, arrays (1-based) and
+// errors. statements: local, assignment, if/elseif/else, while, numeric
+// for, break, return. functions: call, pcall, tonumber, tostring, error,
+// iserror.
+
+struct Script;
+
+// NULL with a message in `err` for a syntax error
+Script *script_compile(const std::string &src, std::string &err);
+void script_free(Script *script);
+
+struct ScriptRun
+{
+    std::vector<std::string> keys; // KEYS
+    std::vector<std::string> argv; // ARGV
+    // runs one command, appends its tagged reply
+    void (*call)(std::vector<std::string> &cmd, std::vector<uint8_t> &out) = NULL;
+    // budget: instructions, commands and copied values, and wall time
+    uint64_t max_ops = 0;
+    uint64_t max_us = 0;
+    // out
+    uint64_t ops = 0;
+    bool over_budget = false;
+};
+
+// appends the tagged reply of the returned value, or the error that
+// stopped the script. commands that already ran are not undone.
+void script_run(const Script *script, ScriptRun &run, std::vector<uint8_t> &out);
+
+// 40 lowercase hex digits, the name a script is cached under
+std::string script_sha1(const std::string &data);
@@ -1,56 +1,48 @@
-#include <stdint.h>
-#include <stdlib.h>
-#include <string.h>
-#include <stdio.h>
-#include <errno.h>
-#include <assert.h>
-#include <math.h>
-#include <fstream>
-
-#include <time.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <netinet/ip.h>
-#include <fcntl.h>
-#include <poll.h>
-#include <mutex>
-
-#include <string>
-#include <vector>
-
-#include "common.h"
-#include "zset.h"
-#include "hashtable.h"
-#include "list.h"
-#include "heap.h"
-#include "thread_pool.h"
-#include "commands/commands.h"
-
-static void msg(const char *msg)
+#include "server.h"
+
+void msg(const char *msg)
 {
     fprintf(stderr, "%s\n", msg);
 }
 
-static void msg_errno(const char *msg)
+void msg_errno(const char *msg)
 {
     fprintf(stderr, "[errno:%d] %s\n", errno, msg);
 }
 
-static void die(const char *msg)
+void die(const char *msg)
 {
     fprintf(stderr, "[%d] %s\n", errno, msg);
     abort();
 }
 
-static uint64_t get_monotonic_msec()
+uint64_t get_wall_sec()
+{
+    return (uint64_t)time(NULL);
+}
+
+uint64_t get_wall_msec()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
+static uint64_t get_wall_usec()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+uint64_t get_monotonic_msec()
 {
     struct timespec tv = {0, 0};
     clock_gettime(CLOCK_MONOTONIC, &tv);
     return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
 }
 
-static void fd_set_nb(int fd)
+void fd_set_nb(int fd)
 {
     errno = 0;
     int flags = fcntl(fd, F_GETFL, 0);
@@ -69,50 +61,42 @@ static void fd_set_nb(int fd)
     }
 }
 
-const size_t k_max_msg = 32 << 20;
-
-typedef std::vector<uint8_t> Buffer;
 // append to the back
-static void
+void
 buf_append(Buffer &buf, const uint8_t *data, size_t len)
 {
     buf.insert(buf.end(), data, data + len);
 }
 
 // remove from the front
-static void buf_consume(Buffer &buf, size_t n)
+void buf_consume(Buffer &buf, size_t n)
 {
     buf.erase(buf.begin(), buf.begin() + n);
 }
 
-struct Conn
-{
-    int fd = -1;
-    // application's intention, for the event loop
-    bool want_read = false;
-    bool want_write = false;
-    bool want_close = false;
-    // buffered input and output
-    Buffer incoming;
-    Buffer outgoing;
-    // timer
-    uint64_t last_active_ms = 0;
-    DList idle_node;
-};
+GlobalData g_data;
 
-static struct
+std::mutex snap_mutex;
+
+Conn *conn_new(int fd)
 {
-    HMap db;                     // map of all client connections
-    std::vector<Conn *> fd2conn; // fd-conn mapping
-    DList idle_list;             // timers of idle connections
-    std::vector<HeapItem> heap;  // timers for key TTLs
-    ThreadPool thread_pool;      // thread pool
-} g_data;
+    Conn *conn = new Conn();
+    conn->fd = fd;
+    conn->id = g_data.next_conn_id++;
+    conn->last_active_ms = get_monotonic_msec();
+    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
 
-std::mutex snap_mutex;
+    if (g_data.fd2conn.size() <= (size_t)fd)
+    {
+        g_data.fd2conn.resize(fd + 1);
+    }
+    assert(!g_data.fd2conn[fd]);
+    g_data.fd2conn[fd] = conn;
+    return conn;
+}
 
 // application callback when listening socket is ready
-static int32_t *handle_accept(int fd)
+static int32_t *handle_accept(int fd, int proto)
 {
     // accept
     struct sockaddr_in client_addr = {};
@@ -128,32 +112,45 @@ static int32_t *handle_accept(int fd)
             ip & 255, (ip >> 8) & 255, (ip >> 16) & 255, ip >> 24,
             ntohs(client_addr.sin_port));
     fd_set_nb(connfd); // set new connection to nonblocking
-
-    Conn *conn = new Conn();
-    conn->fd = connfd;
+    Conn *conn = conn_new(connfd);
+    conn->proto = proto;
     conn->want_read = true;
-    conn->last_active_ms = get_monotonic_msec();
-    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
-
-    if (g_data.fd2conn.size() <= (size_t)connfd)
-    {
-        g_data.fd2conn.resize(connfd + 1);
-    }
-    assert(!g_data.fd2conn[connfd]);
-    g_data.fd2conn[connfd] = conn;
-
     return 0;
 }
 
-static void conn_destroy(Conn *conn)
+
+void conn_destroy(Conn *conn)
 {
+    if (conn == g_data.repl_link)
+    {
+        msg("lost the link to the master");
+        g_data.repl_link = NULL;
+        repl_transfer_reset();
+    }
+    if (conn == g_data.repl_sync_conn)
+    {
+        g_data.repl_sync_conn = NULL; // the child fails on its own
+    }
+    pubsub_conn_gone(conn);
+    migrate_link_gone(conn);
+    delete conn->stream;
+    delete conn->upload;
     (void)close(conn->fd);
     g_data.fd2conn[conn->fd] = NULL;
     dlist_detach(&conn->idle_node);
     delete conn;
 }
 
-const size_t k_max_args = 200 * 1000;
+// drop bytes from the front of `incoming`
+static void conn_consume(Conn *conn, size_t n)
+{
+    buf_consume(conn->incoming, n);
+    conn->in_off += n;
+    while (!conn->v2_reads.empty() && conn->v2_reads.front().first <= conn->in_off)
+    {
+        conn->v2_reads.pop_front();
+    }
+}
 
 static bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t &out)
 {
@@ -183,7 +180,42 @@ read_str(const uint8_t *&cur, const uint8_t *end, size_t n, std::string &out)
 // | nstr | len | str1 | len | str2 | ... | len | strn |
 // +------+-----+------+-----+------+-----+-----+------+
 
-static int32_t
+// size of the first complete request in data, 0 if more data is needed
+size_t req_size(const uint8_t *data, size_t size)
+{
+    const uint8_t *cur = data;
+    const uint8_t *end = data + size;
+    uint32_t nstr = 0;
+    if (!read_u32(cur, end, nstr))
+    {
+        return 0;
+    }
+    for (uint32_t i = 0; i < nstr; i++)
+    {
+        uint32_t str_len = 0;
+        if (!read_u32(cur, end, str_len) || (size_t)(end - cur) < str_len)
+        {
+            return 0;
+        }
+        cur += str_len;
+    }
+    return cur - data;
+}
+
+static void buf_append_u32(Buffer &buf, uint32_t data);
+
+// serialize a command in the request format
+void buf_append_cmd(Buffer &buf, const std::vector<std::string> &cmd)
+{
+    buf_append_u32(buf, (uint32_t)cmd.size());
+    for (const std::string &s : cmd)
+    {
+        buf_append_u32(buf, (uint32_t)s.size());
+        buf_append(buf, (const uint8_t *)s.data(), s.size());
+    }
+}
+
+int32_t
 parse_req(const uint8_t *data, size_t size, std::vector<std::string> &out)
 {
     // fprintf(stderr, "Raw request data (%zu bytes): ", size);
@@ -226,20 +258,8 @@ parse_req(const uint8_t *data, size_t size, std::vector<std::string> &out)
     return 0;
 }
 
-// datatypes of serialized data
-enum
-{
-    TAG_NIL = 0, // nil
-    TAG_ERR = 1, // error code + msg
-    TAG_STR = 2, // string
-    TAG_INT = 3, // int64
-    TAG_DBL = 4, // double
-    TAG_ARR = 5, // array
-    TAG_OK = 6   // success response
-};
-
 // functions for serialization
-static void buf_append_u8(Buffer &buf, uint8_t data)
+void buf_append_u8(Buffer &buf, uint8_t data)
 {
     buf.push_back(data);
 }
@@ -257,21 +277,21 @@ static void buf_append_dbl(Buffer &buf, double data)
 }
 
 // apend serialized datatypes to the back
-static void out_nil(Buffer &out)
+void out_nil(Buffer &out)
 {
     buf_append_u8(out, TAG_NIL);
 }
-static void out_ok(Buffer &out)
+void out_ok(Buffer &out)
 {
     buf_append_u8(out, TAG_OK);
 }
-static void out_str(Buffer &out, const char *s, size_t size)
+void out_str(Buffer &out, const char *s, size_t size)
 {
     buf_append_u8(out, TAG_STR);
     buf_append_u32(out, (uint32_t)size);
     buf_append(out, (const uint8_t *)s, size);
 }
-static void out_int(Buffer &out, int64_t val)
+void out_int(Buffer &out, int64_t val)
 {
     buf_append_u8(out, TAG_INT);
     buf_append_i64(out, val);
@@ -288,56 +308,80 @@ void out_err(Buffer &out, uint32_t code, const std::string &msg)
     buf_append_u32(out, (uint32_t)msg.size());
     buf_append(out, (const uint8_t *)msg.data(), msg.size());
 }
-static void out_arr(Buffer &out, uint32_t n)
+void out_arr(Buffer &out, uint32_t n)
 {
     buf_append_u8(out, TAG_ARR);
     buf_append_u32(out, n);
 }
 
-static size_t out_begin_arr(Buffer &out)
+size_t out_begin_arr(Buffer &out)
 {
     out.push_back(TAG_ARR);
     buf_append_u32(out, 0);
     return out.size() - 4;
 }
-static void out_end_arr(Buffer &out, size_t ctx, uint32_t n)
+void out_end_arr(Buffer &out, size_t ctx, uint32_t n)
 {
     assert(out[ctx - 1] == TAG_ARR);
     memcpy(&out[ctx], &n, 4);
 }
-// value type
-enum
+const uint8_t k_lfu_init = 5; // new keys are not evicted right away
+
+static uint16_t lfu_minutes()
 {
-    T_INIT = 0,
-    T_STR = 1,  // string
-    T_ZSET = 2, // sorted set
-};
+    return (uint16_t)(get_monotonic_msec() / 60000);
+}
 
-// KV pair for db
-struct Entry
+// the counter after decaying by one per idle minute
+uint8_t entry_lfu(Entry *ent)
 {
-    struct HNode node;
-    std::string key;
-    // value
-    uint32_t type = 0;
-    std::string str;
-    ZSet zset;
-    size_t heap_idx = -1; // index of this entry in the heap
-};
+    uint16_t idle = lfu_minutes() - ent->lfu_time;
+    return idle >= ent->lfu ? 0 : ent->lfu - idle;
+}
 
-static Entry *entry_new(uint32_t type)
+// count an access, the counter grows more slowly the higher it is
+static void entry_touch(Entry *ent)
+{
+    uint8_t counter = entry_lfu(ent);
+    if (counter < 255)
+    {
+        double base = counter > k_lfu_init ? counter - k_lfu_init : 0;
+        if (rand() < RAND_MAX / (base * 10 + 1))
+        {
+            counter++;
+        }
+    }
+    ent->lfu = counter;
+    ent->lfu_time = lfu_minutes();
+}
+
+Entry *entry_new(uint32_t type)
 {
     Entry *ent = new Entry();
     ent->type = type;
+    ent->lfu = k_lfu_init;
+    ent->lfu_time = lfu_minutes();
     return ent;
 }
 
-static void entry_del_sync(Entry *ent)
+static bool cb_hfield_del(HNode *node, void *)
+{
+    delete container_of(node, HField, node);
+    return true;
+}
+
+void entry_del_sync(Entry *ent)
 {
     if (ent->type == T_ZSET)
     {
         zset_clear(&ent->zset);
     }
+    if (ent->hash)
+    {
+        hm_foreach(ent->hash, &cb_hfield_del, NULL);
+        hm_clear(ent->hash);
+        delete ent->hash;
+    }
     delete ent;
 }
 
@@ -346,243 +390,1539 @@ static void entry_del_func(void *arg)
     entry_del_sync((Entry *)arg);
 }
 
-static void entry_set_ttl(Entry *ent, int64_t ttl_ms);
-
-static void entry_del(Entry *ent)
+static void garbage_free_func(void *arg)
 {
-    // unlink it from any data structure
-    entry_set_ttl(ent, -1); // soft delete ent from heap
-
-    // run destructor in threadpool only for larger size zset
-    size_t set_size = (ent->type == T_ZSET) ? hm_size(&ent->zset.hmap) : 0;
-    const size_t k_large_container_size = 1000;
-    if (set_size > k_large_container_size)
+    std::vector<void *> *batch = (std::vector<void *> *)arg;
+    for (void *ent : *batch)
     {
-        thread_pool_queue(&g_data.thread_pool, &entry_del_func, ent);
+        entry_del_sync((Entry *)ent);
     }
-    else
+    delete batch;
+}
+
+// hand the garbage of this iteration to the thread pool in one task
+static void garbage_flush()
+{
+    if (g_data.garbage.empty())
     {
-        entry_del_sync(ent);
+        return;
     }
+    std::vector<void *> *batch = new std::vector<void *>();
+    batch->swap(g_data.garbage);
+    thread_pool_queue(&g_data.thread_pool, &garbage_free_func, batch);
 }
 
-struct LookupKey
-{
-    struct HNode node;
-    std::string key;
-};
+const size_t k_large_container_size = 1000;
+const size_t k_large_str_size = 128 << 10; // malloc's mmap threshold
 
-// eq comparison for struct: Entry
-static bool entry_eq(HNode *lhs, HNode *key)
+// whether freeing it is worth a dedicated background task
+static bool entry_is_large(Entry *ent)
 {
-    struct Entry *ent = container_of(lhs, struct Entry, node);
-    struct LookupKey *hkey = container_of(key, struct LookupKey, node);
-    return ent->key == hkey->key;
+    if (ent->type == T_ZSET)
+    {
+        return hm_size(&ent->zset.hmap) > k_large_container_size;
+    }
+    if (ent->hash)
+    {
+        return hm_size(ent->hash) > k_large_container_size;
+    }
+    return ent->str.capacity() >= k_large_str_size;
 }
 
-void do_get(std::vector<std::string> &cmd, Buffer &out)
+static void str_del_func(void *arg)
 {
-    // dummy struct for lookup
-    LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    // hashtable lookup
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!node)
-        return out_nil(out);
+    delete (std::string *)arg;
+}
 
-    Entry *ent = container_of(node, Entry, node);
-    if (ent->type != T_STR)
+// free a huge string buffer in the background
+static void str_del_lazy(std::string &s)
+{
+    if (s.capacity() >= k_large_str_size)
     {
-        return out_err(out, ERR_BAD_TYP, "not a string");
+        std::string *victim = new std::string();
+        victim->swap(s);
+        thread_pool_queue(&g_data.thread_pool, &str_del_func, victim);
     }
-    return out_str(out, ent->str.data(), ent->str.size());
 }
 
-void do_set(std::vector<std::string> &cmd, Buffer &out)
+// `lazy` defers small entries to the per-iteration garbage list
+void entry_del(Entry *ent, bool lazy)
 {
-    std::lock_guard<std::mutex> lk(snap_mutex);
+    // unlink it from any data structure
+    entry_set_ttl(ent, -1); // soft delete ent from heap
+    entry_vlog_forget(ent);
+    cold_read_cancel(ent);
+    if (ent->type == T_ZSET)
+    {
+        ent->zset.heap.clear();
+        entry_sync_zexpire(ent); // and from the member TTL heap
+    }
 
-    // dummy struct for lookup
-    LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    // hashtable lookup
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (node)
+    // run destructor in threadpool for large values
+    if (entry_is_large(ent))
     {
-        // found, update entry
-        Entry *ent = container_of(node, Entry, node);
-        if (ent->type != T_STR)
-        {
-            return out_err(out, ERR_BAD_TYP, "a non string value exists");
-        }
-        ent->str.swap(cmd[2]);
+        thread_pool_queue(&g_data.thread_pool, &entry_del_func, ent);
+    }
+    else if (lazy)
+    {
+        g_data.garbage.push_back(ent);
     }
     else
     {
-        // not found, create new entry
-        Entry *ent = entry_new(T_STR);
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->str.swap(cmd[2]);
-        hm_insert(&g_data.db, &ent->node);
+        entry_del_sync(ent);
     }
-    return out_ok(out);
 }
 
-void do_del(std::vector<std::string> &cmd, Buffer &out)
+bool cb_collect(HNode *node, void *arg)
 {
-    std::lock_guard<std::mutex> lk(snap_mutex);
-    // dummy struct for lookup
-    LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    // hashtable delete
-    HNode *node = hm_delete(&g_data.db, &key.node, &entry_eq);
-    if (node)
+    ((std::vector<HNode *> *)arg)->push_back(node);
+    return true;
+}
+
+// free all entries of a detached keyspace
+void db_free(HMap *db)
+{
+    std::vector<HNode *> nodes;
+    nodes.reserve(hm_size(db));
+    hm_foreach(db, &cb_collect, &nodes);
+    for (HNode *node : nodes)
     {
-        entry_del(container_of(node, Entry, node));
+        entry_del_sync(container_of(node, Entry, node));
     }
-    return out_int(out, node ? 1 : 0);
+    hm_clear(db);
 }
 
-static void heap_delete(std::vector<HeapItem> &heap, size_t pos)
+static void db_free_func(void *arg)
 {
-    // swap with last
-    heap[pos] = heap.back();
-    heap.pop_back();
-
-    if (pos < heap.size())
-        heap_update(heap.data(), pos, heap.size());
+    HMap *db = (HMap *)arg;
+    db_free(db);
+    delete db;
 }
 
-static void heap_upsert(std::vector<HeapItem> &heap, size_t pos, HeapItem t)
+// drop every key, optionally freeing them in the background
+void db_flush(bool async)
 {
-    if (pos < heap.size())
-        heap[pos] = t; // update exising
+    // timers and the value log point into the entries
+    g_data.heap.clear();
+    g_data.zheap.clear();
+    tier_reset();
+    if (async)
+    {
+        HMap *db = new HMap(g_data.db);
+        g_data.db = HMap{};
+        thread_pool_queue(&g_data.thread_pool, &db_free_func, db);
+    }
     else
     {
-        pos = heap.size();
-        heap.push_back(t); // insert new
+        db_free(&g_data.db);
     }
-    heap_update(heap.data(), pos, heap.size());
 }
 
-// set or remove TTL
-static void entry_set_ttl(Entry *ent, int64_t ttl_ms)
+// eq comparison for struct: Entry
+bool entry_eq(HNode *lhs, HNode *key)
 {
-    if (ttl_ms < 0 && ent->heap_idx != (size_t)-1)
-    {
-        heap_delete(g_data.heap, ent->heap_idx);
-        ent->heap_idx = (size_t)-1; // soft delete (-1)
-    }
-    else if (ttl_ms >= 0)
-    {
-        // add/update heap
-        uint64_t expire_at = get_monotonic_msec() + (uint64_t)ttl_ms;
-        HeapItem item = {expire_at, &ent->heap_idx};
-        heap_upsert(g_data.heap, ent->heap_idx, item);
-    }
+    struct Entry *ent = container_of(lhs, struct Entry, node);
+    struct LookupKey *hkey = container_of(key, struct LookupKey, node);
+    return ent->key == hkey->key;
 }
-static bool str2int(const std::string &s, int64_t &out)
+
+// a replica expires keys by the DELs of its master, its clients don't
+// see the ones past their TTL meanwhile
+static bool entry_expired_on_replica(Entry *ent)
 {
-    char *endp = NULL;
-    out = strtoll(s.c_str(), &endp, 10);
-    return endp == s.c_str() + s.size();
+    return !g_data.master_host.empty() && g_data.cur_conn &&
+           ent->heap_idx != (size_t)-1 && g_data.heap[ent->heap_idx].val <= get_monotonic_msec();
 }
 
-// PEXPIRE key ttl_ms
-void do_expire(std::vector<std::string> &cmd, Buffer &out)
+// all key lookups go through here, a key may still be in the image
+HNode *db_lookup(LookupKey *key)
 {
-    int64_t ttl_ms = 0;
-    if (!str2int(cmd[2], ttl_ms))
+    HNode *node = hm_lookup(&g_data.db, &key->node, &entry_eq);
+    if (!node && g_data.img)
     {
-        return out_err(out, ERR_BAD_ARG, "expected int64");
+        img_adopt(key);
+        node = hm_lookup(&g_data.db, &key->node, &entry_eq);
     }
-    LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
     if (node)
     {
         Entry *ent = container_of(node, Entry, node);
-        entry_set_ttl(ent, ttl_ms);
+        if (entry_expired_on_replica(ent))
+        {
+            return NULL;
+        }
+        entry_touch(ent);
     }
-    return out_int(out, node ? 1 : 0);
+    return node;
 }
 
-// PTTL key
-void do_ttl(std::vector<std::string> &cmd, Buffer &out)
+HNode *db_delete(LookupKey *key)
 {
+    if (g_data.img)
+    {
+        db_lookup(key);
+    }
+    return hm_delete(&g_data.db, &key->node, &entry_eq);
+}
+
+void do_get(std::vector<std::string> &cmd, Buffer &out)
+{
+    // dummy struct for lookup
     LookupKey key;
     key.key.swap(cmd[1]);
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    // hashtable lookup
+    HNode *node = db_lookup(&key);
     if (!node)
+        return out_nil(out);
+
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_STR)
     {
-        return out_int(out, -2); // key not found
+        return out_err(out, ERR_BAD_TYP, "not a string");
     }
-    Entry *ent = container_of(node, Entry, node);
-    if (ent->heap_idx == (size_t)-1)
+    if (!entry_ensure_hot(ent))
     {
-        return out_int(out, -1); // no TTL
+        return; // parked
     }
-    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
-    uint64_t now_ms = get_monotonic_msec();
-    return out_int(out, expire_at > now_ms ? (expire_at - now_ms) : 0);
+    std::string tmp;
+    const std::string &val = entry_str(ent, tmp);
+    return out_str(out, val.data(), val.size());
 }
 
-static bool cb_keys(HNode *node, void *arg)
+// an integer in canonical form, as redis' string2ll: no sign, spaces or zeros
+static bool str_is_int(const std::string &s, int64_t &out)
 {
-    Buffer &out = *(Buffer *)arg;
-    const std::string &key = container_of(node, Entry, node)->key;
-    out_str(out, key.data(), key.size());
-    return true;
+    return !s.empty() && s.size() <= 20 && str2int(s, out) && int2str(out) == s;
 }
 
-void do_keys(std::vector<std::string> &cmd, Buffer &out)
+// sets a string value, the old one is left in `val`
+static void entry_set_str(Entry *ent, std::string &val)
 {
-    if (cmd.size() != 1)
+    int64_t v = 0;
+    ent->int_enc = str_is_int(val, v);
+    ent->ival = v;
+    ent->str.swap(val);
+    if (ent->int_enc)
     {
-        return out_err(out, ERR_UNKNOWN, "KEYS command requires no arguments");
+        std::string().swap(ent->str);
     }
-    out_arr(out, (uint32_t)hm_size(&g_data.db));
-    hm_foreach(&g_data.db, &cb_keys, (void *)&out);
 }
 
-static bool str2dbl(const std::string &s, double &out)
+// the value as an integer for INCR and friends
+static bool entry_int(Entry *ent, int64_t &out)
 {
-    char *endp = NULL;
-    out = strtod(s.c_str(), &endp);
-    return endp == s.c_str() + s.size() && !isnan(out);
+    if (ent->int_enc)
+    {
+        out = ent->ival;
+        return true;
+    }
+    return str_is_int(ent->str, out);
 }
 
-// zadd zset score name
-void do_zadd(std::vector<std::string> &cmd, Buffer &out)
+// back to a plain string before it is changed in place
+static void entry_str_decode(Entry *ent)
 {
-    std::lock_guard<std::mutex> lk(snap_mutex);
-    double score = 0;
-    if (!str2dbl(cmd[2], score))
+    if (ent->int_enc)
     {
-        return out_err(out, ERR_BAD_ARG, "expected float");
+        ent->str = int2str(ent->ival);
+        ent->int_enc = false;
     }
-    // lookup or create zset
-    LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+}
 
-    Entry *ent = NULL;
-    if (!hnode)
-    { // insert new key
-        ent = entry_new(T_ZSET);
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        hm_insert(&g_data.db, &ent->node);
-    }
+// SET options
+enum
+{
+    SET_NX = 1 << 0,      // only if missing
+    SET_XX = 1 << 1,      // only if present
+    SET_GET = 1 << 2,     // reply the old value
+    SET_KEEPTTL = 1 << 3, // otherwise the TTL is removed
+    SET_TTL = 1 << 4,     // EX, PX, EXAT or PXAT
+};
+
+// EX s | PX ms | EXAT unix_s | PXAT unix_ms at cmd[i], as ms from now.
+// 0 if it is not one of them, -1 for a bad time.
+static int parse_expire(const std::vector<std::string> &cmd, size_t &i, int64_t &ttl_ms)
+{
+    const char *opt = cmd[i].c_str();
+    bool sec = !strcasecmp(opt, "EX") || !strcasecmp(opt, "EXAT");
+    bool abs = !strcasecmp(opt, "EXAT") || !strcasecmp(opt, "PXAT");
+    if (!sec && strcasecmp(opt, "PX") && strcasecmp(opt, "PXAT"))
+    {
+        return 0;
+    }
+    int64_t v = 0;
+    if (i + 1 >= cmd.size() || !str2int(cmd[i + 1], v) || v <= 0 ||
+        (sec && v > INT64_MAX / 1000))
+    {
+        return -1;
+    }
+    v = sec ? v * 1000 : v;
+    v = abs ? v - (int64_t)get_wall_msec() : v;
+    ttl_ms = v < 0 ? 0 : v; // a time in the past expires it right away
+    i++;
+    return 1;
+}
+
+// SET key value [NX|XX] [GET] [EX s|PX ms|EXAT unix_s|PXAT unix_ms|KEEPTTL]
+void do_set(std::vector<std::string> &cmd, Buffer &out)
+{
+    uint32_t flags = 0;
+    int64_t ttl_ms = -1;
+    for (size_t i = 3; i < cmd.size(); i++)
+    {
+        const char *opt = cmd[i].c_str();
+        uint32_t f = !strcasecmp(opt, "NX")        ? SET_NX
+                     : !strcasecmp(opt, "XX")      ? SET_XX
+                     : !strcasecmp(opt, "GET")     ? SET_GET
+                     : !strcasecmp(opt, "KEEPTTL") ? SET_KEEPTTL
+                                                   : 0;
+        if (!f)
+        {
+            int rv = parse_expire(cmd, i, ttl_ms);
+            if (rv < 0)
+            {
+                return out_err(out, ERR_BAD_ARG, "invalid expire time");
+            }
+            f = rv > 0 ? SET_TTL : 0;
+        }
+        if (!f || (flags & f))
+        {
+            return out_err(out, ERR_BAD_ARG, "syntax error");
+        }
+        flags |= f;
+    }
+    if ((flags & SET_NX && flags & SET_XX) || (flags & SET_TTL && flags & SET_KEEPTTL))
+    {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+
+    std::lock_guard<std::mutex> lk(snap_mutex);
+
+    // dummy struct for lookup
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    // hashtable lookup, the only one
+    HNode *node = db_lookup(&key);
+    Entry *ent = node ? container_of(node, Entry, node) : NULL;
+    if (ent && ent->type != T_STR)
+    {
+        return out_err(out, ERR_BAD_TYP, "a non string value exists");
+    }
+    if (flags & SET_GET)
+    {
+        if (ent && !entry_ensure_hot(ent))
+        {
+            return; // parked
+        }
+        std::string tmp;
+        const std::string &old = ent ? entry_str(ent, tmp) : tmp;
+        ent ? out_str(out, old.data(), old.size()) : out_nil(out);
+    }
+    if ((flags & SET_NX && ent) || (flags & SET_XX && !ent))
+    {
+        cmd_propagate_end(true); // nothing changed
+        return (flags & SET_GET) ? (void)0 : out_nil(out);
+    }
+    if (ent)
+    {
+        // found, update entry
+        entry_vlog_forget(ent);
+        entry_set_str(ent, cmd[2]);
+        str_del_lazy(cmd[2]); // the old value
+    }
+    else
+    {
+        // not found, create new entry
+        ent = entry_new(T_STR);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        entry_set_str(ent, cmd[2]);
+        hm_insert(&g_data.db, &ent->node);
+    }
+    key_changed("set", ent->key);
+    if (flags & SET_TTL)
+    {
+        entry_set_ttl(ent, ttl_ms);
+        // absolute, for the log and the replicas
+        std::string tmp;
+        propagate_replace({"SET", ent->key, entry_str(ent, tmp), "PXAT",
+                           int2str((int64_t)get_wall_msec() + ttl_ms)});
+    }
+    else if (!(flags & SET_KEEPTTL))
+    {
+        entry_set_ttl(ent, -1);
+    }
+    g_data.dirty++;
+    return (flags & SET_GET) ? (void)0 : out_ok(out);
+}
+
+// GETDEL key
+void do_getdel(std::vector<std::string> &cmd, Buffer &out)
+{
+    std::lock_guard<std::mutex> lk(snap_mutex);
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key);
+    if (!node)
+    {
+        cmd_propagate_end(true); // nothing changed
+        return out_nil(out);
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_STR)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a string");
+    }
+    if (!entry_ensure_hot(ent))
+    {
+        return; // parked
+    }
+    std::string tmp;
+    const std::string &val = entry_str(ent, tmp);
+    out_str(out, val.data(), val.size());
+    hm_delete(&g_data.db, &ent->node, &hnode_same);
+    key_changed("del", ent->key);
+    propagate_replace({"DEL", ent->key});
+    entry_del(ent, false);
+    g_data.dirty++;
+}
+
+// GETEX key [EX s|PX ms|EXAT unix_s|PXAT unix_ms|PERSIST]
+void do_getex(std::vector<std::string> &cmd, Buffer &out)
+{
+    int64_t ttl_ms = -1;
+    bool persist = false;
+    size_t i = 2;
+    if (cmd.size() == 3 && !strcasecmp(cmd[2].c_str(), "PERSIST"))
+    {
+        persist = true;
+    }
+    else if (cmd.size() > 2 && (parse_expire(cmd, i, ttl_ms) <= 0 || i + 1 != cmd.size()))
+    {
+        return out_err(out, ERR_BAD_ARG, "syntax error or invalid expire time");
+    }
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key);
+    Entry *ent = node ? container_of(node, Entry, node) : NULL;
+    if (ent && ent->type != T_STR)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a string");
+    }
+    if (ent && !entry_ensure_hot(ent))
+    {
+        return; // parked
+    }
+    if (!ent || (ttl_ms < 0 && !persist))
+    {
+        cmd_propagate_end(true); // nothing changed
+    }
+    if (!ent)
+    {
+        return out_nil(out);
+    }
+    std::string tmp;
+    const std::string &val = entry_str(ent, tmp);
+    out_str(out, val.data(), val.size());
+    if (ttl_ms >= 0)
+    {
+        entry_set_ttl(ent, ttl_ms);
+        propagate_replace({"PEXPIREAT", ent->key, int2str((int64_t)get_wall_msec() + ttl_ms)});
+        g_data.dirty++;
+    }
+    else if (persist)
+    {
+        entry_set_ttl(ent, -1);
+        propagate_replace({"PEXPIRE", ent->key, "-1"});
+        g_data.dirty++;
+    }
+}
+
+void do_del(std::vector<std::string> &cmd, Buffer &out)
+{
+    std::lock_guard<std::mutex> lk(snap_mutex);
+    // dummy struct for lookup
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    // hashtable delete
+    HNode *node = db_delete(&key);
+    if (node)
+    {
+        key_changed("del", key.key);
+        entry_del(container_of(node, Entry, node), false);
+        g_data.dirty++;
+    }
+    return out_int(out, node ? 1 : 0);
+}
+
+// UNLINK key [key...], like DEL but values are freed in the background
+void do_unlink(std::vector<std::string> &cmd, Buffer &out)
+{
+    std::lock_guard<std::mutex> lk(snap_mutex);
+    int64_t n = 0;
+    for (size_t i = 1; i < cmd.size(); i++)
+    {
+        LookupKey key;
+        key.key.swap(cmd[i]);
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+        HNode *node = db_delete(&key);
+        if (node)
+        {
+            key_changed("del", key.key);
+            entry_del(container_of(node, Entry, node), true);
+            n++;
+        }
+    }
+    g_data.dirty += n;
+    return out_int(out, n);
+}
+
+// FLUSHALL [ASYNC]
+void do_flushall(std::vector<std::string> &cmd, Buffer &out)
+{
+    bool async = false;
+    if (cmd.size() == 2)
+    {
+        std::string opt = cmd[1];
+        std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+        if (opt != "ASYNC" && opt != "SYNC")
+        {
+            return out_err(out, ERR_BAD_ARG, "expected ASYNC or SYNC");
+        }
+        async = opt == "ASYNC";
+    }
+    std::lock_guard<std::mutex> lk(snap_mutex);
+    g_data.dirty += hm_size(&g_data.db) + g_data.img_pending;
+    img_drop();
+    db_flush(async);
+    keys_flushed();
+    return out_ok(out);
+}
+
+// set or remove TTL
+void entry_set_ttl(Entry *ent, int64_t ttl_ms)
+{
+    if (ttl_ms < 0 && ent->heap_idx != (size_t)-1)
+    {
+        heap_delete(g_data.heap, ent->heap_idx);
+        ent->heap_idx = (size_t)-1; // soft delete (-1)
+    }
+    else if (ttl_ms >= 0)
+    {
+        // add/update heap
+        uint64_t expire_at = get_monotonic_msec() + (uint64_t)ttl_ms;
+        HeapItem item = {expire_at, &ent->heap_idx};
+        heap_upsert(g_data.heap, ent->heap_idx, item);
+    }
+}
+
+// track the earliest member TTL of a zset in the global timer.
+// only ZPEXPIRE can move it earlier, so removals leave it alone and
+// process_timers() corrects a stale (too early) timer when it fires.
+void entry_sync_zexpire(Entry *ent)
+{
+    uint64_t next_ms = zset_next_expire(&ent->zset);
+    if (next_ms == (uint64_t)-1 && ent->zheap_idx != (size_t)-1)
+    {
+        heap_delete(g_data.zheap, ent->zheap_idx);
+        ent->zheap_idx = (size_t)-1;
+    }
+    else if (next_ms != (uint64_t)-1)
+    {
+        HeapItem item = {next_ms, &ent->zheap_idx};
+        heap_upsert(g_data.zheap, ent->zheap_idx, item);
+    }
+}
+bool str2int(const std::string &s, int64_t &out)
+{
+    char *endp = NULL;
+    out = strtoll(s.c_str(), &endp, 10);
+    return endp == s.c_str() + s.size();
+}
+
+std::string int2str(int64_t val)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lld", (long long)val);
+    return buf;
+}
+
+// like redis' proto-max-bulk-len
+const size_t k_max_str = 512 << 20;
+
+static Entry *db_find(const std::string &name)
+{
+    LookupKey key;
+    key.key = name;
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key);
+    return node ? container_of(node, Entry, node) : NULL;
+}
+
+static Entry *str_create(std::string &name)
+{
+    Entry *ent = entry_new(T_STR);
+    ent->key.swap(name);
+    ent->node.hcode = str_hash((uint8_t *)ent->key.data(), ent->key.size());
+    hm_insert(&g_data.db, &ent->node);
+    return ent;
+}
+
+// APPEND key value, the new length
+void do_append(std::vector<std::string> &cmd, Buffer &out)
+{
+    std::lock_guard<std::mutex> lk(snap_mutex);
+    Entry *ent = db_find(cmd[1]);
+    if (ent && ent->type != T_STR)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a string");
+    }
+    if (ent && !entry_ensure_hot(ent))
+    {
+        return; // parked
+    }
+    if (ent)
+    {
+        entry_str_decode(ent);
+    }
+    size_t len = (ent ? ent->str.size() : 0) + cmd[2].size();
+    if (len > k_max_str)
+    {
+        return out_err(out, ERR_BAD_ARG, "string exceeds maximum allowed size");
+    }
+    if (!ent)
+    {
+        ent = str_create(cmd[1]);
+        ent->str.swap(cmd[2]);
+    }
+    else
+    {
+        entry_vlog_forget(ent);
+        ent->str.append(cmd[2]);
+    }
+    key_changed("append", ent->key);
+    g_data.dirty++;
+    return out_int(out, (int64_t)len);
+}
+
+// SETRANGE key offset value, zero padded, the new length
+void do_setrange(std::vector<std::string> &cmd, Buffer &out)
+{
+    int64_t off = 0;
+    if (!str2int(cmd[2], off) || off < 0)
+    {
+        return out_err(out, ERR_BAD_ARG, "offset is out of range");
+    }
+    std::lock_guard<std::mutex> lk(snap_mutex);
+    Entry *ent = db_find(cmd[1]);
+    if (ent && ent->type != T_STR)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a string");
+    }
+    if (ent && !entry_ensure_hot(ent))
+    {
+        return; // parked
+    }
+    const std::string &val = cmd[3];
+    if (ent)
+    {
+        entry_str_decode(ent);
+    }
+    if (val.empty())
+    {
+        return out_int(out, ent ? (int64_t)ent->str.size() : 0); // no change
+    }
+    if ((uint64_t)off + val.size() > k_max_str)
+    {
+        return out_err(out, ERR_BAD_ARG, "string exceeds maximum allowed size");
+    }
+    if (!ent)
+    {
+        ent = str_create(cmd[1]);
+    }
+    entry_vlog_forget(ent);
+    if (ent->str.size() < off + val.size())
+    {
+        ent->str.resize(off + val.size(), '\0');
+    }
+    memcpy(&ent->str[off], val.data(), val.size());
+    key_changed("setrange", ent->key);
+    g_data.dirty++;
+    return out_int(out, (int64_t)ent->str.size());
+}
+
+// GETRANGE key start end, inclusive, negative from the end
+void do_getrange(std::vector<std::string> &cmd, Buffer &out)
+{
+    int64_t start = 0, end = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], end))
+    {
+        return out_err(out, ERR_BAD_ARG, "expected int");
+    }
+    Entry *ent = db_find(cmd[1]);
+    if (!ent)
+    {
+        return out_str(out, "", 0);
+    }
+    if (ent->type != T_STR)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a string");
+    }
+    if (!entry_ensure_hot(ent))
+    {
+        return; // parked
+    }
+    std::string tmp;
+    const std::string &str = entry_str(ent, tmp);
+    int64_t len = (int64_t)str.size();
+    start = start < 0 ? std::max<int64_t>(start + len, 0) : start;
+    end = end < 0 ? end + len : std::min(end, len - 1);
+    if (start > end || start >= len)
+    {
+        return out_str(out, "", 0);
+    }
+    return out_str(out, &str[start], (size_t)(end - start + 1));
+}
+
+// STRLEN key, a cold value is not read back
+void do_strlen(std::vector<std::string> &cmd, Buffer &out)
+{
+    Entry *ent = db_find(cmd[1]);
+    if (!ent)
+    {
+        return out_int(out, 0);
+    }
+    if (ent->type != T_STR)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a string");
+    }
+    if (ent->int_enc)
+    {
+        return out_int(out, (int64_t)int2str(ent->ival).size());
+    }
+    return out_int(out, ent->cold ? ent->vlog_len : (int64_t)ent->str.size());
+}
+
+// SETBLOB key size: replies OK, then `size` raw bytes follow the request.
+// they are read into the value, then it is set like SET with a 2nd reply.
+void do_setblob(std::vector<std::string> &cmd, Buffer &out)
+{
+    Conn *conn = g_data.cur_conn;
+    int64_t size = 0;
+    if (!str2int(cmd[2], size) || size < 0 || (uint64_t)size > k_max_str)
+    {
+        return out_err(out, ERR_BAD_ARG, "bad size");
+    }
+    if (!conn || conn->proto >= PROTO_RESP2)
+    {
+        return out_err(out, ERR_BAD_ARG, "SETBLOB is for binary clients");
+    }
+    Entry *ent = db_find(cmd[1]);
+    if (ent && ent->type != T_STR)
+    {
+        return out_err(out, ERR_BAD_TYP, "a non string value exists");
+    }
+    // the SET is logged when the value is complete
+    cmd_propagate_end(true);
+    Upload *up = new Upload();
+    up->req_id = g_data.cur_req_id;
+    up->key.swap(cmd[1]);
+    up->value.resize((size_t)size);
+    conn->upload = up;
+    g_data.uploads++;
+    return out_ok(out);
+}
+
+static void incr_by(std::vector<std::string> &cmd, int64_t delta, Buffer &out)
+{
+    std::lock_guard<std::mutex> lk(snap_mutex);
+    Entry *ent = db_find(cmd[1]);
+    if (ent && ent->type != T_STR)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a string");
+    }
+    if (ent && !entry_ensure_hot(ent))
+    {
+        return; // parked
+    }
+    int64_t val = 0;
+    if (ent && !entry_int(ent, val))
+    {
+        return out_err(out, ERR_BAD_ARG, "value is not an integer or out of range");
+    }
+    if (__builtin_add_overflow(val, delta, &val))
+    {
+        return out_err(out, ERR_BAD_ARG, "increment or decrement would overflow");
+    }
+    if (!ent)
+    {
+        ent = str_create(cmd[1]);
+    }
+    entry_vlog_forget(ent);
+    std::string().swap(ent->str);
+    ent->int_enc = true;
+    ent->ival = val;
+    key_changed("incrby", ent->key);
+    g_data.dirty++;
+    return out_int(out, val);
+}
+
+// INCR key, DECR key
+void do_incr(std::vector<std::string> &cmd, Buffer &out)
+{
+    bool decr = strcasecmp(cmd[0].c_str(), "DECR") == 0;
+    return incr_by(cmd, decr ? -1 : 1, out);
+}
+
+// INCRBY key n, DECRBY key n
+void do_incrby(std::vector<std::string> &cmd, Buffer &out)
+{
+    int64_t n = 0;
+    if (cmd[2].empty() || !str2int(cmd[2], n))
+    {
+        return out_err(out, ERR_BAD_ARG, "expected int");
+    }
+    if (strcasecmp(cmd[0].c_str(), "DECRBY") == 0)
+    {
+        if (n == INT64_MIN)
+        {
+            return out_err(out, ERR_BAD_ARG, "decrement would overflow");
+        }
+        n = -n;
+    }
+    return incr_by(cmd, n, out);
+}
+
+// INCRBYFLOAT key f, logged as a SET of the result
+void do_incrbyfloat(std::vector<std::string> &cmd, Buffer &out)
+{
+    char *endp = NULL;
+    long double incr = strtold(cmd[2].c_str(), &endp);
+    if (cmd[2].empty() || endp != cmd[2].c_str() + cmd[2].size() || !std::isfinite(incr))
+    {
+        return out_err(out, ERR_BAD_ARG, "expected float");
+    }
+    std::lock_guard<std::mutex> lk(snap_mutex);
+    Entry *ent = db_find(cmd[1]);
+    if (ent && ent->type != T_STR)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a string");
+    }
+    if (ent && !entry_ensure_hot(ent))
+    {
+        return; // parked
+    }
+    long double val = 0;
+    if (ent)
+    {
+        std::string tmp;
+        const std::string &str = entry_str(ent, tmp);
+        val = strtold(str.c_str(), &endp);
+        if (str.empty() || endp != str.c_str() + str.size() || isspace((uint8_t)str[0]))
+        {
+            return out_err(out, ERR_BAD_ARG, "value is not a valid float");
+        }
+    }
+    val += incr;
+    if (!std::isfinite(val))
+    {
+        return out_err(out, ERR_BAD_ARG, "increment would produce NaN or Infinity");
+    }
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.17Lg", val);
+    std::string res = buf;
+    if (!ent)
+    {
+        ent = str_create(cmd[1]);
+    }
+    entry_vlog_forget(ent);
+    std::string tmp = res;
+    entry_set_str(ent, tmp);
+    str_del_lazy(tmp); // the old value
+    key_changed("incrbyfloat", ent->key);
+    propagate_replace({"SET", ent->key, res, "KEEPTTL"});
+    g_data.dirty++;
+    return out_str(out, res.data(), res.size());
+}
+
+// rates up to one per us, bursts and periods up to about 30 years
+const double k_throttle_max_us = 1e15;
+
+// THROTTLE key max_burst count period_ms [quantity]
+// GCRA: the key holds the theoretical arrival time (TAT) of the next
+// request. a request that moves it no further than the burst ahead of
+// now is let through. the key expires once the bucket is full again,
+// so an idle limiter takes no memory. replies with
+// [limited, limit, remaining, retry_after_ms, reset_after_ms].
+void do_throttle(std::vector<std::string> &cmd, Buffer &out)
+{
+    int64_t burst = 0, count = 0, period = 0, quantity = 1;
+    if (!str2int(cmd[2], burst) || !str2int(cmd[3], count) || !str2int(cmd[4], period) ||
+        (cmd.size() == 6 && !str2int(cmd[5], quantity)))
+    {
+        return out_err(out, ERR_BAD_ARG, "expected integers");
+    }
+    // the emission interval, the tolerance and the cost, in us
+    double interval = (double)period * 1000 / (double)count;
+    double tolerance = interval * ((double)burst + 1);
+    double cost = interval * (double)quantity;
+    if (burst < 0 || count <= 0 || period <= 0 || quantity < 0 ||
+        tolerance > k_throttle_max_us || cost > k_throttle_max_us)
+    {
+        return out_err(out, ERR_BAD_ARG, "rate out of range");
+    }
+    std::lock_guard<std::mutex> lk(snap_mutex);
+    Entry *ent = db_find(cmd[1]);
+    if (ent && ent->type != T_THROTTLE)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a throttle");
+    }
+    double now = (double)get_wall_usec();
+    double tat = ent ? std::max((double)ent->ival, now) : now;
+    double new_tat = tat + cost;
+    double early = new_tat - tolerance - now; // > 0: too early by that much
+    bool limited = early > 0;
+    double reset = (limited ? tat : new_tat) - now;
+    double left = tolerance - reset;
+    out_arr(out, 5);
+    out_int(out, limited);
+    out_int(out, burst + 1);
+    out_int(out, left > -interval ? (int64_t)(left / interval) : 0);
+    // a cost above the tolerance never goes through
+    out_int(out, !limited ? -1 : cost > tolerance ? -1 : (int64_t)ceil(early / 1000));
+    out_int(out, (int64_t)ceil(reset / 1000));
+    if (limited || cost == 0)
+    {
+        cmd_propagate_end(true); // nothing changed
+        return;
+    }
+    if (!ent)
+    {
+        ent = entry_new(T_THROTTLE);
+        ent->key = cmd[1];
+        ent->node.hcode = str_hash((uint8_t *)ent->key.data(), ent->key.size());
+        hm_insert(&g_data.db, &ent->node);
+    }
+    ent->ival = (int64_t)ceil(new_tat);
+    entry_set_ttl(ent, (int64_t)ceil(reset / 1000));
+    key_changed("throttle", ent->key);
+    g_data.dirty++;
+    // the outcome depends on the clock, the new state is logged
+    Buffer payload;
+    entry_dump(payload, ent, (int64_t)get_wall_msec(), (int64_t)get_monotonic_msec());
+    propagate_replace({"RESTORE", ent->key, std::string(payload.begin(), payload.end()), "REPLACE"});
+}
+
+// a field at `pos` of a packed hash, false at the end
+struct HPacked
+{
+    const char *field = NULL;
+    uint32_t flen = 0;
+    const char *val = NULL;
+    uint32_t vlen = 0;
+    size_t pos = 0;  // of this field
+    size_t next = 0; // of the next one
+};
+
+static bool hpack_at(const std::string &buf, size_t pos, HPacked &it)
+{
+    if (pos >= buf.size())
+    {
+        return false;
+    }
+    it.pos = pos;
+    memcpy(&it.flen, &buf[pos], 4);
+    it.field = &buf[pos + 4];
+    memcpy(&it.vlen, &buf[pos + 4 + it.flen], 4);
+    it.val = &buf[pos + 8 + it.flen];
+    it.next = pos + 8 + it.flen + it.vlen;
+    return true;
+}
+
+static bool hpack_find(const std::string &buf, const std::string &field, HPacked &it)
+{
+    for (size_t pos = 0; hpack_at(buf, pos, it); pos = it.next)
+    {
+        if (it.flen == field.size() && memcmp(it.field, field.data(), it.flen) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void hpack_append(std::string &buf, const char *field, uint32_t flen,
+                  const char *val, uint32_t vlen)
+{
+    buf.append((const char *)&flen, 4);
+    buf.append(field, flen);
+    buf.append((const char *)&vlen, 4);
+    buf.append(val, vlen);
+}
+
+struct HFieldKey
+{
+    HNode node;
+    const char *field = NULL;
+    size_t len = 0;
+};
+
+static bool hfield_eq(HNode *node, HNode *key)
+{
+    HField *hf = container_of(node, HField, node);
+    HFieldKey *hk = container_of(key, HFieldKey, node);
+    return hf->field.size() == hk->len && memcmp(hf->field.data(), hk->field, hk->len) == 0;
+}
+
+static HField *hash_lookup(Entry *ent, const char *field, size_t len)
+{
+    HFieldKey key;
+    key.field = field;
+    key.len = len;
+    key.node.hcode = str_hash((const uint8_t *)field, len);
+    HNode *node = hm_lookup(ent->hash, &key.node, &hfield_eq);
+    return node ? container_of(node, HField, node) : NULL;
+}
+
+void hash_insert(Entry *ent, const char *field, size_t flen, const char *val, size_t vlen)
+{
+    HField *hf = new HField();
+    hf->field.assign(field, flen);
+    hf->val.assign(val, vlen);
+    hf->node.hcode = str_hash((const uint8_t *)field, flen);
+    hm_insert(ent->hash, &hf->node);
+}
+
+size_t hash_len(Entry *ent)
+{
+    if (ent->hash)
+    {
+        return hm_size(ent->hash);
+    }
+    size_t n = 0;
+    HPacked it;
+    for (size_t pos = 0; hpack_at(ent->str, pos, it); pos = it.next)
+    {
+        n++;
+    }
+    return n;
+}
+
+void hash_convert(Entry *ent)
+{
+    size_t n = hash_len(ent);
+    ent->hash = new HMap();
+    hm_reserve(ent->hash, n + 1);
+    HPacked it;
+    for (size_t pos = 0; hpack_at(ent->str, pos, it); pos = it.next)
+    {
+        hash_insert(ent, it.field, it.flen, it.val, it.vlen);
+    }
+    std::string().swap(ent->str);
+}
+
+// NULL if missing, a packed value is copied to `tmp`
+static const std::string *hash_get(Entry *ent, const std::string &field, std::string &tmp)
+{
+    if (ent->hash)
+    {
+        HField *hf = hash_lookup(ent, field.data(), field.size());
+        return hf ? &hf->val : NULL;
+    }
+    HPacked it;
+    if (!hpack_find(ent->str, field, it))
+    {
+        return NULL;
+    }
+    tmp.assign(it.val, it.vlen);
+    return &tmp;
+}
+
+// true if the field is new
+static bool hash_set(Entry *ent, const std::string &field, const std::string &val)
+{
+    if (!ent->hash)
+    {
+        HPacked it;
+        bool found = hpack_find(ent->str, field, it);
+        if (found && it.vlen == val.size())
+        {
+            memcpy(&ent->str[it.pos + 8 + it.flen], val.data(), val.size());
+            return false;
+        }
+        if (found)
+        {
+            ent->str.erase(it.pos, it.next - it.pos);
+        }
+        if (field.size() <= k_hash_packed_max_len && val.size() <= k_hash_packed_max_len &&
+            (found || hash_len(ent) < k_hash_packed_max))
+        {
+            hpack_append(ent->str, field.data(), (uint32_t)field.size(), val.data(), (uint32_t)val.size());
+            return !found;
+        }
+        hash_convert(ent);
+        if (found)
+        {
+            hash_insert(ent, field.data(), field.size(), val.data(), val.size());
+            return false;
+        }
+    }
+    if (HField *hf = hash_lookup(ent, field.data(), field.size()))
+    {
+        hf->val = val;
+        return false;
+    }
+    hash_insert(ent, field.data(), field.size(), val.data(), val.size());
+    return true;
+}
+
+static bool hash_del(Entry *ent, const std::string &field)
+{
+    if (!ent->hash)
+    {
+        HPacked it;
+        if (!hpack_find(ent->str, field, it))
+        {
+            return false;
+        }
+        ent->str.erase(it.pos, it.next - it.pos);
+        return true;
+    }
+    HFieldKey key;
+    key.field = field.data();
+    key.len = field.size();
+    key.node.hcode = str_hash((const uint8_t *)field.data(), field.size());
+    HNode *node = hm_delete(ent->hash, &key.node, &hfield_eq);
+    if (!node)
+    {
+        return false;
+    }
+    delete container_of(node, HField, node);
+    return true;
+}
+
+struct HashForeachCtx
+{
+    HashVisit f;
+    void *arg;
+};
+
+static bool cb_hash_foreach(HNode *node, void *arg)
+{
+    HashForeachCtx *ctx = (HashForeachCtx *)arg;
+    HField *hf = container_of(node, HField, node);
+    ctx->f(hf->field.data(), hf->field.size(), hf->val.data(), hf->val.size(), ctx->arg);
+    return true;
+}
+
+void hash_foreach(Entry *ent, HashVisit f, void *arg)
+{
+    if (ent->hash)
+    {
+        HashForeachCtx ctx = {f, arg};
+        return hm_foreach(ent->hash, &cb_hash_foreach, &ctx);
+    }
+    HPacked it;
+    for (size_t pos = 0; hpack_at(ent->str, pos, it); pos = it.next)
+    {
+        f(it.field, it.flen, it.val, it.vlen, arg);
+    }
+}
+
+// `bad_type` if the key holds something else
+static Entry *hash_find(const std::string &name, bool &bad_type)
+{
+    Entry *ent = db_find(name);
+    bad_type = ent && ent->type != T_HASH;
+    return bad_type ? NULL : ent;
+}
+
+// HSET key field value [field value...], the number of new fields
+void do_hset(std::vector<std::string> &cmd, Buffer &out)
+{
+    if (cmd.size() % 2 != 0)
+    {
+        return out_err(out, ERR_BAD_ARG, "expected field value pairs");
+    }
+    std::lock_guard<std::mutex> lk(snap_mutex);
+    bool bad_type = false;
+    Entry *ent = hash_find(cmd[1], bad_type);
+    if (bad_type)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a hash");
+    }
+    if (!ent)
+    {
+        ent = entry_new(T_HASH);
+        ent->key = cmd[1];
+        ent->node.hcode = str_hash((uint8_t *)ent->key.data(), ent->key.size());
+        hm_insert(&g_data.db, &ent->node);
+    }
+    int64_t added = 0;
+    for (size_t i = 2; i < cmd.size(); i += 2)
+    {
+        added += hash_set(ent, cmd[i], cmd[i + 1]);
+        key_changed("hset", ent->key, &cmd[i]);
+    }
+    g_data.dirty += (cmd.size() - 2) / 2;
+    return out_int(out, added);
+}
+
+// HGET key field
+void do_hget(std::vector<std::string> &cmd, Buffer &out)
+{
+    bool bad_type = false;
+    Entry *ent = hash_find(cmd[1], bad_type);
+    if (bad_type)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a hash");
+    }
+    std::string tmp;
+    const std::string *val = ent ? hash_get(ent, cmd[2], tmp) : NULL;
+    return val ? out_str(out, val->data(), val->size()) : out_nil(out);
+}
+
+// HMGET key field [field...], nil for a missing one
+void do_hmget(std::vector<std::string> &cmd, Buffer &out)
+{
+    bool bad_type = false;
+    Entry *ent = hash_find(cmd[1], bad_type);
+    if (bad_type)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a hash");
+    }
+    out_arr(out, (uint32_t)(cmd.size() - 2));
+    for (size_t i = 2; i < cmd.size(); i++)
+    {
+        std::string tmp;
+        const std::string *val = ent ? hash_get(ent, cmd[i], tmp) : NULL;
+        val ? out_str(out, val->data(), val->size()) : out_nil(out);
+    }
+}
+
+// HDEL key field [field...], the number removed. an empty hash is deleted.
+void do_hdel(std::vector<std::string> &cmd, Buffer &out)
+{
+    std::lock_guard<std::mutex> lk(snap_mutex);
+    bool bad_type = false;
+    Entry *ent = hash_find(cmd[1], bad_type);
+    if (bad_type)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a hash");
+    }
+    int64_t removed = 0;
+    for (size_t i = 2; ent && i < cmd.size(); i++)
+    {
+        if (hash_del(ent, cmd[i]))
+        {
+            removed++;
+            key_changed("hdel", ent->key, &cmd[i]);
+        }
+    }
+    if (removed == 0)
+    {
+        cmd_propagate_end(true); // nothing changed
+        return out_int(out, 0);
+    }
+    if (hash_len(ent) == 0)
+    {
+        LookupKey key;
+        key.key = ent->key;
+        key.node.hcode = ent->node.hcode;
+        db_delete(&key);
+        key_changed("del", key.key);
+        entry_del(ent, true);
+    }
+    g_data.dirty += removed;
+    return out_int(out, removed);
+}
+
+// HLEN key
+void do_hlen(std::vector<std::string> &cmd, Buffer &out)
+{
+    bool bad_type = false;
+    Entry *ent = hash_find(cmd[1], bad_type);
+    if (bad_type)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a hash");
+    }
+    return out_int(out, ent ? (int64_t)hash_len(ent) : 0);
+}
+
+static void cb_hgetall(const char *field, size_t flen, const char *val, size_t vlen, void *arg)
+{
+    Buffer &out = *(Buffer *)arg;
+    out_str(out, field, flen);
+    out_str(out, val, vlen);
+}
+
+// HGETALL key, [field, value, ...]
+void do_hgetall(std::vector<std::string> &cmd, Buffer &out)
+{
+    bool bad_type = false;
+    Entry *ent = hash_find(cmd[1], bad_type);
+    if (bad_type)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a hash");
+    }
+    if (!ent)
+    {
+        return out_arr(out, 0);
+    }
+    out_arr(out, (uint32_t)(hash_len(ent) * 2));
+    hash_foreach(ent, &cb_hgetall, &out);
+}
+
+// HINCRBY key field n, the new value
+void do_hincrby(std::vector<std::string> &cmd, Buffer &out)
+{
+    int64_t incr = 0;
+    if (!str_is_int(cmd[3], incr))
+    {
+        return out_err(out, ERR_BAD_ARG, "expected int64");
+    }
+    std::lock_guard<std::mutex> lk(snap_mutex);
+    bool bad_type = false;
+    Entry *ent = hash_find(cmd[1], bad_type);
+    if (bad_type)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a hash");
+    }
+    int64_t val = 0;
+    std::string tmp;
+    const std::string *old = ent ? hash_get(ent, cmd[2], tmp) : NULL;
+    if (old && !str_is_int(*old, val))
+    {
+        return out_err(out, ERR_BAD_ARG, "hash value is not an integer");
+    }
+    if (__builtin_add_overflow(val, incr, &val))
+    {
+        return out_err(out, ERR_BAD_ARG, "increment or decrement would overflow");
+    }
+    if (!ent)
+    {
+        ent = entry_new(T_HASH);
+        ent->key = cmd[1];
+        ent->node.hcode = str_hash((uint8_t *)ent->key.data(), ent->key.size());
+        hm_insert(&g_data.db, &ent->node);
+    }
+    hash_set(ent, cmd[2], int2str(val));
+    key_changed("hincrby", ent->key, &cmd[2]);
+    g_data.dirty++;
+    return out_int(out, val);
+}
+
+struct HScanCtx
+{
+    Buffer *out = NULL;
+    const std::string *pattern = NULL; // MATCH, NULL for all
+    uint32_t n = 0;                    // fields sent
+};
+
+static void cb_hscan(const char *field, size_t flen, const char *val, size_t vlen, void *arg)
+{
+    HScanCtx *ctx = (HScanCtx *)arg;
+    if (ctx->pattern && !glob_match(*ctx->pattern, std::string(field, flen)))
+    {
+        return;
+    }
+    out_str(*ctx->out, field, flen);
+    out_str(*ctx->out, val, vlen);
+    ctx->n++;
+}
+
+static void cb_hscan_node(HNode *node, void *arg)
+{
+    HField *hf = container_of(node, HField, node);
+    cb_hscan(hf->field.data(), hf->field.size(), hf->val.data(), hf->val.size(), arg);
+}
+
+// HSCAN key cursor [MATCH pattern] [COUNT n], [next cursor, [field, value, ...]].
+// a packed hash is sent whole. a field present for the whole scan is
+// sent at least once.
+void do_hscan(std::vector<std::string> &cmd, Buffer &out)
+{
+    int64_t cursor = 0, count = 10;
+    if (!str2int(cmd[2], cursor) || cursor < 0)
+    {
+        return out_err(out, ERR_BAD_ARG, "bad cursor");
+    }
+    const std::string *pattern = NULL;
+    for (size_t i = 3; i < cmd.size(); i += 2)
+    {
+        if (i + 1 == cmd.size())
+        {
+            return out_err(out, ERR_BAD_ARG, "syntax error");
+        }
+        if (strcasecmp(cmd[i].c_str(), "MATCH") == 0)
+        {
+            pattern = cmd[i + 1] == "*" ? NULL : &cmd[i + 1];
+        }
+        else if (strcasecmp(cmd[i].c_str(), "COUNT") != 0 || !str2int(cmd[i + 1], count) || count <= 0)
+        {
+            return out_err(out, ERR_BAD_ARG, "syntax error");
+        }
+    }
+    bool bad_type = false;
+    Entry *ent = hash_find(cmd[1], bad_type);
+    if (bad_type)
+    {
+        return out_err(out, ERR_BAD_TYP, "not a hash");
+    }
+    Buffer fields;
+    HScanCtx ctx;
+    ctx.out = &fields;
+    ctx.pattern = pattern;
+    uint64_t next = 0;
+    if (ent && !ent->hash)
+    {
+        hash_foreach(ent, &cb_hscan, &ctx);
+    }
+    else if (ent)
+    {
+        // `count` is a hint, a slot is sent whole
+        next = (uint64_t)cursor;
+        do
+        {
+            next = hm_scan(ent->hash, next, &cb_hscan_node, &ctx);
+        } while (next != 0 && ctx.n < (uint64_t)count);
+    }
+    std::string next_str = std::to_string(next);
+    out_arr(out, 2);
+    out_str(out, next_str.data(), next_str.size());
+    out_arr(out, ctx.n * 2);
+    out.insert(out.end(), fields.begin(), fields.end());
+}
+
+// PEXPIRE key ttl_ms
+void do_expire(std::vector<std::string> &cmd, Buffer &out)
+{
+    int64_t ttl_ms = 0;
+    if (!str2int(cmd[2], ttl_ms))
+    {
+        return out_err(out, ERR_BAD_ARG, "expected int64");
+    }
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = db_lookup(&key);
+    if (node)
+    {
+        Entry *ent = container_of(node, Entry, node);
+        entry_set_ttl(ent, ttl_ms);
+        g_data.dirty++;
+        if (ttl_ms >= 0)
+        {
+            propagate_replace({"PEXPIREAT", ent->key, int2str(get_wall_msec() + ttl_ms)});
+        }
+    }
+    return out_int(out, node ? 1 : 0);
+}
+
+// PEXPIREAT key unix_ms
+void do_expireat(std::vector<std::string> &cmd, Buffer &out)
+{
+    int64_t at_ms = 0;
+    if (!str2int(cmd[2], at_ms))
+    {
+        return out_err(out, ERR_BAD_ARG, "expected int64");
+    }
+    int64_t ttl_ms = at_ms - (int64_t)get_wall_msec();
+    cmd[2] = int2str(ttl_ms < 0 ? 0 : ttl_ms);
+    return do_expire(cmd, out);
+}
+
+// PTTL key
+void do_ttl(std::vector<std::string> &cmd, Buffer &out)
+{
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = db_lookup(&key);
+    if (!node)
+    {
+        return out_int(out, -2); // key not found
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->heap_idx == (size_t)-1)
+    {
+        return out_int(out, -1); // no TTL
+    }
+    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+    uint64_t now_ms = get_monotonic_msec();
+    return out_int(out, expire_at > now_ms ? (expire_at - now_ms) : 0);
+}
+
+static bool stream_allowed(Conn *conn);
+static void stream_begin(StreamJob *job, ZNode *znode, Buffer &out);
+
+static bool cb_keys(HNode *node, void *arg)
+{
+    Buffer &out = *(Buffer *)arg;
+    const std::string &key = container_of(node, Entry, node)->key;
+    out_str(out, key.data(), key.size());
+    return true;
+}
+
+void do_keys(std::vector<std::string> &cmd, Buffer &out)
+{
+    if (cmd.size() != 1)
+    {
+        return out_err(out, ERR_UNKNOWN, "KEYS command requires no arguments");
+    }
+    img_adopt_all();
+    if (stream_allowed(g_data.cur_conn))
+    {
+        return stream_begin(new StreamJob(), NULL, out);
+    }
+    out_arr(out, (uint32_t)hm_size(&g_data.db));
+    hm_foreach(&g_data.db, &cb_keys, (void *)&out);
+}
+
+static bool str2dbl(const std::string &s, double &out)
+{
+    char *endp = NULL;
+    out = strtod(s.c_str(), &endp);
+    return endp == s.c_str() + s.size() && !isnan(out);
+}
+
+// zadd zset score name
+// zadd zset score name [score name...]
+void do_zadd(std::vector<std::string> &cmd, Buffer &out)
+{
+    std::lock_guard<std::mutex> lk(snap_mutex);
+    if (cmd.size() % 2 != 0)
+    {
+        return out_err(out, ERR_BAD_ARG, "expected score name pairs");
+    }
+    std::vector<double> scores(cmd.size() / 2 - 1);
+    for (size_t i = 0; i < scores.size(); i++)
+    {
+        if (!str2dbl(cmd[2 + 2 * i], scores[i]))
+        {
+            return out_err(out, ERR_BAD_ARG, "expected float");
+        }
+    }
+    // lookup or create zset
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key);
+
+    Entry *ent = NULL;
+    if (!hnode)
+    { // insert new key
+        ent = entry_new(T_ZSET);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        hm_insert(&g_data.db, &ent->node);
+    }
     else
     { // check existing key
         ent = container_of(hnode, Entry, node);
@@ -592,10 +1932,16 @@ void do_zadd(std::vector<std::string> &cmd, Buffer &out)
         }
     }
 
-    // add or update tuple
-    const std::string &name = cmd[3];
-    bool added = zset_insert(&ent->zset, name.data(), name.size(), score);
-    return out_int(out, (int16_t)added);
+    // add or update tuples
+    int64_t added = 0;
+    for (size_t i = 0; i < scores.size(); i++)
+    {
+        const std::string &name = cmd[3 + 2 * i];
+        added += zset_insert(&ent->zset, name.data(), name.size(), scores[i]);
+        key_changed("zadd", ent->key, &name);
+    }
+    g_data.dirty += scores.size();
+    return out_int(out, added);
 }
 
 static const ZSet k_empty_zset;
@@ -605,7 +1951,7 @@ static ZSet *expect_zset(std::string &s)
     LookupKey key;
     key.key.swap(s);
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    HNode *hnode = db_lookup(&key);
     if (!hnode)
     { // a non-existent key is treated as an empty zset
         return (ZSet *)&k_empty_zset;
@@ -628,10 +1974,95 @@ void do_zrem(std::vector<std::string> &cmd, Buffer &out)
     if (node)
     {
         zset_delete(zset, node);
+        g_data.dirty++;
+        key_changed("zrem", container_of(zset, Entry, zset)->key, &name);
     }
     return out_int(out, node ? 1 : 0);
 }
 
+static Entry *expect_zset_entry(std::string &s, bool &bad_type)
+{
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key);
+    if (!hnode)
+    {
+        return NULL;
+    }
+    Entry *ent = container_of(hnode, Entry, node);
+    bad_type = ent->type != T_ZSET;
+    return bad_type ? NULL : ent;
+}
+
+// zpexpire zset name ttl_ms
+void do_zexpire(std::vector<std::string> &cmd, Buffer &out)
+{
+    int64_t ttl_ms = 0;
+    if (!str2int(cmd[3], ttl_ms))
+    {
+        return out_err(out, ERR_BAD_ARG, "expected int64");
+    }
+    bool bad_type = false;
+    Entry *ent = expect_zset_entry(cmd[1], bad_type);
+    if (bad_type)
+    {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    const std::string &name = cmd[2];
+    ZNode *znode = ent ? zset_lookup(&ent->zset, name.data(), name.size()) : NULL;
+    if (znode)
+    {
+        int64_t expire_at = ttl_ms < 0 ? -1 : (int64_t)(get_monotonic_msec() + ttl_ms);
+        zset_set_expire(&ent->zset, znode, expire_at);
+        entry_sync_zexpire(ent);
+        g_data.dirty++;
+        if (ttl_ms >= 0)
+        {
+            propagate_replace({"ZPEXPIREAT", ent->key, name,
+                               int2str(get_wall_msec() + ttl_ms)});
+        }
+    }
+    return out_int(out, znode ? 1 : 0);
+}
+
+// zpexpireat zset name unix_ms
+void do_zexpireat(std::vector<std::string> &cmd, Buffer &out)
+{
+    int64_t at_ms = 0;
+    if (!str2int(cmd[3], at_ms))
+    {
+        return out_err(out, ERR_BAD_ARG, "expected int64");
+    }
+    int64_t ttl_ms = at_ms - (int64_t)get_wall_msec();
+    cmd[3] = int2str(ttl_ms < 0 ? 0 : ttl_ms);
+    return do_zexpire(cmd, out);
+}
+
+// zpttl zset name
+void do_zttl(std::vector<std::string> &cmd, Buffer &out)
+{
+    bool bad_type = false;
+    Entry *ent = expect_zset_entry(cmd[1], bad_type);
+    if (bad_type)
+    {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    const std::string &name = cmd[2];
+    ZNode *znode = ent ? zset_lookup(&ent->zset, name.data(), name.size()) : NULL;
+    if (!znode)
+    {
+        return out_int(out, -2); // member not found
+    }
+    if (znode->heap_idx == (size_t)-1)
+    {
+        return out_int(out, -1); // no TTL
+    }
+    uint64_t expire_at = ent->zset.heap[znode->heap_idx].val;
+    uint64_t now_ms = get_monotonic_msec();
+    return out_int(out, expire_at > now_ms ? (expire_at - now_ms) : 0);
+}
+
 // zscore zset name
 void do_zscore(std::vector<std::string> &cmd, Buffer &out)
 {
@@ -663,6 +2094,7 @@ void do_zquery(std::vector<std::string> &cmd, Buffer &out)
     }
 
     // get zset
+    std::string key = cmd[1];
     ZSet *zset = expect_zset(cmd[1]);
     if (!zset)
     {
@@ -675,6 +2107,14 @@ void do_zquery(std::vector<std::string> &cmd, Buffer &out)
     }
     ZNode *znode = zset_seekge(zset, score, name.data(), name.size());
     znode = znode_offset(znode, offset);
+    if (stream_allowed(g_data.cur_conn))
+    {
+        StreamJob *job = new StreamJob();
+        job->zquery = true;
+        job->key.swap(key);
+        job->left = limit;
+        return stream_begin(job, znode, out);
+    }
 
     // output
     size_t ctx = out_begin_arr(out);
@@ -688,121 +2128,321 @@ void do_zquery(std::vector<std::string> &cmd, Buffer &out)
     }
     out_end_arr(out, ctx, (uint32_t)n);
 }
-void save_zset(std::ofstream &out, ZSet *zset)
+
+// streamed replies: each chunk but the last is TAG_MORE followed by an
+// array, the last one is a plain array. the client concatenates them.
+const size_t k_stream_chunk = 256 * 1024;
+
+struct StreamOut
+{
+    Buffer *out = NULL;
+    uint32_t n = 0;
+};
+
+static void cb_stream_key(HNode *node, void *arg)
+{
+    StreamOut *so = (StreamOut *)arg;
+    const std::string &key = container_of(node, Entry, node)->key;
+    out_str(*so->out, key.data(), key.size());
+    so->n++;
+}
+
+// a key may be listed twice if the keyspace grows meanwhile
+static bool stream_keys(StreamJob *job, StreamOut &so)
 {
-    uint32_t count = (uint32_t)hm_size(&zset->hmap);
-    out.write((char *)&count, sizeof(count));
-    zset_foreach(zset, [](ZNode *z, void *arg)
-                 {
-        std::ofstream &out = *(std::ofstream *)arg;
-        out.write((char *)&z->score, sizeof(z->score));
-        uint32_t len = (uint32_t)z->len;
-        out.write((char*)&len, sizeof(len));
-        out.write(z->name, len); }, &out);
+    size_t limit = so.out->size() + k_stream_chunk;
+    do
+    {
+        job->cursor = hm_scan(&g_data.db, job->cursor, &cb_stream_key, &so);
+    } while (job->cursor != 0 && so.out->size() < limit);
+    return job->cursor == 0;
 }
-static void load_zset(std::ifstream &in, ZSet *zset)
+
+// from `znode`, or where the last chunk stopped
+static bool stream_zquery(StreamJob *job, ZNode *znode, StreamOut &so)
 {
-    uint32_t count = 0;
-    in.read((char *)&count, sizeof(count));
-    for (uint32_t i = 0; i < count; i++)
+    if (!znode)
     {
-        double score = 0;
-        in.read((char *)&score, sizeof(score));
-        uint32_t len = 0;
-        in.read((char *)&len, sizeof(len));
-        std::string name(len, '\0');
-        in.read(&name[0], len);
-        zset_insert(zset, name.data(), len, score);
+        std::string key = job->key;
+        ZSet *zset = expect_zset(key);
+        if (!zset)
+        {
+            return true; // replaced meanwhile
+        }
+        znode = zset_seekge(zset, job->score, job->name.data(), job->name.size());
+        if (znode && znode->score == job->score && znode->len == job->name.size() &&
+            memcmp(znode->name, job->name.data(), znode->len) == 0)
+        {
+            znode = znode_offset(znode, 1); // already sent
+        }
+    }
+    size_t limit = so.out->size() + k_stream_chunk;
+    while (znode && job->left > 0 && so.out->size() < limit)
+    {
+        out_str(*so.out, znode->name, znode->len);
+        out_dbl(*so.out, znode->score);
+        so.n += 2;
+        job->left -= 2;
+        job->score = znode->score;
+        job->name.assign(znode->name, znode->len);
+        znode = znode_offset(znode, 1);
     }
+    return !znode || job->left <= 0;
 }
-static bool save_snapshot(const char *filename)
+
+// appends the next chunk, true if it is the last one
+static bool stream_chunk(StreamJob *job, ZNode *znode, Buffer &out)
 {
-    std::lock_guard<std::mutex> lk(snap_mutex);
-    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
-    if (!out)
-        return false;
-    uint32_t n = (uint32_t)hm_size(&g_data.db);
-    out.write((char *)&n, sizeof(n));
-    hm_foreach(&g_data.db, [](HNode *node, void *arg)
-               {
-        std::ofstream &out = *(std::ofstream *)arg;
-        Entry *ent = container_of(node, Entry, node);
+    size_t start = out.size();
+    out.push_back(TAG_MORE);
+    StreamOut so;
+    so.out = &out;
+    size_t ctx = out_begin_arr(out);
+    bool done = job->zquery ? stream_zquery(job, znode, so) : stream_keys(job, so);
+    out_end_arr(out, ctx, so.n);
+    if (done)
+    {
+        out.erase(out.begin() + start);
+    }
+    return done;
+}
+
+// binary clients only, one stream at a time
+static bool stream_allowed(Conn *conn)
+{
+    return conn && conn->streaming && !conn->stream && !g_data.atomic;
+}
 
-        uint32_t klen = (uint32_t)ent->key.size();
-        out.write((char*)&klen, sizeof(klen));
-        out.write(ent->key.data(), klen);
+// the first chunk is the reply of the command
+static void stream_begin(StreamJob *job, ZNode *znode, Buffer &out)
+{
+    if (stream_chunk(job, znode, out))
+    {
+        delete job;
+        return;
+    }
+    job->req_id = g_data.cur_req_id;
+    g_data.cur_conn->stream = job;
+    g_data.streams++;
+}
 
-        out.write((char*)&ent->type, sizeof(ent->type));
-        if(ent->type == T_STR) {
-            uint32_t vlen = (uint32_t)ent->str.size();
-            out.write((char*)&vlen, sizeof(vlen));
-            out.write(ent->str.data(), vlen);
+bool write_all(int fd, const uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t rv = write(fd, data, size);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
         }
-        else if(ent->type == T_ZSET) { 
-            save_zset(out, &ent->zset);
+        if (rv <= 0)
+        {
+            return false;
         }
-        return true; }, &out);
+        data += rv;
+        size -= (size_t)rv;
+    }
     return true;
 }
 
-void do_save(std::vector<std::string> &, Buffer &out)
+// PING [message]
+void do_ping(std::vector<std::string> &cmd, Buffer &out)
 {
-    if (save_snapshot("photon.rdb"))
-        out_ok(out);
-    else
-        out_err(out, ERR_UNKNOWN, "save failed");
+    if (cmd.size() == 2)
+    {
+        return out_str(out, cmd[1].data(), cmd[1].size());
+    }
+    return out_str(out, "PONG", 4);
 }
-static bool load_snapshot(const char *filename)
-{
-    std::lock_guard<std::mutex> lk(snap_mutex);
 
-    std::ifstream in(filename, std::ios::binary);
-    if (!in)
-        return false;
+// HELLO [2|3], picks the RESP version of the connection
+void do_hello(std::vector<std::string> &cmd, Buffer &out)
+{
+    Conn *conn = g_data.cur_conn;
+    int64_t ver = conn ? conn->proto : PROTO_BIN;
+    if (cmd.size() == 2 && (!str2int(cmd[1], ver) || ver < PROTO_RESP2 || ver > PROTO_RESP3))
+    {
+        return out_err(out, ERR_BAD_ARG, "unsupported protocol version");
+    }
+    if (conn && conn->proto == PROTO_BIN && ver != PROTO_BIN)
+    {
+        return out_err(out, ERR_BAD_ARG, "HELLO is for RESP clients");
+    }
+    if (conn)
+    {
+        conn->proto = (int)ver;
+    }
+    out_arr(out, 6);
+    out_str(out, "server", 6);
+    out_str(out, "photon", 6);
+    out_str(out, "proto", 5);
+    out_int(out, ver);
+    out_str(out, "id", 2);
+    out_int(out, conn ? (int64_t)conn->id : 0);
+}
 
-    // clear current db
-    hm_clear(&g_data.db);
-    uint32_t n = 0;
-    in.read((char *)&n, sizeof(n));
-    for (uint32_t i = 0; i < n; i++)
+// PROTO 2, switches our protocol to v2 frames after this reply
+void do_proto(std::vector<std::string> &cmd, Buffer &out)
+{
+    Conn *conn = g_data.cur_conn;
+    if (cmd[1] != "2")
     {
-        uint32_t klen = 0;
-        in.read((char *)&klen, sizeof(klen));
-        std::string key(klen, '\0');
-        in.read(&key[0], klen);
+        return out_err(out, ERR_BAD_ARG, "unsupported protocol version");
+    }
+    if (!conn || conn->proto != PROTO_BIN || conn->repl_state != REPL_NONE)
+    {
+        return out_err(out, ERR_BAD_ARG, "PROTO is for binary clients");
+    }
+    conn->proto = PROTO_V2;
+    out_ok(out);
+}
+
+void do_zap(std::vector<std::string> &, Buffer &out)
+{
+    out_str(out, "ZING", 4);
+}
+
+static void info_add(std::string &s, const char *name, uint64_t val)
+{
+    char line[128];
+    snprintf(line, sizeof(line), "%s:%llu\n", name, (unsigned long long)val);
+    s += line;
+}
 
-        uint32_t type = 0;
-        in.read((char *)type, sizeof(type));
-        Entry *ent = entry_new(type);
-        ent->key = key;
-        ent->node.hcode = str_hash((uint8_t *)key.data(), key.size());
+static void info_add_str(std::string &s, const char *name, const char *val)
+{
+    s += name;
+    s += ':';
+    s += val;
+    s += '\n';
+}
 
-        if (type == T_STR)
+// INFO, server metrics as "name:value" lines
+void do_info(std::vector<std::string> &, Buffer &out)
+{
+    std::string s;
+    info_add(s, "keys", hm_size(&g_data.db) + g_data.img_pending);
+    info_add(s, "image_keys_pending", g_data.img_pending);
+    info_add(s, "used_memory", used_memory());
+    info_add(s, "maxmemory", g_data.maxmemory);
+    info_add(s, "tier_cold_keys", g_data.tier_cold_keys);
+    info_add(s, "tier_spills", g_data.tier_spills);
+    info_add(s, "tier_cold_reads", g_data.tier_cold_reads);
+    info_add(s, "tier_cold_reads_in_flight", g_data.cold_reads.size());
+    info_add(s, "tier_compactions", g_data.tier_compactions);
+    uint64_t nsegs = 0, vlog_bytes = 0, vlog_garbage = 0;
+    for (VlogSeg *seg : g_data.vlog_segs)
+    {
+        if (seg)
         {
-            uint32_t vlen = 0;
-            in.read((char *)vlen, sizeof(vlen));
-            ent->str.resize(vlen);
-            in.read(&ent->str[0], vlen);
+            nsegs++;
+            vlog_bytes += seg->size;
+            vlog_garbage += seg->garbage;
         }
-        else if (type == T_ZSET)
+    }
+    info_add(s, "vlog_segments", nsegs);
+    info_add(s, "vlog_bytes", vlog_bytes);
+    info_add(s, "vlog_garbage_bytes", vlog_garbage);
+    info_add(s, "expires", g_data.heap.size());
+
+    info_add(s, "rdb_changes_since_last_save", g_data.dirty);
+    info_add(s, "rdb_bgsave_in_progress", g_data.child_type == CHILD_SAVE);
+    info_add(s, "rdb_bgsave_keys_total", g_data.save_progress->keys_total);
+    info_add(s, "rdb_bgsave_keys_done", g_data.save_progress->keys_done);
+    info_add(s, "rdb_last_save_time", g_data.last_save_time);
+    info_add_str(s, "rdb_last_bgsave_status", g_data.last_save_ok ? "ok" : "err");
+
+    info_add(s, "aof_enabled", g_data.aof_on);
+    info_add(s, "aof_segment", g_data.aof_seq);
+    info_add(s, "aof_buffer_length", g_data.aof_buf.size());
+    info_add(s, "aof_written_bytes", g_data.aof_written);
+    info_add(s, "aof_synced_bytes", g_data.aof_synced);
+    info_add(s, "aof_pending_jobs", g_data.aof_jobs.size());
+    info_add(s, "aof_current_size", g_data.aof_size);
+    info_add(s, "aof_base_size", g_data.aof_rewrite_base_size);
+    info_add(s, "aof_rewrite_in_progress", g_data.child_type == CHILD_AOF_REWRITE);
+    info_add(s, "aof_rewrite_scheduled", g_data.aof_rewrite_scheduled);
+    info_add_str(s, "aof_last_rewrite_status", g_data.aof_last_rewrite_ok ? "ok" : "err");
+
+    info_add(s, "cluster_enabled", g_data.cluster_on);
+    if (g_data.cluster_on)
+    {
+        uint64_t owned = 0, assigned = 0, migrating = 0, importing = 0;
+        for (uint32_t slot = 0; slot < k_cluster_slots; slot++)
         {
-            load_zset(in, &ent->zset);
+            owned += g_data.slot_owner[slot] == 0;
+            assigned += g_data.slot_owner[slot] >= 0;
+            migrating += g_data.slot_migrating[slot] >= 0;
+            importing += g_data.slot_importing[slot] >= 0;
         }
-        hm_insert(&g_data.db, &ent->node);
+        info_add_str(s, "cluster_myself", g_data.cluster_nodes[0].c_str());
+        info_add(s, "cluster_slots_owned", owned);
+        info_add(s, "cluster_slots_assigned", assigned);
+        info_add(s, "cluster_slots_migrating", migrating);
+        info_add(s, "cluster_slots_importing", importing);
+    }
+
+    info_add(s, "pubsub_channels", hm_size(&g_data.channels));
+    info_add(s, "pubsub_patterns", hm_size(&g_data.patterns));
+    info_add(s, "pubsub_messages", g_data.pubsub_messages);
+    info_add(s, "pubsub_dropped_subscribers", g_data.pubsub_dropped);
+    info_add(s, "cdc_prefixes", hm_size(&g_data.cdc.map));
+    info_add(s, "cdc_events", g_data.cdc_events);
+    info_add(s, "cdc_events_dropped", g_data.cdc_dropped);
+    info_add(s, "tracking_clients", g_data.tracking_clients);
+    info_add(s, "tracking_total_keys", hm_size(&g_data.tracking));
+    info_add(s, "tracking_invalidations", g_data.tracking_invalidations);
+    info_add(s, "tracking_overflows", g_data.tracking_overflows);
+    info_add(s, "v2_late_replies", g_data.v2_late);
+    info_add(s, "v2_expired", g_data.v2_expired);
+    info_add(s, "v2_keys_scans", g_data.keys_jobs.size());
+    info_add(s, "streamed_replies", g_data.streams);
+    info_add(s, "blob_uploads", g_data.uploads);
+    info_add(s, "tx_execs", g_data.tx_execs);
+    info_add(s, "tx_aborts", g_data.tx_aborts);
+    info_add(s, "scripts_cached", g_data.scripts.size());
+    info_add(s, "script_runs", g_data.script_runs);
+    info_add(s, "script_budget_aborts", g_data.script_budget_aborts);
+
+    uint64_t nreplicas = 0, nsyncing = 0;
+    for (Conn *conn : g_data.fd2conn)
+    {
+        nreplicas += conn && conn->repl_state == REPL_ONLINE;
+        nsyncing += conn && (conn->repl_state == REPL_WAIT_SYNC || conn->repl_state == REPL_SENDING);
+    }
+    info_add_str(s, "role", g_data.master_host.empty() ? "master" : "replica");
+    info_add(s, "connected_replicas", nreplicas);
+    info_add(s, "replicas_syncing", nsyncing);
+    info_add_str(s, "repl_id", g_data.replid.c_str());
+    info_add(s, "repl_offset", g_data.repl_off);
+    info_add(s, "repl_backlog_size", g_data.repl_backlog.size());
+    info_add(s, "repl_backlog_histlen", g_data.repl_backlog_histlen);
+    if (!g_data.master_host.empty())
+    {
+        Conn *link = g_data.repl_link;
+        info_add_str(s, "master_host", g_data.master_host.c_str());
+        info_add(s, "master_port", g_data.master_port);
+        info_add_str(s, "master_link_status",
+                     link && link->repl_state == REPL_LINK_ONLINE ? "up" : "down");
+        info_add(s, "master_sync_in_progress", link && link->repl_state == REPL_LINK_TRANSFER);
+        info_add(s, "master_sync_received_bytes", g_data.repl_transfer_bytes);
+        info_add_str(s, "master_repl_id", g_data.master_replid.c_str());
+        info_add(s, "master_repl_offset", g_data.master_off);
     }
-    return true;
-}
-void do_load(std::vector<std::string> &, Buffer &out)
-{
-    if (load_snapshot("photon.rdb"))
-        out_ok(out);
-    else
-        out_err(out, ERR_UNKNOWN, "load failed");
-}
 
-void do_zap(std::vector<std::string> &, Buffer &out)
-{
-    out_str(out, "ZING", 4);
+    ThreadPoolStats st;
+    thread_pool_stats(&g_data.thread_pool, &st);
+    uint64_t ntasks = st.completed ? st.completed : 1;
+    info_add(s, "pool_threads", g_data.thread_pool.workers.size());
+    info_add(s, "pool_queued_critical", st.queued[PRIO_CRITICAL]);
+    info_add(s, "pool_queued_background", st.queued[PRIO_BACKGROUND]);
+    info_add(s, "pool_completed", st.completed);
+    info_add(s, "pool_steals", st.steals);
+    info_add(s, "pool_wait_us_avg", st.wait_us_total / ntasks);
+    info_add(s, "pool_wait_us_max", st.wait_us_max);
+    info_add(s, "pool_run_us_avg", st.run_us_total / ntasks);
+    info_add(s, "pool_run_us_max", st.run_us_max);
+    out_str(out, s.data(), s.size());
 }
 
 // void do_request(std::vector<std::string> &cmd, Buffer &out)
@@ -871,7 +2511,7 @@ void do_zap(std::vector<std::string> &, Buffer &out)
 //     }
 // }
 
-static void response_begin(Buffer &out, size_t *header)
+void response_begin(Buffer &out, size_t *header)
 {
     *header = out.size();   // msg header position
     buf_append_u32(out, 0); // reserve space for header
@@ -882,7 +2522,7 @@ static size_t response_size(Buffer &out, size_t header)
     return out.size() - header - 4;
 }
 
-static void response_end(Buffer &out, size_t header)
+void response_end(Buffer &out, size_t header)
 {
     size_t msg_size = response_size(out, header);
     if (msg_size > k_max_msg)
@@ -896,18 +2536,13 @@ static void response_end(Buffer &out, size_t header)
     memcpy(&out[header], &len, 4);
 }
 
-// process 1 req if enough data
-static bool try_one_request(Conn *conn)
+// the request at the front of `incoming`, its size or 0
+static size_t bin_parse(Conn *conn, std::vector<std::string> &cmd)
 {
-    // fprintf(stderr, "try_one_request: Incoming buffer size: %zu\n", conn->incoming.size());
-    // for (size_t i = 0; i < conn->incoming.size(); i++)
-    // {
-    //     fprintf(stderr, "%02x ", conn->incoming[i]);
-    // }
     // try to parse header
     if (conn->incoming.size() < 4)
     {
-        return false; // not enough data
+        return 0; // not enough data
     }
 
     uint32_t len = 0;
@@ -917,75 +2552,570 @@ static bool try_one_request(Conn *conn)
     {
         msg("too long");
         conn->want_close = true;
+        return 0;
+    }
+    size_t expected_size = req_size(conn->incoming.data(), conn->incoming.size());
+    if (expected_size == 0)
+    {
+        return 0;
+    }
+    const uint8_t *request = &conn->incoming[0];
+
+    // got one request, do application logic
+    if (parse_req(request, expected_size, cmd) < 0)
+    {
+        msg("bad request");
+        conn->want_close = true;
+        return 0;
+    }
+    return expected_size;
+}
+
+// the same for a RESP client
+static size_t resp_conn_parse(Conn *conn, std::vector<std::string> &cmd)
+{
+    if (conn->incoming.size() < conn->resp_need)
+    {
+        return 0; // the rest of a big bulk string
+    }
+    int64_t rv = resp_parse(conn->incoming.data(), conn->incoming.size(), cmd,
+                            conn->resp_need);
+    if (rv < 0)
+    {
+        msg("bad RESP request");
+        conn->want_close = true;
+        return 0;
+    }
+    return (size_t)rv;
+}
+
+// protocol v2 frames, after PROTO 2:
+//   request:  len:u32 id:u32 flags:u32 timeout_ms:u32 nstr:u32 (len:u32 str)...
+//   response: len:u32 id:u32 flags:u32 tagged body
+// replies may come in any order, pushes have id 0.
+const size_t k_v2_req_header = 12;
+enum
+{
+    V2_REQ_DEADLINE = 1 << 0, // drop it if not started within timeout_ms
+};
+
+void v2_frame(Buffer &out, uint32_t id, uint32_t flags, const uint8_t *body, size_t size)
+{
+    buf_append_u32(out, (uint32_t)(8 + size));
+    buf_append_u32(out, id);
+    buf_append_u32(out, flags);
+    buf_append(out, body, size);
+}
+
+// process 1 req if enough data
+
+// runs a parsed request, false if it waits for a cold value and did nothing
+static bool run_request(Conn *conn, std::vector<std::string> &cmd, Buffer &out)
+{
+    size_t aof_len = g_data.aof_buf.size();
+    bool asking = conn->asking;
+    g_data.cur_conn = conn;
+    do_request(cmd, out);
+    g_data.cur_conn = NULL;
+    if (g_data.parked)
+    {
+        g_data.parked = false;
         return false;
     }
-    size_t expected_size = 4;
-    const uint8_t *cur = &conn->incoming[4];
-    const uint8_t *end = &conn->incoming[conn->incoming.size()];
+    if (asking)
+    {
+        conn->asking = false; // only for one command
+    }
+    if (g_data.aof_on && g_data.aof_buf.size() > aof_len)
+    {
+        conn->aof_wait = g_data.aof_written + g_data.aof_buf.size();
+    }
+    return true;
+}
 
-    for (uint32_t i = 0; i < len; i++)
+// the reply appended to `outgoing` at `reply_pos` is complete
+static void conn_reply_added(Conn *conn, size_t reply_pos)
+{
+    if (!conn->pubq.empty())
     {
-        uint32_t str_len = 0;
-        if (cur + 4 > end)
+        // behind the queued messages
+        PubMsg *m = new PubMsg();
+        m->data.assign(conn->outgoing.begin() + reply_pos, conn->outgoing.end());
+        conn->outgoing.resize(reply_pos);
+        conn_queue_msg(conn, m);
+    }
+    conn->want_write = true;
+}
+
+static void v2_reply(Conn *conn, uint32_t id, uint32_t flags, Buffer &body)
+{
+    if (body.size() > k_max_msg - 8)
+    {
+        body.clear();
+        out_err(body, ERR_TOO_BIG, "response is too big, ");
+    }
+    if (flags & V2_RES_LATE)
+    {
+        g_data.v2_late++;
+    }
+    size_t reply_pos = conn->outgoing.size();
+    v2_frame(conn->outgoing, id, flags, body.data(), body.size());
+    conn_reply_added(conn, reply_pos);
+}
+
+// a reply made outside of try_one_request, in the protocol of the client
+void conn_reply(Conn *conn, uint32_t id, Buffer &body)
+{
+    if (conn->proto == PROTO_V2)
+    {
+        return v2_reply(conn, id, 0, body);
+    }
+    size_t reply_pos = conn->outgoing.size();
+    if (conn->proto >= PROTO_RESP2)
+    {
+        if (!resp_encode(body.data(), body.size(), conn->outgoing, conn->proto, false))
         {
-            return false;
+            msg("bad reply");
+            conn->want_close = true;
         }
-        memcpy(&str_len, cur, 4);
-        str_len = le32toh(str_len);
-        cur += 4;
+    }
+    else
+    {
+        buf_append_u32(conn->outgoing, (uint32_t)body.size());
+        buf_append(conn->outgoing, body.data(), body.size());
+    }
+    conn_reply_added(conn, reply_pos);
+}
 
-        if (cur + str_len > end)
+// SET of a value too big for one log record: the first piece, then APPENDs
+static void propagate_blob(const std::string &key, const std::string &val)
+{
+    const size_t k_piece = k_max_msg / 2;
+    propagate({"SET", key, val.substr(0, k_piece)});
+    for (size_t off = k_piece; off < val.size(); off += k_piece)
+    {
+        propagate({"APPEND", key, val.substr(off, k_piece)});
+    }
+}
+
+// all the bytes of a SETBLOB are in, set the value
+static void upload_finish(Conn *conn)
+{
+    Upload *up = conn->upload;
+    conn->upload = NULL;
+    std::vector<std::string> cmd = {"SET", up->key, std::string()};
+    cmd[2].swap(up->value);
+    Buffer &out = g_data.reply_tmp;
+    out.clear();
+    g_data.cur_conn = conn;
+    if (!cmd_write_allowed())
+    {
+        out_err(out, ERR_READONLY, "read only replica");
+    }
+    else if (!cmd_cluster_redirect(cmd, 1, out))
+    {
+        size_t aof_len = g_data.aof_buf.size();
+        propagate_blob(up->key, cmd[2]);
+        do_set(cmd, out);
+        if (out[0] == TAG_ERR)
         {
-            return false;
+            g_data.aof_buf.resize(aof_len);
+        }
+        else if (g_data.aof_on && g_data.aof_buf.size() > aof_len)
+        {
+            conn->aof_wait = g_data.aof_written + g_data.aof_buf.size();
         }
-        expected_size += 4 + str_len;
-        // fprintf(stderr, "String %u length: %u, Updated expected size: %zu\n", i + 1, str_len, expected_size); // Add 4 bytes for the length and `len` bytes for the string
-        cur += str_len;
     }
+    g_data.cur_conn = NULL;
+    conn_reply(conn, up->req_id, out);
+    delete up;
+}
 
-    if (expected_size > conn->incoming.size())
+// the bytes of a SETBLOB that came with the requests
+static bool upload_step(Conn *conn)
+{
+    Upload *up = conn->upload;
+    size_t n = std::min(conn->incoming.size(), up->value.size() - up->got);
+    if (n > 0)
+    {
+        memcpy(&up->value[up->got], conn->incoming.data(), n);
+        conn_consume(conn, n);
+        up->got += n;
+    }
+    if (up->got < up->value.size())
     {
         return false;
     }
+    upload_finish(conn);
+    return true;
+}
 
-    // body
-    if (4 + len > conn->incoming.size())
-    {
+static bool keys_job_start(Conn *conn, uint32_t id, const std::vector<std::string> &cmd);
 
+// the keys of a request, false if it is not limited to its keys
+static bool req_keys(const std::vector<std::string> &cmd, std::vector<std::string> &keys)
+{
+    uint32_t flags = cmd.empty() ? 0 : cmd_flags(cmd[0]);
+    if (!(flags & (CMD_KEY | CMD_KEYS)) || cmd.size() < 2)
+    {
         return false;
     }
-    const uint8_t *request = &conn->incoming[0];
+    size_t last = flags & CMD_KEYS ? cmd.size() - 1 : 1;
+    keys.assign(cmd.begin() + 1, cmd.begin() + 1 + last);
+    return true;
+}
 
-    // got one request, do application logic
-    std::vector<std::string> cmd;
+// a request may pass the deferred ones only if it reads keys they do not
+// touch. otherwise it stays in `incoming` until they are done, so the
+// writes of a client run, and reach the log, in the order it sent them.
+static bool v2_must_wait(Conn *conn, const std::vector<std::string> &cmd)
+{
+    if (conn->deferred.empty())
+    {
+        return false;
+    }
+    std::vector<std::string> keys;
+    if (!req_keys(cmd, keys) || (cmd_flags(cmd[0]) & CMD_WRITE))
+    {
+        return true;
+    }
+    for (const V2Deferred &d : conn->deferred)
+    {
+        if (d.all_keys)
+        {
+            return true;
+        }
+        for (const std::string &key : keys)
+        {
+            if (std::find(d.keys.begin(), d.keys.end(), key) != d.keys.end())
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
 
-    if (parse_req(request, expected_size, cmd) < 0)
+// the request id and command of a v2 frame (after its length)
+static bool v2_parse(Conn *conn, const uint8_t *frame, size_t size, uint32_t &id,
+                     std::vector<std::string> &cmd)
+{
+    memcpy(&id, frame, 4);
+    if (parse_req(frame + k_v2_req_header, size - k_v2_req_header, cmd) < 0)
     {
         msg("bad request");
         conn->want_close = true;
         return false;
     }
-    // fprintf(stderr, "try_one_request: Parsed command:\n");
-    // for (size_t i = 0; i < cmd.size(); i++)
+    return true;
+}
+
+// runs a parsed v2 request, false if it waits for a cold value
+static bool v2_run(Conn *conn, uint32_t id, std::vector<std::string> &cmd, uint64_t deadline_ms, bool late)
+{
+    uint32_t flags = late ? V2_RES_LATE : 0;
+    Buffer &out = g_data.reply_tmp;
+    out.clear();
+    if (deadline_ms && get_monotonic_msec() > deadline_ms)
+    {
+        g_data.v2_expired++;
+        flags |= V2_RES_EXPIRED;
+        out_err(out, ERR_TIMEOUT, "deadline exceeded");
+    }
+    else if (keys_job_start(conn, id, cmd))
+    {
+        return true; // replied when the scan is done
+    }
+    else
+    {
+        g_data.cur_req_id = id;
+        bool ok = run_request(conn, cmd, out);
+        g_data.cur_req_id = 0;
+        if (!ok)
+        {
+            return false;
+        }
+        if (conn->migrating)
+        {
+            return true; // replied when the target answers
+        }
+    }
+    v2_reply(conn, id, flags, out);
+    return true;
+}
+
+static bool v2_one_request(Conn *conn)
+{
+    if (conn->incoming.size() < 4)
+    {
+        return false;
+    }
+    uint32_t len = 0;
+    memcpy(&len, conn->incoming.data(), 4);
+    if (len > k_max_msg || len < k_v2_req_header + 4)
+    {
+        msg("bad v2 frame");
+        conn->want_close = true;
+        return false;
+    }
+    if (conn->incoming.size() < 4 + len)
+    {
+        return false;
+    }
+    const uint8_t *frame = &conn->incoming[4];
+    uint32_t flags = 0, timeout_ms = 0;
+    memcpy(&flags, frame + 4, 4);
+    memcpy(&timeout_ms, frame + 8, 4);
+    uint64_t deadline_ms = 0;
+    if (flags & V2_REQ_DEADLINE)
+    {
+        // since the read that completed the frame, a frame that waits in
+        // `incoming` keeps its deadline
+        uint64_t read_ms = conn->last_active_ms;
+        for (auto &it : conn->v2_reads)
+        {
+            if (it.first >= conn->in_off + 4 + len)
+            {
+                read_ms = it.second;
+                break;
+            }
+        }
+        deadline_ms = read_ms + timeout_ms;
+    }
+    uint32_t id = 0;
+    std::vector<std::string> cmd;
+    if (!v2_parse(conn, frame, len, id, cmd))
+    {
+        return false;
+    }
+    if (v2_must_wait(conn, cmd))
+    {
+        return false; // run when the deferred requests are done
+    }
+    if (!v2_run(conn, id, cmd, deadline_ms, false))
+    {
+        // its keys from the frame, the handler may have taken the strings
+        V2Deferred d;
+        d.frame.assign(frame, frame + len);
+        d.deadline_ms = deadline_ms;
+        cmd.clear();
+        v2_parse(conn, frame, len, id, cmd);
+        d.all_keys = !req_keys(cmd, d.keys);
+        conn->deferred.push_back(std::move(d));
+    }
+    conn_consume(conn, 4 + len);
+    return true;
+}
+
+// the deferred v2 requests of a client, now that a cold value is back.
+// they do not conflict with each other, see v2_must_wait().
+void v2_resume(Conn *conn)
+{
+    std::vector<V2Deferred> todo;
+    todo.swap(conn->deferred);
+    for (V2Deferred &d : todo)
+    {
+        uint32_t id = 0;
+        std::vector<std::string> cmd;
+        if (v2_parse(conn, d.frame.data(), d.frame.size(), id, cmd) &&
+            !v2_run(conn, id, cmd, d.deadline_ms, true))
+        {
+            conn->deferred.push_back(std::move(d)); // another cold value
+        }
+    }
+}
+
+bool try_one_request(Conn *conn)
+{
+    // fprintf(stderr, "try_one_request: Incoming buffer size: %zu\n", conn->incoming.size());
+    // for (size_t i = 0; i < conn->incoming.size(); i++)
     // {
-    //     fprintf(stderr, "  Command[%zu]: %s\n", i, cmd[i].c_str());
+    //     fprintf(stderr, "%02x ", conn->incoming[i]);
     // }
+    if (conn->parked)
+    {
+        return false; // resumed when the cold value is back
+    }
+    if (conn->stream && conn->proto != PROTO_V2)
+    {
+        return false; // after the last chunk
+    }
+    if (conn->migrating)
+    {
+        return false; // after the reply of the target
+    }
+    if (!conn->migrate_addr.empty())
+    {
+        return migrate_link_step(conn);
+    }
+    if (conn->upload)
+    {
+        return upload_step(conn);
+    }
+    if (conn == g_data.repl_link)
+    {
+        return repl_link_step(conn); // replies and the stream from the master
+    }
+    if (conn->proto == PROTO_V2)
+    {
+        return v2_one_request(conn);
+    }
+    std::vector<std::string> cmd;
+    size_t expected_size = conn->proto == PROTO_BIN ? bin_parse(conn, cmd)
+                                                    : resp_conn_parse(conn, cmd);
+    if (expected_size == 0)
+    {
+        return false;
+    }
+    if (cmd.empty() && conn->proto != PROTO_BIN)
+    {
+        conn_consume(conn, expected_size);
+        return true; // an empty inline line
+    }
+    // RESP replies are made in our format, then translated
+    bool resp = conn->proto >= PROTO_RESP2;
+    Buffer &out = resp ? g_data.reply_tmp : conn->outgoing;
+    size_t reply_pos = conn->outgoing.size();
+    out.resize(resp ? 0 : reply_pos);
     size_t header_pos = 0;
-    response_begin(conn->outgoing, &header_pos);
+    response_begin(out, &header_pos);
 
-    do_request(cmd, conn->outgoing);
+    if (!run_request(conn, cmd, out))
+    {
+        // run it again later, nothing was done
+        conn->parked = true;
+        conn->outgoing.resize(reply_pos);
+        return false;
+    }
+    if (conn->migrating)
+    {
+        // replied when the target answers
+        conn->outgoing.resize(reply_pos);
+        conn_consume(conn, expected_size);
+        return false;
+    }
 
-    response_end(conn->outgoing, header_pos);
+    response_end(out, header_pos);
+    if (resp)
+    {
+        if (!resp_encode(&out[header_pos + 4], out.size() - header_pos - 4,
+                         conn->outgoing, conn->proto, false))
+        {
+            msg("bad reply");
+            conn->want_close = true;
+        }
+    }
+    conn_reply_added(conn, reply_pos);
+    conn_consume(conn, expected_size);
+    return true;
+}
 
-    buf_consume(conn->incoming, expected_size);
-    conn->want_write = true;
+// KEYS from a v2 client is answered later, so its other requests go on
+static bool keys_job_start(Conn *conn, uint32_t id, const std::vector<std::string> &cmd)
+{
+    if (cmd.size() != 1 || strcasecmp(cmd[0].c_str(), "KEYS") != 0 || stream_allowed(conn) ||
+        conn->in_multi)
+    {
+        return false;
+    }
+    img_adopt_all(); // the scan only sees the keyspace
+    KeysJob *job = new KeysJob();
+    job->fd = conn->fd;
+    job->conn_id = conn->id;
+    job->req_id = id;
+    g_data.keys_jobs.push_back(job);
     return true;
 }
 
+static void cb_keys_job(HNode *node, void *arg)
+{
+    KeysJob *job = (KeysJob *)arg;
+    const std::string &key = container_of(node, Entry, node)->key;
+    out_str(job->body, key.data(), key.size());
+    job->n++;
+}
+
+const size_t k_keys_slots_per_iter = 1024;
+
+// a key may be listed twice if the keyspace grows during the scan
+static void keys_cron()
+{
+    std::vector<KeysJob *> &jobs = g_data.keys_jobs;
+    for (size_t i = 0; i < jobs.size();)
+    {
+        KeysJob *job = jobs[i];
+        Conn *conn = (size_t)job->fd < g_data.fd2conn.size() ? g_data.fd2conn[job->fd] : NULL;
+        bool done = !conn || conn->id != job->conn_id || conn->want_close;
+        for (size_t k = 0; !done && k < k_keys_slots_per_iter; k++)
+        {
+            job->cursor = hm_scan(&g_data.db, job->cursor, &cb_keys_job, job);
+            done = job->cursor == 0;
+        }
+        if (!done)
+        {
+            i++;
+            continue;
+        }
+        if (conn && conn->id == job->conn_id && !conn->want_close)
+        {
+            Buffer &out = g_data.reply_tmp;
+            out.clear();
+            out_arr(out, job->n);
+            buf_append(out, job->body.data(), job->body.size());
+            v2_reply(conn, job->req_id, V2_RES_LATE, out);
+        }
+        delete job;
+        jobs[i] = jobs.back();
+        jobs.pop_back();
+    }
+}
+
+// the next chunk of a streamed reply, once the last one is written
+static void stream_next(Conn *conn)
+{
+    StreamJob *job = conn->stream;
+    Buffer &out = g_data.reply_tmp;
+    out.clear();
+    bool done = stream_chunk(job, NULL, out);
+    if (conn->proto == PROTO_V2)
+    {
+        v2_frame(conn->outgoing, job->req_id, 0, out.data(), out.size());
+    }
+    else
+    {
+        buf_append_u32(conn->outgoing, (uint32_t)out.size());
+        buf_append(conn->outgoing, out.data(), out.size());
+    }
+    if (done)
+    {
+        delete job;
+        conn->stream = NULL;
+        // the pipelined requests behind it
+        while (try_one_request(conn))
+        {
+        }
+    }
+}
+
 static void handle_write(Conn *conn)
 {
-    assert(conn->outgoing.size() > 0);
-    ssize_t rv = write(conn->fd, &conn->outgoing[0], conn->outgoing.size());
+    assert(conn_has_output(conn));
+    // the replies, then the shared messages without copying them
+    const size_t k_max_iov = 64;
+    struct iovec iov[k_max_iov];
+    size_t niov = 0;
+    if (!conn->outgoing.empty())
+    {
+        iov[niov++] = {&conn->outgoing[0], conn->outgoing.size()};
+    }
+    size_t head = conn->pubq_head;
+    for (size_t i = 0; i < conn->pubq.size() && niov < k_max_iov; i++)
+    {
+        PubMsg *m = conn->pubq[i];
+        iov[niov++] = {&m->data[head], m->data.size() - head};
+        head = 0;
+    }
+    ssize_t rv = writev(conn->fd, iov, (int)niov);
     if (rv < 0 && errno == EAGAIN)
         return; // not ready
 
@@ -996,10 +3126,16 @@ static void handle_write(Conn *conn)
         return;
     }
     // remove written data from out buf
-    buf_consume(conn->outgoing, (size_t)rv);
+    size_t n = std::min((size_t)rv, conn->outgoing.size());
+    buf_consume(conn->outgoing, n);
+    conn_pubq_consume(conn, (size_t)rv - n);
 
     // update readiness if all data written
-    if (conn->outgoing.size() == 0)
+    if (!conn_has_output(conn) && conn->stream)
+    {
+        return stream_next(conn);
+    }
+    if (!conn_has_output(conn))
     {
         conn->want_read = true;
         conn->want_write = false;
@@ -1009,7 +3145,16 @@ static void handle_write(Conn *conn)
 static void handle_read(Conn *conn)
 {
     uint8_t buf[64 * 1024];
-    ssize_t rv = read(conn->fd, buf, sizeof(buf));
+    uint8_t *dst = buf;
+    size_t cap = sizeof(buf);
+    // the bytes of a SETBLOB go straight into the value
+    Upload *up = conn->incoming.empty() ? conn->upload : NULL;
+    if (up && up->got < up->value.size())
+    {
+        dst = (uint8_t *)&up->value[up->got];
+        cap = up->value.size() - up->got;
+    }
+    ssize_t rv = read(conn->fd, dst, cap);
 
     if (rv < 0 && errno == EAGAIN)
     {
@@ -1038,10 +3183,21 @@ static void handle_read(Conn *conn)
         return;
     }
     // got some data
-    buf_append(conn->incoming, buf, (size_t)rv);
+    if (dst == buf)
+    {
+        buf_append(conn->incoming, buf, (size_t)rv);
+    }
+    else
+    {
+        up->got += (size_t)rv;
+    }
 
     // update idle timer only on actual activity (r/w)
     conn->last_active_ms = get_monotonic_msec();
+    if (conn->proto == PROTO_V2 && dst == buf)
+    {
+        conn->v2_reads.push_back({conn->in_off + conn->incoming.size(), conn->last_active_ms});
+    }
     dlist_detach(&conn->idle_node);
     dlist_insert_before(&g_data.idle_list, &conn->idle_node);
 
@@ -1050,10 +3206,14 @@ static void handle_read(Conn *conn)
     {
     }
 
-    if (conn->outgoing.size() > 0)
+    if (conn_has_output(conn))
     {
         conn->want_read = false;
         conn->want_write = true;
+        if (g_data.aof_on)
+        {
+            return; // written after the group commit of this iteration
+        }
         // The socket is likely ready to write in a request-response protocol,
         // try to write it without waiting for the next iteration.
         return handle_write(conn);
@@ -1072,11 +3232,26 @@ static uint32_t next_timer_ms()
         Conn *conn = container_of(g_data.idle_list.next, Conn, idle_node);
         next_ms = conn->last_active_ms + k_idle_timeout_ms;
     }
-    // TTL using heap
-    if (!g_data.heap.empty() && g_data.heap[0].val < next_ms)
+    // TTL using heap, replicas wait for the master
+    bool expiring = g_data.master_host.empty();
+    if (expiring && !g_data.heap.empty() && g_data.heap[0].val < next_ms)
     {
         next_ms = g_data.heap[0].val;
     }
+    if (expiring && !g_data.zheap.empty() && g_data.zheap[0].val < next_ms)
+    {
+        next_ms = g_data.zheap[0].val;
+    }
+    // adopt the image in the background while idle, scan for KEYS
+    if (g_data.img || !g_data.keys_jobs.empty())
+    {
+        return 0;
+    }
+    // background saves are polled
+    if (now_ms + k_cron_interval_ms < next_ms)
+    {
+        next_ms = now_ms + k_cron_interval_ms;
+    }
     if (next_ms == (uint64_t)-1)
         return -1;
 
@@ -1085,11 +3260,20 @@ static uint32_t next_timer_ms()
     return (int32_t)next_ms - now_ms;
 }
 
-static bool hnode_same(HNode *node, HNode *key)
+bool hnode_same(HNode *node, HNode *key)
 {
     return node == key;
 }
 
+// a zset member is about to be removed by its TTL
+static void cb_zexpired(ZNode *znode, void *arg)
+{
+    Entry *ent = (Entry *)arg;
+    std::string name(znode->name, znode->len);
+    key_changed("expired", ent->key, &name);
+    propagate({"ZREM", ent->key, name});
+}
+
 static void process_timers()
 {
     uint64_t now_ms = get_monotonic_msec();
@@ -1102,9 +3286,22 @@ static void process_timers()
         {
             break; // not expired
         }
+        if (conn->repl_state != REPL_NONE || !conn->channels.empty() ||
+            !conn->patterns.empty() || !conn->cdc_prefixes.empty() || conn->stream)
+        {
+            // replication links and subscribers are quiet while there are no writes
+            conn->last_active_ms = now_ms;
+            dlist_detach(&conn->idle_node);
+            dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+            continue;
+        }
         fprintf(stderr, "removing idle connection: %d\n", conn->fd);
         conn_destroy(conn);
     }
+    if (!g_data.master_host.empty())
+    {
+        return; // a replica's keys expire by the DELs of the master
+    }
     // TTL using heap
     const size_t k_max_works = 2000; // to limit the number of keys expiring at same time
     size_t nworks = 0;
@@ -1114,29 +3311,492 @@ static void process_timers()
         Entry *ent = container_of(heap[0].ref, Entry, heap_idx);
         HNode *node = hm_delete(&g_data.db, &ent->node, &hnode_same);
         assert(node == &ent->node);
+        propagate({"DEL", ent->key});
+        key_changed("expired", ent->key);
         // delete key
-        entry_del(ent);
+        entry_del(ent, true);
+        g_data.dirty++;
         if (nworks++ > k_max_works)
         {
             break;
         }
     }
+    // zset member TTLs share the same budget
+    const std::vector<HeapItem> &zheap = g_data.zheap;
+    while (!zheap.empty() && zheap[0].val < now_ms && nworks < k_max_works)
+    {
+        Entry *ent = container_of(zheap[0].ref, Entry, zheap_idx);
+        size_t n = zset_expire(&ent->zset, now_ms, k_max_works - nworks,
+                               &cb_zexpired, ent);
+        entry_sync_zexpire(ent);
+        nworks += n;
+        g_data.dirty += n;
+        if (!ent->zset.root)
+        {
+            // the last member is gone, so is the key
+            hm_delete(&g_data.db, &ent->node, &hnode_same);
+            propagate({"DEL", ent->key});
+            key_changed("del", ent->key);
+            entry_del(ent, true);
+        }
+    }
 }
 
-static void save_snap_task(void *arg)
+// every write path comes here
+uint32_t watch_bucket(const std::string &key)
 {
-    const char *filename = (const char *)arg;
-    save_snapshot(filename);
+    return str_hash((const uint8_t *)key.data(), key.size()) & (k_watch_buckets - 1);
 }
 
-int main()
+void key_changed(const char *event, const std::string &key, const std::string *member)
 {
-    // init
-    dlist_init(&g_data.idle_list);
-    thread_pool_init(&g_data.thread_pool, 4);
+    g_data.watch_versions[watch_bucket(key)]++;
+    tracking_invalidate(key);
+    cdc_emit(event, key, member);
+}
+
+// every key changed at once: FLUSHALL, or a snapshot replaced the keyspace
+void keys_flushed()
+{
+    for (uint64_t &v : g_data.watch_versions)
+    {
+        v++;
+    }
+    tracking_flush_all(true);
+    cdc_emit_all("flushall");
+}
+
+// transactions: MULTI queues, EXEC runs the queue back-to-back in one
+// call, so no other client runs in between. WATCH aborts EXEC if a key
+// changed since, by its bucket's version.
+
+bool cmd_multi_active()
+{
+    Conn *conn = g_data.cur_conn;
+    return conn && conn->in_multi;
+}
+
+void cmd_multi_fail()
+{
+    if (cmd_multi_active())
+    {
+        g_data.cur_conn->multi_failed = true;
+    }
+}
+
+void cmd_multi_queue(std::vector<std::string> &cmd, Buffer &out)
+{
+    g_data.cur_conn->multi_queue.push_back(std::move(cmd));
+    return out_str(out, "QUEUED", 6);
+}
+
+static void multi_reset(Conn *conn)
+{
+    conn->in_multi = false;
+    conn->multi_failed = false;
+    conn->multi_queue.clear();
+    conn->watched.clear();
+}
+
+void do_multi(std::vector<std::string> &, Buffer &out)
+{
+    Conn *conn = g_data.cur_conn;
+    if (!conn)
+    {
+        return out_err(out, ERR_UNKNOWN, "not a client");
+    }
+    if (conn->in_multi)
+    {
+        return out_err(out, ERR_BAD_ARG, "MULTI calls can not be nested");
+    }
+    conn->in_multi = true;
+    return out_ok(out);
+}
+
+void do_discard(std::vector<std::string> &, Buffer &out)
+{
+    Conn *conn = g_data.cur_conn;
+    if (!conn || !conn->in_multi)
+    {
+        return out_err(out, ERR_BAD_ARG, "DISCARD without MULTI");
+    }
+    multi_reset(conn);
+    return out_ok(out);
+}
+
+// WATCH key...
+void do_watch(std::vector<std::string> &cmd, Buffer &out)
+{
+    Conn *conn = g_data.cur_conn;
+    if (!conn)
+    {
+        return out_err(out, ERR_UNKNOWN, "not a client");
+    }
+    if (conn->in_multi)
+    {
+        return out_err(out, ERR_BAD_ARG, "WATCH inside MULTI is not allowed");
+    }
+    for (size_t i = 1; i < cmd.size(); i++)
+    {
+        uint32_t b = watch_bucket(cmd[i]);
+        conn->watched.push_back({b, g_data.watch_versions[b]});
+    }
+    return out_ok(out);
+}
+
+void do_unwatch(std::vector<std::string> &, Buffer &out)
+{
+    if (Conn *conn = g_data.cur_conn)
+    {
+        conn->watched.clear();
+    }
+    return out_ok(out);
+}
+
+// an array of the replies, nil if a watched key changed
+void do_exec(std::vector<std::string> &, Buffer &out)
+{
+    Conn *conn = g_data.cur_conn;
+    if (!conn || !conn->in_multi)
+    {
+        return out_err(out, ERR_BAD_ARG, "EXEC without MULTI");
+    }
+    std::vector<std::vector<std::string>> queue;
+    queue.swap(conn->multi_queue);
+    bool failed = conn->multi_failed;
+    bool changed = false;
+    for (const std::pair<uint32_t, uint64_t> &w : conn->watched)
+    {
+        changed = changed || g_data.watch_versions[w.first] != w.second;
+    }
+    multi_reset(conn);
+    if (failed || changed)
+    {
+        g_data.tx_aborts++;
+        if (failed)
+        {
+            return out_err(out, ERR_BAD_ARG, "EXECABORT transaction discarded because of previous errors");
+        }
+        return out_nil(out);
+    }
+    // cold values are read in place and replies are never streamed,
+    // nothing may stop halfway
+    g_data.tx_execs++;
+    g_data.atomic = true;
+    out_arr(out, (uint32_t)queue.size());
+    propagate_tx_begin();
+    for (std::vector<std::string> &cmd : queue)
+    {
+        do_request(cmd, out);
+    }
+    propagate_tx_end();
+    g_data.atomic = false;
+}
+
+// scripts run their commands through do_request, so each write is
+// recorded for the log and replicas like one from a client, all of them
+// in one MULTI ... EXEC block
+
+static void script_call(std::vector<std::string> &cmd, Buffer &out)
+{
+    if (cmd_flags(cmd[0]) & (CMD_TX | CMD_NOTX | CMD_NOSCRIPT))
+    {
+        return out_err(out, ERR_SCRIPT, "command not allowed from a script");
+    }
+    do_request(cmd, out);
+}
+
+static Script *script_get(const std::string &src, Buffer &out)
+{
+    std::string sha = script_sha1(src);
+    auto it = g_data.scripts.find(sha);
+    if (it != g_data.scripts.end())
+    {
+        return it->second;
+    }
+    std::string err;
+    Script *script = script_compile(src, err);
+    if (!script)
+    {
+        out_err(out, ERR_SCRIPT, "compile error: " + err);
+        return NULL;
+    }
+    g_data.scripts[sha] = script;
+    return script;
+}
+
+// cmd[1] is the script, cmd[2] the number of keys after it, then ARGV
+static void script_exec(Script *script, std::vector<std::string> &cmd, Buffer &out)
+{
+    int64_t nkeys = 0;
+    if (!str2int(cmd[2], nkeys) || nkeys < 0 || (size_t)nkeys > cmd.size() - 3)
+    {
+        return out_err(out, ERR_BAD_ARG, "bad number of keys");
+    }
+    // the keys must be served here, commands on other keys fail inside
+    std::vector<std::string> keys(cmd.begin() + 3, cmd.begin() + 3 + nkeys);
+    if (nkeys > 0)
+    {
+        keys.insert(keys.begin(), cmd[0]);
+        if (cmd_cluster_redirect(keys, (size_t)nkeys, out))
+        {
+            return;
+        }
+        keys.erase(keys.begin());
+    }
+    ScriptRun run;
+    run.keys.swap(keys);
+    run.argv.assign(std::make_move_iterator(cmd.begin() + 3 + nkeys), std::make_move_iterator(cmd.end()));
+    run.call = &script_call;
+    run.max_ops = g_data.script_max_ops;
+    run.max_us = g_data.script_max_ms * 1000;
+    bool atomic = g_data.atomic; // inside EXEC
+    g_data.atomic = true;
+    propagate_tx_begin();
+    script_run(script, run, out);
+    propagate_tx_end();
+    g_data.atomic = atomic;
+    g_data.script_runs++;
+    g_data.script_budget_aborts += run.over_budget;
+}
+
+// EVAL script numkeys key... arg...
+void do_eval(std::vector<std::string> &cmd, Buffer &out)
+{
+    if (Script *script = script_get(cmd[1], out))
+    {
+        script_exec(script, cmd, out);
+    }
+}
+
+// EVALSHA sha1 numkeys key... arg...
+void do_evalsha(std::vector<std::string> &cmd, Buffer &out)
+{
+    std::string sha = cmd[1];
+    std::transform(sha.begin(), sha.end(), sha.begin(), ::tolower);
+    auto it = g_data.scripts.find(sha);
+    if (it == g_data.scripts.end())
+    {
+        return out_err(out, ERR_NOSCRIPT, "no script with this sha1, use EVAL");
+    }
+    script_exec(it->second, cmd, out);
+}
+
+// SCRIPT LOAD script | EXISTS sha1... | FLUSH
+void do_script(std::vector<std::string> &cmd, Buffer &out)
+{
+    std::string sub = cmd[1];
+    std::transform(sub.begin(), sub.end(), sub.begin(), ::toupper);
+    if (sub == "LOAD" && cmd.size() == 3)
+    {
+        if (!script_get(cmd[2], out))
+        {
+            return;
+        }
+        std::string sha = script_sha1(cmd[2]);
+        return out_str(out, sha.data(), sha.size());
+    }
+    if (sub == "EXISTS" && cmd.size() >= 3)
+    {
+        out_arr(out, (uint32_t)(cmd.size() - 2));
+        for (size_t i = 2; i < cmd.size(); i++)
+        {
+            std::string sha = cmd[i];
+            std::transform(sha.begin(), sha.end(), sha.begin(), ::tolower);
+            out_int(out, g_data.scripts.count(sha));
+        }
+        return;
+    }
+    if (sub == "FLUSH" && cmd.size() == 2)
+    {
+        for (auto &it : g_data.scripts)
+        {
+            script_free(it.second);
+        }
+        g_data.scripts.clear();
+        return out_ok(out);
+    }
+    return out_err(out, ERR_BAD_ARG, "expected SCRIPT LOAD script | EXISTS sha1... | FLUSH");
+}
+
+static volatile sig_atomic_t g_shutdown = 0;
+
+static void on_shutdown_signal(int)
+{
+    g_shutdown = 1;
+}
+
+
+// bytes, with an optional k/m/g suffix
+static bool parse_bytes(const char *s, uint64_t &out)
+{
+    char *end = NULL;
+    uint64_t val = strtoull(s, &end, 10);
+    int shift = *end == 'k' ? 10 : *end == 'm' ? 20 : *end == 'g' ? 30 : 0;
+    if (end == s || (shift && end[1]) || (!shift && *end))
+    {
+        return false;
+    }
+    out = val << shift;
+    return true;
+}
+
+// --save <seconds> <changes> (repeatable), --save off
+static bool parse_args(int argc, char **argv)
+{
+    bool default_rules = true;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--save" && i + 1 < argc && std::string(argv[i + 1]) == "off")
+        {
+            default_rules = false;
+            g_data.save_rules.clear();
+            i++;
+        }
+        else if (arg == "--appendonly" && i + 1 < argc)
+        {
+            std::string val = argv[++i];
+            if (val != "yes" && val != "no")
+            {
+                return false;
+            }
+            g_data.aof_on = val == "yes";
+        }
+        else if (arg == "--port" && i + 1 < argc)
+        {
+            int64_t port = 0;
+            if (!str2int(argv[++i], port) || port <= 0 || port > 65535)
+            {
+                return false;
+            }
+            g_data.port = (int)port;
+        }
+        else if (arg == "--replicaof" && i + 2 < argc)
+        {
+            int64_t port = 0;
+            if (!str2int(argv[i + 2], port) || port <= 0 || port > 65535)
+            {
+                return false;
+            }
+            g_data.master_host = argv[i + 1];
+            g_data.master_port = (int)port;
+            i += 2;
+        }
+        else if (arg == "--cluster" && i + 1 < argc)
+        {
+            std::string val = argv[++i];
+            if (val != "yes" && val != "no")
+            {
+                return false;
+            }
+            g_data.cluster_on = val == "yes";
+        }
+        else if (arg == "--cluster-announce" && i + 1 < argc)
+        {
+            g_data.cluster_announce = argv[++i];
+        }
+        else if ((arg == "--script-max-ops" || arg == "--script-max-ms") && i + 1 < argc)
+        {
+            int64_t val = 0;
+            if (!str2int(argv[++i], val) || val < 0)
+            {
+                return false;
+            }
+            (arg == "--script-max-ops" ? g_data.script_max_ops : g_data.script_max_ms) = (uint64_t)val;
+        }
+        else if (arg == "--repl-backlog-size" && i + 1 < argc)
+        {
+            uint64_t val = 0;
+            if (!parse_bytes(argv[++i], val) || val == 0)
+            {
+                return false;
+            }
+            g_data.repl_backlog_size = (size_t)val;
+        }
+        else if (arg == "--maxmemory" && i + 1 < argc)
+        {
+            if (!parse_bytes(argv[++i], g_data.maxmemory))
+            {
+                return false;
+            }
+        }
+        else if (arg == "--resp-port" && i + 1 < argc)
+        {
+            int64_t val = 0;
+            if (!str2int(argv[++i], val) || val <= 0 || val > 65535)
+            {
+                return false;
+            }
+            g_data.resp_port = (int)val;
+        }
+        else if (arg == "--tracking-table-max" && i + 1 < argc)
+        {
+            int64_t val = 0;
+            if (!str2int(argv[++i], val) || val <= 0)
+            {
+                return false;
+            }
+            g_data.tracking_max = (uint64_t)val;
+        }
+        else if (arg == "--pubsub-output-limit" && i + 1 < argc)
+        {
+            if (!parse_bytes(argv[++i], g_data.pubsub_limit))
+            {
+                return false;
+            }
+        }
+        else if (arg == "--warmrestart" && i + 1 < argc)
+        {
+            std::string val = argv[++i];
+            if (val != "yes" && val != "no")
+            {
+                return false;
+            }
+            g_data.warm_restart = val == "yes";
+        }
+        else if (arg == "--appendfsync" && i + 1 < argc)
+        {
+            std::string val = argv[++i];
+            if (val == "always")
+                g_data.aof_fsync = AOF_FSYNC_ALWAYS;
+            else if (val == "everysec")
+                g_data.aof_fsync = AOF_FSYNC_EVERYSEC;
+            else if (val == "no")
+                g_data.aof_fsync = AOF_FSYNC_NO;
+            else
+                return false;
+        }
+        else if (arg == "--save" && i + 2 < argc)
+        {
+            SaveRule rule;
+            int64_t seconds = 0, changes = 0;
+            if (!str2int(argv[i + 1], seconds) || !str2int(argv[i + 2], changes) ||
+                seconds <= 0 || changes <= 0)
+            {
+                return false;
+            }
+            if (default_rules)
+            {
+                default_rules = false;
+                g_data.save_rules.clear();
+            }
+            rule.seconds = (uint64_t)seconds;
+            rule.changes = (uint64_t)changes;
+            g_data.save_rules.push_back(rule);
+            i += 2;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
-    load_snapshot("photon.rdb");
-    // server listening socket
+// a nonblocking listening socket on the loopback interface
+static int listen_on(int port)
+{
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0)
     {
@@ -1149,7 +3809,7 @@ int main()
     // bind
     struct sockaddr_in addr = {};
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(1234);
+    addr.sin_port = htons((uint16_t)port);
     addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);
     int rv = bind(fd, (const struct sockaddr *)&addr, sizeof(addr));
     if (rv)
@@ -1165,16 +3825,88 @@ int main()
     {
         die("listen()");
     }
+    return fd;
+}
+
+int main(int argc, char **argv)
+{
+    // init
+    g_data.save_rules = {{3600, 1}, {300, 100}, {60, 10000}};
+    if (!parse_args(argc, argv))
+    {
+        fprintf(stderr, "usage: %s [--port <port>] [--resp-port <port>] [--replicaof <host> <port>]"
+                        " [--repl-backlog-size <bytes>] [--cluster yes|no] [--cluster-announce <host>]"
+                        " [--pubsub-output-limit <bytes>] [--tracking-table-max <keys>]"
+                        " [--save <seconds> <changes>]... [--save off]"
+                        " [--appendonly yes|no] [--appendfsync always|everysec|no]"
+                        " [--warmrestart yes|no] [--maxmemory <bytes>]"
+                        " [--script-max-ops <n>] [--script-max-ms <ms>]\n",
+                argv[0]);
+        return 1;
+    }
+    dlist_init(&g_data.idle_list);
+    // also decodes snapshots at startup, so scale with the cores
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_pool_init(&g_data.thread_pool, ncpu > 4 ? (size_t)ncpu : 4);
+    void *shared = mmap(NULL, sizeof(SaveProgress), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+    {
+        die("mmap()");
+    }
+    g_data.save_progress = new (shared) SaveProgress();
+
+    // no SA_RESTART, poll() returns EINTR and the loop sees the flag
+    struct sigaction sa = {};
+    sa.sa_handler = &on_shutdown_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // a peer may go away while we write to it
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+    repl_new_replid();
+    if (g_data.cluster_on)
+    {
+        cluster_init();
+        if (!cluster_load())
+        {
+            die("bad photon-cluster.conf");
+        }
+    }
+
+    vlog_remove_files();
+    uint64_t aof_base = 0;
+    if (g_data.warm_restart && img_open("photon.img", &aof_base))
+    {
+        fprintf(stderr, "mapped %llu keys from the warm restart image\n",
+                (unsigned long long)g_data.img_pending);
+    }
+    else if (!load_snapshot("photon.rdb", &aof_base) && access("photon.rdb", F_OK) == 0)
+    {
+        // starting empty would overwrite it on the next save
+        die("failed to load photon.rdb");
+    }
+    aof_load(aof_base);
+    g_data.last_save_time = get_wall_sec(); // save rules count from here
+    // server listening sockets
+    int fd = listen_on(g_data.port);
+    int resp_fd = g_data.resp_port ? listen_on(g_data.resp_port) : -1;
 
     // event loop
     std::vector<struct pollfd> poll_args;
 
-    while (true)
+    while (!g_shutdown)
     {
         poll_args.clear();
         // put listening socket in 1st position
         struct pollfd pdf = {fd, POLLIN, 0};
         poll_args.push_back(pdf);
+        // then the thread pool completions
+        struct pollfd done_pfd = {thread_pool_done_fd(&g_data.thread_pool), POLLIN, 0};
+        poll_args.push_back(done_pfd);
+        // and the RESP listener, ignored by poll() if it is -1
+        struct pollfd resp_pfd = {resp_fd, POLLIN, 0};
+        poll_args.push_back(resp_pfd);
 
         // the rest are connection sockets
         for (Conn *conn : g_data.fd2conn)
@@ -1185,11 +3917,11 @@ int main()
             // always poll() for error
             struct pollfd pfd = {conn->fd, POLLERR, 0};
             // poll() flags from the application's intent
-            if (conn->want_read)
+            if (conn->want_read && !conn->parked)
             {
                 pfd.events |= POLLIN;
             }
-            if (conn->want_write)
+            if (conn->want_write && !conn_aof_blocked(conn))
             {
                 pfd.events |= POLLOUT;
             }
@@ -1211,17 +3943,30 @@ int main()
         // handle listening socket
         if (poll_args[0].revents)
         {
-            handle_accept(fd);
+            handle_accept(fd, PROTO_BIN);
+        }
+        if (poll_args[2].revents)
+        {
+            handle_accept(resp_fd, PROTO_RESP2);
+        }
+        // run callbacks of finished background task groups
+        if (poll_args[1].revents)
+        {
+            thread_pool_run_done(&g_data.thread_pool);
         }
 
         // handle connection sockets
-        for (size_t i = 1; i < poll_args.size(); i++)
+        for (size_t i = 3; i < poll_args.size(); i++)
         {
             uint32_t ready = poll_args[i].revents;
             if (ready == 0)
                 continue;
 
             Conn *conn = g_data.fd2conn[poll_args[i].fd];
+            if (!conn)
+            {
+                continue; // closed by an earlier one, e.g. REPLICAOF
+            }
 
             // // update idle timer by moving conn to end of list
             // conn->last_active_ms = get_monotonic_msec();
@@ -1240,13 +3985,57 @@ int main()
             }
 
             // close socket from err or logic
-            if ((ready & POLLERR) || conn->want_close)
+            if ((ready & (POLLERR | POLLHUP)) || conn->want_close)
             {
                 conn_destroy(conn);
             }
         } // for each conn sockets
+        // close the subscribers that fell behind
+        pubsub_cron();
         // process idle timers
         process_timers();
+        // move a batch of keys out of the warm restart image
+        img_adopt_cron();
+        // a slice of the keyspace for each KEYS of a v2 client
+        keys_cron();
+        // spill cold values past maxmemory
+        tier_cron();
+        // free this iteration's deleted entries in one background task
+        garbage_flush();
+        // one batch of change events and invalidations per client
+        cdc_flush();
+        tracking_send();
+        // feed the replicas, then the group commit of the append log
+        repl_feed();
+        if (g_data.aof_on)
+        {
+            aof_flush();
+        }
+        // background save
+        child_check_done(false);
+        repl_cron();
+        bgsave_cron();
+        aof_rewrite_cron();
+    }
+
+    // clean shutdown: let queued background work finish
+    msg("shutting down");
+    close(fd);
+    if (resp_fd >= 0)
+    {
+        close(resp_fd);
+    }
+    if (g_data.child_pid != -1)
+    {
+        kill(g_data.child_pid, SIGKILL);
+        child_check_done(true);
+    }
+    aof_shutdown();
+    if (g_data.warm_restart && !img_save("photon.img"))
+    {
+        msg("failed to write the warm restart image");
     }
+    tier_reset();
+    thread_pool_destroy(&g_data.thread_pool);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,661 @@
+#pragma once
+
+// internal to the server: the types and the global state, and the
+// functions its source files share
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <math.h>
+
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <malloc.h>
+#include <mutex>
+
+#include <dirent.h>
+#include <netdb.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+
+#include "common.h"
+#include "zset.h"
+#include "hashtable.h"
+#include "list.h"
+#include "heap.h"
+#include "thread_pool.h"
+#include "snapshot.h"
+#include "cluster.h"
+#include "resp.h"
+#include "script.h"
+#include "commands/commands.h"
+
+const size_t k_max_msg = 32 << 20;
+
+// connections by key prefix, looked up once per distinct prefix length
+struct PrefixIndex
+{
+    HMap map;
+    std::map<size_t, uint32_t> lens; // prefix length -> number of prefixes
+};
+
+// a published message, one response shared by the queues of its subscribers
+struct PubMsg
+{
+    uint32_t refs = 0;
+    Buffer data;
+    PubMsg *copies[3] = {NULL, NULL, NULL}; // v2/RESP2/RESP3, made when needed
+};
+
+// keys share version counters, a change to another key of the bucket
+// makes a false conflict
+const size_t k_watch_buckets = 1 << 16;
+
+// a v2 request frame (after its length) to run again when a value is back
+struct V2Deferred
+{
+    Buffer frame;
+    uint64_t deadline_ms = 0; // 0 for none
+    // the keys it touches, or all of them
+    std::vector<std::string> keys;
+    bool all_keys = false;
+};
+
+// KEYS of a v2 client, a slice of the keyspace per iteration
+struct KeysJob
+{
+    int fd = -1;
+    uint64_t conn_id = 0; // the fd may be reused meanwhile
+    uint32_t req_id = 0;
+    uint64_t cursor = 0;
+    uint32_t n = 0;
+    Buffer body; // the keys so far
+};
+
+// a MIGRATE waiting for the replies of the target, see do_migrate()
+struct MigrateJob
+{
+    int fd = -1;
+    uint64_t conn_id = 0; // the caller, the fd may be reused meanwhile
+    uint32_t req_id = 0;
+    std::string target; // "host:port"
+    std::vector<std::string> keys;
+    std::vector<uint64_t> versions; // WATCH versions of the keys when sent
+    size_t replies = 0;             // still to come
+    bool ok = true;
+};
+
+// a big array reply, sent a chunk at a time as the socket drains
+struct StreamJob
+{
+    uint32_t req_id = 0; // for v2 frames
+    bool zquery = false;
+    uint64_t cursor = 0; // KEYS
+    // ZQUERY: resumes after (score, name)
+    std::string key;
+    double score = 0;
+    std::string name;
+    int64_t left = 0;
+};
+
+// SETBLOB: the raw bytes after the request are read into the value
+struct Upload
+{
+    uint32_t req_id = 0; // for v2 frames
+    std::string key;
+    std::string value; // sized up front, filled up to `got`
+    size_t got = 0;
+};
+
+// wire protocol of a connection, ours or a RESP version
+enum
+{
+    PROTO_BIN = 0,
+    PROTO_V2 = 1, // multiplexed frames, after PROTO 2
+    PROTO_RESP2 = 2,
+    PROTO_RESP3 = 3,
+};
+
+struct Conn
+{
+    int fd = -1;
+    int proto = PROTO_BIN;
+    size_t resp_need = 0; // bytes of the partial RESP request, at least
+    // application's intention, for the event loop
+    bool want_read = false;
+    bool want_write = false;
+    bool want_close = false;
+    // buffered input and output
+    Buffer incoming;
+    Buffer outgoing;
+    // timer
+    uint64_t last_active_ms = 0;
+    DList idle_node;
+    // with appendfsync always, replies wait until the log is synced up to here
+    uint64_t aof_wait = 0;
+    // waiting for a cold value, the request stays in `incoming` until then
+    bool parked = false;
+    // a replica connected to us, or our link to the master
+    int repl_state = 0;
+    uint64_t repl_off = 0; // next stream offset to send to a replica
+    Buffer repl_pending;   // the stream while its full sync runs
+    // ASKING was sent, the next command may use an importing slot
+    bool asking = false;
+    // pub/sub: messages go out after `outgoing`, in order
+    std::deque<PubMsg *> pubq;
+    size_t pubq_head = 0;  // bytes of the front message already sent
+    size_t pubq_bytes = 0; // bytes not sent yet
+    std::vector<std::string> channels;
+    std::vector<std::string> patterns;
+    // change feed: prefixes, and the events of this iteration
+    std::vector<std::string> cdc_prefixes;
+    Buffer cdc_batch;
+    uint32_t cdc_count = 0;
+    uint64_t cdc_seq = 0; // of the last event added, against duplicates
+    // client side caching, invalidations to send at the end of the iteration
+    uint64_t id = 0;
+    bool tracking = false;
+    bool tracking_bcast = false;
+    std::vector<std::string> tracking_prefixes;
+    std::vector<std::string> inval_keys;
+    bool inval_all = false;
+    // protocol v2: requests waiting for a cold value, the later ones go on
+    // unless they have to stay behind, see v2_must_wait()
+    std::vector<V2Deferred> deferred;
+    // when the bytes of the requests were read: (end offset of a read,
+    // time), offsets count all the bytes that went into `incoming`
+    uint64_t in_off = 0;
+    std::deque<std::pair<uint64_t, uint64_t>> v2_reads;
+    // CLIENT STREAMING: big arrays are sent in chunks, one at a time
+    bool streaming = false;
+    StreamJob *stream = NULL;
+    Upload *upload = NULL;
+    // MULTI: commands checked when queued, run by EXEC
+    bool in_multi = false;
+    bool multi_failed = false; // a command was refused, EXEC aborts
+    std::vector<std::vector<std::string>> multi_queue;
+    std::vector<std::pair<uint32_t, uint64_t>> watched; // bucket, version
+    // MIGRATE: the caller waits for the target, the link carries the jobs
+    bool migrating = false;
+    std::string migrate_addr; // of a link, empty otherwise
+    std::deque<MigrateJob *> migrate_jobs;
+};
+
+inline bool conn_has_output(Conn *conn)
+{
+    return !conn->outgoing.empty() || !conn->pubq.empty();
+}
+
+// save after `changes` writes within `seconds`
+struct SaveRule
+{
+    uint64_t seconds = 0;
+    uint64_t changes = 0;
+};
+
+struct Entry;
+
+// a value log file, cold string values are appended to the active one
+struct VlogSeg
+{
+    uint32_t id = 0;
+    int fd = -1;
+    uint64_t size = 0;
+    uint64_t garbage = 0; // bytes of records no entry points to
+};
+
+// a cold value being read back on the thread pool
+struct ColdRead
+{
+    TaskGroup group;
+    Entry *ent = NULL; // NULL once the entry is deleted
+    int fd = -1;       // dup of the segment's, it may be removed meanwhile
+    uint32_t seg = 0;
+    int64_t off = 0;
+    uint32_t len = 0;
+    std::string value;
+    bool ok = false;
+    std::vector<int> waiters; // fds of the parked clients
+};
+
+enum
+{
+    CHILD_NONE = 0,
+    CHILD_SAVE = 1,        // BGSAVE
+    CHILD_AOF_REWRITE = 2, // BGREWRITEAOF
+    CHILD_REPL_SYNC = 3,   // snapshot to a replica's socket
+};
+
+enum
+{
+    REPL_NONE = 0,
+    // a replica connected to us
+    REPL_WAIT_SYNC = 1, // full sync, waiting for the fork
+    REPL_SENDING = 2,   // the child writes the snapshot to the socket
+    REPL_ONLINE = 3,    // fed from the backlog
+    // our link to the master
+    REPL_LINK_HANDSHAKE = 4, // PSYNC sent
+    REPL_LINK_TRANSFER = 5,  // receiving the snapshot
+    REPL_LINK_ONLINE = 6,    // applying the command stream
+};
+
+enum
+{
+    AOF_FSYNC_NO = 0,       // leave it to the OS
+    AOF_FSYNC_EVERYSEC = 1, // at most once per second
+    AOF_FSYNC_ALWAYS = 2,   // before replying to the writer
+};
+
+// fsync (and close) of a log segment, run in order on the thread pool
+struct AofJob
+{
+    TaskGroup group;
+    int fd = -1;
+    uint64_t off = 0; // log offset covered by the fsync
+    bool close_fd = false;
+    bool running = false;
+    int err = 0;
+};
+
+// a MULTI ... EXEC block of the command stream, applied once complete
+struct StreamTx
+{
+    bool open = false;
+    std::vector<std::vector<std::string>> cmds;
+    uint64_t bytes = 0; // of the stream since the last applied command
+};
+
+// written by the BGSAVE child, read by the parent
+struct SaveProgress
+{
+    std::atomic<uint64_t> keys_total;
+    std::atomic<uint64_t> keys_done;
+};
+
+struct GlobalData
+{
+    HMap db;                     // map of all client connections
+    std::vector<Conn *> fd2conn; // fd-conn mapping
+    DList idle_list;             // timers of idle connections
+    std::vector<HeapItem> heap;  // timers for key TTLs
+    std::vector<HeapItem> zheap; // timers for zset member TTLs (earliest per zset)
+    ThreadPool thread_pool;      // thread pool
+    std::vector<void *> garbage; // lazily freed entries, handed off per iteration
+    // persistence
+    uint64_t dirty = 0;                  // changes since the last save
+    std::vector<SaveRule> save_rules;    // automatic BGSAVE triggers
+    pid_t child_pid = -1;                // BGSAVE or log rewrite child
+    int child_type = CHILD_NONE;
+    uint64_t dirty_before_save = 0;      // `dirty` when the child forked
+    SaveProgress *save_progress = NULL;  // shared with the child
+    uint64_t last_save_time = 0;         // unix time of the last successful save
+    bool last_save_ok = true;
+    uint64_t last_bgsave_start = 0;
+    // append-only log, split in numbered segments
+    bool aof_on = false;
+    int aof_fsync = AOF_FSYNC_EVERYSEC;
+    int aof_fd = -1;
+    uint64_t aof_seq = 0;               // current segment
+    uint64_t aof_save_base = 0;         // first segment not covered by the snapshot
+    Buffer aof_buf;                     // commands of this iteration
+    size_t aof_prop_start = -1;         // record of the running command
+    size_t aof_tx_start = -1;           // MULTI of the running EXEC or script
+    int aof_tx_depth = 0;               // a script inside EXEC nests
+    bool aof_loading = false;
+    uint64_t aof_written = 0;           // bytes written, all segments of this run
+    uint64_t aof_synced = 0;            // bytes known to be on disk
+    uint64_t aof_queued = 0;            // highest offset of a queued fsync
+    uint64_t aof_last_fsync_ms = 0;
+    std::deque<AofJob *> aof_jobs;      // front is running
+    uint64_t aof_size = 0;              // bytes in the live segments
+    uint64_t aof_rewrite_base_size = 0; // aof_size after the last rewrite
+    uint64_t aof_rewrite_seq = 0;       // segment replaced by the running rewrite
+    bool aof_rewrite_scheduled = false; // waiting for BGSAVE to finish
+    bool aof_last_rewrite_ok = true;
+    // warm restart image, mapped until all of it is adopted
+    bool warm_restart = false;
+    uint8_t *img = NULL;
+    size_t img_size = 0;
+    uint64_t img_nslots = 0;
+    uint64_t img_slots_off = 0;
+    uint64_t img_pending = 0; // records not adopted yet
+    uint64_t img_cursor = 0;  // next slot for background adoption
+    // tiered storage, cold string values live in the value log
+    uint64_t maxmemory = 0;             // 0 disables tiering
+    Conn *cur_conn = NULL;              // the client of the running command
+    uint32_t cur_req_id = 0;            // and its v2 request id
+    bool parked = false;                // the running command waits for a cold value
+    std::vector<VlogSeg *> vlog_segs;   // by id, NULL once removed
+    VlogSeg *vlog_active = NULL;
+    std::vector<ColdRead *> cold_reads; // in flight
+    bool vlog_compacting = false;
+    uint64_t tier_last_ms = 0;
+    uint64_t tier_cold_keys = 0;
+    uint64_t tier_spills = 0;
+    uint64_t tier_cold_reads = 0;
+    uint64_t tier_compactions = 0;
+    // replication, the stream is what goes to the append log
+    int port = 1234;
+    std::string replid;                   // names our stream history
+    uint64_t repl_off = 0;                // bytes of the stream so far
+    Buffer repl_backlog;                  // ring of the last bytes, empty until a replica asks
+    size_t repl_backlog_size = 1 << 20;
+    size_t repl_backlog_idx = 0;          // next write position
+    uint64_t repl_backlog_histlen = 0;
+    size_t repl_fed = 0;                  // bytes of `aof_buf` already in the backlog
+    Conn *repl_sync_conn = NULL;          // replica of the running full sync
+    std::string master_host;              // empty on a master
+    int master_port = 0;
+    Conn *repl_link = NULL;
+    uint64_t repl_retry_ms = 0;           // next connection attempt
+    std::string master_replid;            // the master's stream we follow
+    uint64_t master_off = 0;              // bytes of it applied
+    std::string repl_transfer_replid;     // of the full sync in progress
+    int64_t repl_transfer_off = -1;       // its stream offset, -1 until received
+    int repl_transfer_fd = -1;            // the snapshot is spooled to a file
+    uint64_t repl_transfer_bytes = 0;     // received so far
+    StreamTx repl_tx;                     // a block of the stream being received
+    // cluster mode, nodes are named by their "host:port"
+    bool cluster_on = false;
+    std::string cluster_announce = "127.0.0.1"; // our host for the others
+    std::vector<std::string> cluster_nodes;     // [0] is us
+    std::vector<int32_t> slot_owner;            // node index, -1 if not served
+    std::vector<int32_t> slot_migrating;        // to this node, -1 if none
+    std::vector<int32_t> slot_importing;        // from this node, -1 if none
+    std::map<std::string, Conn *> migrate_links; // "host:port" -> connection
+    // pub/sub, by channel name and by pattern
+    HMap channels;
+    HMap patterns;
+    uint64_t pubsub_limit = 32 << 20; // bytes queued before a subscriber is dropped
+    std::vector<int> pubsub_drops;    // fds to close after this iteration
+    uint64_t pubsub_messages = 0;
+    uint64_t pubsub_dropped = 0;
+    // change feed, by key prefix
+    PrefixIndex cdc;
+    std::vector<int> cdc_pending;        // fds with events to send
+    uint64_t cdc_seq = 0;
+    uint64_t cdc_events = 0;
+    uint64_t cdc_dropped = 0;            // events not delivered
+    // client side caching
+    uint64_t next_conn_id = 1;
+    HMap tracking;                   // key -> clients that read it
+    PrefixIndex tracking_prefixes;   // BCAST clients
+    uint64_t tracking_max = 1000000; // keys in `tracking`
+    std::vector<int> inval_pending;  // fds with invalidations to send
+    uint64_t tracking_clients = 0;
+    uint64_t tracking_invalidations = 0;
+    uint64_t tracking_overflows = 0;
+    // RESP clients on their own port
+    int resp_port = 0;  // 0 for none
+    Buffer reply_tmp;   // a RESP or v2 reply, before it is translated or framed
+    // protocol v2
+    std::vector<KeysJob *> keys_jobs;
+    uint64_t v2_late = 0;    // replies after those of later requests
+    uint64_t v2_expired = 0; // requests dropped past their deadline
+    uint64_t streams = 0;    // replies sent in chunks
+    uint64_t uploads = 0;    // SETBLOB
+    // WATCH: a version per bucket of keys, bumped by every change
+    std::vector<uint64_t> watch_versions = std::vector<uint64_t>(k_watch_buckets);
+    // EXEC or a script runs: values are read in place, no reply streams
+    bool atomic = false;
+    uint64_t tx_execs = 0;
+    uint64_t tx_aborts = 0; // by a watched key or a refused command
+    // scripts, by the sha1 of their source
+    std::map<std::string, Script *> scripts;
+    uint64_t script_max_ops = 1000000;
+    uint64_t script_max_ms = 100;
+    uint64_t script_runs = 0;
+    uint64_t script_budget_aborts = 0;
+};
+
+extern GlobalData g_data;
+extern std::mutex snap_mutex;
+
+// value type
+enum
+{
+    T_INIT = 0,
+    T_STR = 1,  // string
+    T_ZSET = 2, // sorted set
+    T_THROTTLE = 3, // rate limiter, the GCRA arrival time in `ival`
+    T_HASH = 4,     // field-value map
+};
+
+// a field of a hash in the table encoding
+struct HField
+{
+    HNode node;
+    std::string field;
+    std::string val;
+};
+
+// KV pair for db
+struct Entry
+{
+    struct HNode node;
+    std::string key;
+    // value
+    uint32_t type = 0;
+    std::string str;
+    bool int_enc = false; // a T_STR held in `ival`, `str` is empty
+    int64_t ival = 0;     // or a T_THROTTLE's arrival time, unix us
+    ZSet zset;
+    // T_HASH: fields packed in `str` while small, then a table of HField
+    HMap *hash = NULL;
+    size_t heap_idx = -1; // index of this entry in the heap
+    size_t zheap_idx = -1; // index of this entry in the zset member TTL heap
+    // access frequency, a logarithmic counter that decays over time
+    uint8_t lfu = 0;
+    uint16_t lfu_time = 0; // minutes
+    // the string value is also in the value log if vlog_off >= 0,
+    // a cold entry has only that copy
+    bool cold = false;
+    uint32_t vlog_seg = 0;
+    uint32_t vlog_len = 0;
+    int64_t vlog_off = -1;
+};
+
+struct LookupKey
+{
+    struct HNode node;
+    std::string key;
+};
+
+const uint64_t k_cron_interval_ms = 100; // periodic checks, e.g. save rules
+
+// protocol v2 response flags
+enum
+{
+    V2_RES_LATE = 1 << 0,    // after the replies of later requests
+    V2_RES_EXPIRED = 1 << 1, // not run, the deadline passed
+    V2_RES_PUSH = 1 << 2,    // not a reply: pub/sub, invalidations, ...
+};
+
+// hashes: up to k_hash_packed_max small fields are packed in `str` as
+// (len:u32 field len:u32 val)... and found by a scan. past that the hash
+// moves to a table of HField for good.
+const size_t k_hash_packed_max = 128;
+const size_t k_hash_packed_max_len = 64; // bytes of a field or a value
+
+typedef void (*HashVisit)(const char *field, size_t flen, const char *val, size_t vlen, void *arg);
+
+// written in sections of about this size, each with one write()
+const size_t k_snap_block = 1 << 20;
+
+struct SnapWriter
+{
+    int fd = -1;
+    bool ok = true;
+    Buffer buf;
+    size_t sec_start = 0; // section header in `buf`
+    uint32_t sec_count = 0;
+    int64_t now_wall = 0; // ms
+    int64_t now_mono = 0; // ms
+    bool framed = false;  // each block prefixed by its length, for a socket
+};
+
+// a pub/sub channel or pattern, or a prefix of a PrefixIndex
+struct Channel
+{
+    HNode node;
+    std::string name;
+    std::vector<Conn *> subs;
+};
+
+// server.cpp: helpers, connections, the keyspace and the data types
+void msg(const char *msg);
+void msg_errno(const char *msg);
+void die(const char *msg);
+uint64_t get_wall_sec();
+uint64_t get_wall_msec();
+uint64_t get_monotonic_msec();
+void fd_set_nb(int fd);
+void buf_append(Buffer &buf, const uint8_t *data, size_t len);
+void buf_consume(Buffer &buf, size_t n);
+Conn *conn_new(int fd);
+void conn_destroy(Conn *conn);
+size_t req_size(const uint8_t *data, size_t size);
+void buf_append_cmd(Buffer &buf, const std::vector<std::string> &cmd);
+int32_t parse_req(const uint8_t *data, size_t size, std::vector<std::string> &out);
+void buf_append_u8(Buffer &buf, uint8_t data);
+void out_nil(Buffer &out);
+void out_ok(Buffer &out);
+void out_str(Buffer &out, const char *s, size_t size);
+void out_int(Buffer &out, int64_t val);
+void out_arr(Buffer &out, uint32_t n);
+size_t out_begin_arr(Buffer &out);
+void out_end_arr(Buffer &out, size_t ctx, uint32_t n);
+uint8_t entry_lfu(Entry *ent);
+Entry *entry_new(uint32_t type);
+void entry_del_sync(Entry *ent);
+void entry_del(Entry *ent, bool lazy);
+bool cb_collect(HNode *node, void *arg);
+void db_free(HMap *db);
+void db_flush(bool async);
+bool entry_eq(HNode *lhs, HNode *key);
+HNode *db_lookup(LookupKey *key);
+HNode *db_delete(LookupKey *key);
+void entry_set_ttl(Entry *ent, int64_t ttl_ms);
+void entry_sync_zexpire(Entry *ent);
+bool str2int(const std::string &s, int64_t &out);
+std::string int2str(int64_t val);
+void hpack_append(std::string &buf, const char *field, uint32_t flen, const char *val, uint32_t vlen);
+void hash_insert(Entry *ent, const char *field, size_t flen, const char *val, size_t vlen);
+size_t hash_len(Entry *ent);
+void hash_convert(Entry *ent);
+void hash_foreach(Entry *ent, HashVisit f, void *arg);
+bool write_all(int fd, const uint8_t *data, size_t size);
+void response_begin(Buffer &out, size_t *header);
+void response_end(Buffer &out, size_t header);
+void v2_frame(Buffer &out, uint32_t id, uint32_t flags, const uint8_t *body, size_t size);
+void conn_reply(Conn *conn, uint32_t id, Buffer &body);
+void v2_resume(Conn *conn);
+bool try_one_request(Conn *conn);
+bool hnode_same(HNode *node, HNode *key);
+uint32_t watch_bucket(const std::string &key);
+void key_changed(const char *event, const std::string &key, const std::string *member = NULL);
+void keys_flushed();
+
+// persist.cpp: entry records and snapshots
+void entry_dump(Buffer &out, Entry *ent, int64_t now_wall, int64_t now_mono);
+Entry *entry_restore(SnapReader &r, int64_t now_wall, int64_t now_mono, int64_t &expire_at);
+bool snapshot_write(SnapWriter &w, uint64_t aof_base);
+void child_check_done(bool block);
+void bgsave_cron();
+bool load_snapshot_data(const uint8_t *data, size_t size, uint64_t *aof_base);
+bool load_snapshot(const char *filename, uint64_t *aof_base);
+
+// aof.cpp: the append-only log
+void propagate_replace(const std::vector<std::string> &cmd);
+void propagate(const std::vector<std::string> &cmd);
+void propagate_tx_begin();
+void propagate_tx_end();
+uint64_t stream_apply(StreamTx &tx, std::vector<std::string> &cmd, size_t size);
+void aof_remove_old(uint64_t base);
+void aof_flush();
+void aof_rotate();
+bool conn_aof_blocked(Conn *conn);
+void aof_load(uint64_t base);
+void aof_shutdown();
+uint64_t aof_disk_size();
+void aof_rewrite_done(bool ok, pid_t pid);
+void aof_rewrite_cron();
+
+// image.cpp: warm restart
+void img_drop();
+void img_adopt(LookupKey *key);
+void img_adopt_cron();
+void img_adopt_all();
+bool img_open(const char *filename, uint64_t *aof_base);
+bool img_save(const char *filename);
+
+// tier.cpp: cold values in the value log
+void vlog_remove_files();
+void entry_vlog_forget(Entry *ent);
+const std::string &entry_str(Entry *ent, std::string &tmp);
+void tier_reset();
+void cold_read_cancel(Entry *ent);
+bool entry_ensure_hot(Entry *ent);
+uint64_t used_memory();
+void tier_cron();
+
+// replication.cpp
+void repl_new_replid();
+void repl_new_history();
+void repl_feed_backlog();
+void repl_feed();
+void repl_sync_done(bool ok);
+void repl_transfer_reset();
+bool repl_link_step(Conn *conn);
+void repl_cron();
+
+// cluster.cpp: slots and MIGRATE
+void cluster_init();
+bool cluster_load();
+bool migrate_link_step(Conn *conn);
+void migrate_link_gone(Conn *conn);
+
+// pubsub.cpp: channels and pushed messages
+Channel *channel_find(HMap *map, const std::string &name, bool create);
+bool channel_unsub(HMap *map, const std::string &name, Conn *conn);
+bool glob_match(const std::string &pat, const std::string &s);
+void pubmsg_unref(PubMsg *m);
+PubMsg *pubmsg_for(PubMsg *m, int proto);
+void conn_queue_msg(Conn *conn, PubMsg *m);
+void conn_pubq_consume(Conn *conn, size_t n);
+void pubsub_push(Conn *conn, PubMsg *m);
+void pubsub_cron();
+void pubsub_conn_gone(Conn *conn);
+
+// cdc.cpp: connections by key prefix, and the change feed
+void prefix_add(PrefixIndex &idx, const std::string &prefix, Conn *conn);
+bool prefix_del(PrefixIndex &idx, const std::string &prefix, Conn *conn);
+void prefix_foreach(PrefixIndex &idx, const std::string &key, void (*f)(Conn *, void *), void *arg);
+void cdc_conn_gone(Conn *conn);
+void cdc_emit(const char *event, const std::string &key, const std::string *member);
+void cdc_emit_all(const char *event);
+void cdc_flush();
+
+// tracking.cpp: client side caching
+void tracking_flush_all(bool bcast_too);
+void tracking_invalidate(const std::string &k);
+void tracking_send();
+void tracking_off(Conn *conn);
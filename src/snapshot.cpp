@@ -0,0 +1,127 @@
+#include "snapshot.h"
+#include <endian.h>
+#include <string.h>
+
+// CRC-32 (IEEE), slicing by 8 bytes
+static uint32_t g_crc_table[8][256];
+
+static bool crc32_init()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+        {
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+        g_crc_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        for (int t = 1; t < 8; t++)
+        {
+            uint32_t prev = g_crc_table[t - 1][i];
+            g_crc_table[t][i] = g_crc_table[0][prev & 0xff] ^ (prev >> 8);
+        }
+    }
+    return true;
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size)
+{
+    static bool init = crc32_init();
+    (void)init;
+    crc = ~crc;
+    while (size >= 8)
+    {
+        uint32_t lo = 0, hi = 0;
+        memcpy(&lo, data, 4);
+        memcpy(&hi, data + 4, 4);
+        lo ^= crc;
+        crc = g_crc_table[7][lo & 0xff] ^ g_crc_table[6][(lo >> 8) & 0xff] ^
+              g_crc_table[5][(lo >> 16) & 0xff] ^ g_crc_table[4][lo >> 24] ^
+              g_crc_table[3][hi & 0xff] ^ g_crc_table[2][(hi >> 8) & 0xff] ^
+              g_crc_table[1][(hi >> 16) & 0xff] ^ g_crc_table[0][hi >> 24];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+    {
+        crc = g_crc_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void snap_append_u32(std::vector<uint8_t> &buf, uint32_t v)
+{
+    v = htole32(v);
+    buf.insert(buf.end(), (const uint8_t *)&v, (const uint8_t *)&v + 4);
+}
+
+void snap_append_u64(std::vector<uint8_t> &buf, uint64_t v)
+{
+    v = htole64(v);
+    buf.insert(buf.end(), (const uint8_t *)&v, (const uint8_t *)&v + 8);
+}
+
+void snap_append_dbl(std::vector<uint8_t> &buf, double v)
+{
+    uint64_t bits = 0;
+    memcpy(&bits, &v, 8);
+    snap_append_u64(buf, bits);
+}
+
+bool snap_read(SnapReader &r, void *out, size_t size)
+{
+    if (!r.ok || (size_t)(r.end - r.cur) < size)
+    {
+        r.ok = false;
+        return false;
+    }
+    memcpy(out, r.cur, size);
+    r.cur += size;
+    return true;
+}
+
+uint8_t snap_read_u8(SnapReader &r)
+{
+    uint8_t v = 0;
+    snap_read(r, &v, sizeof(v));
+    return v;
+}
+
+uint32_t snap_read_u32(SnapReader &r)
+{
+    uint32_t v = 0;
+    snap_read(r, &v, sizeof(v));
+    return le32toh(v);
+}
+
+uint64_t snap_read_u64(SnapReader &r)
+{
+    uint64_t v = 0;
+    snap_read(r, &v, sizeof(v));
+    return le64toh(v);
+}
+
+double snap_read_dbl(SnapReader &r)
+{
+    uint64_t bits = snap_read_u64(r);
+    double v = 0;
+    memcpy(&v, &bits, 8);
+    return v;
+}
+
+const uint8_t *snap_read_str(SnapReader &r, uint32_t &len)
+{
+    len = snap_read_u32(r);
+    if (!r.ok || (size_t)(r.end - r.cur) < len)
+    {
+        r.ok = false;
+        len = 0;
+        return NULL;
+    }
+    const uint8_t *data = r.cur;
+    r.cur += len;
+    return data;
+}
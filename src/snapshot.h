@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// snapshot file v2, integers are little-endian
+//
+//   header:  magic[8] version:u32 nkeys:u64 aof_base:u64 crc:u32
+//   section: kind:u8 count:u32 len:u64 payload[len] crc:u32
+//
+// the header crc covers the fields before it, a section crc covers its
+// payload. the last section is SNAP_SEC_END with no payload.
+const char k_snap_magic[8] = {'P', 'H', 'O', 'T', 'O', 'N', 'D', 'B'};
+const uint32_t k_snap_version = 2;
+const size_t k_snap_header_size = 8 + 4 + 8 + 8 + 4;
+const size_t k_snap_section_header = 1 + 4 + 8;
+
+enum
+{
+    SNAP_SEC_END = 0,
+    SNAP_SEC_ENTRIES = 1, // `count` serialized entries
+};
+
+// entry record flags
+enum
+{
+    SNAP_F_TTL = 1 << 0,        // followed by the expiration, unix ms
+    SNAP_F_MEMBER_TTL = 1 << 1, // zset members carry an expiration, -1 for none
+    SNAP_F_INT = 1 << 2,        // an integer string, stored as i64
+};
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size);
+
+// little-endian encoding for the formats in this file
+void snap_append_u32(std::vector<uint8_t> &buf, uint32_t v);
+void snap_append_u64(std::vector<uint8_t> &buf, uint64_t v);
+void snap_append_dbl(std::vector<uint8_t> &buf, double v);
+
+// bounds-checked decoding of an in-memory image, sticky on error
+struct SnapReader
+{
+    const uint8_t *cur = NULL;
+    const uint8_t *end = NULL;
+    bool ok = true;
+};
+
+bool snap_read(SnapReader &r, void *out, size_t size);
+uint8_t snap_read_u8(SnapReader &r);
+uint32_t snap_read_u32(SnapReader &r);
+uint64_t snap_read_u64(SnapReader &r);
+double snap_read_dbl(SnapReader &r);
+// a u32 length followed by the bytes, points into the image
+const uint8_t *snap_read_str(SnapReader &r, uint32_t &len);
+
+// warm restart image, written on a clean shutdown and mapped at startup.
+// entries are adopted into the keyspace on access and in the background.
+//
+//   header:  magic[8] version:u32 nkeys:u64 nslots:u64 slots_off:u64 aof_base:u64 crc:u32
+//   record:  next:u64 hcode:u64 adopted:u8 entry
+//   slots:   nslots x u64, the offset of the first record of each chain, 0 for none
+//
+// `next` chains the records of a slot, `entry` is a serialized entry.
+const char k_img_magic[8] = {'P', 'H', 'O', 'T', 'O', 'I', 'M', 'G'};
+const uint32_t k_img_version = 1;
+const size_t k_img_header_size = 8 + 4 + 8 + 8 + 8 + 8 + 4;
+const size_t k_img_record_header = 8 + 8 + 1;
@@ -1,23 +1,204 @@
 #include "thread_pool.h"
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+static thread_local Worker *tl_worker = NULL; // NULL outside the pool
+
+static uint64_t get_monotonic_usec()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+static void atomic_max(std::atomic<uint64_t> &a, uint64_t val)
+{
+    uint64_t cur = a.load();
+    while (cur < val && !a.compare_exchange_weak(cur, val))
+    {
+    }
+}
+
+// owner only
+static bool deque_push(WorkDeque *d, Work *w)
+{
+    int64_t b = d->bottom.load();
+    int64_t t = d->top.load();
+    if (b - t >= (int64_t)k_deque_cap)
+    {
+        return false; // full
+    }
+    d->slots[b & (k_deque_cap - 1)].store(w);
+    d->bottom.store(b + 1);
+    return true;
+}
+
+// owner only, LIFO
+static Work *deque_pop(WorkDeque *d)
+{
+    int64_t b = d->bottom.load() - 1;
+    d->bottom.store(b);
+    int64_t t = d->top.load();
+    if (t > b)
+    { // empty
+        d->bottom.store(b + 1);
+        return NULL;
+    }
+    Work *w = d->slots[b & (k_deque_cap - 1)].load();
+    if (t == b)
+    { // last item, race with thieves
+        if (!d->top.compare_exchange_strong(t, t + 1))
+        {
+            w = NULL;
+        }
+        d->bottom.store(b + 1);
+    }
+    return w;
+}
+
+// any thread, FIFO
+static Work *deque_steal(WorkDeque *d)
+{
+    int64_t t = d->top.load();
+    int64_t b = d->bottom.load();
+    if (t >= b)
+    {
+        return NULL; // empty
+    }
+    Work *w = d->slots[t & (k_deque_cap - 1)].load();
+    if (!d->top.compare_exchange_strong(t, t + 1))
+    {
+        return NULL; // lost the race
+    }
+    return w;
+}
+
+static Work *inbox_pop(Worker *wk, int prio, bool wait_lock)
+{
+    if (wait_lock)
+    {
+        pthread_mutex_lock(&wk->inbox_mu);
+    }
+    else if (pthread_mutex_trylock(&wk->inbox_mu) != 0)
+    {
+        return NULL; // don't pile up on a busy shard
+    }
+    Work *w = NULL;
+    if (!wk->inbox[prio].empty())
+    {
+        w = wk->inbox[prio].front();
+        wk->inbox[prio].pop_front();
+    }
+    pthread_mutex_unlock(&wk->inbox_mu);
+    return w;
+}
+
+// find a task: own deque, own inbox, then steal from others
+static Work *find_work(ThreadPool *tp, Worker *self, size_t start)
+{
+    size_t n = tp->workers.size();
+    for (int prio = 0; prio < PRIO_COUNT; prio++)
+    {
+        if (self)
+        {
+            if (Work *w = deque_pop(&self->local[prio]))
+                return w;
+            if (Work *w = inbox_pop(self, prio, true))
+                return w;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            Worker *victim = tp->workers[(start + i) % n];
+            if (victim == self)
+                continue;
+            Work *w = deque_steal(&victim->local[prio]);
+            if (!w)
+                w = inbox_pop(victim, prio, false);
+            if (w)
+            {
+                tp->steals++;
+                return w;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void group_finish(ThreadPool *tp, TaskGroup *group)
+{
+    pthread_mutex_lock(&group->mu);
+    assert(group->pending > 0);
+    bool last = --group->pending == 0;
+    void (*done)(void *) = group->done;
+    if (last)
+    {
+        pthread_cond_broadcast(&group->done_cond);
+    }
+    // the group may be freed by a waiter once unlocked
+    pthread_mutex_unlock(&group->mu);
+
+    if (last && done)
+    {
+        pthread_mutex_lock(&tp->done_mu);
+        tp->done_groups.push_back(group);
+        pthread_mutex_unlock(&tp->done_mu);
+        uint64_t one = 1;
+        ssize_t rv = write(tp->done_fd, &one, sizeof(one));
+        (void)rv;
+    }
+}
+
+static void run_work(ThreadPool *tp, Work *w)
+{
+    tp->pending--;
+    tp->queued[w->prio]--;
+    uint64_t start_us = get_monotonic_usec();
+    uint64_t wait_us = start_us - w->queued_us;
+    tp->wait_us_total += wait_us;
+    atomic_max(tp->wait_us_max, wait_us);
+
+    w->f(w->arg);
+
+    uint64_t run_us = get_monotonic_usec() - start_us;
+    tp->run_us_total += run_us;
+    atomic_max(tp->run_us_max, run_us);
+    tp->completed++;
+    if (w->group)
+    {
+        group_finish(tp, w->group);
+    }
+    delete w;
+}
 
 static void *worker(void *arg)
 {
-    ThreadPool *tp = (ThreadPool *)arg;
+    Worker *self = (Worker *)arg;
+    ThreadPool *tp = self->tp;
+    tl_worker = self;
+    size_t start = 0;
     while (true)
     {
-        pthread_mutex_lock(&tp->mu);
-        // wait for condition i.e a non empty queue
-        while (tp->queue.empty())
+        if (Work *w = find_work(tp, self, start++))
         {
-            pthread_cond_wait(&tp->not_empty, &tp->mu);
+            run_work(tp, w);
+            continue;
+        }
+        // nothing to do, sleep until a submission
+        pthread_mutex_lock(&tp->idle_mu);
+        tp->sleepers++; // before checking `pending`, pairs with submit
+        while (tp->pending.load() == 0 && !tp->stop.load())
+        {
+            pthread_cond_wait(&tp->not_empty, &tp->idle_mu);
+        }
+        tp->sleepers--;
+        bool quit = tp->stop.load() && tp->pending.load() == 0;
+        pthread_mutex_unlock(&tp->idle_mu);
+        if (quit)
+        {
+            break;
         }
-
-        // got the job
-        Work w = tp->queue.front();
-        tp->queue.pop_front();
-        pthread_mutex_unlock(&tp->mu);
-        w.f(w.arg);
     }
     return NULL;
 }
@@ -26,23 +207,186 @@ void thread_pool_init(ThreadPool *tp, size_t num_threads)
 {
     assert(num_threads > 0);
 
-    int rv = pthread_mutex_init(&tp->mu, NULL);
+    int rv = pthread_mutex_init(&tp->idle_mu, NULL);
     assert(rv == 0);
     rv = pthread_cond_init(&tp->not_empty, NULL);
     assert(rv == 0);
+    rv = pthread_mutex_init(&tp->done_mu, NULL);
+    assert(rv == 0);
+    tp->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(tp->done_fd >= 0);
+    for (int prio = 0; prio < PRIO_COUNT; prio++)
+    {
+        tp->queued[prio] = 0;
+    }
 
-    tp->threads.resize(num_threads);
+    // all workers exist before any of them starts stealing
+    tp->workers.resize(num_threads);
     for (size_t i = 0; i < num_threads; i++)
     {
-        int rv = pthread_create(&tp->threads[i], NULL, &worker, tp);
+        tp->workers[i] = new Worker();
+        tp->workers[i]->tp = tp;
+        rv = pthread_mutex_init(&tp->workers[i]->inbox_mu, NULL);
         assert(rv == 0);
     }
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        rv = pthread_create(&tp->workers[i]->thread, NULL, &worker, tp->workers[i]);
+        assert(rv == 0);
+    }
+    (void)rv;
+}
+
+void thread_pool_destroy(ThreadPool *tp)
+{
+    pthread_mutex_lock(&tp->idle_mu);
+    tp->stop = true;
+    pthread_cond_broadcast(&tp->not_empty);
+    pthread_mutex_unlock(&tp->idle_mu);
+
+    for (Worker *wk : tp->workers)
+    {
+        pthread_join(wk->thread, NULL);
+    }
+    // others may steal from a worker until they all exit
+    for (Worker *wk : tp->workers)
+    {
+        pthread_mutex_destroy(&wk->inbox_mu);
+        delete wk;
+    }
+    tp->workers.clear();
+    // callbacks of the last groups still belong to the event loop
+    thread_pool_run_done(tp);
+    close(tp->done_fd);
+    tp->done_fd = -1;
+    pthread_mutex_destroy(&tp->done_mu);
+    pthread_cond_destroy(&tp->not_empty);
+    pthread_mutex_destroy(&tp->idle_mu);
+}
+
+void thread_pool_submit(ThreadPool *tp, TaskGroup *group, int prio,
+                        void (*f)(void *), void *arg)
+{
+    assert(prio >= 0 && prio < PRIO_COUNT);
+    if (group)
+    {
+        pthread_mutex_lock(&group->mu);
+        group->pending++;
+        pthread_mutex_unlock(&group->mu);
+    }
+    Work *w = new Work{f, arg, group, prio, get_monotonic_usec()};
+    tp->queued[prio]++;
+    tp->pending++; // visible before the task, a thief may run it right away
+
+    Worker *self = tl_worker;
+    if (!self || self->tp != tp || !deque_push(&self->local[prio], w))
+    {
+        // from outside the pool (or a full deque): pick an inbox
+        Worker *wk = self && self->tp == tp
+                         ? self
+                         : tp->workers[tp->next_inbox++ % tp->workers.size()];
+        pthread_mutex_lock(&wk->inbox_mu);
+        wk->inbox[prio].push_back(w);
+        pthread_mutex_unlock(&wk->inbox_mu);
+    }
+
+    if (tp->sleepers.load() > 0)
+    {
+        pthread_mutex_lock(&tp->idle_mu);
+        pthread_cond_signal(&tp->not_empty);
+        pthread_mutex_unlock(&tp->idle_mu);
+    }
 }
 
 void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg)
 {
-    pthread_mutex_lock(&tp->mu);
-    tp->queue.push_back(Work{f, arg});
-    pthread_cond_signal(&tp->not_empty);
-    pthread_mutex_unlock(&tp->mu);
-}
\ No newline at end of file
+    thread_pool_submit(tp, NULL, PRIO_BACKGROUND, f, arg);
+}
+
+void thread_pool_stats(ThreadPool *tp, ThreadPoolStats *stats)
+{
+    for (int prio = 0; prio < PRIO_COUNT; prio++)
+    {
+        stats->queued[prio] = tp->queued[prio].load();
+    }
+    stats->completed = tp->completed.load();
+    stats->steals = tp->steals.load();
+    stats->wait_us_total = tp->wait_us_total.load();
+    stats->wait_us_max = tp->wait_us_max.load();
+    stats->run_us_total = tp->run_us_total.load();
+    stats->run_us_max = tp->run_us_max.load();
+}
+
+int thread_pool_done_fd(ThreadPool *tp)
+{
+    return tp->done_fd;
+}
+
+// run the completion callbacks of finished groups, on the event loop
+void thread_pool_run_done(ThreadPool *tp)
+{
+    uint64_t cnt = 0;
+    ssize_t rv = read(tp->done_fd, &cnt, sizeof(cnt)); // reset the eventfd
+    (void)rv;
+
+    std::vector<TaskGroup *> groups;
+    pthread_mutex_lock(&tp->done_mu);
+    groups.swap(tp->done_groups);
+    pthread_mutex_unlock(&tp->done_mu);
+    for (TaskGroup *group : groups)
+    {
+        group->done(group->done_arg); // may free the group
+    }
+}
+
+void task_group_init(TaskGroup *group, void (*done)(void *), void *arg)
+{
+    group->pending = 1; // held open until task_group_close()
+    int rv = pthread_mutex_init(&group->mu, NULL);
+    assert(rv == 0);
+    rv = pthread_cond_init(&group->done_cond, NULL);
+    assert(rv == 0);
+    (void)rv;
+    group->done = done;
+    group->done_arg = arg;
+}
+
+void task_group_destroy(TaskGroup *group)
+{
+    pthread_cond_destroy(&group->done_cond);
+    pthread_mutex_destroy(&group->mu);
+}
+
+void task_group_close(ThreadPool *tp, TaskGroup *group)
+{
+    group_finish(tp, group);
+}
+
+void task_group_wait(ThreadPool *tp, TaskGroup *group)
+{
+    task_group_close(tp, group);
+    size_t start = 0;
+    while (true)
+    {
+        pthread_mutex_lock(&group->mu);
+        bool done = group->pending == 0;
+        pthread_mutex_unlock(&group->mu);
+        if (done)
+        {
+            return;
+        }
+        // help instead of blocking while there is queued work
+        if (Work *w = find_work(tp, tl_worker, start++))
+        {
+            run_work(tp, w);
+            continue;
+        }
+        pthread_mutex_lock(&group->mu);
+        while (group->pending > 0)
+        {
+            pthread_cond_wait(&group->done_cond, &group->mu);
+        }
+        pthread_mutex_unlock(&group->mu);
+        return;
+    }
+}
@@ -1,23 +1,114 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+#include <atomic>
 #include <deque>
 #include <pthread.h>
 #include <vector>
 
+// task priorities, lower runs first
+enum
+{
+    PRIO_CRITICAL = 0,   // a client is waiting on the result
+    PRIO_BACKGROUND = 1, // lazy frees, snapshots, merges
+    PRIO_COUNT = 2,
+};
+
+struct TaskGroup;
+
 struct Work
 {
     void (*f)(void *) = NULL;
     void *arg = NULL;
+    TaskGroup *group = NULL;
+    int prio = PRIO_BACKGROUND;
+    uint64_t queued_us = 0; // for latency metrics
 };
 
-struct ThreadPool
+// bounded Chase-Lev deque: the owner pushes and pops at the bottom,
+// other workers steal from the top without taking a lock
+const size_t k_deque_cap = 1024; // 2^n
+struct WorkDeque
 {
-    std::vector<pthread_t> threads;
-    std::deque<Work> queue;
+    std::atomic<int64_t> top{0};
+    std::atomic<int64_t> bottom{0};
+    std::atomic<Work *> slots[k_deque_cap] = {};
+};
+
+struct ThreadPool;
+
+struct Worker
+{
+    ThreadPool *tp = NULL;
+    pthread_t thread;
+    WorkDeque local[PRIO_COUNT]; // tasks spawned by this worker
+    // tasks submitted from outside the pool, sharded to spread the lock
+    pthread_mutex_t inbox_mu;
+    std::deque<Work *> inbox[PRIO_COUNT];
+};
+
+// a set of tasks whose completion is observed as a unit. a group starts
+// open and completes when its last task finishes after it is closed.
+struct TaskGroup
+{
+    size_t pending = 0; // tasks + 1 while open, guarded by mu
     pthread_mutex_t mu;
+    pthread_cond_t done_cond;
+    // optional callback, runs on the event loop after the last task
+    void (*done)(void *) = NULL;
+    void *done_arg = NULL;
+};
+
+struct ThreadPoolStats
+{
+    size_t queued[PRIO_COUNT] = {}; // queue depth
+    uint64_t completed = 0;
+    uint64_t steals = 0;
+    uint64_t wait_us_total = 0; // time spent queued
+    uint64_t wait_us_max = 0;
+    uint64_t run_us_total = 0; // time spent running
+    uint64_t run_us_max = 0;
+};
+
+struct ThreadPool
+{
+    std::vector<Worker *> workers;
+    std::atomic<size_t> next_inbox{0}; // round robin for outside submissions
+    std::atomic<size_t> pending{0};    // queued, not yet taken
+    std::atomic<bool> stop{false};
+    // idle workers sleep here
+    pthread_mutex_t idle_mu;
     pthread_cond_t not_empty;
+    std::atomic<size_t> sleepers{0};
+    // finished task groups waiting for the event loop
+    pthread_mutex_t done_mu;
+    std::vector<TaskGroup *> done_groups;
+    int done_fd = -1; // eventfd, readable when done_groups is non-empty
+    // metrics
+    std::atomic<size_t> queued[PRIO_COUNT];
+    std::atomic<uint64_t> completed{0};
+    std::atomic<uint64_t> steals{0};
+    std::atomic<uint64_t> wait_us_total{0};
+    std::atomic<uint64_t> wait_us_max{0};
+    std::atomic<uint64_t> run_us_total{0};
+    std::atomic<uint64_t> run_us_max{0};
 };
 
 void thread_pool_init(ThreadPool *tp, size_t num_threads);
-void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg);
\ No newline at end of file
+void thread_pool_destroy(ThreadPool *tp); // runs the remaining tasks and joins
+void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg);
+void thread_pool_submit(ThreadPool *tp, TaskGroup *group, int prio,
+                        void (*f)(void *), void *arg);
+void thread_pool_stats(ThreadPool *tp, ThreadPoolStats *stats);
+
+// completions are posted back to the event loop through an fd
+int thread_pool_done_fd(ThreadPool *tp);
+void thread_pool_run_done(ThreadPool *tp);
+
+void task_group_init(TaskGroup *group, void (*done)(void *), void *arg);
+void task_group_destroy(TaskGroup *group);
+// no more tasks; `done` runs once the submitted ones finish
+void task_group_close(ThreadPool *tp, TaskGroup *group);
+// close, then block until all tasks of the group finish, helping with queued work
+void task_group_wait(ThreadPool *tp, TaskGroup *group);
@@ -0,0 +1,511 @@
+#include "server.h"
+
+// tiered storage: past --maxmemory, the string values of rarely used
+// keys move to append-only value log files. the key and the location of
+// the value stay in memory, reading it parks the client until it is back.
+//
+//   record: klen:u32 key vlen:u32 value crc:u32 (crc of the value)
+
+static void vlog_segment_name(uint32_t id, char *buf, size_t size)
+{
+    snprintf(buf, size, "photon.vlog.%u", id);
+}
+
+static VlogSeg *vlog_seg(uint32_t id)
+{
+    return id < g_data.vlog_segs.size() ? g_data.vlog_segs[id] : NULL;
+}
+
+static bool pread_all(int fd, void *buf, size_t size, int64_t off)
+{
+    uint8_t *p = (uint8_t *)buf;
+    while (size > 0)
+    {
+        ssize_t rv = pread(fd, p, size, (off_t)off);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            return false;
+        }
+        p += rv;
+        off += rv;
+        size -= (size_t)rv;
+    }
+    return true;
+}
+
+static bool vlog_read(int fd, int64_t off, uint32_t len, std::string &out)
+{
+    out.resize(len);
+    uint32_t crc = 0;
+    bool ok = pread_all(fd, &out[0], len, off) && pread_all(fd, &crc, 4, off + len);
+    return ok && le32toh(crc) == crc32_update(0, (const uint8_t *)out.data(), len);
+}
+
+// append a record to `buf`, which goes to the end of `seg`.
+// returns the file offset of the value.
+static int64_t vlog_add_record(Buffer &buf, VlogSeg *seg, const std::string &key,
+                               const uint8_t *val, uint32_t len)
+{
+    snap_append_u32(buf, (uint32_t)key.size());
+    buf_append(buf, (const uint8_t *)key.data(), key.size());
+    snap_append_u32(buf, len);
+    int64_t off = (int64_t)(seg->size + buf.size());
+    buf_append(buf, val, len);
+    snap_append_u32(buf, crc32_update(0, val, len));
+    return off;
+}
+
+static bool vlog_write(VlogSeg *seg, const Buffer &buf)
+{
+    size_t nwritten = 0;
+    while (nwritten < buf.size())
+    {
+        ssize_t rv = pwrite(seg->fd, &buf[nwritten], buf.size() - nwritten,
+                            (off_t)(seg->size + nwritten));
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            msg_errno("pwrite() value log");
+            return false;
+        }
+        nwritten += (size_t)rv;
+    }
+    seg->size += buf.size();
+    return true;
+}
+
+// the segment new records go to
+static VlogSeg *vlog_open_active()
+{
+    const uint64_t k_vlog_seg_max = 64 << 20;
+    if (g_data.vlog_active && g_data.vlog_active->size < k_vlog_seg_max)
+    {
+        return g_data.vlog_active;
+    }
+    VlogSeg *seg = new VlogSeg();
+    seg->id = (uint32_t)g_data.vlog_segs.size();
+    char name[64];
+    vlog_segment_name(seg->id, name, sizeof(name));
+    seg->fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (seg->fd < 0)
+    {
+        msg_errno("open() value log");
+        delete seg;
+        return NULL;
+    }
+    g_data.vlog_segs.push_back(seg);
+    g_data.vlog_active = seg;
+    return seg;
+}
+
+static void vlog_remove(VlogSeg *seg)
+{
+    char name[64];
+    vlog_segment_name(seg->id, name, sizeof(name));
+    close(seg->fd);
+    unlink(name);
+    if (g_data.vlog_active == seg)
+    {
+        g_data.vlog_active = NULL;
+    }
+    g_data.vlog_segs[seg->id] = NULL;
+    delete seg;
+}
+
+// the value log is a cache of the keyspace, it is not kept across restarts
+void vlog_remove_files()
+{
+    DIR *dir = opendir(".");
+    if (!dir)
+    {
+        return;
+    }
+    while (struct dirent *de = readdir(dir))
+    {
+        if (strncmp(de->d_name, "photon.vlog.", 12) == 0)
+        {
+            unlink(de->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+// the record is no longer the value of the entry
+void entry_vlog_forget(Entry *ent)
+{
+    if (ent->vlog_off < 0)
+    {
+        return;
+    }
+    if (VlogSeg *seg = vlog_seg(ent->vlog_seg))
+    {
+        seg->garbage += 4 + ent->key.size() + 4 + ent->vlog_len + 4;
+    }
+    if (ent->cold)
+    {
+        ent->cold = false;
+        g_data.tier_cold_keys--;
+    }
+    ent->vlog_off = -1;
+}
+
+// the string value, read from the value log if it's cold
+const std::string &entry_str(Entry *ent, std::string &tmp)
+{
+    if (ent->int_enc)
+    {
+        tmp = int2str(ent->ival);
+        return tmp;
+    }
+    if (!ent->cold)
+    {
+        return ent->str;
+    }
+    VlogSeg *seg = vlog_seg(ent->vlog_seg);
+    if (!seg || !vlog_read(seg->fd, ent->vlog_off, ent->vlog_len, tmp))
+    {
+        msg("value log: read failed");
+        tmp.clear();
+    }
+    return tmp;
+}
+
+// the entries are gone, so is the value log
+void tier_reset()
+{
+    for (ColdRead *rd : g_data.cold_reads)
+    {
+        rd->ent = NULL;
+    }
+    for (VlogSeg *seg : g_data.vlog_segs)
+    {
+        if (seg)
+        {
+            vlog_remove(seg);
+        }
+    }
+    g_data.vlog_segs.clear();
+    g_data.vlog_active = NULL;
+    g_data.tier_cold_keys = 0;
+}
+
+void cold_read_cancel(Entry *ent)
+{
+    for (ColdRead *rd : g_data.cold_reads)
+    {
+        if (rd->ent == ent)
+        {
+            rd->ent = NULL;
+        }
+    }
+}
+
+static void cold_read_func(void *arg)
+{
+    ColdRead *rd = (ColdRead *)arg;
+    rd->ok = vlog_read(rd->fd, rd->off, rd->len, rd->value);
+    close(rd->fd);
+}
+
+// run the requests of a client that was waiting for a cold value
+static void conn_resume(Conn *conn)
+{
+    conn->parked = false;
+    v2_resume(conn);
+    while (try_one_request(conn))
+    {
+    }
+    if (conn_has_output(conn))
+    {
+        conn->want_read = false;
+        conn->want_write = true;
+    }
+}
+
+// on the event loop: promote the value, then resume the clients
+static void cold_read_done(void *arg)
+{
+    ColdRead *rd = (ColdRead *)arg;
+    g_data.cold_reads.erase(std::find(g_data.cold_reads.begin(), g_data.cold_reads.end(), rd));
+    Entry *ent = rd->ent;
+    // it may have been overwritten or moved by a compaction meanwhile
+    if (ent && ent->cold && ent->vlog_seg == rd->seg && ent->vlog_off == rd->off)
+    {
+        if (rd->ok)
+        {
+            // the record stays as a clean copy, spilling it again is free
+            ent->str.swap(rd->value);
+            ent->cold = false;
+            g_data.tier_cold_keys--;
+        }
+        else
+        {
+            msg("value log: read failed, dropping the key");
+            hm_delete(&g_data.db, &ent->node, &hnode_same);
+            propagate({"DEL", ent->key});
+            entry_del(ent, true);
+        }
+    }
+    task_group_destroy(&rd->group);
+    for (int fd : rd->waiters)
+    {
+        Conn *conn = (size_t)fd < g_data.fd2conn.size() ? g_data.fd2conn[fd] : NULL;
+        if (conn && (conn->parked || !conn->deferred.empty()))
+        {
+            conn_resume(conn);
+        }
+    }
+    delete rd;
+}
+
+// false if the client is parked until the value is read back
+bool entry_ensure_hot(Entry *ent)
+{
+    if (!ent->cold)
+    {
+        return true;
+    }
+    VlogSeg *seg = vlog_seg(ent->vlog_seg);
+    if (!g_data.cur_conn || g_data.atomic || !seg)
+    {
+        // no client to park, e.g. replaying the log
+        std::string tmp;
+        ent->str.swap((std::string &)entry_str(ent, tmp));
+        ent->cold = false;
+        g_data.tier_cold_keys--;
+        return true;
+    }
+    ColdRead *rd = NULL;
+    for (ColdRead *cur : g_data.cold_reads)
+    {
+        if (cur->ent == ent && cur->seg == ent->vlog_seg && cur->off == ent->vlog_off)
+        {
+            rd = cur;
+        }
+    }
+    if (!rd)
+    {
+        rd = new ColdRead();
+        rd->ent = ent;
+        rd->fd = dup(seg->fd);
+        rd->seg = ent->vlog_seg;
+        rd->off = ent->vlog_off;
+        rd->len = ent->vlog_len;
+        task_group_init(&rd->group, &cold_read_done, rd);
+        thread_pool_submit(&g_data.thread_pool, &rd->group, PRIO_CRITICAL, &cold_read_func, rd);
+        task_group_close(&g_data.thread_pool, &rd->group);
+        g_data.cold_reads.push_back(rd);
+        g_data.tier_cold_reads++;
+    }
+    // a v2 client may wait on it for several requests
+    int fd = g_data.cur_conn->fd;
+    if (std::find(rd->waiters.begin(), rd->waiters.end(), fd) == rd->waiters.end())
+    {
+        rd->waiters.push_back(fd);
+    }
+    g_data.parked = true;
+    return false;
+}
+
+// move the values of the least frequently used keys out of memory
+static void tier_spill(uint64_t used)
+{
+    const size_t k_tier_spill_work = 1000;
+    const size_t k_tier_samples = 16;
+    const size_t k_tier_min_value = 64; // not worth it below the location record
+    VlogSeg *seg = vlog_open_active();
+    if (!seg)
+    {
+        return;
+    }
+    Buffer buf;
+    std::vector<Entry *> victims;
+    uint64_t freed = 0;
+    size_t misses = 0;
+    while (used > g_data.maxmemory + freed && victims.size() < k_tier_spill_work &&
+           misses < k_tier_samples)
+    {
+        HNode *nodes[k_tier_samples];
+        uint64_t rnd = ((uint64_t)rand() << 31) ^ (uint64_t)rand();
+        size_t n = hm_sample(&g_data.db, rnd, nodes, k_tier_samples);
+        Entry *best = NULL;
+        for (size_t i = 0; i < n; i++)
+        {
+            Entry *ent = container_of(nodes[i], Entry, node);
+            if (ent->type != T_STR || ent->cold || ent->str.size() < k_tier_min_value)
+            {
+                continue;
+            }
+            if (!best || entry_lfu(ent) < entry_lfu(best))
+            {
+                best = ent;
+            }
+        }
+        if (!best)
+        {
+            misses++;
+            continue;
+        }
+        best->cold = true; // not picked again
+        victims.push_back(best);
+        freed += best->str.capacity();
+        if (best->vlog_off < 0)
+        {
+            best->vlog_seg = seg->id;
+            best->vlog_len = (uint32_t)best->str.size();
+            best->vlog_off = vlog_add_record(buf, seg, best->key,
+                                             (const uint8_t *)best->str.data(), best->vlog_len);
+        }
+    }
+    uint64_t old_size = seg->size;
+    bool ok = vlog_write(seg, buf);
+    for (Entry *ent : victims)
+    {
+        if (!ok)
+        {
+            ent->cold = false;
+            if (ent->vlog_seg == seg->id && ent->vlog_off >= (int64_t)old_size)
+            {
+                ent->vlog_off = -1;
+            }
+            continue;
+        }
+        std::string().swap(ent->str);
+        g_data.tier_cold_keys++;
+        g_data.tier_spills++;
+    }
+}
+
+struct VlogCompaction
+{
+    TaskGroup group;
+    uint32_t seg = 0;
+    int fd = -1;
+    uint64_t size = 0;
+    Buffer data;
+    bool ok = false;
+};
+
+static void vlog_compact_func(void *arg)
+{
+    VlogCompaction *job = (VlogCompaction *)arg;
+    job->data.resize(job->size);
+    job->ok = pread_all(job->fd, job->data.data(), job->size, 0);
+    close(job->fd);
+}
+
+// on the event loop: move the live records to the active segment
+static void vlog_compact_done(void *arg)
+{
+    VlogCompaction *job = (VlogCompaction *)arg;
+    g_data.vlog_compacting = false;
+    VlogSeg *seg = vlog_seg(job->seg);
+    VlogSeg *active = seg && job->ok ? vlog_open_active() : NULL;
+    if (active && active != seg)
+    {
+        Buffer out;
+        std::vector<std::pair<Entry *, int64_t>> moved;
+        SnapReader r = {job->data.data(), job->data.data() + job->data.size()};
+        while (r.ok && r.cur < r.end)
+        {
+            LookupKey key;
+            uint32_t klen = 0, vlen = 0;
+            const uint8_t *kdata = snap_read_str(r, klen);
+            int64_t off = (int64_t)(r.cur - job->data.data()) + 4;
+            const uint8_t *val = snap_read_str(r, vlen);
+            snap_read_u32(r); // crc, checked when read
+            if (!r.ok)
+            {
+                break;
+            }
+            key.key.assign((const char *)kdata, klen);
+            key.node.hcode = str_hash(kdata, klen);
+            HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+            Entry *ent = node ? container_of(node, Entry, node) : NULL;
+            if (!ent || ent->vlog_seg != seg->id || ent->vlog_off != off)
+            {
+                continue; // garbage
+            }
+            if (ent->cold)
+            {
+                moved.push_back({ent, vlog_add_record(out, active, ent->key, val, vlen)});
+            }
+            else
+            {
+                ent->vlog_off = -1; // drop the clean copy
+            }
+        }
+        if (vlog_write(active, out))
+        {
+            for (auto &item : moved)
+            {
+                item.first->vlog_seg = active->id;
+                item.first->vlog_off = item.second;
+            }
+            vlog_remove(seg);
+            g_data.tier_compactions++;
+        }
+    }
+    task_group_destroy(&job->group);
+    delete job;
+}
+
+// segments that are mostly garbage are rewritten
+static void vlog_compact_cron()
+{
+    if (g_data.vlog_compacting)
+    {
+        return;
+    }
+    for (VlogSeg *seg : g_data.vlog_segs)
+    {
+        if (!seg || seg == g_data.vlog_active || seg->garbage * 2 < seg->size)
+        {
+            continue;
+        }
+        if (seg->garbage >= seg->size)
+        {
+            vlog_remove(seg); // nothing to move
+            return;
+        }
+        VlogCompaction *job = new VlogCompaction();
+        job->seg = seg->id;
+        job->fd = dup(seg->fd);
+        job->size = seg->size;
+        task_group_init(&job->group, &vlog_compact_done, job);
+        thread_pool_submit(&g_data.thread_pool, &job->group, PRIO_BACKGROUND,
+                           &vlog_compact_func, job);
+        task_group_close(&g_data.thread_pool, &job->group);
+        g_data.vlog_compacting = true;
+        return;
+    }
+}
+
+uint64_t used_memory()
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+void tier_cron()
+{
+    uint64_t now_ms = get_monotonic_msec();
+    if (!g_data.maxmemory || now_ms < g_data.tier_last_ms + k_cron_interval_ms)
+    {
+        return;
+    }
+    g_data.tier_last_ms = now_ms;
+    uint64_t used = used_memory();
+    if (used > g_data.maxmemory)
+    {
+        tier_spill(used);
+    }
+    vlog_compact_cron();
+}
@@ -0,0 +1,261 @@
+#include "server.h"
+
+// client side caching: with CLIENT TRACKING ON, the keys a client reads
+// are remembered, and it gets ["invalidate", [key...]] once they change.
+// with BCAST it gets them for every change under its prefixes instead.
+// past --tracking-table-max keys the table is dropped and every tracking
+// client gets ["invalidate", nil], i.e. forget everything.
+
+struct TrackRef
+{
+    int fd;
+    uint64_t id; // the fd may be reused by another client
+};
+
+struct TrackedKey
+{
+    HNode node;
+    std::string key;
+    std::vector<TrackRef> readers;
+};
+
+static bool tracked_eq(HNode *lhs, HNode *key)
+{
+    TrackedKey *tk = container_of(lhs, TrackedKey, node);
+    LookupKey *hkey = container_of(key, LookupKey, node);
+    return tk->key == hkey->key;
+}
+
+static void inval_add(Conn *conn, const std::string &key)
+{
+    if (conn->inval_all || (!conn->inval_keys.empty() && conn->inval_keys.back() == key))
+    {
+        return;
+    }
+    if (conn->inval_keys.empty())
+    {
+        g_data.inval_pending.push_back(conn->fd);
+    }
+    conn->inval_keys.push_back(key);
+}
+
+static void inval_all(Conn *conn)
+{
+    if (!conn->inval_all && conn->inval_keys.empty())
+    {
+        g_data.inval_pending.push_back(conn->fd);
+    }
+    conn->inval_all = true;
+    conn->inval_keys.clear();
+}
+
+static void tracking_clear()
+{
+    std::vector<HNode *> nodes;
+    nodes.reserve(hm_size(&g_data.tracking));
+    hm_foreach(&g_data.tracking, &cb_collect, &nodes);
+    for (HNode *node : nodes)
+    {
+        delete container_of(node, TrackedKey, node);
+    }
+    hm_clear(&g_data.tracking);
+}
+
+// everyone that tracks anything starts over
+void tracking_flush_all(bool bcast_too)
+{
+    for (Conn *conn : g_data.fd2conn)
+    {
+        if (conn && conn->tracking && (bcast_too || !conn->tracking_bcast))
+        {
+            inval_all(conn);
+        }
+    }
+    tracking_clear();
+}
+
+// a client read this key
+void cmd_track_read(const std::string &k)
+{
+    Conn *conn = g_data.cur_conn;
+    if (!conn || !conn->tracking || conn->tracking_bcast)
+    {
+        return;
+    }
+    LookupKey key;
+    key.key = k;
+    key.node.hcode = str_hash((const uint8_t *)k.data(), k.size());
+    HNode *node = hm_lookup(&g_data.tracking, &key.node, &tracked_eq);
+    TrackedKey *tk = node ? container_of(node, TrackedKey, node) : NULL;
+    if (!tk)
+    {
+        if (hm_size(&g_data.tracking) >= g_data.tracking_max)
+        {
+            g_data.tracking_overflows++;
+            tracking_flush_all(false);
+        }
+        tk = new TrackedKey();
+        tk->key = k;
+        tk->node.hcode = key.node.hcode;
+        hm_insert(&g_data.tracking, &tk->node);
+    }
+    for (const TrackRef &ref : tk->readers)
+    {
+        if (ref.fd == conn->fd && ref.id == conn->id)
+        {
+            return;
+        }
+    }
+    tk->readers.push_back({conn->fd, conn->id});
+}
+
+static void cb_inval_bcast(Conn *conn, void *arg)
+{
+    inval_add(conn, *(const std::string *)arg);
+}
+
+void tracking_invalidate(const std::string &k)
+{
+    if (hm_size(&g_data.tracking) > 0)
+    {
+        LookupKey key;
+        key.key = k;
+        key.node.hcode = str_hash((const uint8_t *)k.data(), k.size());
+        HNode *node = hm_delete(&g_data.tracking, &key.node, &tracked_eq);
+        TrackedKey *tk = node ? container_of(node, TrackedKey, node) : NULL;
+        for (size_t i = 0; tk && i < tk->readers.size(); i++)
+        {
+            Conn *conn = g_data.fd2conn[tk->readers[i].fd];
+            if (conn && conn->id == tk->readers[i].id && conn->tracking)
+            {
+                inval_add(conn, k);
+            }
+        }
+        delete tk; // read again to be tracked again
+    }
+    prefix_foreach(g_data.tracking_prefixes, k, &cb_inval_bcast, (void *)&k);
+}
+
+// at the end of an iteration, with the change feed
+void tracking_send()
+{
+    for (int fd : g_data.inval_pending)
+    {
+        Conn *conn = g_data.fd2conn[fd];
+        if (!conn || (!conn->inval_all && conn->inval_keys.empty()))
+        {
+            continue;
+        }
+        PubMsg *m = new PubMsg();
+        size_t header = 0;
+        response_begin(m->data, &header);
+        out_arr(m->data, 2);
+        out_str(m->data, "invalidate", 10);
+        if (conn->inval_all)
+        {
+            out_nil(m->data);
+        }
+        else
+        {
+            out_arr(m->data, (uint32_t)conn->inval_keys.size());
+            for (const std::string &k : conn->inval_keys)
+            {
+                out_str(m->data, k.data(), k.size());
+            }
+        }
+        response_end(m->data, header);
+        g_data.tracking_invalidations += conn->inval_all ? 1 : conn->inval_keys.size();
+        conn->inval_keys.clear();
+        conn->inval_all = false;
+        // dropped if it falls behind, a stale cache is worse than none
+        m->refs++;
+        pubsub_push(conn, m);
+        pubmsg_unref(m);
+    }
+    g_data.inval_pending.clear();
+}
+
+void tracking_off(Conn *conn)
+{
+    for (const std::string &prefix : conn->tracking_prefixes)
+    {
+        prefix_del(g_data.tracking_prefixes, prefix, conn);
+    }
+    conn->tracking_prefixes.clear();
+    if (conn->tracking)
+    {
+        g_data.tracking_clients--;
+    }
+    conn->tracking = false;
+    conn->tracking_bcast = false;
+}
+
+// CLIENT TRACKING ON [BCAST] [PREFIX prefix]... | CLIENT TRACKING OFF
+void do_client(std::vector<std::string> &cmd, Buffer &out)
+{
+    Conn *conn = g_data.cur_conn;
+    for (size_t i = 1; i < cmd.size() && i < 3; i++)
+    {
+        std::transform(cmd[i].begin(), cmd[i].end(), cmd[i].begin(), ::toupper);
+    }
+    if (!conn)
+    {
+        return out_err(out, ERR_UNKNOWN, "not a client");
+    }
+    if (cmd[1] == "STREAMING" && cmd.size() == 3 && (cmd[2] == "ON" || cmd[2] == "OFF"))
+    {
+        if (conn->proto >= PROTO_RESP2)
+        {
+            return out_err(out, ERR_BAD_ARG, "streaming is for binary clients");
+        }
+        conn->streaming = cmd[2] == "ON";
+        return out_ok(out);
+    }
+    if (cmd[1] != "TRACKING" || cmd.size() < 3 || (cmd[2] != "ON" && cmd[2] != "OFF"))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect TRACKING ON|OFF or STREAMING ON|OFF");
+    }
+    bool bcast = false;
+    std::vector<std::string> prefixes;
+    for (size_t i = 3; i < cmd.size(); i++)
+    {
+        if (strcasecmp(cmd[i].c_str(), "BCAST") == 0)
+        {
+            bcast = true;
+        }
+        else if (strcasecmp(cmd[i].c_str(), "PREFIX") == 0 && i + 1 < cmd.size())
+        {
+            prefixes.push_back(cmd[++i]);
+        }
+        else
+        {
+            return out_err(out, ERR_BAD_ARG, "expect BCAST or PREFIX");
+        }
+    }
+    if (!prefixes.empty() && !bcast)
+    {
+        return out_err(out, ERR_BAD_ARG, "PREFIX needs BCAST");
+    }
+    tracking_off(conn);
+    if (cmd[2] == "OFF")
+    {
+        return out_ok(out);
+    }
+    if (bcast && prefixes.empty())
+    {
+        prefixes.push_back(""); // all keys
+    }
+    for (const std::string &prefix : prefixes)
+    {
+        if (std::find(conn->tracking_prefixes.begin(), conn->tracking_prefixes.end(),
+                      prefix) == conn->tracking_prefixes.end())
+        {
+            prefix_add(g_data.tracking_prefixes, prefix, conn);
+            conn->tracking_prefixes.push_back(prefix);
+        }
+    }
+    conn->tracking = true;
+    conn->tracking_bcast = bcast;
+    g_data.tracking_clients++;
+    return out_ok(out);
+}
@@ -12,6 +12,7 @@ static ZNode *znode_new(const char *name, size_t len, double score)
     avl_init(&node->tree);
     node->hmap.next = NULL;
     node->score = score;
+    node->heap_idx = (size_t)-1;
     node->len = len;
     node->hmap.hcode = str_hash((uint8_t *)name, len);
     memcpy(&node->name[0], name, len);
@@ -133,6 +134,8 @@ void zset_delete(ZSet *zset, ZNode *node)
     key.len = node->len;
     HNode *hnode = hm_delete(&zset->hmap, &key.node, &hcmp);
     assert(hnode);
+    // remove from TTL heap
+    zset_set_expire(zset, node, -1);
     // remove from AVL
     zset->root = avl_del(&node->tree);
     // free node
@@ -181,6 +184,46 @@ void zset_clear(ZSet *zset)
     hm_clear(&zset->hmap);
     tree_dispose(zset->root);
     zset->root = NULL;
+    zset->heap.clear();
+}
+
+// set or remove the expiration time of a member
+void zset_set_expire(ZSet *zset, ZNode *node, int64_t expire_at)
+{
+    if (expire_at < 0 && node->heap_idx != (size_t)-1)
+    {
+        heap_delete(zset->heap, node->heap_idx);
+        node->heap_idx = (size_t)-1;
+    }
+    else if (expire_at >= 0)
+    {
+        HeapItem item = {(uint64_t)expire_at, &node->heap_idx};
+        heap_upsert(zset->heap, node->heap_idx, item);
+    }
+}
+
+// earliest member expiration, -1 if none
+uint64_t zset_next_expire(ZSet *zset)
+{
+    return zset->heap.empty() ? (uint64_t)-1 : zset->heap[0].val;
+}
+
+// delete up to max_works expired members, returns the number deleted
+size_t zset_expire(ZSet *zset, uint64_t now_ms, size_t max_works,
+                   void (*on_expire)(ZNode *, void *), void *arg)
+{
+    size_t nworks = 0;
+    while (nworks < max_works && !zset->heap.empty() && zset->heap[0].val < now_ms)
+    {
+        ZNode *node = container_of(zset->heap[0].ref, ZNode, heap_idx);
+        if (on_expire)
+        {
+            on_expire(node, arg);
+        }
+        zset_delete(zset, node);
+        nworks++;
+    }
+    return nworks;
 }
 
 struct ZSetCtx
@@ -200,4 +243,73 @@ void zset_foreach(ZSet *zset, void (*f)(ZNode *, void *), void *arg)
 {
     ZSetCtx ctx = {f, arg};
     hm_foreach(&zset->hmap, zset_foreach_adapter, &ctx);
-}
\ No newline at end of file
+}
+static void tree_foreach(AVLNode *node, void (*f)(ZNode *, void *), void *arg)
+{
+    if (!node)
+        return;
+    tree_foreach(node->left, f, arg);
+    f(container_of(node, ZNode, tree), arg);
+    tree_foreach(node->right, f, arg);
+}
+
+void zset_foreach_sorted(ZSet *zset, void (*f)(ZNode *, void *), void *arg)
+{
+    tree_foreach(zset->root, f, arg);
+}
+
+void zset_builder_add(ZSetBuilder *b, const char *name, size_t len, double score)
+{
+    b->nodes.push_back(znode_new(name, len, score));
+}
+
+// balanced subtree of nodes[lo, hi)
+static AVLNode *tree_build(std::vector<ZNode *> &nodes, size_t lo, size_t hi, AVLNode *parent)
+{
+    if (lo >= hi)
+        return NULL;
+    size_t mid = lo + (hi - lo) / 2;
+    AVLNode *node = &nodes[mid]->tree;
+    node->parent = parent;
+    node->left = tree_build(nodes, lo, mid, node);
+    node->right = tree_build(nodes, mid + 1, hi, node);
+    uint32_t lh = avl_height(node->left), rh = avl_height(node->right);
+    node->height = 1 + (lh > rh ? lh : rh);
+    node->cnt = 1 + avl_cnt(node->left) + avl_cnt(node->right);
+    return node;
+}
+
+void zset_builder_finish(ZSetBuilder *b, ZSet *zset)
+{
+    assert(!zset->root);
+    std::vector<ZNode *> &nodes = b->nodes;
+    bool sorted = true;
+    for (size_t i = 1; i < nodes.size() && sorted; i++)
+    {
+        sorted = zless(&nodes[i - 1]->tree, &nodes[i]->tree);
+    }
+    hm_reserve(&zset->hmap, nodes.size());
+    if (sorted)
+    {
+        for (ZNode *node : nodes)
+        {
+            hm_insert(&zset->hmap, &node->hmap);
+        }
+        zset->root = tree_build(nodes, 0, nodes.size(), NULL);
+    }
+    else
+    {
+        for (ZNode *node : nodes)
+        {
+            if (ZNode *dup = zset_lookup(zset, node->name, node->len))
+            {
+                zset_update(zset, dup, node->score);
+                znode_del(node);
+                continue;
+            }
+            hm_insert(&zset->hmap, &node->hmap);
+            tree_insert(zset, node);
+        }
+    }
+    nodes.clear();
+}
@@ -2,11 +2,13 @@
 
 #include "avl.h"
 #include "hashtable.h"
+#include "heap.h"
 
 struct ZSet
 {
     AVLNode *root = NULL; // index by (score,name)
     HMap hmap;            // index by name
+    std::vector<HeapItem> heap; // member TTLs
 };
 
 struct ZNode
@@ -14,6 +16,7 @@ struct ZNode
     AVLNode tree;
     HNode hmap;
     double score = 0;
+    size_t heap_idx = -1; // index of this node in the zset's TTL heap
     size_t len = 0;
     char name[0];
 };
@@ -25,4 +28,21 @@ ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len);
 void zset_clear(ZSet *zset);
 ZNode *znode_offset(ZNode *node, int64_t offset);
 
-void zset_foreach(ZSet *zset, void (*f)(ZNode *, void *), void *arg);
\ No newline at end of file
+// bulk load, O(n) when the members come in (score, name) order
+struct ZSetBuilder
+{
+    std::vector<ZNode *> nodes;
+};
+void zset_builder_add(ZSetBuilder *b, const char *name, size_t len, double score);
+// into an empty zset, out of order input falls back to inserting one by one
+void zset_builder_finish(ZSetBuilder *b, ZSet *zset);
+
+// per-member expiration, in the caller's clock (ms)
+void zset_set_expire(ZSet *zset, ZNode *node, int64_t expire_at);
+uint64_t zset_next_expire(ZSet *zset);
+size_t zset_expire(ZSet *zset, uint64_t now_ms, size_t max_works,
+                   void (*on_expire)(ZNode *, void *), void *arg);
+
+void zset_foreach(ZSet *zset, void (*f)(ZNode *, void *), void *arg);
+// in (score, name) order
+void zset_foreach_sorted(ZSet *zset, void (*f)(ZNode *, void *), void *arg);
\ No newline at end of file
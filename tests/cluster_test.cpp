@@ -0,0 +1,108 @@
+// three cluster nodes: keys of other nodes get MOVED, and a slot moved
+// with SETSLOT and MIGRATE is served through ASK, then by its new owner
+#include "server_test.h"
+#include "cluster.h"
+
+static std::string node_name(const Server &s)
+{
+    return "127.0.0.1:" + std::to_string(s.port);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <server binary>\n", argv[0]);
+        return 2;
+    }
+    g_server_bin = argv[1];
+    Server nodes[3];
+    Client c[3];
+    for (int i = 0; i < 3; i++)
+    {
+        nodes[i].args = {"--cluster", "yes", "--save", "off"};
+        CHECK(server_start(nodes[i]));
+        CHECK(client_open(c[i], nodes[i]));
+    }
+    const int ranges[3][2] = {{0, 5460}, {5461, 10922}, {10923, 16383}};
+    for (int i = 0; i < 3; i++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            CHECK(c[i].get({"CLUSTER", "ADDSLOTSRANGE", std::to_string(ranges[k][0]),
+                            std::to_string(ranges[k][1]), node_name(nodes[k])}) == "OK");
+        }
+    }
+    int64_t slot = c[0].call({"CLUSTER", "KEYSLOT", "foo"}).num;
+    int own = slot <= 5460 ? 0 : slot <= 10922 ? 1 : 2;
+    int tgt = (own + 1) % 3;
+    std::string slot_str = std::to_string(slot);
+
+    // MOVED to the owner
+    Reply r = c[tgt].call({"SET", "foo", "bar"});
+    CHECK(r.tag == TAG_ERR && r.code == ERR_MOVED);
+    CHECK(r.str == slot_str + " " + node_name(nodes[own]));
+    CHECK(c[own].get({"SET", "foo", "bar"}) == "OK");
+    const int nkeys = 30;
+    for (int i = 0; i < nkeys; i++)
+    {
+        CHECK(c[own].get({"SET", "{foo}" + std::to_string(i), std::to_string(i)}) == "OK");
+    }
+    CHECK(c[own].get({"PEXPIRE", "{foo}1", "100000"}) == "1");
+    CHECK(c[own].get({"ZADD", "{foo}z", "1", "m"}) == "1");
+
+    // move the slot: a first batch, then check the redirections
+    CHECK(c[tgt].get({"CLUSTER", "SETSLOT", slot_str, "IMPORTING", node_name(nodes[own])}) == "OK");
+    CHECK(c[own].get({"CLUSTER", "SETSLOT", slot_str, "MIGRATING", node_name(nodes[tgt])}) == "OK");
+    Reply keys = c[own].call({"CLUSTER", "GETKEYSINSLOT", slot_str, "5"});
+    CHECK(keys.tag == TAG_ARR && keys.arr.size() == 5);
+    std::vector<std::string> migrate = {"MIGRATE", "127.0.0.1", std::to_string(nodes[tgt].port)};
+    for (Reply &k : keys.arr)
+    {
+        migrate.push_back(k.str);
+    }
+    CHECK(c[own].get(migrate) == "OK");
+    std::string moved_key = keys.arr[0].str;
+    r = c[own].call({"GET", moved_key});
+    CHECK(r.tag == TAG_ERR && r.code == ERR_ASK);
+    CHECK(r.str == slot_str + " " + node_name(nodes[tgt]));
+    r = c[tgt].call({"GET", moved_key});
+    CHECK(r.tag == TAG_ERR && r.code == ERR_MOVED); // not without ASKING
+    CHECK(c[tgt].get({"ASKING"}) == "OK");
+    CHECK(c[tgt].call({"GET", moved_key}).tag != TAG_ERR);
+    r = c[tgt].call({"GET", moved_key});
+    CHECK(r.tag == TAG_ERR && r.code == ERR_MOVED); // ASKING is for one command
+
+    // the rest, then the new owner everywhere
+    for (int round = 0; round < 100; round++)
+    {
+        keys = c[own].call({"CLUSTER", "GETKEYSINSLOT", slot_str, "7"});
+        if (keys.tag != TAG_ARR || keys.arr.empty())
+            break;
+        migrate.resize(3);
+        for (Reply &k : keys.arr)
+        {
+            migrate.push_back(k.str);
+        }
+        CHECK(c[own].get(migrate) == "OK");
+    }
+    CHECK(c[own].call({"CLUSTER", "COUNTKEYSINSLOT", slot_str}).num == 0);
+    for (int i = 0; i < 3; i++)
+    {
+        CHECK(c[i].get({"CLUSTER", "SETSLOT", slot_str, "NODE", node_name(nodes[tgt])}) == "OK");
+    }
+    CHECK(c[tgt].call({"CLUSTER", "COUNTKEYSINSLOT", slot_str}).num == nkeys + 2);
+    CHECK(c[tgt].get({"GET", "foo"}) == "bar");
+    CHECK(c[tgt].get({"GET", "{foo}7"}) == "7");
+    CHECK(c[tgt].call({"PTTL", "{foo}1"}).num > 90000);
+    CHECK(c[tgt].call({"ZSCORE", "{foo}z", "m"}).dbl == 1);
+    r = c[own].call({"GET", "foo"});
+    CHECK(r.tag == TAG_ERR && r.code == ERR_MOVED);
+    CHECK(r.str == slot_str + " " + node_name(nodes[tgt]));
+
+    for (Server &s : nodes)
+    {
+        server_cleanup(s);
+    }
+    return g_failed ? 1 : 0;
+}
@@ -0,0 +1,168 @@
+// hm_scan visits every key that stays in the map, while it grows and
+// rehashes between the calls
+#include "hashtable.h"
+#include "common.h"
+#include <stdio.h>
+#include <vector>
+
+static int g_failed = 0;
+
+static void expect(const char *name, bool ok)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "%s: failed\n", name);
+        g_failed++;
+    }
+}
+
+struct Item
+{
+    HNode node;
+    uint32_t key = 0;
+};
+
+static bool item_eq(HNode *a, HNode *b)
+{
+    return container_of(a, Item, node)->key == container_of(b, Item, node)->key;
+}
+
+static uint64_t key_hash(uint32_t key)
+{
+    return str_hash((const uint8_t *)&key, sizeof(key));
+}
+
+static void add(HMap *hmap, std::vector<Item *> &items, uint32_t key)
+{
+    Item *item = new Item();
+    item->key = key;
+    item->node.hcode = key_hash(key);
+    hm_insert(hmap, &item->node);
+    items.push_back(item);
+}
+
+static void remove(HMap *hmap, uint32_t key)
+{
+    Item probe;
+    probe.key = key;
+    probe.node.hcode = key_hash(key);
+    HNode *node = hm_delete(hmap, &probe.node, &item_eq);
+    if (node)
+    {
+        container_of(node, Item, node)->key = UINT32_MAX; // freed at the end
+    }
+}
+
+static void cb_count(HNode *node, void *arg)
+{
+    uint32_t key = container_of(node, Item, node)->key;
+    std::vector<int> &seen = *(std::vector<int> *)arg;
+    if (key < seen.size())
+    {
+        seen[key]++;
+    }
+}
+
+static void finish(HMap *hmap, std::vector<Item *> &items)
+{
+    hm_clear(hmap);
+    for (Item *item : items)
+    {
+        delete item;
+    }
+    items.clear();
+}
+
+int main()
+{
+    const uint32_t n = 1000;
+    // a quiet map: each key exactly once
+    {
+        HMap hmap;
+        std::vector<Item *> items;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            add(&hmap, items, i);
+        }
+        Item probe;
+        while (hmap.older.tab)
+        {
+            hm_lookup(&hmap, &probe.node, &item_eq); // each one moves some keys
+        }
+        std::vector<int> seen(n);
+        uint64_t cursor = 0;
+        do
+        {
+            cursor = hm_scan(&hmap, cursor, &cb_count, &seen);
+        } while (cursor != 0);
+        bool once = true;
+        for (int c : seen)
+        {
+            once = once && c == 1;
+        }
+        expect("quiet map, each key once", once);
+        finish(&hmap, items);
+    }
+    // the map doubles several times during the scan, and some of the
+    // scan's calls happen halfway through a rehash
+    {
+        HMap hmap;
+        std::vector<Item *> items;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            add(&hmap, items, i);
+        }
+        std::vector<int> seen(n);
+        uint64_t cursor = 0;
+        uint32_t next = n;
+        size_t calls_rehashing = 0;
+        do
+        {
+            calls_rehashing += hmap.older.tab != NULL;
+            cursor = hm_scan(&hmap, cursor, &cb_count, &seen);
+            for (int k = 0; k < 40; k++)
+            {
+                add(&hmap, items, next++);
+            }
+        } while (cursor != 0);
+        bool all = true;
+        for (int c : seen)
+        {
+            all = all && c >= 1;
+        }
+        expect("growing map, every key", all);
+        expect("growing map, scanned while rehashing", calls_rehashing > 0);
+        expect("growing map, grew", hm_size(&hmap) > 4 * n);
+        finish(&hmap, items);
+    }
+    // keys deleted during the scan do not hide the others
+    {
+        HMap hmap;
+        std::vector<Item *> items;
+        for (uint32_t i = 0; i < 2 * n; i++)
+        {
+            add(&hmap, items, i);
+        }
+        std::vector<int> seen(2 * n);
+        uint64_t cursor = 0;
+        uint32_t victim = n;
+        uint32_t next = 2 * n;
+        do
+        {
+            cursor = hm_scan(&hmap, cursor, &cb_count, &seen);
+            for (int k = 0; k < 8 && victim < 2 * n; k++)
+            {
+                remove(&hmap, victim++);
+            }
+            add(&hmap, items, next++);
+        } while (cursor != 0);
+        bool all = true;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            all = all && seen[i] >= 1;
+        }
+        expect("shrinking map, every kept key", all);
+        finish(&hmap, items);
+    }
+    return g_failed ? 1 : 0;
+}
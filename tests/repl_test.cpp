@@ -0,0 +1,201 @@
+// a replica gets a full sync, with the writes made during it, and a
+// partial resync after its link to the master is cut
+#include "server_test.h"
+#include <poll.h>
+#include <atomic>
+#include <thread>
+
+// forwards one connection at a time to `target`, until told to cut it
+struct Proxy
+{
+    int listen_fd = -1;
+    int port = 0;
+    int target = 0;
+    std::atomic<bool> cut{false};
+    std::atomic<bool> quit{false};
+    std::thread thread;
+};
+
+static bool forward(int from, int to)
+{
+    char buf[64 << 10];
+    ssize_t rv = read(from, buf, sizeof(buf));
+    return rv > 0 && write(to, buf, (size_t)rv) == rv;
+}
+
+static void proxy_loop(Proxy *p)
+{
+    while (!p->quit)
+    {
+        struct pollfd pfd = {p->listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 50) <= 0)
+            continue;
+        int a = accept(p->listen_fd, NULL, NULL);
+        int b = a < 0 ? -1 : tcp_connect(p->target);
+        struct timeval tv = {0, 0};
+        setsockopt(b, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        p->cut = false;
+        while (a >= 0 && b >= 0 && !p->quit && !p->cut)
+        {
+            struct pollfd fds[2] = {{a, POLLIN, 0}, {b, POLLIN, 0}};
+            if (poll(fds, 2, 50) <= 0)
+                continue;
+            if ((fds[0].revents && !forward(a, b)) || (fds[1].revents && !forward(b, a)))
+                break;
+        }
+        if (a >= 0)
+            close(a);
+        if (b >= 0)
+            close(b);
+    }
+}
+
+static void proxy_start(Proxy &p, int target)
+{
+    p.target = target;
+    p.port = free_port();
+    p.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(p.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)p.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(p.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(p.listen_fd, 4) != 0)
+    {
+        perror("proxy");
+        exit(2);
+    }
+    p.thread = std::thread(proxy_loop, &p);
+}
+
+static void proxy_stop(Proxy &p)
+{
+    p.quit = true;
+    p.thread.join();
+    close(p.listen_fd);
+}
+
+// pipelined SETs of `n` keys
+static void fill(Client &c, int n, size_t value_size)
+{
+    std::string value(value_size, 'v');
+    for (int i = 0; i < n; i += 1000)
+    {
+        std::string req;
+        int end = std::min(n, i + 1000);
+        for (int k = i; k < end; k++)
+        {
+            std::string key = "k" + std::to_string(k);
+            uint32_t hdr[3] = {3, 3, 0};
+            req.append((const char *)hdr, 8);
+            req += "SET";
+            uint32_t len = (uint32_t)key.size();
+            req.append((const char *)&len, 4);
+            req += key;
+            len = (uint32_t)value.size();
+            req.append((const char *)&len, 4);
+            req += value;
+        }
+        bool ok = write(c.fd, req.data(), req.size()) == (ssize_t)req.size();
+        for (int k = i; k < end && ok; k++)
+        {
+            uint32_t rlen = 0;
+            std::string body;
+            ok = read_full(c.fd, &rlen, 4);
+            body.resize(rlen);
+            ok = ok && read_full(c.fd, &body[0], rlen);
+        }
+        if (!ok)
+        {
+            CHECK(ok);
+            return;
+        }
+    }
+}
+
+static int count_lines(const std::string &path, const char *needle)
+{
+    FILE *fp = fopen(path.c_str(), "r");
+    int n = 0;
+    char line[1024];
+    while (fp && fgets(line, sizeof(line), fp))
+    {
+        n += strstr(line, needle) != NULL;
+    }
+    if (fp)
+        fclose(fp);
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <server binary>\n", argv[0]);
+        return 2;
+    }
+    g_server_bin = argv[1];
+    Server master, replica;
+    // a backlog far smaller than the writes made during the full sync
+    master.args = {"--save", "off", "--repl-backlog-size", "16k"};
+    replica.args = {"--save", "off"};
+    CHECK(server_start(master));
+    CHECK(server_start(replica));
+    Proxy proxy;
+    proxy_start(proxy, master.port);
+    Client m, r;
+    CHECK(client_open(m, master));
+    CHECK(client_open(r, replica));
+    const int nkeys = 100000;
+    fill(m, nkeys, 100);
+
+    // full sync, writes go on meanwhile
+    CHECK(r.get({"REPLICAOF", "127.0.0.1", std::to_string(proxy.port)}) == "OK");
+    int nwrites = 0;
+    for (int i = 0; i < 20000 && info_field(r, "master_link_status") != "up"; i++)
+    {
+        for (int k = 0; k < 10; k++, nwrites++)
+        {
+            m.call({"SET", "w" + std::to_string(nwrites), std::string(100, 'w')});
+        }
+    }
+    CHECK(info_field(r, "master_link_status") == "up");
+    m.call({"SET", "last", "1"});
+    CHECK(wait_for([&] { return r.get({"GET", "last"}) == "1"; }));
+    CHECK(info_field(r, "keys") == std::to_string(nkeys + nwrites + 1));
+    CHECK(r.get({"GET", "k0"}) == std::string(100, 'v'));
+    CHECK(r.get({"GET", "k" + std::to_string(nkeys - 1)}) == std::string(100, 'v'));
+    bool all = true;
+    for (int i = 0; i < nwrites; i++)
+    {
+        all = all && r.get({"GET", "w" + std::to_string(i)}) == std::string(100, 'w');
+    }
+    CHECK(all);
+    CHECK(access((replica.dir + "/photon-sync.tmp").c_str(), F_OK) != 0);
+    CHECK(r.get({"SET", "x", "1"}).compare(0, 6, "(err 5") == 0);
+
+    // cut the link, write, and the replica catches up from the backlog
+    proxy.cut = true;
+    CHECK(wait_for([&] { return info_field(r, "master_link_status") == "down"; }));
+    for (int i = 0; i < 20; i++)
+    {
+        m.call({"SET", "p" + std::to_string(i), std::to_string(i)});
+    }
+    m.call({"DEL", "k0"});
+    CHECK(wait_for([&] { return r.get({"GET", "p19"}) == "19"; }));
+    CHECK(r.call({"GET", "k0"}).tag == TAG_NIL);
+    CHECK(info_field(r, "master_repl_offset") == info_field(m, "repl_offset"));
+    std::string mlog = master.dir + "/server.log";
+    CHECK(count_lines(mlog, "full sync of a replica started") == 1);
+    CHECK(count_lines(mlog, "partial resync of a replica") == 1);
+
+    // promoted, it takes writes again
+    CHECK(r.get({"REPLICAOF", "NO", "ONE"}) == "OK");
+    CHECK(r.get({"SET", "x", "1"}) == "OK");
+
+    proxy_stop(proxy);
+    server_cleanup(master);
+    server_cleanup(replica);
+    return g_failed ? 1 : 0;
+}
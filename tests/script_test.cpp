@@ -0,0 +1,50 @@
+// regression cases for the script compiler
+#include "script.h"
+#include "commands/commands.h"
+#include <stdio.h>
+#include <string>
+
+// provided by the server, the compiler does not reach it
+void out_err(Buffer &out, uint32_t code, const std::string &msg)
+{
+    (void)out;
+    (void)code;
+    (void)msg;
+}
+
+static int g_failed = 0;
+
+static void expect_compiles(const char *name, const std::string &src, bool ok)
+{
+    std::string err;
+    Script *script = script_compile(src, err);
+    if ((script != NULL) != ok)
+    {
+        fprintf(stderr, "%s: expected %s, got '%s'\n", name, ok ? "success" : "an error", err.c_str());
+        g_failed++;
+    }
+    script_free(script);
+}
+
+static std::string repeat(const char *s, size_t n)
+{
+    std::string out;
+    while (n--)
+    {
+        out += s;
+    }
+    return out;
+}
+
+int main()
+{
+    // prefix operators must not recurse once per operator
+    expect_compiles("long not chain", "return " + repeat("not ", 200000) + "1", true);
+    expect_compiles("long neg chain", "return " + repeat("- ", 200000) + "1", true);
+    expect_compiles("long len chain", "return " + repeat("#", 200000) + "KEYS", true);
+    // nesting is still bounded
+    expect_compiles("deep parens", "return " + repeat("(", 100000) + "1" + repeat(")", 100000), false);
+    expect_compiles("deep prefix parens", "return " + repeat("not (", 100000) + "1" + repeat(")", 100000), false);
+    expect_compiles("deep blocks", repeat("do ", 100000) + repeat("end ", 100000), false);
+    return g_failed ? 1 : 0;
+}
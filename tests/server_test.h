@@ -0,0 +1,332 @@
+// helpers for the tests that run `server` processes: each one gets its
+// own directory and a free port, and is talked to with the binary protocol
+#pragma once
+
+#include "commands/commands.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+static int g_failed = 0;
+
+#define CHECK(cond)                                                                  \
+    do                                                                               \
+    {                                                                                \
+        if (!(cond))                                                                 \
+        {                                                                            \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            g_failed++;                                                              \
+        }                                                                            \
+    } while (0)
+
+inline void sleep_ms(int ms)
+{
+    struct timespec ts = {ms / 1000, (long)(ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+// a port nobody listens on right now
+inline int free_port()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) != 0)
+    {
+        perror("free_port");
+        exit(2);
+    }
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+inline int tcp_connect(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    struct timeval tv = {10, 0}; // a hung server fails the test
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+// a decoded reply
+struct Reply
+{
+    uint8_t tag = TAG_NIL;
+    uint32_t code = 0; // TAG_ERR
+    std::string str;   // TAG_STR, TAG_ERR
+    int64_t num = 0;   // TAG_INT
+    double dbl = 0;    // TAG_DBL
+    std::vector<Reply> arr;
+};
+
+inline bool parse_reply(const uint8_t *&cur, const uint8_t *end, Reply &out)
+{
+    if (cur >= end)
+        return false;
+    out.tag = *cur++;
+    uint32_t len = 0;
+    switch (out.tag)
+    {
+    case TAG_NIL:
+    case TAG_OK:
+        return true;
+    case TAG_ERR:
+        if (end - cur < 8)
+            return false;
+        memcpy(&out.code, cur, 4);
+        memcpy(&len, cur + 4, 4);
+        cur += 8;
+        break;
+    case TAG_STR:
+        if (end - cur < 4)
+            return false;
+        memcpy(&len, cur, 4);
+        cur += 4;
+        break;
+    case TAG_INT:
+    case TAG_DBL:
+        if (end - cur < 8)
+            return false;
+        memcpy(out.tag == TAG_INT ? (void *)&out.num : (void *)&out.dbl, cur, 8);
+        cur += 8;
+        return true;
+    case TAG_ARR:
+        if (end - cur < 4)
+            return false;
+        memcpy(&len, cur, 4);
+        cur += 4;
+        out.arr.resize(len);
+        for (Reply &r : out.arr)
+        {
+            if (!parse_reply(cur, end, r))
+                return false;
+        }
+        return true;
+    default:
+        return false;
+    }
+    if ((size_t)(end - cur) < len)
+        return false;
+    out.str.assign((const char *)cur, len);
+    cur += len;
+    return true;
+}
+
+inline bool read_full(int fd, void *buf, size_t n)
+{
+    uint8_t *p = (uint8_t *)buf;
+    while (n > 0)
+    {
+        ssize_t rv = read(fd, p, n);
+        if (rv <= 0)
+            return false;
+        p += rv;
+        n -= (size_t)rv;
+    }
+    return true;
+}
+
+struct Client
+{
+    int fd = -1;
+
+    Client() = default;
+    Client(const Client &) = delete;
+
+    // one command, its reply. a lost connection is a TAG_ERR with code 0.
+    Reply call(const std::vector<std::string> &cmd)
+    {
+        std::string req;
+        uint32_t n = (uint32_t)cmd.size();
+        req.append((const char *)&n, 4);
+        for (const std::string &s : cmd)
+        {
+            n = (uint32_t)s.size();
+            req.append((const char *)&n, 4);
+            req += s;
+        }
+        Reply out;
+        out.tag = TAG_ERR;
+        out.str = "connection lost";
+        if (fd < 0 || write(fd, req.data(), req.size()) != (ssize_t)req.size())
+            return out;
+        uint32_t len = 0;
+        std::string body;
+        if (!read_full(fd, &len, 4))
+            return out;
+        body.resize(len);
+        if (!read_full(fd, &body[0], len))
+            return out;
+        const uint8_t *cur = (const uint8_t *)body.data();
+        parse_reply(cur, cur + len, out);
+        return out;
+    }
+    // the reply as a string, "" for nil, "OK", "(err N) msg" or the number
+    std::string get(const std::vector<std::string> &cmd)
+    {
+        Reply r = call(cmd);
+        switch (r.tag)
+        {
+        case TAG_OK:
+            return "OK";
+        case TAG_ERR:
+            return "(err " + std::to_string(r.code) + ") " + r.str;
+        case TAG_INT:
+            return std::to_string(r.num);
+        default:
+            return r.str;
+        }
+    }
+    ~Client()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+};
+
+// a server process in a directory of its own
+struct Server
+{
+    pid_t pid = -1;
+    int port = 0;
+    std::string dir;
+    std::vector<std::string> args;
+};
+
+static const char *g_server_bin = NULL;
+
+inline bool server_start(Server &s)
+{
+    if (s.dir.empty())
+    {
+        char tmpl[] = "/tmp/photon-test-XXXXXX";
+        if (!mkdtemp(tmpl))
+            return false;
+        s.dir = tmpl;
+    }
+    if (!s.port)
+        s.port = free_port();
+    char bin[PATH_MAX]; // the child runs in the server's directory
+    if (!realpath(g_server_bin, bin))
+        return false;
+    s.pid = fork();
+    if (s.pid == 0)
+    {
+        if (chdir(s.dir.c_str()) != 0)
+            _exit(127);
+        int log = open("server.log", O_WRONLY | O_CREAT | O_APPEND, 0644);
+        dup2(log, 1);
+        dup2(log, 2);
+        std::vector<std::string> args = {bin, "--port", std::to_string(s.port)};
+        args.insert(args.end(), s.args.begin(), s.args.end());
+        std::vector<char *> argv;
+        for (std::string &a : args)
+            argv.push_back(&a[0]);
+        argv.push_back(NULL);
+        execv(bin, argv.data());
+        _exit(127);
+    }
+    // up once it accepts
+    for (int i = 0; i < 500; i++)
+    {
+        int fd = tcp_connect(s.port);
+        if (fd >= 0)
+        {
+            close(fd);
+            return true;
+        }
+        if (waitpid(s.pid, NULL, WNOHANG) == s.pid)
+        {
+            s.pid = -1;
+            return false;
+        }
+        sleep_ms(10);
+    }
+    return false;
+}
+
+// SIGTERM is a clean shutdown, SIGKILL a crash
+inline void server_stop(Server &s, int sig = SIGTERM)
+{
+    if (s.pid > 0)
+    {
+        kill(s.pid, sig);
+        waitpid(s.pid, NULL, 0);
+    }
+    s.pid = -1;
+}
+
+inline void server_cleanup(Server &s)
+{
+    server_stop(s, SIGKILL);
+    if (!s.dir.empty())
+    {
+        std::string cmd = "rm -rf '" + s.dir + "'";
+        if (system(cmd.c_str()) != 0)
+            fprintf(stderr, "cannot remove %s\n", s.dir.c_str());
+    }
+}
+
+inline bool client_open(Client &c, const Server &s)
+{
+    if (c.fd >= 0)
+        close(c.fd);
+    c.fd = tcp_connect(s.port);
+    return c.fd >= 0;
+}
+
+// poll until `cond` holds, for up to `ms`
+template <class F>
+inline bool wait_for(F cond, int ms = 5000)
+{
+    for (int waited = 0; waited < ms; waited += 10)
+    {
+        if (cond())
+            return true;
+        sleep_ms(10);
+    }
+    return cond();
+}
+
+// a field of INFO
+inline std::string info_field(Client &c, const std::string &name)
+{
+    std::string info = c.get({"INFO"});
+    size_t pos = info.find("\n" + name + ":");
+    if (pos == std::string::npos)
+    {
+        if (info.compare(0, name.size() + 1, name + ":") != 0)
+            return "";
+        pos = 0;
+    }
+    else
+    {
+        pos++;
+    }
+    pos += name.size() + 1;
+    return info.substr(pos, info.find('\n', pos) - pos);
+}
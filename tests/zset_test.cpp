@@ -0,0 +1,134 @@
+// a zset bulk loaded with ZSetBuilder is the same as one built by inserts:
+// a balanced tree with correct counts, and every member in its hash index
+#include "zset.h"
+#include <math.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+static int g_failed = 0;
+
+static void expect(const char *name, bool ok)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "%s: failed\n", name);
+        g_failed++;
+    }
+}
+
+// height of a valid AVL subtree, -1 if anything is off
+static int tree_check(AVLNode *node, AVLNode *parent)
+{
+    if (!node)
+        return 0;
+    if (node->parent != parent)
+        return -1;
+    int lh = tree_check(node->left, node);
+    int rh = tree_check(node->right, node);
+    if (lh < 0 || rh < 0 || lh - rh > 1 || rh - lh > 1)
+        return -1;
+    int h = 1 + (lh > rh ? lh : rh);
+    if (node->height != (uint32_t)h || node->cnt != 1 + avl_cnt(node->left) + avl_cnt(node->right))
+        return -1;
+    return h;
+}
+
+struct Member
+{
+    std::string name;
+    double score;
+};
+
+static void cb_collect(ZNode *node, void *arg)
+{
+    ((std::vector<Member> *)arg)->push_back({std::string(node->name, node->len), node->score});
+}
+
+// the zset holds exactly `want`, which is in (score, name) order
+static bool same_members(ZSet *zset, const std::vector<Member> &want)
+{
+    std::vector<Member> got;
+    zset_foreach_sorted(zset, &cb_collect, &got);
+    if (got.size() != want.size() || hm_size(&zset->hmap) != want.size())
+        return false;
+    ZNode *first = zset_seekge(zset, -INFINITY, "", 0);
+    for (size_t i = 0; i < want.size(); i++)
+    {
+        if (got[i].name != want[i].name || got[i].score != want[i].score)
+            return false;
+        ZNode *node = zset_lookup(zset, want[i].name.data(), want[i].name.size());
+        if (!node || node->score != want[i].score || znode_offset(first, (int64_t)i) != node)
+            return false;
+    }
+    return true;
+}
+
+static std::string member_name(int i)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), "m%05d", i);
+    return buf;
+}
+
+int main()
+{
+    // sorted input: the O(n) build
+    for (int n : {0, 1, 2, 3, 7, 100, 1000, 4097})
+    {
+        std::vector<Member> want;
+        ZSetBuilder b;
+        for (int i = 0; i < n; i++)
+        {
+            want.push_back({member_name(i), (double)(i / 3)}); // ties go by name
+            zset_builder_add(&b, want.back().name.data(), want.back().name.size(), want.back().score);
+        }
+        ZSet zset;
+        zset_builder_finish(&b, &zset);
+        std::string label = "sorted " + std::to_string(n);
+        expect((label + ", balanced").c_str(), tree_check(zset.root, NULL) >= 0);
+        expect((label + ", members").c_str(), same_members(&zset, want));
+        expect((label + ", builder emptied").c_str(), b.nodes.empty());
+        // the built tree takes inserts and deletes like any other
+        for (int i = 0; i < n; i += 2)
+        {
+            ZNode *node = zset_lookup(&zset, want[i].name.data(), want[i].name.size());
+            zset_delete(&zset, node);
+        }
+        std::vector<Member> rest;
+        for (int i = 1; i < n; i += 2)
+        {
+            rest.push_back(want[i]);
+        }
+        std::string extra = "zzz";
+        zset_insert(&zset, extra.data(), extra.size(), 1e9);
+        rest.push_back({extra, 1e9});
+        expect((label + ", balanced after changes").c_str(), tree_check(zset.root, NULL) >= 0);
+        expect((label + ", members after changes").c_str(), same_members(&zset, rest));
+        zset_clear(&zset);
+    }
+    // out of order input, with a member given twice: the last score wins
+    {
+        ZSetBuilder b;
+        const int n = 500;
+        for (int i = n - 1; i >= 0; i--)
+        {
+            std::string name = member_name(i);
+            zset_builder_add(&b, name.data(), name.size(), (double)i);
+        }
+        std::string dup = member_name(0);
+        zset_builder_add(&b, dup.data(), dup.size(), 1e6);
+        ZSet zset;
+        zset_builder_finish(&b, &zset);
+        std::vector<Member> want;
+        for (int i = 1; i < n; i++)
+        {
+            want.push_back({member_name(i), (double)i});
+        }
+        want.push_back({dup, 1e6});
+        expect("unsorted, balanced", tree_check(zset.root, NULL) >= 0);
+        expect("unsorted, members", same_members(&zset, want));
+        zset_clear(&zset);
+    }
+    return g_failed ? 1 : 0;
+}